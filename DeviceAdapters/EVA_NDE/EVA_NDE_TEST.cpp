@@ -4,10 +4,14 @@
 
 #include "EVA_NDE_TEST.h"
 #include "XYStage.h"
+#include "GrblStreamer.h"
+#include "GrblSimulator.h"
 #include "../../MMDevice/ModuleInterface.h"
 //#include "MMCore.h"
 #include <sstream>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 
 #ifdef WIN32
    #define WIN32_LEAN_AND_MEAN
@@ -17,6 +21,7 @@
 
 const char* g_DeviceNameEVA_NDE_GrblHub = "EVA_NDE_Grbl-Hub";
 const char* g_DeviceNameEVA_NDE_GrblXYStage = "XYStage";
+const char* g_DeviceNameGrblSimulator = "GrblSimulator";
 //const char* g_DeviceNameEVA_NDE_GrblZStage="ZStage";
 //const char* g_DeviceNameEVA_NDE_GrblZStage = "EVA_NDE_Grbl-ZStage";
 
@@ -30,6 +35,24 @@ const int g_Max_MMVersion = 10;
 const char* g_versionProp = "Version";
 const char* g_normalLogicString = "Normal";
 const char* g_invertedLogicString = "Inverted";
+const char* g_statusIntervalProp = "StatusIntervalMs";
+const size_t g_maxPendingReplies = 256;
+const unsigned long g_positionHistorySize = 8192; // 80 s of reports at 10 ms
+const unsigned long g_positionSamplesMax = 64;     // more than fit in a property value
+const unsigned char g_feedHold = '!';
+const unsigned char g_softReset = 0x18;
+const unsigned char g_jogCancel = 0x85;            // Grbl 1.1
+const double g_holdTimeoutMs = 5000.0;             // deceleration from full speed
+const double g_restartTimeoutMs = 2000.0;          // soft reset until the start-up banner
+
+// scan settings, with their defaults
+const char* g_scanSettingProps[] = {"ScanStartXMm", "ScanStartYMm", "ScanWidthMm", "ScanHeightMm",
+      "ScanPitchMm", "ScanIndexStepMm", "PulserPRFHz", "ScopeRearmUs"};
+const double g_scanSettingDefaults[] = {0.0, 0.0, 10.0, 10.0, 0.1, 0.1, 1000.0, 0.0};
+const long g_scanSettingCount = sizeof(g_scanSettingDefaults) / sizeof(g_scanSettingDefaults[0]);
+const char* g_scanCameraProp = "ScanCamera";
+const char* g_scanIdle = "Idle";
+const char* g_scanStart = "Start";
 
 // static lock
 MMThreadLock CEVA_NDE_GrblHub::lock_;
@@ -44,6 +67,7 @@ MODULE_API void InitializeModuleData()
 	//AddAvailableDeviceName(g_DeviceNameEVA_NDE_GrblXYStage, "XYStage");
     RegisterDevice(g_DeviceNameEVA_NDE_GrblHub,  MM::HubDevice ,"Hub (required)");
 	RegisterDevice(g_DeviceNameEVA_NDE_GrblXYStage,  MM:: XYStageDevice ,"XYStage");
+	RegisterDevice(g_DeviceNameGrblSimulator, MM::SerialDevice, "Simulated Grbl controller (use as the hub's port)");
 	//RegisterDevice(g_DeviceNameEVA_NDE_GrblZStage,MM:: ZStageDevice ,"EVA_NDE_Grbl-ZStage");
 }
 
@@ -60,6 +84,10 @@ MODULE_API MM::Device* CreateDevice(const char* deviceName)
    {
       return new XYStage;
    }
+   else if (strcmp(deviceName, g_DeviceNameGrblSimulator) == 0)
+   {
+      return new GrblSimulator;
+   }
    //else if (strcmp(deviceName, g_DeviceNameEVA_NDE_GrblZStage) == 0)
    //{
    //   return new CEVA_NDE_GrblZStage;
@@ -92,20 +120,19 @@ std::vector<std::string> split(const std::string &s, char delim) {
     return elems;
 }
 
-template <class Type>
-Type stringToNum(const std::string& str)
-{
-	std::istringstream iss(str);
-	Type num;
-	iss >> num;
-	return num;    
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 // CEVA_NDE_GrblHUb implementation
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~
 //
 CEVA_NDE_GrblHub::CEVA_NDE_GrblHub() :
+streamer_ (0),
+monitorThread_ (0),
+statusIntervalMs_ (50),
+parametersValid_ (false),
+parametersError_ (DEVICE_OK),
+positionHistory_ (g_positionHistorySize),
+usPerChar_ (0.0),
+restartCount_ (0),
 initialized_ (false)
 {
    portAvailable_ = false;
@@ -118,6 +145,21 @@ initialized_ (false)
    MPos[0] = 0.0;
    MPos[1] = 0.0;
    MPos[2] = 0.0;
+   statusSnapshot_.state[0] = 0;
+   for (int i = 0; i < 3; i++)
+   {
+      statusSnapshot_.mPos[i] = 0.0;
+      statusSnapshot_.wPos[i] = 0.0;
+   }
+   statusSnapshot_.sequence = 0;
+   scanSettings_.assign(g_scanSettingDefaults, g_scanSettingDefaults + g_scanSettingCount);
+   scanPlan_.pointsPerRow = 0;
+   scanPlan_.rampPoints = 0;
+   scanPlan_.triggersPerRow = 0;
+   scanPlan_.rows = 0;
+   scanPlan_.triggers = 0;
+   scanPlan_.feed = 0.0;
+   scanPlan_.overscan = 0.0;
 
    InitializeDefaultErrorMessages();
 
@@ -128,6 +170,14 @@ initialized_ (false)
    errorText << "The firmware version on the EVA_NDE_Grbl is not compatible with this adapter.  Please use firmware version ";
 
    SetErrorText(ERR_VERSION_MISMATCH, errorText.str().c_str());
+   SetErrorText(ERR_STREAM_ACTIVE, "A G-code program is being streamed to the controller");
+   SetErrorText(ERR_STREAM_LINE_FAILED, "The controller rejected one or more lines of the G-code program");
+   SetErrorText(ERR_STREAM_TIMEOUT, "Timed out waiting for the G-code program to finish");
+   SetErrorText(ERR_LINE_TOO_LONG, "G-code line does not fit in the controller's receive buffer");
+   SetErrorText(ERR_MOTION_NOT_STOPPED, "The stage did not come to a stop after a feed hold");
+   SetErrorText(ERR_SCAN_INVALID, "Invalid scan settings: pitch, index step, PRF and acceleration ($8) must be positive");
+
+   streamer_ = new GrblStreamer(this);
 
    CPropertyAction* pAct  = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnPort);
    //CreateProperty("ComPort", "Undifined", MM::String, false, pAct);
@@ -140,6 +190,7 @@ initialized_ (false)
 CEVA_NDE_GrblHub::~CEVA_NDE_GrblHub()
 {
    Shutdown();
+   delete streamer_;
 
 }
 
@@ -150,16 +201,87 @@ void CEVA_NDE_GrblHub::GetName(char* name) const
 
 bool CEVA_NDE_GrblHub::Busy()
 {
-   return false;
+   return IsStreaming();
 }
 
-// private and expects caller to:
-// 1. guard the port
-// 2. purge the port
+// Updates status, MPos and WPos
 int CEVA_NDE_GrblHub::GetStatus()
+{
+   GrblStatus snapshot;
+   int ret = GetStatusSnapshot(snapshot);
+   if (ret != DEVICE_OK)
+      return ret;
+   status.assign(snapshot.state);
+   for (int i = 0; i < 3; i++)
+   {
+      MPos[i] = snapshot.mPos[i];
+      WPos[i] = snapshot.wPos[i];
+   }
+   return DEVICE_OK;
+}
+
+/**
+ * Returns the machine status. Once the hub is initialized this is the last
+ * report received by the input monitor thread, without any serial traffic;
+ * before that (device detection) the controller is queried.
+ */
+int CEVA_NDE_GrblHub::GetStatusSnapshot(GrblStatus& snapshot)
+{
+   if (monitorThread_ == 0)
+      return QueryStatus(snapshot);
+
+   // right after start-up the first report may still be on its way
+   MM::MMTime start = GetCurrentMMTime();
+   for (;;)
+   {
+      {
+         MMThreadGuard guard(statusLock_);
+         if (statusSnapshot_.sequence > 0)
+         {
+            snapshot = statusSnapshot_;
+            return DEVICE_OK;
+         }
+      }
+      if ((GetCurrentMMTime() - start).getMsec() > 10.0 * statusIntervalMs_ + 500.0)
+         return ERR_COMMUNICATION;
+      CDeviceUtils::SleepMs(1);
+   }
+}
+
+/**
+ * Waits for a status report newer than the one numbered 'sequence' and
+ * returns it. Wakes up as soon as the monitor thread has parsed the report;
+ * meant for a single waiting thread.
+ */
+int CEVA_NDE_GrblHub::WaitForStatus(long sequence, double timeoutMs, GrblStatus& snapshot)
+{
+   if (monitorThread_ == 0)
+      return DEVICE_NOT_CONNECTED;
+   MM::MMTime start = GetCurrentMMTime();
+   for (;;)
+   {
+      // reset before looking, so that a report arriving meanwhile still wakes us
+      statusEvent_.Reset();
+      {
+         MMThreadGuard guard(statusLock_);
+         if (statusSnapshot_.sequence > sequence)
+         {
+            snapshot = statusSnapshot_;
+            return DEVICE_OK;
+         }
+      }
+      double leftMs = timeoutMs - (GetCurrentMMTime() - start).getMsec();
+      if (leftMs <= 0.0)
+         return DEVICE_SERIAL_TIMEOUT;
+      statusEvent_.Wait(leftMs);
+   }
+}
+
+// Sends '?' and waits for the reply; only used while the monitor is not running
+int CEVA_NDE_GrblHub::QueryStatus(GrblStatus& snapshot)
 {
    std::string cmd;
-   cmd.assign("?"); // x step/mm
+   cmd.assign("?");
    std::string returnString;
    int ret = SendCommand(cmd,returnString);
    if (ret != DEVICE_OK)
@@ -167,44 +289,189 @@ int CEVA_NDE_GrblHub::GetStatus()
 	 LogMessage("command send failed!");
     return ret;
    }
-   std::vector<std::string> tokenInput;
-	char* pEnd;
-   	CDeviceUtils::Tokenize(returnString, tokenInput, "<>,:\r\n");
+   ret = ParseStatus(returnString, snapshot);
+   if (ret == DEVICE_OK)
+      snapshot.sequence = 1;
+   return ret;
+}
+
+int CEVA_NDE_GrblHub::ParseStatus(const std::string& reply, GrblStatus& snapshot)
+{
    //sample: <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>
-	if(tokenInput.size() != 9)
+	if (!statusParser_.ParseStatus(reply.c_str(), reply.length(), snapshot))
 	{
-		LogMessage(returnString.c_str());
+		LogMessage(reply.c_str());
 		LogMessage("echo error!");
 		return DEVICE_ERR;
 	}
-	status.assign(tokenInput[0].c_str());
-	MPos[0] = stringToNum<double>(tokenInput[2]);
-	MPos[1] = stringToNum<double>(tokenInput[3]);
-	MPos[2] = stringToNum<double>(tokenInput[4]);
-	WPos[0] = stringToNum<double>(tokenInput[6]);
-	WPos[1] = stringToNum<double>(tokenInput[7]);
-	WPos[2] = stringToNum<double>(tokenInput[8]);
+	snapshot.timestamp = GetCurrentMMTime();
    return DEVICE_OK;
 
 }
+
+/**
+ * Handles one line received from the controller (called by the input
+ * monitor thread). Status reports are published as the new snapshot,
+ * acknowledgements of streamed lines go to the streamer, and everything
+ * else is queued for SendCommand.
+ */
+void CEVA_NDE_GrblHub::ProcessReply(const std::string& line)
+{
+   if (line[0] == '<')
+   {
+      GrblStatus snapshot;
+      if (ParseStatus(line, snapshot) != DEVICE_OK)
+         return;
+      // the position was sampled when Grbl started sending the report
+      snapshot.timestamp = snapshot.timestamp - MM::MMTime((line.length() + 2) * usPerChar_);
+      positionHistory_.Add((long long)snapshot.timestamp.sec_ * 1000000 + snapshot.timestamp.uSec_,
+            snapshot.mPos);
+
+      {
+         MMThreadGuard guard(statusLock_);
+         snapshot.sequence = statusSnapshot_.sequence + 1;
+         statusSnapshot_ = snapshot;
+         statusReply_ = line;
+      }
+      statusEvent_.Set();
+      return;
+   }
+   if (streamer_->OnReply(line))
+      return;
+   // start-up banner, e.g. "Grbl 0.9j ['$' for help]"
+   if (line.compare(0, 5, "Grbl ") == 0)
+   {
+      SetVersion(line.substr(5, line.find(' ', 5) - 5));
+      // the controller has restarted: the last WCO and the settings read
+      // before may no longer hold
+      statusParser_.Reset();
+      InvalidateParameters();
+      MMThreadGuard guard(statusLock_);
+      restartCount_++;
+   }
+
+   MMThreadGuard guard(replyLock_);
+   if (replies_.size() >= g_maxPendingReplies)
+      replies_.pop_front();
+   replies_.push_back(line);
+}
+
+void CEVA_NDE_GrblHub::ClearReplies()
+{
+   MMThreadGuard guard(replyLock_);
+   replies_.clear();
+}
+
+bool CEVA_NDE_GrblHub::PopReply(std::string& line)
+{
+   MMThreadGuard guard(replyLock_);
+   if (replies_.empty())
+      return false;
+   line = replies_.front();
+   replies_.pop_front();
+   return true;
+}
+
 int CEVA_NDE_GrblHub::SetSync(int axis, double value ){
-   std::string cmd;
-   char buff[20];
-   sprintf(buff, "M108P%.3fQ%d", value,axis);
-   cmd.assign(buff); 
+   std::string cmd = FormatSync(axis, value);
    std::string returnString;
    int ret = SendCommand(cmd,returnString);
    return ret;
 }
+// M108: sync pulse every 'value' mm of travel along 'axis', and one at once
+std::string CEVA_NDE_GrblHub::FormatSync(int axis, double value)
+{
+   char buff[40];
+   sprintf(buff, "M108P%.4fQ%d", RoundSyncStep(value),axis);
+   return std::string(buff);
+}
+// M109: no more sync pulses; unlike M108 it gives none itself
+std::string CEVA_NDE_GrblHub::FormatSyncOff()
+{
+   return "M109";
+}
+// The sync step FormatSync() sends for 'value' mm
+double CEVA_NDE_GrblHub::RoundSyncStep(double value)
+{
+   return floor(value * 10000.0 + 0.5) / 10000.0;
+}
+/**
+ * Writes a setting to the controller and, once accepted, to the cache.
+ */
 int CEVA_NDE_GrblHub::SetParameter(int index, double value){
    std::string cmd;
-   char buff[20];
+   char buff[40];
    sprintf(buff, "$%d=%.3f", index,value);
    cmd.assign(buff); 
    std::string returnString;
    int ret = SendCommand(cmd,returnString);
+   if (ret == DEVICE_OK)
+      UpdateParameter(cmd);
    return ret;
 }
+
+/**
+ * Returns a setting from the cache, reading all settings ($$) first if the
+ * cache is empty. If that read fails, the error is returned without asking
+ * the controller again until InvalidateParameters() is called.
+ */
+int CEVA_NDE_GrblHub::GetParameter(int index, double& value)
+{
+   bool valid;
+   int error;
+   {
+      MMThreadGuard guard(parameterLock_);
+      valid = parametersValid_;
+      error = parametersError_;
+   }
+   if (!valid)
+   {
+      if (error != DEVICE_OK)
+         return error;
+      int ret = GetParameters();
+      if (ret != DEVICE_OK)
+      {
+         // a stream only holds the port for a while; try again afterwards
+         if (ret != ERR_STREAM_ACTIVE)
+         {
+            MMThreadGuard guard(parameterLock_);
+            parametersError_ = ret;
+         }
+         return ret;
+      }
+   }
+   MMThreadGuard guard(parameterLock_);
+   if (index < 0 || index >= (int)parameters_.size())
+      return DEVICE_INVALID_PROPERTY_VALUE;
+   value = parameters_[index];
+   return DEVICE_OK;
+}
+
+/**
+ * Makes the next GetParameter() read the settings from the controller.
+ */
+void CEVA_NDE_GrblHub::InvalidateParameters()
+{
+   MMThreadGuard guard(parameterLock_);
+   parametersValid_ = false;
+   parametersError_ = DEVICE_OK;
+}
+
+// Writes through a "$N=value" command that the controller accepted
+void CEVA_NDE_GrblHub::UpdateParameter(const std::string& command)
+{
+   int index;
+   double value;
+   if (!GrblReplyParser::ParseSetting(command.c_str(), command.length(), index, value))
+      return;
+   MMThreadGuard guard(parameterLock_);
+   if (index < 0 || index > g_GrblMaxSettingIndex)
+      parametersValid_ = false;
+   else if (parametersValid_ && index < (int)parameters_.size())
+      parameters_[index] = value;
+   else
+      parametersValid_ = false; // not a setting we know: read them all again
+}
 //int CEVA_NDE_GrblHub::Reset(){
 //	MMThreadGuard(this->executeLock_);
 //   std::string cmd;
@@ -231,6 +498,10 @@ int CEVA_NDE_GrblHub::SetParameter(int index, double value){
 //   return ret;
 //}
 
+/**
+ * Reads all settings ($$) from the controller into the cache. Also the way
+ * to refresh the cache after the settings were changed behind the hub.
+ */
 int CEVA_NDE_GrblHub::GetParameters()
 {
 	/*
@@ -268,19 +539,34 @@ int CEVA_NDE_GrblHub::GetParameters()
    if (ret != DEVICE_OK)
     return ret;
    
-   	std::vector<std::string> tokenInput;
-
-	char* pEnd;
-   	CDeviceUtils::Tokenize(returnString, tokenInput, "$=()\r\n");
-   if(tokenInput.size() != PARAMETERS_COUNT*3)
-	   return DEVICE_ERR;
-   parameters.clear();
-   std::vector<std::string>::iterator it;
-   for (it=tokenInput.begin(); it!=tokenInput.end(); it+=3)
+   // parameters is indexed by setting number
+   std::vector<double> parameters(PARAMETERS_COUNT, 0.0);
+   int count = 0;
+   const char* line = returnString.c_str();
+   const char* end = line + returnString.length();
+   while (line < end)
    {
-	   std::string str = *(it+1);
-	   parameters.push_back(stringToNum<double>(str));
+      const char* lineEnd = line;
+      while (lineEnd < end && *lineEnd != '\r' && *lineEnd != '\n')
+         lineEnd++;
+      int index;
+      double value;
+      if (GrblReplyParser::ParseSetting(line, (size_t)(lineEnd - line), index, value) &&
+            index >= 0 && index <= g_GrblMaxSettingIndex)
+      {
+         if (index >= (int)parameters.size())
+            parameters.resize(index + 1, 0.0);
+         parameters[index] = value;
+         count++;
+      }
+      line = lineEnd + 1;
    }
+   if(count < PARAMETERS_COUNT)
+	   return DEVICE_ERR;
+
+   MMThreadGuard guard(parameterLock_);
+   parameters_.swap(parameters);
+   parametersValid_ = true;
    return DEVICE_OK;
 
 }
@@ -288,10 +574,13 @@ int CEVA_NDE_GrblHub::SendCommand(std::string command, std::string &returnString
 {
    if(!portAvailable_)
 	   return ERR_NO_PORT_SET;
+   // while streaming, the streamer owns the port
+   if (IsStreaming())
+      return ERR_STREAM_ACTIVE;
    // needs a lock because the other Thread will also use this function
-   MMThreadGuard(this->executeLock_);
-   PurgeComPortH();
+   MMThreadGuard guard(executeLock_);
    int ret = DEVICE_OK;
+   double timeoutMs;
    	if(command.c_str()[0] == '$' && command.c_str()[1] == 'H') 
 	{
 		// Check that we have a controller:
@@ -299,16 +588,19 @@ int CEVA_NDE_GrblHub::SendCommand(std::string command, std::string &returnString
 		if( DEVICE_OK != ret) 
 
 		return ret;
-		ret = GetParameters();
-		if( DEVICE_OK != ret)
-		return ret;
-	   	SetAnswerTimeoutMs(60000.0);
+	   	timeoutMs = 60000.0;
 	}
    else if(command.c_str()[0] == '$' || command.c_str()[0] == '?')
-	  SetAnswerTimeoutMs(5000.0);//for long command
+	  timeoutMs = 5000.0;//for long command
    else
-	  SetAnswerTimeoutMs(300.0); //for normal command
+	  timeoutMs = 300.0; //for normal command
 
+   // the input monitor thread owns the read side of the port
+   if (monitorThread_ != 0)
+      return SendCommandMonitored(command, timeoutMs, returnString);
+
+   PurgeComPortH();
+   SetAnswerTimeoutMs(timeoutMs);
    ret = SetCommandComPortH(command.c_str(),"\n");
    if (ret != DEVICE_OK)
    {
@@ -318,7 +610,7 @@ int CEVA_NDE_GrblHub::SendCommand(std::string command, std::string &returnString
    std::string an;
    if(command.c_str()[0] == 0x18 ){
         CDeviceUtils::SleepMs(600);
-	    ret = GetParameters();
+	    InvalidateParameters();
 	    returnString.assign("ok");
 		LogMessage(std::string("Reset!"));
 		return DEVICE_OK;
@@ -366,6 +658,340 @@ int CEVA_NDE_GrblHub::SendCommand(std::string command, std::string &returnString
    }
 }
 
+// SendCommand while the input monitor thread is running: the command is
+// written here and its reply collected from the lines the monitor queues.
+// Status queries are answered from the last report.
+int CEVA_NDE_GrblHub::SendCommandMonitored(const std::string& command, double timeoutMs, std::string& returnString)
+{
+   if (command == "?")
+   {
+      GrblStatus snapshot;
+      int ret = GetStatusSnapshot(snapshot);
+      if (ret != DEVICE_OK)
+         return ret;
+      MMThreadGuard guard(statusLock_);
+      returnString = statusReply_;
+      return DEVICE_OK;
+   }
+
+   ClearReplies();
+   bool reset = command.c_str()[0] == 0x18;
+   std::string line = reset ? command.substr(0, 1) : command + "\n";
+   int ret = WriteToComPortH((const unsigned char*)line.c_str(), (unsigned)line.length());
+   if (ret != DEVICE_OK)
+   {
+	   LogMessage(std::string("command write fail"));
+	   return ret;
+   }
+
+   if (reset)
+      timeoutMs = 2000.0; // until the start-up banner
+   std::string answer;
+   std::string reply;
+   MM::MMTime start = GetCurrentMMTime();
+   for (;;)
+   {
+      if (!PopReply(reply))
+      {
+         if ((GetCurrentMMTime() - start).getMsec() > timeoutMs)
+         {
+            LogMessage(std::string("answer get error!"));
+            return DEVICE_SERIAL_TIMEOUT;
+         }
+         CDeviceUtils::SleepMs(1);
+         continue;
+      }
+      LogMessage(reply, true);
+      if (reset)
+      {
+         // ProcessReply() has reset the status parser on the banner
+         if (reply.find("Grbl") == std::string::npos)
+            continue;
+         InvalidateParameters();
+         returnString.assign("ok");
+         LogMessage(std::string("Reset!"));
+         return DEVICE_OK;
+      }
+      if (reply.compare(0, 2, "ok") == 0)
+         break;
+      if (reply.compare(0, 5, "error") == 0 || reply.compare(0, 5, "ALARM") == 0)
+      {
+         returnString.assign(reply);
+         return DEVICE_ERR;
+      }
+      if (!answer.empty())
+         answer += "\r\n";
+      answer += reply;
+   }
+
+   if (command.c_str()[0] == '$')
+      returnString.assign(answer);
+   else
+      returnString.assign("ok");
+   return DEVICE_OK;
+}
+
+/**
+ * Starts streaming a G-code program and returns at once. Lines are sent
+ * as fast as Grbl's receive buffer allows, without waiting for each "ok".
+ * Other commands are refused until the stream has finished.
+ */
+int CEVA_NDE_GrblHub::StreamProgram(const std::vector<std::string>& program)
+{
+   if(!portAvailable_)
+	   return ERR_NO_PORT_SET;
+   // acknowledgements reach the streamer through the input monitor thread
+   if (monitorThread_ == 0)
+      return DEVICE_NOT_CONNECTED;
+   MMThreadGuard guard(executeLock_);
+   return streamer_->Start(program);
+}
+
+/**
+ * Waits until every line of the streamed program has been acknowledged.
+ */
+int CEVA_NDE_GrblHub::WaitForStream(double timeoutMs)
+{
+   return streamer_->Wait(timeoutMs);
+}
+
+/**
+ * Stops streaming. Lines already in Grbl's buffer are still executed.
+ */
+void CEVA_NDE_GrblHub::AbortStream()
+{
+   streamer_->Abort(2000.0);
+}
+
+bool CEVA_NDE_GrblHub::IsStreaming()
+{
+   return streamer_ != 0 && streamer_->IsActive();
+}
+
+/**
+ * Writes a real-time command ('?', '!', '~', 0x18, 0x85, ...). Grbl acts on
+ * these as soon as they arrive, ahead of any queued line, and does not
+ * reply "ok"; they are not held up by a command waiting for its reply.
+ */
+int CEVA_NDE_GrblHub::SendRealtime(unsigned char command)
+{
+   if(!portAvailable_)
+	   return ERR_NO_PORT_SET;
+   return WriteToComPortH(&command, 1);
+}
+
+/**
+ * Whether the controller has the jog command $J= and jog cancel (0x85),
+ * i.e. runs Grbl 1.1 or later.
+ */
+bool CEVA_NDE_GrblHub::HasJogCommand()
+{
+   MMThreadGuard guard(statusLock_);
+   return !version_.empty() && atof(version_.c_str()) >= 1.1;
+}
+
+/**
+ * Starts a relative move at the given feed (mm/min) that StopMotion()
+ * cancels at once. Grbl 1.1 jogs with $J=, which leaves the modal state
+ * alone; older versions get a G91 feed move and are left in G90.
+ */
+int CEVA_NDE_GrblHub::Jog(double dxMm, double dyMm, double feed)
+{
+   char buf[100];
+   std::string returnString;
+   if (HasJogCommand())
+   {
+      snprintf(buf, sizeof(buf), "$J=G91X%.3fY%.3fF%.1f", dxMm, dyMm, feed);
+      return SendCommand(buf, returnString);
+   }
+   snprintf(buf, sizeof(buf), "G91G01X%.3fY%.3fF%.1f", dxMm, dyMm, feed);
+   int ret = SendCommand(buf, returnString);
+   if (ret != DEVICE_OK)
+      return ret;
+   return SendCommand("G90", returnString);
+}
+
+/**
+ * Stops all motion as fast as the controller can decelerate and drops the
+ * queued moves, including a streamed program. A Grbl 1.1 jog is cancelled
+ * with 0x85. Otherwise a feed hold stops the stage and, once it has come
+ * to rest, a soft reset flushes the planner; resetting while moving would
+ * lose the position. The reset leaves the controller in G90.
+ */
+int CEVA_NDE_GrblHub::StopMotion()
+{
+   if(!portAvailable_)
+	   return ERR_NO_PORT_SET;
+
+   GrblStatus snapshot;
+   if (HasJogCommand() && GetStatusSnapshot(snapshot) == DEVICE_OK &&
+         strcmp(snapshot.state, "Jog") == 0)
+      return SendRealtime(g_jogCancel);
+
+   int ret = SendRealtime(g_feedHold);
+   if (ret != DEVICE_OK)
+      return ret;
+   // lines still to be sent would end up behind the reset
+   if (IsStreaming())
+      streamer_->Abort(0.0);
+   ret = WaitForHold(g_holdTimeoutMs);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   // the reset is real-time as well, so that it does not wait behind a
+   // command holding executeLock_ (e.g. $H)
+   long restarts;
+   {
+      MMThreadGuard guard(statusLock_);
+      restarts = restartCount_;
+   }
+   ret = SendRealtime(g_softReset);
+   if (ret != DEVICE_OK)
+      return ret;
+   InvalidateParameters();
+   LogMessage(std::string("Reset!"));
+   if (monitorThread_ == 0)
+   {
+      statusParser_.Reset();
+      CDeviceUtils::SleepMs(600);
+      return DEVICE_OK;
+   }
+   return WaitForRestart(restarts, g_restartTimeoutMs);
+}
+
+// Waits for the start-up banner that follows a soft reset. Grbl drops what
+// it receives while it restarts, so commands must not be sent earlier.
+int CEVA_NDE_GrblHub::WaitForRestart(long restarts, double timeoutMs)
+{
+   MM::MMTime start = GetCurrentMMTime();
+   for (;;)
+   {
+      {
+         MMThreadGuard guard(statusLock_);
+         if (restartCount_ != restarts)
+            return DEVICE_OK;
+      }
+      if ((GetCurrentMMTime() - start).getMsec() > timeoutMs)
+         return DEVICE_SERIAL_TIMEOUT;
+      CDeviceUtils::SleepMs(1);
+   }
+}
+
+// Waits until a feed hold has brought the stage to rest. Grbl 1.1 reports
+// "Hold:0" then; older versions only "Hold", so two reports at the same
+// position are taken as standing still.
+int CEVA_NDE_GrblHub::WaitForHold(double timeoutMs)
+{
+   MM::MMTime start = GetCurrentMMTime();
+   long lastSequence = 0;
+   double lastPos[3] = {0.0, 0.0, 0.0};
+   for (;;)
+   {
+      GrblStatus snapshot;
+      int ret = GetStatusSnapshot(snapshot);
+      if (ret != DEVICE_OK)
+         return ret;
+      if (snapshot.sequence != lastSequence)
+      {
+         // 0.8 reports a finished hold with moves left as "Queue"
+         if (strcmp(snapshot.state, "Idle") == 0 || strcmp(snapshot.state, "Hold:0") == 0 ||
+               strcmp(snapshot.state, "Queue") == 0)
+            return DEVICE_OK;
+         if (strcmp(snapshot.state, "Hold") == 0 && lastSequence != 0 &&
+               snapshot.mPos[0] == lastPos[0] && snapshot.mPos[1] == lastPos[1] &&
+               snapshot.mPos[2] == lastPos[2])
+            return DEVICE_OK;
+         lastSequence = snapshot.sequence;
+         for (int i = 0; i < 3; i++)
+            lastPos[i] = snapshot.mPos[i];
+      }
+      if ((GetCurrentMMTime() - start).getMsec() > timeoutMs)
+         return ERR_MOTION_NOT_STOPPED;
+      CDeviceUtils::SleepMs(1);
+   }
+}
+
+// Reads the version with $I, e.g. "[0.9j.20160303:]" or "[VER:1.1h.20190825:]".
+// Grbl 0.8 has no $I; the version then stays unknown.
+int CEVA_NDE_GrblHub::QueryVersion()
+{
+   std::string returnString;
+   int ret = SendCommand("$I", returnString);
+   if (ret != DEVICE_OK)
+      return ret;
+   size_t begin = returnString.find('[');
+   if (begin == std::string::npos)
+      return DEVICE_OK;
+   begin++;
+   if (returnString.compare(begin, 4, "VER:") == 0)
+      begin += 4;
+   size_t end = returnString.find_first_of(".:]", returnString.find('.', begin) + 1);
+   if (end == std::string::npos)
+      return DEVICE_OK;
+   SetVersion(returnString.substr(begin, end - begin));
+   return DEVICE_OK;
+}
+
+void CEVA_NDE_GrblHub::SetVersion(const std::string& version)
+{
+   MMThreadGuard guard(statusLock_);
+   version_ = version;
+}
+
+/**
+ * Plans a serpentine scan from the scan properties and the controller's
+ * acceleration ($8) and seek rate ($5), and sets the RowCount of the scan
+ * camera, if any, to the number of triggers per row.
+ */
+int CEVA_NDE_GrblHub::PlanScan(ScanPlan& plan)
+{
+   ScanSettings settings;
+   int ret = GetParameter(8, settings.acceleration);
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = GetParameter(5, settings.maxFeed);
+   if (ret != DEVICE_OK)
+      return ret;
+   settings.startX = scanSettings_[0];
+   settings.startY = scanSettings_[1];
+   settings.width = scanSettings_[2];
+   settings.height = scanSettings_[3];
+   settings.pitch = scanSettings_[4];
+   settings.indexStep = scanSettings_[5];
+   settings.prfHz = scanSettings_[6];
+   settings.rearmUs = scanSettings_[7];
+   ret = ScanPlanner::Plan(settings, plan);
+   if (ret != DEVICE_OK)
+      return ret;
+
+   if (!scanCamera_.empty())
+   {
+      ret = GetCoreCallback()->SetDeviceProperty(scanCamera_.c_str(), "RowCount",
+            CDeviceUtils::ConvertToString(plan.triggersPerRow));
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+
+   std::ostringstream os;
+   os << "Scan: " << plan.rows << " rows of " << plan.pointsPerRow << " points, "
+      << plan.rampPoints << " ramp triggers per side, " << plan.triggers
+      << " triggers in all, feed " << plan.feed
+      << " mm/min, overscan " << plan.overscan << " mm";
+   LogMessage(os.str().c_str());
+   return DEVICE_OK;
+}
+
+/**
+ * Plans the scan and starts streaming it.
+ */
+int CEVA_NDE_GrblHub::StartScan()
+{
+   int ret = PlanScan(scanPlan_);
+   if (ret != DEVICE_OK)
+      return ret;
+   return StreamProgram(scanPlan_.program);
+}
+
 MM::DeviceDetectionStatus CEVA_NDE_GrblHub::DetectDevice(void)
 {
   if (initialized_)
@@ -448,8 +1074,58 @@ int CEVA_NDE_GrblHub::Initialize()
    ret = CreateProperty("Command","", MM::String, false, pAct);
    if (DEVICE_OK != ret)
       return ret;
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnStatusInterval);
+   ret = CreateProperty(g_statusIntervalProp, CDeviceUtils::ConvertToString(statusIntervalMs_), MM::Integer, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   SetPropertyLimits(g_statusIntervalProp, 10, 1000);
+
+   for (long i = 0; i < g_scanSettingCount; i++)
+   {
+      CPropertyActionEx* pActEx = new CPropertyActionEx(this, &CEVA_NDE_GrblHub::OnScanSetting, i);
+      ret = CreateProperty(g_scanSettingProps[i], CDeviceUtils::ConvertToString(scanSettings_[i]), MM::Float, false, pActEx);
+      if (DEVICE_OK != ret)
+         return ret;
+   }
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnScanCamera);
+   ret = CreateProperty(g_scanCameraProp, "", MM::String, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnScanFeed);
+   ret = CreateProperty("ScanFeedMmPerMin", "0", MM::Float, true, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnScanRowCount);
+   ret = CreateProperty("ScanRowCount", "0", MM::Integer, true, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnScan);
+   ret = CreateProperty("Scan", g_scanIdle, MM::String, false, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+   AddAllowedValue("Scan", g_scanIdle);
+   AddAllowedValue("Scan", g_scanStart);
+   pAct = new CPropertyAction(this, &CEVA_NDE_GrblHub::OnPositionSamples);
+   ret = CreateProperty("PositionSamples", "", MM::String, true, pAct);
+   if (DEVICE_OK != ret)
+      return ret;
+
    // turn off verbose serial debug messages
    GetCoreCallback()->SetDeviceProperty(port_.c_str(), "Verbose", "0");
+
+   // to date status reports back to when they were sent (10 bits per character)
+   char baudRate[MM::MaxStrLength];
+   if (GetCoreCallback()->GetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, baudRate) == DEVICE_OK &&
+         atof(baudRate) > 0.0)
+      usPerChar_ = 1.0e7 / atof(baudRate);
+
+   // from now on the monitor thread reads everything the controller sends
+   positionHistory_.Clear();
+   PurgeComPortH();
+   monitorThread_ = new EVA_NDE_GrblInputMonitorThread(*this);
+   monitorThread_->Start();
+   QueryVersion();
+
    // synchronize all properties
    // --------------------------
    ret = UpdateStatus();
@@ -493,6 +1169,15 @@ int CEVA_NDE_GrblHub::SetAnswerTimeoutMs(double timeout)
 
 int CEVA_NDE_GrblHub::Shutdown()
 {
+   if (streamer_)
+      streamer_->Abort(2000.0);
+   if (monitorThread_ != 0)
+   {
+      monitorThread_->Stop();
+      monitorThread_->wait();
+      delete monitorThread_;
+      monitorThread_ = 0;
+   }
    initialized_ = false;
 
    return DEVICE_OK;
@@ -527,6 +1212,7 @@ int CEVA_NDE_GrblHub::OnVersion(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
    if (pAct == MM::BeforeGet)
    {
+	   MMThreadGuard guard(statusLock_);
 	   pProp->Set(version_.c_str());
    }
    return DEVICE_OK;
@@ -549,6 +1235,181 @@ int CEVA_NDE_GrblHub::OnCommand(MM::PropertyBase* pProp, MM::ActionType pAct)
 		  commandResult_.assign("Error!");
 		  return DEVICE_ERR;
 	  }
+	  UpdateParameter(cmd);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnStatusInterval(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(statusIntervalMs_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(statusIntervalMs_);
+   }
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EVA_NDE_GrblInputMonitorThread implementation
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+EVA_NDE_GrblInputMonitorThread::EVA_NDE_GrblInputMonitorThread(CEVA_NDE_GrblHub& hub) :
+   hub_(hub),
+   stop_(true)
+{
+}
+
+int EVA_NDE_GrblInputMonitorThread::svc()
+{
+   const unsigned char query = '?';
+   MM::MMTime lastQuery(0.0);
+   while (!stop_)
+   {
+      MM::MMTime now = hub_.GetCurrentMMTimeH();
+      if ((now - lastQuery).getMsec() >= hub_.GetStatusIntervalMs())
+      {
+         // real-time command: no line end, no "ok" in reply
+         if (hub_.WriteToComPortH(&query, 1) != DEVICE_OK)
+            hub_.LogMessageH("Status query failed", true);
+         lastQuery = now;
+      }
+
+      unsigned char buf[256];
+      unsigned long bytesRead = 0;
+      int ret = hub_.ReadFromComPortH(buf, sizeof(buf), bytesRead);
+      if (ret != DEVICE_OK)
+      {
+         std::ostringstream os;
+         os << "Monitor thread: error reading from port: " << ret;
+         hub_.LogMessageH(os.str());
+         CDeviceUtils::SleepMs(10);
+         continue;
+      }
+      if (bytesRead == 0)
+      {
+         CDeviceUtils::SleepMs(1);
+         continue;
+      }
+
+      for (unsigned long i = 0; i < bytesRead; i++)
+      {
+         char c = (char)buf[i];
+         if (c == '\n')
+         {
+            if (!partialLine_.empty())
+               hub_.ProcessReply(partialLine_);
+            partialLine_.clear();
+         }
+         else if (c != '\r')
+            partialLine_ += c;
+      }
+   }
+   return 0;
+}
+
+void EVA_NDE_GrblInputMonitorThread::Start()
+{
+   stop_ = false;
+   partialLine_.clear();
+   activate();
+}
+
+int CEVA_NDE_GrblHub::OnScanSetting(MM::PropertyBase* pProp, MM::ActionType pAct, long index)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(scanSettings_[index]);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(scanSettings_[index]);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnScanCamera(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(scanCamera_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      pProp->Get(scanCamera_);
+   }
+   return DEVICE_OK;
+}
+
+// feedrate of the last plan
+int CEVA_NDE_GrblHub::OnScanFeed(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(scanPlan_.feed);
+   }
+   return DEVICE_OK;
+}
+
+// triggers per row of the last plan, including the ramps
+int CEVA_NDE_GrblHub::OnScanRowCount(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(scanPlan_.triggersPerRow);
+   }
+   return DEVICE_OK;
+}
+
+int CEVA_NDE_GrblHub::OnScan(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(IsStreaming() ? g_scanStart : g_scanIdle);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      std::string value;
+      pProp->Get(value);
+      if (value == g_scanStart)
+         return StartScan();
+      AbortStream();
+   }
+   return DEVICE_OK;
+}
+
+/*
+ * Newest positions from the status reports, for other devices to stamp
+ * their data with: "<t0>;<dt>,<x>,<y>;..." newest first, as many as fit
+ * in a property value. t0 is the time of the newest report in us, in the
+ * time base of MM::Core::GetCurrentMMTime(); dt is relative to it and x, y
+ * are machine positions in um. Never waits for a report.
+ */
+int CEVA_NDE_GrblHub::OnPositionSamples(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      std::string text;
+      if (positionHistory_.GetNewest(g_positionSamplesMax, positionSamples_) > 0)
+      {
+         char buf[80];
+         long long newestUs = positionSamples_.back().timeUs;
+         sprintf(buf, "%lld", newestUs);
+         text = buf;
+         for (size_t i = positionSamples_.size(); i-- > 0; )
+         {
+            const PositionHistory::Sample& sample = positionSamples_[i];
+            sprintf(buf, ";%lld,%.2f,%.2f", sample.timeUs - newestUs,
+                  sample.pos[0] * 1000.0, sample.pos[1] * 1000.0);
+            if (text.size() + strlen(buf) >= (size_t)MM::MaxStrLength)
+               break;
+            text += buf;
+         }
+      }
+      pProp->Set(text.c_str());
    }
    return DEVICE_OK;
 }
@@ -18,8 +18,14 @@
 
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
+#include "../../MMDevice/DeviceThreads.h"
+#include "GrblEvent.h"
+#include "GrblParser.h"
+#include "PositionHistory.h"
+#include "ScanPlanner.h"
 #include <string>
 #include <map>
+#include <deque>
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
@@ -33,6 +39,15 @@
 #define ERR_COMMUNICATION 107
 #define ERR_NO_PORT_SET 108
 #define ERR_VERSION_MISMATCH 109
+#define ERR_STREAM_ACTIVE 110
+#define ERR_STREAM_LINE_FAILED 111
+#define ERR_STREAM_TIMEOUT 112
+#define ERR_LINE_TOO_LONG 113
+#define ERR_SCAN_INVALID 114
+#define ERR_MOTION_NOT_STOPPED 116
+#define ERR_MOVE_TIMEOUT 117
+#define ERR_MOVE_ALARM 118
+#define ERR_SEQUENCE_SYNC 119
 
 #define PARAMETERS_COUNT 23
 
@@ -40,9 +55,10 @@ extern std::vector<std::string> &split(const std::string &s, char delim, std::ve
 std::vector<std::string> split(const std::string &s, char delim);
 
 class EVA_NDE_GrblInputMonitorThread;
+class GrblStreamer;
 //void AddAvailableDeviceName(const char* name, const char* descr);
 
-class CEVA_NDE_GrblHub : public HubBase<CEVA_NDE_GrblHub>  
+class CEVA_NDE_GrblHub : public HubBase<CEVA_NDE_GrblHub>
 {
 public:
    CEVA_NDE_GrblHub();
@@ -61,6 +77,13 @@ public:
    int OnVersion(MM::PropertyBase* pPropt, MM::ActionType eAct);
    int OnStatus(MM::PropertyBase* pProp, MM::ActionType pAct);
    int OnCommand(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnStatusInterval(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnScanSetting(MM::PropertyBase* pProp, MM::ActionType pAct, long index);
+   int OnScanCamera(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnScanFeed(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnScanRowCount(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnScan(MM::PropertyBase* pProp, MM::ActionType pAct);
+   int OnPositionSamples(MM::PropertyBase* pProp, MM::ActionType pAct);
    // custom interface for child devices
    bool IsPortAvailable() {return portAvailable_;}
    bool IsTimedOutputActive() {return timedOutputActive_;}
@@ -80,26 +103,90 @@ public:
 	{
 		return GetSerialAnswer(port_.c_str(),term,ans);
 	}
+   int LogMessageH(const std::string& msg, bool debugOnly = false) {return LogMessage(msg, debugOnly);}
+   MM::MMTime GetCurrentMMTimeH() {return GetCurrentMMTime();}
    static MMThreadLock& GetLock() {return lock_;}
 
    int SendCommand(std::string command, std::string &returnString);
    int SetAnswerTimeoutMs(double timout);
    int SetSync(int axis, double value );
+   static std::string FormatSync(int axis, double value);
+   static std::string FormatSyncOff();
+   static double RoundSyncStep(double value);
 
+   // settings ($$), cached until a reset or a refresh
    int GetParameters();
+   int GetParameter(int index, double& value);
    int SetParameter(int index, double value);
-   std::vector<double> parameters;
+   void InvalidateParameters();
    //int Reset();
    double MPos[3];
    double WPos[3];
    int GetStatus(); 
+   int GetStatusSnapshot(GrblStatus& snapshot);
+   int WaitForStatus(long sequence, double timeoutMs, GrblStatus& snapshot);
+   int ParseStatus(const std::string& reply, GrblStatus& snapshot);
    std::string status;
+
+   // called by the input monitor thread
+   void ProcessReply(const std::string& line);
+   long GetStatusIntervalMs() {return statusIntervalMs_;}
+
+   // streaming of G-code programs
+   int StreamProgram(const std::vector<std::string>& program);
+   int WaitForStream(double timeoutMs);
+   void AbortStream();
+   bool IsStreaming();
+
+   // real-time control: single bytes that bypass the command lock and
+   // Grbl's line queue
+   int SendRealtime(unsigned char command);
+   bool HasJogCommand();
+   int Jog(double dxMm, double dyMm, double feed);
+   int StopMotion();
+
+   // serpentine C-scans
+   int PlanScan(ScanPlan& plan);
+   int StartScan();
 private:
+   int QueryStatus(GrblStatus& snapshot);
+   int QueryVersion();
+   void SetVersion(const std::string& version);
+   int WaitForHold(double timeoutMs);
+   int WaitForRestart(long restarts, double timeoutMs);
+   int SendCommandMonitored(const std::string& command, double timeoutMs, std::string& returnString);
+   void ClearReplies();
+   bool PopReply(std::string& line);
+   void UpdateParameter(const std::string& command);
+
    MMThreadLock executeLock_;
+   GrblStreamer* streamer_;
+   EVA_NDE_GrblInputMonitorThread* monitorThread_;
+   long statusIntervalMs_;
+   MMThreadLock parameterLock_;
+   std::vector<double> parameters_;   // indexed by setting number, synchronized by parameterLock_
+   bool parametersValid_;             // synchronized by parameterLock_
+   int parametersError_;              // of the last failed $$ read, synchronized by parameterLock_
+
+   std::vector<double> scanSettings_;  // indexed like g_scanSettingProps
+   std::string scanCamera_;
+   ScanPlan scanPlan_;                 // last plan
+
+   GrblReplyParser statusParser_;     // used by the monitor thread once it runs
+   MMThreadLock statusLock_;
+   GrblStatus statusSnapshot_;        // synchronized by statusLock_
+   std::string statusReply_;          // raw text of the last report, synchronized by statusLock_
+   GrblEvent statusEvent_;            // set on every report
+   MMThreadLock replyLock_;
+   std::deque<std::string> replies_;  // replies not consumed by the streamer, synchronized by replyLock_
+   PositionHistory positionHistory_;  // MPos of every status report
+   std::vector<PositionHistory::Sample> positionSamples_; // newest reports, for PositionSamples
+   double usPerChar_;                 // serial transmission time of one character
+   long restartCount_;                // start-up banners received, synchronized by statusLock_
 
    std::string commandResult_;
    std::string port_;
-   std::string version_;
+   std::string version_;              // synchronized by statusLock_ once the monitor runs
    bool initialized_;
    bool portAvailable_;
    bool timedOutputActive_;
@@ -107,4 +194,25 @@ private:
 
 };
 
+//////////////////////////////////////////////////////////////////////////////
+// EVA_NDE_GrblInputMonitorThread class
+// Owns the read side of the serial port once the hub is initialized: sends
+// the '?' real-time query at the hub's status interval and hands every
+// line received to CEVA_NDE_GrblHub::ProcessReply().
+//////////////////////////////////////////////////////////////////////////////
+class EVA_NDE_GrblInputMonitorThread : public MMDeviceThreadBase
+{
+public:
+   EVA_NDE_GrblInputMonitorThread(CEVA_NDE_GrblHub& hub);
+   int svc();
+
+   void Start();
+   void Stop() {stop_ = true;}
+
+private:
+   CEVA_NDE_GrblHub& hub_;
+   volatile bool stop_; // set by Stop() from another thread
+   std::string partialLine_;
+};
+
 #endif //_EVA_NDE_Grbl_H_
\ No newline at end of file
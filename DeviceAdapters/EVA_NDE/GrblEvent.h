@@ -0,0 +1,118 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblEvent.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Waitable event for threads of the Grbl adapters
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_EVENT_H_
+#define _GRBL_EVENT_H_
+
+#ifdef _WIN32
+   #ifndef WIN32_LEAN_AND_MEAN
+      #define WIN32_LEAN_AND_MEAN
+   #endif
+   #include <windows.h>
+#else
+   #include <pthread.h>
+   #include <sys/time.h>
+   #include <errno.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// GrblEvent class
+// Manual-reset event: once Set(), Wait() returns at once until Reset().
+// Lets a thread sleep until another one has news for it, instead of
+// polling a flag.
+//////////////////////////////////////////////////////////////////////////////
+class GrblEvent
+{
+public:
+   GrblEvent()
+   {
+#ifdef _WIN32
+      event_ = CreateEvent(NULL, TRUE, FALSE, NULL);
+#else
+      signaled_ = false;
+      pthread_mutex_init(&mutex_, NULL);
+      pthread_cond_init(&cond_, NULL);
+#endif
+   }
+
+   ~GrblEvent()
+   {
+#ifdef _WIN32
+      CloseHandle(event_);
+#else
+      pthread_cond_destroy(&cond_);
+      pthread_mutex_destroy(&mutex_);
+#endif
+   }
+
+   void Set()
+   {
+#ifdef _WIN32
+      SetEvent(event_);
+#else
+      pthread_mutex_lock(&mutex_);
+      signaled_ = true;
+      pthread_cond_broadcast(&cond_);
+      pthread_mutex_unlock(&mutex_);
+#endif
+   }
+
+   void Reset()
+   {
+#ifdef _WIN32
+      ResetEvent(event_);
+#else
+      pthread_mutex_lock(&mutex_);
+      signaled_ = false;
+      pthread_mutex_unlock(&mutex_);
+#endif
+   }
+
+   /**
+    * Waits until the event is set; returns false on timeout.
+    */
+   bool Wait(double timeoutMs)
+   {
+      if (timeoutMs < 0.0)
+         timeoutMs = 0.0;
+#ifdef _WIN32
+      return WaitForSingleObject(event_, (DWORD)(timeoutMs + 0.5)) == WAIT_OBJECT_0;
+#else
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      long long deadlineUs = (long long)now.tv_sec * 1000000 + now.tv_usec + (long long)(timeoutMs * 1000.0);
+      struct timespec deadline;
+      deadline.tv_sec = (time_t)(deadlineUs / 1000000);
+      deadline.tv_nsec = (long)(deadlineUs % 1000000) * 1000;
+
+      pthread_mutex_lock(&mutex_);
+      int ret = 0;
+      while (!signaled_ && ret != ETIMEDOUT)
+         ret = pthread_cond_timedwait(&cond_, &mutex_, &deadline);
+      bool signaled = signaled_;
+      pthread_mutex_unlock(&mutex_);
+      return signaled;
+#endif
+   }
+
+private:
+   // Forbid copying
+   GrblEvent(const GrblEvent&);
+   GrblEvent& operator=(const GrblEvent&);
+
+#ifdef _WIN32
+   HANDLE event_;
+#else
+   bool signaled_;
+   pthread_mutex_t mutex_;
+   pthread_cond_t cond_;
+#endif
+};
+
+#endif //_GRBL_EVENT_H_
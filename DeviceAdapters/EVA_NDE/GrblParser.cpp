@@ -0,0 +1,284 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblParser.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Allocation-free parsing of Grbl status reports and settings
+// LICENSE:       LGPL
+//
+
+#include "GrblParser.h"
+#include <cstring>
+
+namespace {
+
+const double g_pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+      1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+const int g_maxFractionDigits = 15;
+const int g_maxFieldValues = 3;
+
+inline bool IsDigit(char c)
+{
+   return c >= '0' && c <= '9';
+}
+
+inline bool IsLetter(char c)
+{
+   return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+inline bool StartsNumber(const char* p, const char* end)
+{
+   return p < end && (IsDigit(*p) || *p == '-' || *p == '+' || *p == '.');
+}
+
+inline bool NameIs(const char* name, size_t length, const char* expected)
+{
+   return strlen(expected) == length && strncmp(name, expected, length) == 0;
+}
+
+// Copies [begin, end) into a fixed buffer, truncating
+void CopyField(char* dest, size_t destSize, const char* begin, const char* end)
+{
+   size_t length = (size_t)(end - begin);
+   if (length > destSize - 1)
+      length = destSize - 1;
+   memcpy(dest, begin, length);
+   dest[length] = 0;
+}
+
+} // anonymous namespace
+
+GrblReplyParser::GrblReplyParser()
+{
+   Reset();
+}
+
+/**
+ * Forgets the work coordinate offset, e.g. after a controller reset.
+ */
+void GrblReplyParser::Reset()
+{
+   wco_[0] = wco_[1] = wco_[2] = 0.0;
+   haveWco_ = false;
+}
+
+/**
+ * Parses a decimal number ([+-]digits[.digits]) at p, which is advanced
+ * past it. Returns false if there is no number at p.
+ */
+bool GrblReplyParser::ParseNumber(const char*& p, const char* end, double& value)
+{
+   const char* q = p;
+   bool negative = false;
+   if (q < end && (*q == '-' || *q == '+'))
+   {
+      negative = *q == '-';
+      q++;
+   }
+
+   double mantissa = 0.0;
+   int digits = 0;
+   int fractionDigits = 0;
+   while (q < end && IsDigit(*q))
+   {
+      mantissa = mantissa * 10.0 + (*q - '0');
+      digits++;
+      q++;
+   }
+   if (q < end && *q == '.')
+   {
+      q++;
+      while (q < end && IsDigit(*q))
+      {
+         // digits beyond double precision are dropped
+         if (fractionDigits < g_maxFractionDigits)
+         {
+            mantissa = mantissa * 10.0 + (*q - '0');
+            fractionDigits++;
+         }
+         digits++;
+         q++;
+      }
+   }
+   if (digits == 0)
+      return false;
+
+   value = mantissa / g_pow10[fractionDigits];
+   if (negative)
+      value = -value;
+   p = q;
+   return true;
+}
+
+/**
+ * Parses a status report, e.g.
+ *    <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000>           (0.8)
+ *    <Idle,MPos:0.000,0.000,0.000,WPos:0.000,0.000,0.000,Buf:0,RX:0> (0.9)
+ *    <Idle|MPos:0.000,0.000,0.000|Bf:15,128|FS:0,0|WCO:0.000,0.000,0.000> (1.1)
+ * Text around the brackets (line ends, "ok") is ignored. Fills every field
+ * of status except timestamp and sequence. Returns false if the reply is
+ * not a status report or has no position.
+ */
+bool GrblReplyParser::ParseStatus(const char* reply, size_t length, GrblStatus& status)
+{
+   const char* end = reply + length;
+   const char* p = reply;
+   while (p < end && *p != '<')
+      p++;
+   if (p == end)
+      return false;
+   p++;
+   const char* close = p;
+   while (close < end && *close != '>')
+      close++;
+   if (close == end)
+      return false;
+   end = close;
+
+   status.state[0] = 0;
+   status.plannerFree = status.rxFree = -1;
+   status.plannerUsed = status.rxUsed = -1;
+   status.feed = status.spindle = -1.0;
+   status.pins[0] = 0;
+
+   // state, up to the first separator; 1.1 separates fields with '|'
+   const char* field = p;
+   while (p < end && *p != ',' && *p != '|')
+      p++;
+   CopyField(status.state, sizeof(status.state), field, p);
+   if (status.state[0] == 0)
+      return false;
+
+   bool haveMPos = false;
+   bool haveWPos = false;
+   bool haveReportedWco = false;
+   while (p < end)
+   {
+      p++; // separator
+      const char* name = p;
+      while (p < end && IsLetter(*p))
+         p++;
+      size_t nameLength = (size_t)(p - name);
+      if (p == end || *p != ':')
+      {
+         // not a field: skip to the next separator
+         while (p < end && *p != ',' && *p != '|')
+            p++;
+         continue;
+      }
+      p++;
+
+      if (NameIs(name, nameLength, "Pn"))
+      {
+         const char* pins = p;
+         while (p < end && IsLetter(*p))
+            p++;
+         CopyField(status.pins, sizeof(status.pins), pins, p);
+         continue;
+      }
+
+      // values are numbers separated by ','; in 0.8 and 0.9 a ',' followed
+      // by a letter starts the next field
+      double values[g_maxFieldValues];
+      int count = 0;
+      double value;
+      while (ParseNumber(p, end, value))
+      {
+         if (count < g_maxFieldValues)
+            values[count] = value;
+         count++;
+         if (p < end && *p == ',' && StartsNumber(p + 1, end))
+            p++;
+         else
+            break;
+      }
+      // skip whatever could not be parsed
+      while (p < end && *p != ',' && *p != '|')
+         p++;
+
+      if (NameIs(name, nameLength, "MPos") && count >= 3)
+      {
+         status.mPos[0] = values[0]; status.mPos[1] = values[1]; status.mPos[2] = values[2];
+         haveMPos = true;
+      }
+      else if (NameIs(name, nameLength, "WPos") && count >= 3)
+      {
+         status.wPos[0] = values[0]; status.wPos[1] = values[1]; status.wPos[2] = values[2];
+         haveWPos = true;
+      }
+      else if (NameIs(name, nameLength, "WCO") && count >= 3)
+      {
+         wco_[0] = values[0]; wco_[1] = values[1]; wco_[2] = values[2];
+         haveWco_ = true;
+         haveReportedWco = true;
+      }
+      else if (NameIs(name, nameLength, "Bf") && count >= 2)
+      {
+         status.plannerFree = (long)values[0];
+         status.rxFree = (long)values[1];
+      }
+      else if (NameIs(name, nameLength, "Buf") && count >= 1)
+         status.plannerUsed = (long)values[0];
+      else if (NameIs(name, nameLength, "RX") && count >= 1)
+         status.rxUsed = (long)values[0];
+      else if (NameIs(name, nameLength, "FS") && count >= 2)
+      {
+         status.feed = values[0];
+         status.spindle = values[1];
+      }
+      else if (NameIs(name, nameLength, "F") && count >= 1)
+         status.feed = values[0];
+   }
+
+   if (!haveMPos && !haveWPos)
+      return false;
+   if (haveMPos && haveWPos && !haveReportedWco)
+   {
+      // 0.8 and 0.9 report both positions
+      for (int i = 0; i < 3; i++)
+         wco_[i] = status.mPos[i] - status.wPos[i];
+      haveWco_ = true;
+   }
+   for (int i = 0; i < 3; i++)
+   {
+      double wco = haveWco_ ? wco_[i] : 0.0;
+      if (!haveWPos)
+         status.wPos[i] = status.mPos[i] - wco;
+      else if (!haveMPos)
+         status.mPos[i] = status.wPos[i] + wco;
+      status.wco[i] = wco;
+   }
+   return true;
+}
+
+/**
+ * Parses one line of the reply to "$$", "$<index>=<value>" optionally
+ * followed by a description (0.8: "$0=250.000 (x, step/mm)").
+ * Returns false if the index is above g_GrblMaxSettingIndex.
+ */
+bool GrblReplyParser::ParseSetting(const char* line, size_t length, int& index, double& value)
+{
+   const char* end = line + length;
+   const char* p = line;
+   if (p == end || *p != '$')
+      return false;
+   p++;
+   if (p == end || !IsDigit(*p))
+      return false;
+   int n = 0;
+   while (p < end && IsDigit(*p))
+   {
+      n = n * 10 + (*p - '0');
+      if (n > g_GrblMaxSettingIndex)
+         return false;
+      p++;
+   }
+   if (p == end || *p != '=')
+      return false;
+   p++;
+   if (!ParseNumber(p, end, value))
+      return false;
+   index = n;
+   return true;
+}
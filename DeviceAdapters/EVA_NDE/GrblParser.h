@@ -0,0 +1,62 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblParser.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Allocation-free parsing of Grbl status reports and settings
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_PARSER_H_
+#define _GRBL_PARSER_H_
+
+#include "../../MMDevice/MMDevice.h"
+#include <cstddef>
+
+// Highest setting number ParseSetting() accepts ($0 to $255)
+const int g_GrblMaxSettingIndex = 255;
+
+// Machine status as last reported by Grbl in reply to '?'. Fields the
+// firmware did not report are -1 (numbers) or empty (strings).
+struct GrblStatus
+{
+   char state[16];       // Idle, Run, Hold, Hold:0, Alarm, ...
+   double mPos[3];       // machine position, mm
+   double wPos[3];       // work position, mm
+   double wco[3];        // work coordinate offset (MPos - WPos), mm
+   long plannerFree;     // Bf (1.1): free planner blocks
+   long rxFree;          // Bf (1.1): free bytes in the serial receive buffer
+   long plannerUsed;     // Buf (0.9): blocks in the planner
+   long rxUsed;          // RX (0.9): bytes in the serial receive buffer
+   double feed;          // FS or F: current feed rate, mm/min
+   double spindle;       // FS: spindle speed
+   char pins[12];        // Pn (1.1): input pins that are active, e.g. "XP"
+   MM::MMTime timestamp; // when the report was received
+   long sequence;        // number of reports received, 0 if none yet
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// GrblReplyParser class
+// Parses status reports of Grbl 0.8 and 0.9 (comma separated) and 1.1
+// (fields separated by '|') in place, without allocating memory, so that
+// it can run for every report on the input monitor thread.
+//
+// Grbl 1.1 reports either MPos or WPos, and WCO only every few reports;
+// the parser keeps the last WCO to derive the other position.
+//////////////////////////////////////////////////////////////////////////////
+class GrblReplyParser
+{
+public:
+   GrblReplyParser();
+
+   bool ParseStatus(const char* reply, size_t length, GrblStatus& status);
+   static bool ParseSetting(const char* line, size_t length, int& index, double& value);
+   static bool ParseNumber(const char*& p, const char* end, double& value);
+   void Reset();
+
+private:
+   double wco_[3];
+   bool haveWco_;
+};
+
+#endif //_GRBL_PARSER_H_
@@ -0,0 +1,870 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSimulator.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Simulated Grbl controller, exposed as a serial port device
+// LICENSE:       LGPL
+//
+
+#include "GrblSimulator.h"
+#include "GrblParser.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#ifdef WIN32
+   #define snprintf _snprintf 
+#endif
+
+extern const char* g_DeviceNameGrblSimulator;
+
+namespace {
+
+const char* g_banner = "\r\nGrbl 0.9j ['$' for help]\r\n";
+const size_t g_rxBufferSize = 128;
+const size_t g_plannerSize = 18;
+const size_t g_maxSyncPulses = 65536;
+const double g_syncToleranceMm = 1.0e-6; // travel rounding that still gives a pulse
+const double g_maxTickSec = 0.001;  // longest integration step
+const double g_bitsPerChar = 10.0;  // start, 8 data bits, stop
+const int g_axes = 3;
+
+// settings in the numbering of the hub ($0-$22), with their defaults
+struct SettingInfo
+{
+   double value;
+   bool integer;
+   const char* description;
+};
+
+const SettingInfo g_settingInfo[] = {
+   {250.0, false, "x, step/mm"},
+   {250.0, false, "y, step/mm"},
+   {250.0, false, "z, step/mm"},
+   {10.0, true, "step pulse, usec"},
+   {250.0, false, "default feed, mm/min"},
+   {500.0, false, "default seek, mm/min"},
+   {192.0, true, "step port invert mask, int:11000000"},
+   {25.0, true, "step idle delay, msec"},
+   {10.0, false, "acceleration, mm/sec^2"},
+   {0.05, false, "junction deviation, mm"},
+   {0.1, false, "arc, mm/segment"},
+   {25.0, true, "n-arc correction, int"},
+   {3.0, true, "n-decimals, int"},
+   {0.0, true, "report inches, bool"},
+   {1.0, true, "auto start, bool"},
+   {0.0, true, "invert step enable, bool"},
+   {0.0, true, "hard limits, bool"},
+   {0.0, true, "homing cycle, bool"},
+   {0.0, true, "homing dir invert mask, int:00000000"},
+   {25.0, false, "homing feed, mm/min"},
+   {250.0, false, "homing seek, mm/min"},
+   {100.0, true, "homing debounce, msec"},
+   {1.0, false, "homing pull-off, mm"}};
+const int g_settingCount = sizeof(g_settingInfo) / sizeof(g_settingInfo[0]);
+
+enum Setting
+{
+   DefaultFeed = 4,
+   DefaultSeek = 5,
+   Acceleration = 8,
+   JunctionDeviation = 9,
+   HomingSeek = 20
+};
+
+} // anonymous namespace
+
+class GrblSimulator::SimulatorThread : public MMDeviceThreadBase
+{
+public:
+   SimulatorThread(GrblSimulator& sim) : sim_(sim), stop_(false) {}
+
+   int svc()
+   {
+      while (!stop_)
+      {
+         sim_.Tick();
+         CDeviceUtils::SleepMs(1);
+      }
+      return 0;
+   }
+
+   void Stop() {stop_ = true;}
+
+private:
+   GrblSimulator& sim_;
+   volatile bool stop_;
+};
+
+GrblSimulator::GrblSimulator() :
+   initialized_(false),
+   thread_(0),
+   baudRate_(115200),
+   answerTimeoutMs_(500.0),
+   lastArrivalUs_(0.0),
+   absolute_(true),
+   rapid_(true),
+   feed_(0.0),
+   speed_(0.0),
+   progress_(0.0),
+   hold_(false),
+   lastTickUs_(0.0),
+   syncStep_(0.0),
+   syncAxis_(0),
+   syncTravel_(0.0),
+   linesReceived_(0),
+   syncPulseCount_(0),
+   rxOverflows_(0)
+{
+   for (int i = 0; i < g_axes; i++)
+      mPos_[i] = 0.0;
+   for (int i = 0; i < g_settingCount; i++)
+      settings_.push_back(g_settingInfo[i].value);
+
+   CreateProperty(MM::g_Keyword_Name, g_DeviceNameGrblSimulator, MM::String, true);
+   CreateProperty(MM::g_Keyword_Description, "Simulated Grbl controller", MM::String, true);
+
+   // the properties the hub sets on its port, before initialization
+   CPropertyAction* pAct = new CPropertyAction(this, &GrblSimulator::OnBaudRate);
+   CreateProperty(MM::g_Keyword_BaudRate, "115200", MM::Integer, false, pAct, true);
+   const char* baudRates[] = {"9600", "19200", "38400", "57600", "115200", "230400"};
+   for (unsigned i = 0; i < sizeof(baudRates) / sizeof(baudRates[0]); i++)
+      AddAllowedValue(MM::g_Keyword_BaudRate, baudRates[i]);
+
+   pAct = new CPropertyAction(this, &GrblSimulator::OnAnswerTimeout);
+   CreateProperty("AnswerTimeout", "500", MM::Float, false, pAct, true);
+   CreateProperty(MM::g_Keyword_Handshaking, "Off", MM::String, false, 0, true);
+   CreateProperty(MM::g_Keyword_StopBits, "1", MM::String, false, 0, true);
+   CreateProperty("Verbose", "0", MM::Integer, false, 0, true);
+   CreateProperty("DelayBetweenCharsMs", "0", MM::Float, false, 0, true);
+}
+
+GrblSimulator::~GrblSimulator()
+{
+   Shutdown();
+}
+
+void GrblSimulator::GetName(char* name) const
+{
+   CDeviceUtils::CopyLimitedString(name, g_DeviceNameGrblSimulator);
+}
+
+int GrblSimulator::Initialize()
+{
+   // the hub initializes its port again while detecting the controller
+   if (initialized_)
+      return DEVICE_OK;
+
+   if (!HasProperty("LinesReceived"))
+   {
+      CPropertyAction* pAct = new CPropertyAction(this, &GrblSimulator::OnLinesReceived);
+      int ret = CreateProperty("LinesReceived", "0", MM::Integer, true, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
+      pAct = new CPropertyAction(this, &GrblSimulator::OnSyncPulses);
+      ret = CreateProperty("SyncPulses", "0", MM::Integer, true, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
+      pAct = new CPropertyAction(this, &GrblSimulator::OnRxOverflows);
+      ret = CreateProperty("RxOverflows", "0", MM::Integer, true, pAct);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+
+   {
+      MMThreadGuard guard(lock_);
+      Reset();
+      for (int i = 0; i < g_axes; i++)
+         mPos_[i] = 0.0;
+      linesReceived_ = 0;
+      syncPulseCount_ = 0;
+      rxOverflows_ = 0;
+      pulses_.clear();
+      tx_.clear();
+      txArrivalUs_.clear();
+      lastArrivalUs_ = 0.0;
+      lastTickUs_ = NowUs();
+      Send(g_banner);
+   }
+
+   thread_ = new SimulatorThread(*this);
+   thread_->activate();
+   initialized_ = true;
+   return DEVICE_OK;
+}
+
+int GrblSimulator::Shutdown()
+{
+   if (thread_ != 0)
+   {
+      thread_->Stop();
+      thread_->wait();
+      delete thread_;
+      thread_ = 0;
+   }
+   initialized_ = false;
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Serial API
+///////////////////////////////////////////////////////////////////////////////
+
+int GrblSimulator::SetCommand(const char* command, const char* term)
+{
+   std::string line(command);
+   if (term != 0)
+      line += term;
+   return Write((const unsigned char*)line.data(), (unsigned long)line.size());
+}
+
+int GrblSimulator::GetAnswer(char* txt, unsigned maxChars, const char* term)
+{
+   if (maxChars == 0)
+      return DEVICE_BUFFER_OVERFLOW;
+   std::string terminator(term != 0 ? term : "\r\n");
+   std::string answer;
+   MM::MMTime start = GetCurrentMMTime();
+   while ((GetCurrentMMTime() - start).getMsec() < answerTimeoutMs_)
+   {
+      unsigned char c;
+      unsigned long read = 0;
+      Read(&c, 1, read);
+      if (read == 0)
+      {
+         CDeviceUtils::SleepMs(1);
+         continue;
+      }
+      answer += (char)c;
+      if (answer.size() >= terminator.size() &&
+            answer.compare(answer.size() - terminator.size(), terminator.size(), terminator) == 0)
+      {
+         answer.erase(answer.size() - terminator.size());
+         if (answer.size() >= maxChars)
+            return DEVICE_BUFFER_OVERFLOW;
+         strcpy(txt, answer.c_str());
+         return DEVICE_OK;
+      }
+   }
+   return DEVICE_SERIAL_TIMEOUT;
+}
+
+/**
+ * Real-time commands take effect at once; everything else goes to the
+ * receive buffer, and is lost if the buffer is full.
+ */
+int GrblSimulator::Write(const unsigned char* buf, unsigned long bufLen)
+{
+   MMThreadGuard guard(lock_);
+   for (unsigned long i = 0; i < bufLen; i++)
+   {
+      char c = (char)buf[i];
+      switch (c)
+      {
+      case '?':
+         Send(StatusReport() + "\r\n");
+         break;
+      case '!':
+         // only a running cycle can be held
+         if (!planner_.empty())
+            hold_ = true;
+         break;
+      case '~':
+         hold_ = false;
+         break;
+      case 0x18:
+         Reset();
+         Send(g_banner);
+         break;
+      default:
+         if (rx_.size() >= g_rxBufferSize)
+            rxOverflows_++;
+         else
+            rx_ += c;
+      }
+   }
+   return DEVICE_OK;
+}
+
+/**
+ * Returns the reply bytes that have arrived by now at the baud rate.
+ */
+int GrblSimulator::Read(unsigned char* buf, unsigned long bufLen, unsigned long& charsRead)
+{
+   MMThreadGuard guard(lock_);
+   charsRead = 0;
+   double now = NowUs();
+   while (charsRead < bufLen && !tx_.empty() && txArrivalUs_.front() <= now)
+   {
+      buf[charsRead++] = (unsigned char)tx_.front();
+      tx_.pop_front();
+      txArrivalUs_.pop_front();
+   }
+   return DEVICE_OK;
+}
+
+int GrblSimulator::Purge()
+{
+   MMThreadGuard guard(lock_);
+   tx_.clear();
+   txArrivalUs_.clear();
+   return DEVICE_OK;
+}
+
+/**
+ * Returns the sync pulses given since initialization (the last 65536).
+ */
+std::vector<GrblSimulator::SyncPulse> GrblSimulator::GetSyncPulses()
+{
+   MMThreadGuard guard(lock_);
+   return std::vector<SyncPulse>(pulses_.begin(), pulses_.end());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Controller
+///////////////////////////////////////////////////////////////////////////////
+
+void GrblSimulator::Tick()
+{
+   MMThreadGuard guard(lock_);
+   double now = NowUs();
+   double seconds = (now - lastTickUs_) / 1.0e6;
+   lastTickUs_ = now;
+   for (; seconds > 0.0; seconds -= g_maxTickSec)
+      Advance(seconds < g_maxTickSec ? seconds : g_maxTickSec);
+   ProcessLines();
+}
+
+/**
+ * Executes the first planner block for the given time. The speed follows a
+ * trapezoid: accelerate towards the nominal speed, but never beyond the
+ * speed from which the exit speed can still be reached.
+ */
+void GrblSimulator::Advance(double seconds)
+{
+   if (planner_.empty())
+      return;
+
+   Block& block = planner_.front();
+   double accel = settings_[Acceleration];
+   if (block.type == Block::Sync)
+   {
+      syncStep_ = block.syncStep;
+      syncAxis_ = block.syncAxis;
+      syncTravel_ = 0.0;
+      if (block.syncPulse)
+         EmitSyncPulse(0, 0.0);
+      planner_.pop_front();
+      return;
+   }
+   if (block.type == Block::Dwell)
+   {
+      // the block counts down its own time
+      if (!hold_)
+         block.seconds -= seconds;
+      if (block.seconds <= 0.0)
+         planner_.pop_front();
+      return;
+   }
+
+   double exit = 0.0;
+   if (planner_.size() > 1 && planner_[1].type == Block::Motion)
+      exit = planner_[1].entry;
+   double remaining = block.length - progress_;
+   double target = hold_ ? 0.0 : block.speed;
+   double limit = sqrt(exit * exit + 2.0 * accel * remaining);
+   if (limit < target)
+      target = limit;
+   if (speed_ < target)
+      speed_ = speed_ + accel * seconds < target ? speed_ + accel * seconds : target;
+   else
+      speed_ = hold_ && speed_ - accel * seconds > 0.0 ? speed_ - accel * seconds : target;
+
+   double step = speed_ * seconds;
+   if (step > remaining)
+      step = remaining;
+   progress_ += step;
+   for (int i = 0; i < g_axes; i++)
+      mPos_[i] = block.target[i] - block.unit[i] * (block.length - progress_);
+
+   double axisFraction = fabs(block.unit[syncAxis_]);
+   if (syncStep_ > g_syncToleranceMm && axisFraction > 0.0)
+   {
+      syncTravel_ += axisFraction * step;
+      while (syncTravel_ >= syncStep_ - g_syncToleranceMm)
+      {
+         syncTravel_ -= syncStep_;
+         EmitSyncPulse(block.unit, syncTravel_ / axisFraction);
+      }
+   }
+
+   if (progress_ >= block.length)
+   {
+      for (int i = 0; i < g_axes; i++)
+         mPos_[i] = block.target[i];
+      bool home = block.type == Block::Home;
+      planner_.pop_front();
+      progress_ = 0.0;
+      if (planner_.empty() || planner_.front().type != Block::Motion)
+         speed_ = 0.0;
+      if (home)
+         Send("ok\r\n");
+   }
+}
+
+/**
+ * Executes the complete lines in the receive buffer while the planner has
+ * room. Settings are only changed with the planner empty, as in Grbl.
+ */
+void GrblSimulator::ProcessLines()
+{
+   for (;;)
+   {
+      size_t end = rx_.find('\n');
+      if (end == std::string::npos)
+         return;
+      if (planner_.size() >= g_plannerSize)
+         return;
+
+      std::string line;
+      for (size_t i = 0; i < end; i++)
+      {
+         char c = rx_[i];
+         if (c == '(' || c == ';')
+            break;
+         if (c != ' ' && c != '\r' && c != '\t')
+            line += (char)toupper((unsigned char)c);
+      }
+      if (!line.empty() && line[0] == '$' && !planner_.empty())
+         return;
+      rx_.erase(0, end + 1);
+      linesReceived_++;
+
+      bool deferAck = false;
+      std::string reply = ExecuteLine(line, deferAck);
+      if (!deferAck)
+         Send(reply + "\r\n");
+   }
+}
+
+std::string GrblSimulator::ExecuteLine(const std::string& line, bool& deferAck)
+{
+   if (line.empty())
+      return "ok";
+   if (line[0] == '$')
+      return ExecuteSetting(line, deferAck);
+   return ExecuteGCode(line);
+}
+
+std::string GrblSimulator::ExecuteSetting(const std::string& line, bool& deferAck)
+{
+   if (line == "$$")
+   {
+      std::string reply;
+      for (int i = 0; i < g_settingCount; i++)
+      {
+         char buf[128];
+         if (g_settingInfo[i].integer)
+            snprintf(buf, sizeof(buf), "$%d=%d (%s)\r\n", i, (int)settings_[i], g_settingInfo[i].description);
+         else
+            snprintf(buf, sizeof(buf), "$%d=%.3f (%s)\r\n", i, settings_[i], g_settingInfo[i].description);
+         reply += buf;
+      }
+      return reply + "ok";
+   }
+   if (line == "$I")
+      return "[0.9j.20160303:]\r\nok";
+   if (line == "$X")
+   {
+      Send("[Caution: Unlocked]\r\n");
+      return "ok";
+   }
+   if (line == "$H")
+   {
+      double origin[g_axes] = {0.0, 0.0, 0.0};
+      AddMotion(origin, settings_[HomingSeek] / 60.0, Block::Home);
+      deferAck = true;
+      return "";
+   }
+
+   int index;
+   double value;
+   if (!GrblReplyParser::ParseSetting(line.c_str(), line.size(), index, value))
+      return "error: Invalid statement";
+   if (index < 0 || index >= g_settingCount)
+      return "error: Invalid statement";
+   if (value < 0.0)
+      return "error: Value < 0.0";
+   settings_[index] = value;
+   return "ok";
+}
+
+/**
+ * Executes a line of G-code; supports what the hub and the XY stage send.
+ */
+std::string GrblSimulator::ExecuteGCode(const std::string& line)
+{
+   const char* p = line.c_str();
+   const char* end = p + line.size();
+   bool dwell = false;
+   bool sync = false;
+   bool syncOff = false;
+   bool hasAxis[g_axes] = {false, false, false};
+   double axis[g_axes] = {0.0, 0.0, 0.0};
+   double pWord = 0.0;
+   double qWord = 0.0;
+   bool hasP = false;
+
+   while (p < end)
+   {
+      char letter = *p++;
+      double value;
+      if (letter < 'A' || letter > 'Z')
+         return "error: Expected command letter";
+      if (!GrblReplyParser::ParseNumber(p, end, value))
+         return "error: Bad number format";
+      int code = (int)floor(value + 0.5);
+      switch (letter)
+      {
+      case 'G':
+         if (code == 0 || code == 1)
+            rapid_ = code == 0;
+         else if (code == 4)
+            dwell = true;
+         else if (code == 90 || code == 91)
+            absolute_ = code == 90;
+         else if (code != 17 && code != 20 && code != 21 && code != 94)
+            return "error: Unsupported statement";
+         break;
+      case 'M':
+         if (code == 108)
+            sync = true;
+         else if (code == 109)
+            syncOff = true;
+         else if (code != 2 && code != 3 && code != 5 && code != 8 && code != 9 && code != 30)
+            return "error: Unsupported statement";
+         break;
+      case 'F':
+         if (value <= 0.0)
+            return "error: Invalid feed rate";
+         feed_ = value;
+         break;
+      case 'X':
+      case 'Y':
+      case 'Z':
+         hasAxis[letter - 'X'] = true;
+         axis[letter - 'X'] = value;
+         break;
+      case 'P':
+         hasP = true;
+         pWord = value;
+         break;
+      case 'Q':
+         qWord = value;
+         break;
+      default:
+         return "error: Unsupported statement";
+      }
+   }
+
+   if (dwell)
+   {
+      if (!hasP || pWord < 0.0)
+         return "error: Invalid statement";
+      Block block = Block();
+      block.type = Block::Dwell;
+      block.seconds = pWord;
+      AddBlock(block);
+   }
+   if (sync)
+   {
+      int syncAxis = (int)floor(qWord + 0.5);
+      if (pWord < 0.0 || syncAxis < 0 || syncAxis >= g_axes)
+         return "error: Invalid statement";
+      Block block = Block();
+      block.type = Block::Sync;
+      block.syncStep = pWord;
+      block.syncAxis = syncAxis;
+      block.syncPulse = true;
+      AddBlock(block);
+   }
+   if (syncOff)
+   {
+      Block block = Block();
+      block.type = Block::Sync;
+      AddBlock(block);
+   }
+   if (hasAxis[0] || hasAxis[1] || hasAxis[2])
+   {
+      // the target is relative to where the planned blocks end
+      double from[g_axes];
+      for (int i = 0; i < g_axes; i++)
+         from[i] = mPos_[i];
+      for (std::deque<Block>::const_reverse_iterator it = planner_.rbegin(); it != planner_.rend(); ++it)
+      {
+         if (it->type == Block::Motion || it->type == Block::Home)
+         {
+            for (int i = 0; i < g_axes; i++)
+               from[i] = it->target[i];
+            break;
+         }
+      }
+      double target[g_axes];
+      for (int i = 0; i < g_axes; i++)
+      {
+         if (!hasAxis[i])
+            target[i] = from[i];
+         else
+            target[i] = absolute_ ? axis[i] : from[i] + axis[i];
+      }
+      double feed = rapid_ ? settings_[DefaultSeek] : (feed_ > 0.0 ? feed_ : settings_[DefaultFeed]);
+      AddMotion(target, feed / 60.0, Block::Motion);
+   }
+   return "ok";
+}
+
+void GrblSimulator::AddMotion(const double target[3], double speed, Block::Type type)
+{
+   Block block = Block();
+   block.type = type;
+   double from[g_axes];
+   for (int i = 0; i < g_axes; i++)
+      from[i] = mPos_[i];
+   for (std::deque<Block>::const_reverse_iterator it = planner_.rbegin(); it != planner_.rend(); ++it)
+   {
+      if (it->type == Block::Motion || it->type == Block::Home)
+      {
+         for (int i = 0; i < g_axes; i++)
+            from[i] = it->target[i];
+         break;
+      }
+   }
+
+   double squared = 0.0;
+   for (int i = 0; i < g_axes; i++)
+   {
+      block.target[i] = target[i];
+      block.unit[i] = target[i] - from[i];
+      squared += block.unit[i] * block.unit[i];
+   }
+   block.length = sqrt(squared);
+   if (block.length == 0.0)
+   {
+      if (type == Block::Home)
+         Send("ok\r\n");
+      return;
+   }
+   for (int i = 0; i < g_axes; i++)
+      block.unit[i] /= block.length;
+   block.speed = speed;
+
+   // junction speed with the previous block, if motion follows motion
+   block.maxEntry = 0.0;
+   if (type == Block::Motion && !planner_.empty() && planner_.back().type == Block::Motion)
+   {
+      const Block& previous = planner_.back();
+      double cosTheta = 0.0;
+      for (int i = 0; i < g_axes; i++)
+         cosTheta -= previous.unit[i] * block.unit[i];
+      double limit = previous.speed < speed ? previous.speed : speed;
+      if (cosTheta < -0.999999)
+         block.maxEntry = limit; // straight on
+      else if (cosTheta < 0.999999)
+      {
+         double sinHalf = sqrt(0.5 * (1.0 - cosTheta));
+         double junction = sqrt(settings_[Acceleration] * settings_[JunctionDeviation] *
+               sinHalf / (1.0 - sinHalf));
+         block.maxEntry = junction < limit ? junction : limit;
+      }
+   }
+   block.entry = 0.0;
+   AddBlock(block);
+}
+
+void GrblSimulator::AddBlock(const Block& block)
+{
+   planner_.push_back(block);
+   PlanBlocks();
+}
+
+/**
+ * Look-ahead over the planned blocks: a backward pass limits each entry
+ * speed to what still allows stopping at the end of the planner, a forward
+ * pass to what can be reached from the current speed. The block being
+ * executed keeps its speed.
+ */
+void GrblSimulator::PlanBlocks()
+{
+   double accel = settings_[Acceleration];
+   double next = 0.0; // entry speed of the following block
+   for (size_t i = planner_.size(); i-- > 1; )
+   {
+      Block& block = planner_[i];
+      if (block.type != Block::Motion)
+      {
+         next = 0.0;
+         continue;
+      }
+      double reachable = sqrt(next * next + 2.0 * accel * block.length);
+      block.entry = block.maxEntry < reachable ? block.maxEntry : reachable;
+      next = block.entry;
+   }
+
+   if (planner_.empty())
+      return;
+   const Block& first = planner_.front();
+   double exit = 0.0;
+   if (first.type == Block::Motion || first.type == Block::Home)
+      exit = sqrt(speed_ * speed_ + 2.0 * accel * (first.length - progress_));
+   for (size_t i = 1; i < planner_.size(); i++)
+   {
+      Block& block = planner_[i];
+      if (block.type != Block::Motion)
+      {
+         exit = 0.0;
+         continue;
+      }
+      if (block.entry > exit)
+         block.entry = exit;
+      exit = sqrt(block.entry * block.entry + 2.0 * accel * block.length);
+   }
+}
+
+/**
+ * Records a sync pulse given 'back' mm before the current position along
+ * 'unit' (none if 'unit' is 0), i.e. where the step was actually crossed.
+ */
+void GrblSimulator::EmitSyncPulse(const double* unit, double back)
+{
+   SyncPulse pulse;
+   pulse.time = GetCurrentMMTime();
+   if (unit != 0 && speed_ > 0.0)
+      pulse.time = pulse.time - MM::MMTime(back / speed_ * 1.0e6);
+   for (int i = 0; i < g_axes; i++)
+      pulse.mPos[i] = unit != 0 ? mPos_[i] - unit[i] * back : mPos_[i];
+   pulses_.push_back(pulse);
+   if (pulses_.size() > g_maxSyncPulses)
+      pulses_.pop_front();
+   syncPulseCount_++;
+   if (syncStep_ == 0.0)
+      syncTravel_ = 0.0;
+}
+
+/**
+ * Soft reset: motion stops where it is, queued lines and blocks are lost.
+ */
+void GrblSimulator::Reset()
+{
+   rx_.clear();
+   planner_.clear();
+   speed_ = 0.0;
+   progress_ = 0.0;
+   hold_ = false;
+   absolute_ = true;
+   rapid_ = true;
+   feed_ = 0.0;
+   syncStep_ = 0.0;
+   syncTravel_ = 0.0;
+}
+
+std::string GrblSimulator::StatusReport()
+{
+   const char* state = "Idle";
+   if (hold_)
+      state = "Hold";
+   else if (!planner_.empty())
+      state = planner_.front().type == Block::Home ? "Home" : "Run";
+
+   // no work offset: WPos is MPos
+   char buf[192];
+   snprintf(buf, sizeof(buf), "<%s,MPos:%.3f,%.3f,%.3f,WPos:%.3f,%.3f,%.3f,Buf:%d,RX:%d>",
+         state, mPos_[0], mPos_[1], mPos_[2], mPos_[0], mPos_[1], mPos_[2],
+         (int)planner_.size(), (int)rx_.size());
+   return buf;
+}
+
+/**
+ * Queues reply text; each character arrives one character time after the
+ * previous one.
+ */
+void GrblSimulator::Send(const std::string& text)
+{
+   double usPerChar = g_bitsPerChar * 1.0e6 / baudRate_;
+   double arrival = NowUs();
+   if (arrival < lastArrivalUs_)
+      arrival = lastArrivalUs_;
+   for (size_t i = 0; i < text.size(); i++)
+   {
+      arrival += usPerChar;
+      tx_.push_back(text[i]);
+      txArrivalUs_.push_back(arrival);
+   }
+   lastArrivalUs_ = arrival;
+}
+
+double GrblSimulator::NowUs()
+{
+   return GetCurrentMMTime().getUsec();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+
+int GrblSimulator::OnBaudRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(baudRate_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      MMThreadGuard guard(lock_);
+      pProp->Get(baudRate_);
+   }
+   return DEVICE_OK;
+}
+
+int GrblSimulator::OnAnswerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(answerTimeoutMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(answerTimeoutMs_);
+   }
+   return DEVICE_OK;
+}
+
+int GrblSimulator::OnLinesReceived(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(lock_);
+      pProp->Set(linesReceived_);
+   }
+   return DEVICE_OK;
+}
+
+int GrblSimulator::OnSyncPulses(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(lock_);
+      pProp->Set(syncPulseCount_);
+   }
+   return DEVICE_OK;
+}
+
+int GrblSimulator::OnRxOverflows(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(lock_);
+      pProp->Set(rxOverflows_);
+   }
+   return DEVICE_OK;
+}
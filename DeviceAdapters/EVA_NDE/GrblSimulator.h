@@ -0,0 +1,148 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblSimulator.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Simulated Grbl controller, exposed as a serial port device
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_SIMULATOR_H_
+#define _GRBL_SIMULATOR_H_
+
+#include "../../MMDevice/MMDevice.h"
+#include "../../MMDevice/DeviceBase.h"
+#include "../../MMDevice/DeviceThreads.h"
+#include <deque>
+#include <string>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////////
+// GrblSimulator class
+// A serial port device that behaves like a Grbl 0.9 controller, so that
+// the hub and the XY stage can be run and benchmarked without hardware:
+// select it as the hub's Port.
+//
+// - Lines go through a 128 byte receive buffer and a planner of 18 blocks;
+//   each line is acknowledged with "ok" or "error: ..." once planned, so a
+//   full planner holds back the host exactly like the real controller.
+// - Motion is executed in real time with the acceleration ($8) and the
+//   junction deviation ($9) of the settings, with look-ahead over the
+//   planned blocks.
+// - '?', '!', '~' and 0x18 are real-time commands; $$, $N=value, $H, $I
+//   and $X are supported. Settings use the numbering the hub expects
+//   ($0-$22).
+// - M108 P<mm> Q<axis> arms a sync pulse every P mm of travel along the
+//   axis, starting with one at once (P0: that pulse only). M109 disarms
+//   it without a pulse. Pulses are counted in the SyncPulses property and
+//   kept with their time and position for benchmarks.
+// - Replies are delivered at the speed of the BaudRate property.
+//////////////////////////////////////////////////////////////////////////////
+class GrblSimulator : public CSerialBase<GrblSimulator>
+{
+public:
+   struct SyncPulse
+   {
+      MM::MMTime time;
+      double mPos[3];
+   };
+
+   GrblSimulator();
+   ~GrblSimulator();
+
+   // Device API
+   int Initialize();
+   int Shutdown();
+   void GetName(char* pszName) const;
+   bool Busy() {return false;}
+
+   // Serial API
+   MM::PortType GetPortType() const {return MM::SerialPort;}
+   int SetCommand(const char* command, const char* term);
+   int GetAnswer(char* txt, unsigned maxChars, const char* term);
+   int Write(const unsigned char* buf, unsigned long bufLen);
+   int Read(unsigned char* buf, unsigned long bufLen, unsigned long& charsRead);
+   int Purge();
+
+   std::vector<SyncPulse> GetSyncPulses();
+
+   // action interface
+   int OnBaudRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAnswerTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLinesReceived(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSyncPulses(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRxOverflows(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+private:
+   struct Block
+   {
+      enum Type {Motion, Dwell, Sync, Home};
+      Type type;
+      double target[3];  // mm, machine coordinates
+      double unit[3];    // direction
+      double length;     // mm
+      double speed;      // nominal, mm/sec
+      double maxEntry;   // junction limit, mm/sec
+      double entry;      // planned entry speed, mm/sec
+      double seconds;    // Dwell, time left
+      double syncStep;   // Sync, mm
+      int syncAxis;      // Sync
+      bool syncPulse;    // Sync, false for M109
+   };
+
+   class SimulatorThread;
+
+   void Tick();
+   void Advance(double seconds);
+   void ProcessLines();
+   std::string ExecuteLine(const std::string& line, bool& deferAck);
+   std::string ExecuteSetting(const std::string& line, bool& deferAck);
+   std::string ExecuteGCode(const std::string& line);
+   void AddMotion(const double target[3], double speed, Block::Type type);
+   void AddBlock(const Block& block);
+   void PlanBlocks();
+   void EmitSyncPulse(const double* unit, double back);
+   void Reset();
+   std::string StatusReport();
+   void Send(const std::string& text);
+   double NowUs();
+
+   bool initialized_;
+   SimulatorThread* thread_;
+   MMThreadLock lock_;
+
+   // serial line
+   long baudRate_;
+   double answerTimeoutMs_;
+   std::string rx_;                  // received, not yet executed
+   std::deque<char> tx_;             // replies on their way to the host
+   std::deque<double> txArrivalUs_;  // when each of them has arrived
+   double lastArrivalUs_;
+
+   // interpreter
+   std::vector<double> settings_;
+   bool absolute_;
+   bool rapid_;
+   double feed_;                     // mm/min, 0 if not set
+
+   // planner and execution
+   std::deque<Block> planner_;
+   double mPos_[3];
+   double speed_;                    // current speed, mm/sec
+   double progress_;                 // mm done in the first block
+   bool hold_;
+   double lastTickUs_;
+
+   // sync pulses
+   double syncStep_;                 // mm, 0 if not armed
+   int syncAxis_;
+   double syncTravel_;               // travel since the last pulse
+   std::deque<SyncPulse> pulses_;
+
+   // statistics
+   long linesReceived_;
+   long syncPulseCount_;
+   long rxOverflows_;
+};
+
+#endif //_GRBL_SIMULATOR_H_
@@ -0,0 +1,214 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblStreamer.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Streams G-code programs to Grbl, keeping its serial receive
+//                buffer full (character-counting protocol)
+// LICENSE:       LGPL
+//
+
+#include "GrblStreamer.h"
+#include "EVA_NDE_TEST.h"
+#include <sstream>
+
+GrblStreamer::GrblStreamer(CEVA_NDE_GrblHub* hub) :
+   hub_(hub),
+   nextLine_(0),
+   inFlightChars_(0),
+   acknowledged_(0),
+   active_(false),
+   abort_(false),
+   result_(DEVICE_OK)
+{
+}
+
+/**
+ * Starts streaming a program and returns at once. Lines are sent without
+ * trailing whitespace; empty lines are skipped. Returns the write error if
+ * the stream ended before any line was sent.
+ */
+int GrblStreamer::Start(const std::vector<std::string>& program)
+{
+   std::vector<std::string> lines;
+   for (size_t i = 0; i < program.size(); i++)
+   {
+      std::string line = program[i];
+      size_t end = line.find_last_not_of(" \t\r\n");
+      if (end == std::string::npos)
+         continue;
+      line.erase(end + 1);
+      if (line.size() + 1 > g_GrblRxBufferSize)
+         return ERR_LINE_TOO_LONG;
+      lines.push_back(line);
+   }
+
+   MMThreadGuard guard(lock_);
+   if (active_)
+      return ERR_STREAM_ACTIVE;
+   program_.swap(lines);
+   nextLine_ = 0;
+   inFlight_.clear();
+   inFlightChars_ = 0;
+   acknowledged_ = 0;
+   abort_ = false;
+   result_ = DEVICE_OK;
+   errors_.clear();
+   active_ = true;
+
+   SendLines();
+   if (active_ && program_.empty())
+      Finish(DEVICE_OK);
+   return active_ ? DEVICE_OK : result_;
+}
+
+/**
+ * Handles one reply line from Grbl. Returns true if it belonged to the
+ * stream, false if the hub should handle it.
+ */
+bool GrblStreamer::OnReply(const std::string& reply)
+{
+   bool ok = reply.compare(0, 2, "ok") == 0;
+   bool rejected = reply.compare(0, 5, "error") == 0;
+   bool alarm = reply.compare(0, 5, "ALARM") == 0;
+   if (!ok && !rejected && !alarm)
+      return false;
+
+   MMThreadGuard guard(lock_);
+   if (!active_)
+      return false;
+
+   if (alarm)
+   {
+      LineError e;
+      e.lineNumber = inFlight_.empty() ? (long)nextLine_ : (long)inFlight_.front();
+      e.command = (size_t)e.lineNumber < program_.size() ? program_[e.lineNumber] : "";
+      e.message = reply;
+      errors_.push_back(e);
+      hub_->LogMessageH("Stream stopped by " + reply);
+      Finish(ERR_STREAM_LINE_FAILED);
+      return true;
+   }
+   if (inFlight_.empty())
+      return false;
+
+   size_t line = inFlight_.front();
+   inFlight_.pop_front();
+   inFlightChars_ -= (unsigned)program_[line].size() + 1;
+   acknowledged_++;
+   if (rejected)
+   {
+      LineError e;
+      e.lineNumber = (long)line;
+      e.command = program_[line];
+      e.message = reply;
+      errors_.push_back(e);
+      std::ostringstream os;
+      os << "Line " << line << " (" << program_[line] << ") rejected: " << reply;
+      hub_->LogMessageH(os.str());
+   }
+
+   SendLines();
+   if (inFlight_.empty() && (abort_ || nextLine_ >= program_.size()))
+      Finish(DEVICE_OK);
+   return true;
+}
+
+/**
+ * Waits until every line has been acknowledged. Returns the error that
+ * ended the stream, ERR_STREAM_LINE_FAILED if Grbl rejected any line, or
+ * ERR_STREAM_TIMEOUT if the stream is still running after timeoutMs.
+ */
+int GrblStreamer::Wait(double timeoutMs)
+{
+   MM::MMTime start = hub_->GetCurrentMMTimeH();
+   while (IsActive())
+   {
+      if ((hub_->GetCurrentMMTimeH() - start).getMsec() > timeoutMs)
+         return ERR_STREAM_TIMEOUT;
+      CDeviceUtils::SleepMs(1);
+   }
+
+   MMThreadGuard guard(lock_);
+   if (result_ != DEVICE_OK)
+      return result_;
+   return errors_.empty() ? DEVICE_OK : ERR_STREAM_LINE_FAILED;
+}
+
+/**
+ * Stops sending and waits up to drainTimeoutMs for the lines already sent
+ * to be acknowledged, so that their replies are not taken for replies to
+ * later commands. Lines already in Grbl's buffer are still executed.
+ */
+void GrblStreamer::Abort(double drainTimeoutMs)
+{
+   {
+      MMThreadGuard guard(lock_);
+      if (!active_)
+         return;
+      abort_ = true;
+      if (inFlight_.empty())
+      {
+         Finish(DEVICE_OK);
+         return;
+      }
+   }
+   if (Wait(drainTimeoutMs) == ERR_STREAM_TIMEOUT)
+   {
+      MMThreadGuard guard(lock_);
+      hub_->LogMessageH("Stream aborted with unacknowledged lines");
+      Finish(DEVICE_OK);
+   }
+}
+
+bool GrblStreamer::IsActive()
+{
+   MMThreadGuard guard(lock_);
+   return active_;
+}
+
+long GrblStreamer::GetLinesAcknowledged()
+{
+   MMThreadGuard guard(lock_);
+   return acknowledged_;
+}
+
+std::vector<GrblStreamer::LineError> GrblStreamer::GetErrors()
+{
+   MMThreadGuard guard(lock_);
+   return errors_;
+}
+
+// Writes every line that fits in Grbl's receive buffer. Called with lock_
+// held, so that lines go out in the order they are queued in inFlight_.
+void GrblStreamer::SendLines()
+{
+   while (!abort_ && nextLine_ < program_.size())
+   {
+      std::string line = program_[nextLine_] + "\n";
+      if (inFlightChars_ + line.size() > g_GrblRxBufferSize)
+         return;
+      int ret = hub_->WriteToComPortH((const unsigned char*)line.c_str(), (unsigned)line.size());
+      if (ret != DEVICE_OK)
+      {
+         abort_ = true;
+         result_ = ret;
+         if (inFlight_.empty())
+            Finish(ret);
+         return;
+      }
+      inFlight_.push_back(nextLine_);
+      inFlightChars_ += (unsigned)line.size();
+      nextLine_++;
+   }
+}
+
+// Ends the stream. Called with lock_ held.
+void GrblStreamer::Finish(int result)
+{
+   if (result_ == DEVICE_OK)
+      result_ = result;
+   inFlight_.clear();
+   inFlightChars_ = 0;
+   active_ = false;
+}
@@ -0,0 +1,75 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          GrblStreamer.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Streams G-code programs to Grbl, keeping its serial receive
+//                buffer full (character-counting protocol)
+// LICENSE:       LGPL
+//
+
+#ifndef _GRBL_STREAMER_H_
+#define _GRBL_STREAMER_H_
+
+#include "../../MMDevice/DeviceThreads.h"
+#include "../../MMDevice/MMDevice.h"
+#include <deque>
+#include <string>
+#include <vector>
+
+// Size of Grbl's serial receive buffer; lines in flight must fit in it
+const unsigned g_GrblRxBufferSize = 128;
+
+class CEVA_NDE_GrblHub;
+
+//////////////////////////////////////////////////////////////////////////////
+// GrblStreamer class
+// Sends a program line by line without waiting for each "ok": a line is
+// written as soon as the characters of all unacknowledged lines plus this
+// one fit in Grbl's receive buffer, so the planner never runs dry. Every
+// "ok" or "error" acknowledges the oldest line in flight. Errors are
+// recorded per line and streaming goes on, as Grbl itself does; an alarm
+// ends the stream.
+//
+// The streamer has no thread of its own. The hub's input monitor thread
+// hands it every reply through OnReply(), and the lines that fit after an
+// acknowledgement are written right there.
+//////////////////////////////////////////////////////////////////////////////
+class GrblStreamer
+{
+public:
+   struct LineError
+   {
+      long lineNumber;      // index in the program
+      std::string command;
+      std::string message;  // reply from Grbl
+   };
+
+   GrblStreamer(CEVA_NDE_GrblHub* hub);
+
+   int Start(const std::vector<std::string>& program);
+   bool OnReply(const std::string& reply);
+   int Wait(double timeoutMs);
+   void Abort(double drainTimeoutMs);
+   bool IsActive();
+   long GetLinesAcknowledged();
+   std::vector<LineError> GetErrors();
+
+private:
+   void SendLines();
+   void Finish(int result);
+
+   CEVA_NDE_GrblHub* hub_;
+   MMThreadLock lock_;
+   std::vector<std::string> program_;
+   size_t nextLine_;               // next program line to send
+   std::deque<size_t> inFlight_;   // lines sent and not acknowledged yet
+   unsigned inFlightChars_;        // their size, including line ends
+   long acknowledged_;
+   bool active_;
+   bool abort_;
+   int result_;
+   std::vector<LineError> errors_;
+};
+
+#endif //_GRBL_STREAMER_H_
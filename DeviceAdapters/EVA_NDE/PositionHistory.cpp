@@ -0,0 +1,71 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PositionHistory.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Time-indexed ring buffer of reported machine positions
+// LICENSE:       LGPL
+//
+
+#include "PositionHistory.h"
+
+PositionHistory::PositionHistory(unsigned long capacity) :
+   samples_(capacity),
+   first_(0),
+   count_(0)
+{
+}
+
+/**
+ * Records the position at timeUs, dropping the oldest sample when full.
+ * Samples not later than the newest one are ignored.
+ */
+void PositionHistory::Add(long long timeUs, const double pos[3])
+{
+   MMThreadGuard guard(lock_);
+   if (count_ > 0 && timeUs <= At(count_ - 1).timeUs)
+      return;
+
+   unsigned long capacity = (unsigned long)samples_.size();
+   Sample* sample;
+   if (count_ < capacity)
+   {
+      sample = &samples_[(first_ + count_) % capacity];
+      count_++;
+   }
+   else
+   {
+      sample = &samples_[first_];
+      first_ = (first_ + 1) % capacity;
+   }
+   sample->timeUs = timeUs;
+   sample->pos[0] = pos[0];
+   sample->pos[1] = pos[1];
+   sample->pos[2] = pos[2];
+}
+
+void PositionHistory::Clear()
+{
+   MMThreadGuard guard(lock_);
+   first_ = 0;
+   count_ = 0;
+}
+
+/**
+ * Copies up to maxCount of the newest samples, oldest first, without
+ * waiting for new ones. Returns the number copied.
+ */
+unsigned long PositionHistory::GetNewest(unsigned long maxCount, std::vector<Sample>& samples)
+{
+   MMThreadGuard guard(lock_);
+   unsigned long count = count_ < maxCount ? count_ : maxCount;
+   samples.resize(count);
+   for (unsigned long i = 0; i < count; i++)
+      samples[i] = At(count_ - count + i);
+   return count;
+}
+
+const PositionHistory::Sample& PositionHistory::At(unsigned long i) const
+{
+   return samples_[(first_ + i) % samples_.size()];
+}
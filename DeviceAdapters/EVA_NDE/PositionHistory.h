@@ -0,0 +1,46 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PositionHistory.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Time-indexed ring buffer of reported machine positions
+// LICENSE:       LGPL
+//
+
+#ifndef _POSITION_HISTORY_H_
+#define _POSITION_HISTORY_H_
+
+#include "../../MMDevice/DeviceThreads.h"
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////////
+// PositionHistory class
+// Keeps the most recent machine positions with the time they were valid.
+// Samples must be added in time order. Thread safe.
+//////////////////////////////////////////////////////////////////////////////
+class PositionHistory
+{
+public:
+   PositionHistory(unsigned long capacity);
+
+   void Add(long long timeUs, const double pos[3]);
+   void Clear();
+   struct Sample
+   {
+      long long timeUs;
+      double pos[3];
+   };
+
+   unsigned long GetNewest(unsigned long maxCount, std::vector<Sample>& samples);
+
+private:
+
+   const Sample& At(unsigned long i) const; // i-th oldest; lock_ held
+
+   MMThreadLock lock_;
+   std::vector<Sample> samples_;
+   unsigned long first_;  // oldest sample
+   unsigned long count_;
+};
+
+#endif //_POSITION_HISTORY_H_
@@ -0,0 +1,76 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ScanPlanner.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Plans serpentine C-scans: stage path, feedrate and trigger
+//                count matched to the pulser and the scope
+// LICENSE:       LGPL
+//
+
+#include "ScanPlanner.h"
+#include "EVA_NDE_TEST.h"
+#include <cmath>
+#include <cstdio>
+
+// guards the rounding of width / pitch and height / indexStep
+const double g_planEpsilon = 1e-9;
+
+int ScanPlanner::Plan(const ScanSettings& settings, ScanPlan& plan)
+{
+   // the step M108 actually counts
+   double pitch = CEVA_NDE_GrblHub::RoundSyncStep(settings.pitch);
+   if (settings.width < 0.0 || settings.height < 0.0 || pitch <= 0.0 ||
+         settings.indexStep <= 0.0 || settings.prfHz <= 0.0 ||
+         settings.rearmUs < 0.0 || settings.acceleration <= 0.0)
+      return ERR_SCAN_INVALID;
+
+   plan.pointsPerRow = (long)floor(settings.width / pitch + g_planEpsilon) + 1;
+   plan.rows = (long)floor(settings.height / settings.indexStep + g_planEpsilon) + 1;
+
+   // one trigger per pitch; both the pulser and the scope must keep up
+   double triggerRate = settings.prfHz;
+   if (settings.rearmUs > 0.0 && 1.0e6 / settings.rearmUs < triggerRate)
+      triggerRate = 1.0e6 / settings.rearmUs;
+   plan.feed = pitch * triggerRate * 60.0;
+   if (settings.maxFeed > 0.0 && plan.feed > settings.maxFeed)
+      plan.feed = settings.maxFeed;
+
+   double velocity = plan.feed / 60.0; // mm/sec
+   double ramp = velocity * velocity / (2.0 * settings.acceleration);
+   plan.rampPoints = (long)ceil(ramp / pitch - g_planEpsilon);
+   if (plan.rampPoints < 0)
+      plan.rampPoints = 0;
+   plan.overscan = plan.rampPoints * pitch;
+   // the pulse M108 gives at the ramp start, then one per pitch travelled
+   plan.triggersPerRow = plan.pointsPerRow + 2 * plan.rampPoints;
+
+   double rowLength = (plan.pointsPerRow - 1) * pitch;
+   char buff[100];
+   plan.program.clear();
+   plan.program.push_back("G90");
+   plan.triggers = 0;
+   for (long row = 0; row < plan.rows; row++)
+   {
+      bool forward = (row % 2) == 0;
+      double y = settings.startY + row * settings.indexStep;
+      double from = forward ? settings.startX - plan.overscan : settings.startX + rowLength + plan.overscan;
+      double to = forward ? settings.startX + rowLength + plan.overscan : settings.startX - plan.overscan;
+
+      // no pulses on the way to the ramp start, whatever was armed before
+      plan.program.push_back(CEVA_NDE_GrblHub::FormatSyncOff());
+      sprintf(buff, "G00X%.4fY%.4f", from, y);
+      plan.program.push_back(buff);
+      plan.program.push_back("G4P0");
+      plan.program.push_back(CEVA_NDE_GrblHub::FormatSync(0, pitch));
+      sprintf(buff, "G01X%.4fF%.3f", to, plan.feed);
+      plan.program.push_back(buff);
+
+      long rowTriggers = 1 + (long)floor(fabs(to - from) / pitch + 1.0e-6);
+      if (rowTriggers != plan.triggersPerRow)
+         return ERR_SCAN_INVALID;
+      plan.triggers += rowTriggers;
+   }
+   plan.program.push_back(CEVA_NDE_GrblHub::FormatSyncOff());
+   return DEVICE_OK;
+}
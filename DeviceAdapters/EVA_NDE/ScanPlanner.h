@@ -0,0 +1,65 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ScanPlanner.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Plans serpentine C-scans: stage path, feedrate and trigger
+//                count matched to the pulser and the scope
+// LICENSE:       LGPL
+//
+
+#ifndef _SCAN_PLANNER_H_
+#define _SCAN_PLANNER_H_
+
+#include <string>
+#include <vector>
+
+struct ScanSettings
+{
+   double startX;       // first scan point, mm
+   double startY;       // mm
+   double width;        // scan length along X, mm
+   double height;       // extent along Y, mm
+   double pitch;        // distance between triggers along a row, mm
+   double indexStep;    // distance between rows, mm
+   double prfHz;        // maximum pulse repetition frequency of the pulser
+   double rearmUs;      // time the scope needs between two captures, 0 if none
+   double acceleration; // Grbl $8, mm/sec^2
+   double maxFeed;      // Grbl $5 (default seek), mm/min; 0 for no limit
+};
+
+struct ScanPlan
+{
+   long pointsPerRow;         // scan points of a row
+   long rampPoints;           // triggers on each overscan ramp
+   long triggersPerRow;       // pointsPerRow plus both ramps; the camera's RowCount
+   long rows;
+   long triggers;             // sync pulses of the whole program, rows * triggersPerRow
+   double feed;               // mm/min
+   double overscan;           // mm, before and after each row
+   std::vector<std::string> program;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// ScanPlanner class
+// Computes the fastest feedrate for which the trigger rate (feed / pitch)
+// stays within both the pulser PRF and the scope's re-arm time, and the
+// overscan the stage needs to reach that feedrate (v^2 / 2a) before the
+// first point of a row. The overscan is rounded up to whole pitches so
+// that triggers fired on the ramps stay on the scan grid.
+//
+// The program moves rows along X in alternating directions. The sync is
+// disarmed (M109) for every rapid move. Each row starts from rest at its
+// ramp start, where M108 gives the row's first pulse and arms one every
+// pitch along X, and runs to the end of the opposite ramp in one feed move.
+// The program ends with the sync disarmed, so it gives exactly
+// triggersPerRow pulses per row. The pitch is rounded to the resolution of
+// M108 so that the pulses stay on the planned grid.
+//////////////////////////////////////////////////////////////////////////////
+class ScanPlanner
+{
+public:
+   static int Plan(const ScanSettings& settings, ScanPlan& plan);
+};
+
+#endif //_SCAN_PLANNER_H_
@@ -22,6 +22,7 @@
 #include "../../MMDevice/ModuleInterface.h"
 #include "XYStage.h"
 #include <sstream>
+#include <cmath>
 #include "EVA_NDE_TEST.h"
 
 ///////////
@@ -51,79 +52,213 @@ const long yAxisMaxSteps = 1500000L;   // maximum number of steps in Y
 const double stepSizeUm = 0.05;        // step size in microns
 const double accelScale = 13.7438;     // scaling factor for acceleration
 const double velocityScale = 134218.0; // scaling factor for velocity
+const long maxSequenceLength = 100000L; // sequences are streamed, not stored on the controller
+const double jogDurationSec = 60.0;     // a continuous move is a jog this long
+const double statusWaitMs = 1000.0;     // longest sleep between checks while moving
+const double idleMarginMs = 2.0;        // reports this soon after a move was queued may predate it
+const double sequenceToleranceUm = 0.001; // positions closer than this are equal
 
 ///////////////////////////////////////////////////////////////////////////////
 // CommandThread class
-// (for executing move commands)
+// (tracks the execution of move commands)
+// Moves return as soon as the controller has queued them. A planner model
+// (trapezoidal profile of each queued move) tells when they should be done;
+// at that time the thread sends one real-time status query, and the first
+// report saying Idle ends the motion. An Alarm ends it as well, and so does
+// a completed Hold or a Door state when no program is streaming, since the
+// stage then stays put until told otherwise. In between the thread sleeps on
+// the status reports of the hub's monitor thread, without serial traffic of
+// its own.
 ///////////////////////////////////////////////////////////////////////////////
 
 class XYStage::CommandThread : public MMDeviceThreadBase
 {
    public:
       CommandThread(XYStage* stage) :
-         stop_(false), moving_(false), stage_(stage), errCode_(DEVICE_OK) {}
+         stop_(false), started_(false), moving_(false), queried_(true), alarm_(false), stage_(stage) {}
 
       virtual ~CommandThread() {}
-	  
-      int svc()
-      {
-		CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(stage_->GetParentHub());
-		if (!hub || !hub->IsPortAvailable()) {
-			return ERR_NO_PORT_SET;
-		}
-		while(1)
-		{
-			int ret = hub->GetStatus();
-			if(ret != DEVICE_OK){
-				moving_ = false;
-				break;
-			}
-			char buf[30]="";
-			ret = hub->GetProperty("Status",buf);
-			if((strcmp(buf,"Idle") == 0 )){
-				moving_ = false;
-				break;
-			}
-			else
-				moving_ = true;
-			CDeviceUtils::SleepMs(10);
-		}
 
-         return 0;
-      }
-      void Stop() {stop_ = true;}
-      bool GetStop() {return stop_;}
-      int GetErrorCode() {return errCode_;}
-      bool IsMoving()  {  return moving_;}
+      int svc();
+      void Start() {stop_ = false; started_ = true; activate();}
+      void Stop() {stop_ = true; wake_.Set();}
+      bool IsStarted() {return started_;}
+      bool IsMoving() {MMThreadGuard guard(lock_); return moving_;}
+      void OnMoveQueued(double seconds);
+      int WaitForMotionDone(double timeoutMs);
 
    private:
-      void Reset() {stop_ = false; errCode_ = DEVICE_OK; moving_ = false;}
-      enum Command {MOVE, MOVEREL, HOME};
-      bool stop_;
-      bool moving_;
+      static bool HasStopped(const char* state, bool streaming);
+      void SetIdle(bool alarm = false);
+
+      volatile bool stop_;
+      bool started_;
+      MMThreadLock lock_;
+      bool moving_;               // synchronized by lock_
+      bool queried_;              // status queried at the expected end, synchronized by lock_
+      bool alarm_;                // the last motion ended on Alarm, synchronized by lock_
+      MM::MMTime queuedAt_;       // when the last move was queued, synchronized by lock_
+      MM::MMTime expectedEnd_;    // when the queued moves should be done, synchronized by lock_
+      GrblEvent wake_;            // a move was queued, or stop
+      GrblEvent done_;            // set while not moving
       XYStage* stage_;
-      long x_;
-      long y_;
-      Command cmd_;
-      Command lastCmd_;
-      int errCode_;
 };
 
+int XYStage::CommandThread::svc()
+{
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(stage_->GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   long sequence = 0;
+   while (!stop_)
+   {
+      bool moving, queried;
+      MM::MMTime queuedAt, expectedEnd;
+      {
+         MMThreadGuard guard(lock_);
+         moving = moving_;
+         queried = queried_;
+         queuedAt = queuedAt_;
+         expectedEnd = expectedEnd_;
+      }
+      if (!moving)
+      {
+         wake_.Wait(1000.0);
+         wake_.Reset();
+         continue;
+      }
+
+      // until the expected end, only wake up for reports
+      double waitMs = statusWaitMs;
+      if (!queried)
+      {
+         waitMs = (expectedEnd - stage_->GetCurrentMMTime()).getMsec();
+         if (waitMs > statusWaitMs)
+            waitMs = statusWaitMs;
+      }
+      GrblStatus snapshot;
+      int ret = hub->WaitForStatus(sequence, waitMs, snapshot);
+      if (ret == DEVICE_SERIAL_TIMEOUT)
+      {
+         if (!queried && !(stage_->GetCurrentMMTime() < expectedEnd))
+         {
+            // the moves should be done: ask for a report now
+            hub->SendRealtime('?');
+            MMThreadGuard guard(lock_);
+            queried_ = true;
+         }
+         continue;
+      }
+      if (ret != DEVICE_OK)
+      {
+         // without status reports the motion cannot be followed
+         SetIdle();
+         continue;
+      }
+      sequence = snapshot.sequence;
+
+      // a report taken right after the "ok" may predate the start of the move
+      if (snapshot.timestamp < queuedAt + MM::MMTime(idleMarginMs * 1000.0))
+         continue;
+      if (strncmp(snapshot.state, "Alarm", 5) == 0)
+         SetIdle(true);
+      else if (HasStopped(snapshot.state, hub->IsStreaming()))
+         SetIdle();
+   }
+   return 0;
+}
+
+// Whether a reported state means that the stage has come to rest and will
+// not move on by itself. A stream resumes after a hold, so only Idle counts
+// while one is running.
+bool XYStage::CommandThread::HasStopped(const char* state, bool streaming)
+{
+   if (strcmp(state, "Idle") == 0)
+      return !streaming;
+   if (streaming)
+      return false;
+   // Hold:1 is still decelerating; Door:2 and Door:3 are stopping or resuming
+   if (strncmp(state, "Hold", 4) == 0)
+      return strcmp(state, "Hold:1") != 0;
+   if (strncmp(state, "Door", 4) == 0)
+      return strcmp(state, "Door:2") != 0 && strcmp(state, "Door:3") != 0;
+   return false;
+}
+
+/**
+ * Called when the controller has queued a move that takes 'seconds' once
+ * the moves ahead of it are done.
+ */
+void XYStage::CommandThread::OnMoveQueued(double seconds)
+{
+   bool started;
+   {
+      MMThreadGuard guard(lock_);
+      MM::MMTime now = stage_->GetCurrentMMTime();
+      MM::MMTime begin = moving_ && now < expectedEnd_ ? expectedEnd_ : now;
+      expectedEnd_ = begin + MM::MMTime(seconds * 1.0e6);
+      queuedAt_ = now;
+      queried_ = false;
+      alarm_ = false;
+      started = !moving_;
+      moving_ = true;
+      done_.Reset();
+   }
+   if (started)
+      stage_->OnBusyChanged(true);
+   wake_.Set();
+}
+
+/**
+ * Blocks until the motion is done, i.e. until Busy() turns false.
+ * Returns ERR_MOVE_ALARM if the controller went into Alarm instead of
+ * completing the moves.
+ */
+int XYStage::CommandThread::WaitForMotionDone(double timeoutMs)
+{
+   if (IsMoving() && !done_.Wait(timeoutMs))
+      return ERR_MOVE_TIMEOUT;
+   MMThreadGuard guard(lock_);
+   return alarm_ ? ERR_MOVE_ALARM : DEVICE_OK;
+}
+
+void XYStage::CommandThread::SetIdle(bool alarm)
+{
+   {
+      MMThreadGuard guard(lock_);
+      if (!moving_)
+         return;
+      moving_ = false;
+      alarm_ = alarm;
+      done_.Set();
+   }
+   stage_->OnBusyChanged(false);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // XYStage class
 ///////////////////////////////////////////////////////////////////////////////
 
 XYStage::XYStage() :
    CXYStageBase<XYStage>(),
+   syncStep_(1.0),
+   syncRestorePending_(false),
    initialized_(false),
    home_(false),
    answerTimeoutMs_(1000.0),
    moveTimeoutMs_(10000.0),
-
+   lastMode_(MOVE),
    cmdThread_(0)
 {
    // set default error messages
    InitializeDefaultErrorMessages();
+   SetErrorText(ERR_MOVE_TIMEOUT, "Timed out waiting for the stage to finish moving");
+   SetErrorText(ERR_MOVE_ALARM, "The controller went into Alarm before the stage finished moving");
+   SetErrorText(ERR_SEQUENCE_SYNC, "The sequence program does not give one sync pulse per position");
+
+   targetUm_[0] = 0.0;
+   targetUm_[1] = 0.0;
 
 
    // create pre-initialization properties
@@ -162,15 +297,16 @@ int XYStage::Initialize()
    char hubLabel[MM::MaxStrLength];
    hub->GetLabel(hubLabel);
    SetParentID(hubLabel); // for backward comp.
-   parameters_ = &hub->parameters;
    int ret = DEVICE_ERR;
 
-   // Step size
-   CreateProperty(g_StepSizeXProp, CDeviceUtils::ConvertToString(stepSizeUm), MM::Float, true);
-   CreateProperty(g_StepSizeYProp, CDeviceUtils::ConvertToString(stepSizeUm), MM::Float, true);
+   // Step size, from the controller's steps/mm ($0, $1)
+   CPropertyAction* pAct = new CPropertyAction (this, &XYStage::OnStepSizeX);
+   CreateProperty(g_StepSizeXProp, CDeviceUtils::ConvertToString(stepSizeUm), MM::Float, true, pAct);
+   pAct = new CPropertyAction (this, &XYStage::OnStepSizeY);
+   CreateProperty(g_StepSizeYProp, CDeviceUtils::ConvertToString(stepSizeUm), MM::Float, true, pAct);
 
    // Max Speed
-   CPropertyAction* pAct = new CPropertyAction (this, &XYStage::OnMaxVelocity);
+   pAct = new CPropertyAction (this, &XYStage::OnMaxVelocity);
    CreateProperty(g_MaxVelocityProp, "100.0", MM::Float, false, pAct);
    //SetPropertyLimits(g_MaxVelocityProp, 0.0, 31999.0);
 
@@ -194,6 +330,7 @@ int XYStage::Initialize()
    if (ret != DEVICE_OK)
       return ret;
 
+   cmdThread_->Start();
    initialized_ = true;
    return DEVICE_OK;
 }
@@ -201,7 +338,7 @@ int XYStage::Initialize()
 int XYStage::Shutdown()
 {
 
-   if (cmdThread_ && cmdThread_->IsMoving())
+   if (cmdThread_ && cmdThread_->IsStarted())
    {
       cmdThread_->Stop();
       cmdThread_->wait();
@@ -218,40 +355,93 @@ int XYStage::Shutdown()
 
 bool XYStage::Busy()
 {
-	return false;
+	return cmdThread_ != 0 && cmdThread_->IsMoving();
+}
+
+/**
+ * Blocks until the moves queued so far are done.
+ */
+int XYStage::WaitForMotionDone(double timeoutMs)
+{
+   if (cmdThread_ == 0)
+      return DEVICE_OK;
+   return cmdThread_->WaitForMotionDone(timeoutMs);
 }
  
 double XYStage::GetStepSizeXUm()
 {
-	CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
-	if (!hub || !hub->IsPortAvailable()) {
-		return ERR_NO_PORT_SET;
-	}
-   return 1000.0/(*parameters_)[0];
+   return GetStepSizeUm(0);
 }
 
 double XYStage::GetStepSizeYUm()
+{
+   return GetStepSizeUm(1);
+}
+
+// Step size from the steps/mm setting of an axis, served from the hub's
+// settings cache; falls back to the nominal step size if it is unknown
+double XYStage::GetStepSizeUm(int axisSetting)
 {
 	CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
 	if (!hub || !hub->IsPortAvailable()) {
-		return ERR_NO_PORT_SET;
+		return stepSizeUm;
 	}
-   return 1000.0/(*parameters_)[1];
+   double stepsPerMm;
+   if (hub->GetParameter(axisSetting, stepsPerMm) != DEVICE_OK || stepsPerMm <= 0.0)
+      return stepSizeUm;
+   return 1000.0/stepsPerMm;
 }
 
-int XYStage::SetPositionSteps(long x, long y)
+// Tells the command thread about a move the controller has queued. Moves
+// start where the previous queued move ends, or at the reported position
+// if the stage is at rest. A feed of 0 means the seek rate ($5, G00).
+void XYStage::TrackMove(double xUm, double yUm, bool relative, double feed)
 {
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || cmdThread_ == 0)
+      return;
+   double from[2] = {targetUm_[0], targetUm_[1]};
+   GrblStatus snapshot;
+   if (!cmdThread_->IsMoving() && hub->GetStatusSnapshot(snapshot) == DEVICE_OK)
+   {
+      from[0] = snapshot.mPos[0] * 1000.0;
+      from[1] = snapshot.mPos[1] * 1000.0;
+   }
+   targetUm_[0] = relative ? from[0] + xUm : xUm;
+   targetUm_[1] = relative ? from[1] + yUm : yUm;
+
+   if (feed <= 0.0 && hub->GetParameter(5, feed) != DEVICE_OK)
+      feed = 0.0;
+   double dx = targetUm_[0] - from[0];
+   double dy = targetUm_[1] - from[1];
+   cmdThread_->OnMoveQueued(MoveDurationSec(sqrt(dx * dx + dy * dy) / 1000.0, feed));
+}
 
-   SetPositionUm(x*GetStepSizeXUm(), y*GetStepSizeYUm());
-   CDeviceUtils::SleepMs(10); // to make sure that there is enough time for thread to get started
+// Duration of a move from rest to rest: accelerate at $8 to the feed
+// (mm/min), cruise, decelerate; a short move never reaches the feed.
+double XYStage::MoveDurationSec(double distanceMm, double feed)
+{
+   double velocity = feed / 60.0;
+   if (distanceMm <= 0.0 || velocity <= 0.0)
+      return 0.0;
+   double accel = 0.0;
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || hub->GetParameter(8, accel) != DEVICE_OK || accel <= 0.0)
+      return distanceMm / velocity;
+   if (distanceMm >= velocity * velocity / accel)
+      return distanceMm / velocity + velocity / accel;
+   return 2.0 * sqrt(distanceMm / accel);
+}
 
-   return DEVICE_OK;   
+int XYStage::SetPositionSteps(long x, long y)
+{
+   // Busy() is true once this returns
+   return SetPositionUm(x*GetStepSizeXUm(), y*GetStepSizeYUm());
 }
  
 int XYStage::SetRelativePositionSteps(long x, long y)
 {
-   SetRelativePositionUm(x*GetStepSizeXUm(), y*GetStepSizeYUm());
-   return DEVICE_OK;
+   return SetRelativePositionUm(x*GetStepSizeXUm(), y*GetStepSizeYUm());
 }
 int XYStage::GetPositionUm(double& x, double& y){
    int ret;
@@ -259,14 +449,17 @@ int XYStage::GetPositionUm(double& x, double& y){
 	if (!hub || !hub->IsPortAvailable()) {
 		return ERR_NO_PORT_SET;
 	}
-    ret = hub->GetStatus();
+	// last status reported to the hub's monitor thread; no serial round-trip
+	GrblStatus snapshot;
+    ret = hub->GetStatusSnapshot(snapshot);
 	if (ret != DEVICE_OK)
     return ret;
-	x =  hub->MPos[0]*1000.0 ;
-	y =   hub->MPos[1]*1000.0;
+	x =  snapshot.mPos[0]*1000.0 ;
+	y =   snapshot.mPos[1]*1000.0;
    ostringstream os;
-   os << "GetPositionSteps(), X=" << x << ", Y=" << y;
+   os << "GetPositionUm(), X=" << x << ", Y=" << y;
    LogMessage(os.str().c_str(), true);
+   return DEVICE_OK;
 }
 int XYStage::GetPositionSteps(long& x, long& y)
 {
@@ -275,11 +468,12 @@ int XYStage::GetPositionSteps(long& x, long& y)
 	if (!hub || !hub->IsPortAvailable()) {
 		return ERR_NO_PORT_SET;
 	}
-    ret = hub->GetStatus();
+	GrblStatus snapshot;
+    ret = hub->GetStatusSnapshot(snapshot);
 	if (ret != DEVICE_OK)
     return ret;
-	x =  hub->MPos[0]*1000 /GetStepSizeXUm();
-	y =   hub->MPos[1]*1000 /GetStepSizeXUm();
+	x =  snapshot.mPos[0]*1000 /GetStepSizeXUm();
+	y =   snapshot.mPos[1]*1000 /GetStepSizeYUm();
    ostringstream os;
    os << "GetPositionSteps(), X=" << x << ", Y=" << y;
    LogMessage(os.str().c_str(), true);
@@ -290,16 +484,19 @@ int XYStage::SetPositionUm(double x, double y){
 	if (!hub || !hub->IsPortAvailable()) {
 		return ERR_NO_PORT_SET;
 	}
-	int errCode_ = DEVICE_ERR;
-	if(lastMode_ != MOVE){
-		std::string tmp("G90");
-		errCode_ = hub->SendCommand(tmp,tmp);
-		lastMode_ = MOVE;
-	}
+	int errCode_ = RestoreSync();
+	if (errCode_ != DEVICE_OK)
+		return errCode_;
+	// the distance mode goes on the same line: one round-trip per move
 	char buff[100];
-	sprintf(buff, "G00X%fY%f", x/1000.0,y/1000.0);
+	sprintf(buff, "%sG00X%fY%f", lastMode_ != MOVE ? "G90" : "", x/1000.0,y/1000.0);
 	std::string buffAsStdStr = buff;
 	errCode_ = hub->SendCommand(buffAsStdStr,buffAsStdStr); //stage_->MoveBlocking(x_, y_);
+	if (errCode_ == DEVICE_OK)
+	{
+		lastMode_ = MOVE;
+		TrackMove(x, y, false, 0.0);
+	}
 
 	ostringstream os;
 	os << "Move finished with error code: " << errCode_;
@@ -311,16 +508,18 @@ int XYStage::SetRelativePositionUm(double dx, double dy){
 	if (!hub || !hub->IsPortAvailable()) {
 		return ERR_NO_PORT_SET;
 	}
-	int errCode_ = DEVICE_ERR;
-	if(lastMode_ != MOVEREL){
-		std::string tmp("G91");
-		errCode_ = hub->SendCommand(tmp,tmp);
-		lastMode_ = MOVEREL;
-	}
+	int errCode_ = RestoreSync();
+	if (errCode_ != DEVICE_OK)
+		return errCode_;
 	char buff[100];
-	sprintf(buff, "G00X%fY%f", dx/1000.0,dy/1000.0);
+	sprintf(buff, "%sG00X%fY%f", lastMode_ != MOVEREL ? "G91" : "", dx/1000.0,dy/1000.0);
 	std::string buffAsStdStr = buff;
     errCode_ = hub->SendCommand(buffAsStdStr,buffAsStdStr);  // relative move
+	if (errCode_ == DEVICE_OK)
+	{
+		lastMode_ = MOVEREL;
+		TrackMove(dx, dy, true, 0.0);
+	}
 
     ostringstream os;
     os << "Move finished with error code: " << errCode_;
@@ -354,11 +553,45 @@ int XYStage::Home()
 
 /**
  * Stops XY stage immediately. Blocks until done.
+ * The stop is sent as real-time bytes, so it takes effect even while
+ * another thread waits for the reply to a move command.
  */
 int XYStage::Stop()
 {
-   int ret;
-   return DEVICE_OK;
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   int ret = hub->StopMotion();
+   lastMode_ = UNKNOWN;
+   if (ret != DEVICE_OK)
+      return ret;
+   // the reset may have dropped the sync step
+   syncRestorePending_ = true;
+   return RestoreSync();
+}
+
+/**
+ * Moves continuously at the given velocity (mm/sec) until stopped, or for
+ * at most jogDurationSec. Move(0, 0) stops.
+ */
+int XYStage::Move(double vx, double vy)
+{
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   double speed = sqrt(vx * vx + vy * vy);
+   if (speed == 0.0)
+      return Stop();
+   int ret = RestoreSync();
+   if (ret != DEVICE_OK)
+      return ret;
+   ret = hub->Jog(vx * jogDurationSec, vy * jogDurationSec, speed * 60.0);
+   lastMode_ = UNKNOWN;
+   if (ret == DEVICE_OK)
+      TrackMove(vx * jogDurationSec * 1000.0, vy * jogDurationSec * 1000.0, true, speed * 60.0);
+   return ret;
 }
 
 /**
@@ -387,18 +620,181 @@ int XYStage::GetLimitsUm(double& xMin, double& xMax, double& yMin, double& yMax)
 
 int XYStage::GetStepLimits(long& xMin, long& xMax, long& yMin, long& yMax)
 {
-   xMin = 0L;
-   yMin = 0L;
-   xMax = xAxisMaxSteps;
-   yMax = yAxisMaxSteps;
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   // the travel is fixed; the number of steps depends on the step size
+   double xMinUm, xMaxUm, yMinUm, yMaxUm;
+   GetLimitsUm(xMinUm, xMaxUm, yMinUm, yMaxUm);
+   double xStepUm = GetStepSizeXUm();
+   double yStepUm = GetStepSizeYUm();
+   xMin = (long)floor(xMinUm / xStepUm + 0.5);
+   yMin = (long)floor(yMinUm / yStepUm + 0.5);
+   xMax = (long)floor(xMaxUm / xStepUm + 0.5);
+   yMax = (long)floor(yMaxUm / yStepUm + 0.5);
 
    return DEVICE_OK;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// XY stage sequencing
+// The position list is compiled into a G-code program that is streamed to
+// the controller. Points are grouped into runs of equally spaced positions
+// along X or Y; the stage stops at the first point of each run, M108 arms
+// a sync pulse every 'spacing' mm along the run's axis, and a single feed
+// move travels to the last point, so the camera is triggered at every
+// position without a command round-trip per point. The sync is disarmed
+// (M109) during the rapid moves between runs and after the last one, so
+// the program gives exactly one pulse per position; the SyncStep property
+// is armed again before the next ordinary move.
+///////////////////////////////////////////////////////////////////////////////
+
+int XYStage::GetXYStageSequenceMaxLength(long& nrEvents) const
+{
+   nrEvents = maxSequenceLength;
+   return DEVICE_OK;
+}
+
+int XYStage::StartXYStageSequence()
+{
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   int ret = hub->StreamProgram(sequenceProgram_);
+   if (ret != DEVICE_OK)
+      return ret;
+   lastMode_ = MOVE; // the program runs in absolute mode
+   syncRestorePending_ = true;
+   if (!sequence_.empty())
+   {
+      targetUm_[0] = sequence_.back().first;
+      targetUm_[1] = sequence_.back().second;
+   }
+   // no duration model for a program: busy until the stream ends and the
+   // controller reports Idle
+   cmdThread_->OnMoveQueued(0.0);
+   return DEVICE_OK;
+}
+
+int XYStage::StopXYStageSequence()
+{
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable()) {
+      return ERR_NO_PORT_SET;
+   }
+   // halts the motion already queued in Grbl as well as the stream
+   int ret = hub->StopMotion();
+   lastMode_ = UNKNOWN;
+   if (ret != DEVICE_OK)
+      return ret;
+   // the aborted program may have left a different sync step armed
+   syncRestorePending_ = true;
+   return RestoreSync();
+}
+
+int XYStage::ClearXYStageSequence()
+{
+   sequence_.clear();
+   sequenceProgram_.clear();
+   return DEVICE_OK;
+}
+
+int XYStage::AddToXYStageSequence(double positionX, double positionY)
+{
+   if ((long)sequence_.size() >= maxSequenceLength)
+      return DEVICE_SEQUENCE_TOO_LARGE;
+   sequence_.push_back(std::make_pair(positionX, positionY));
+   return DEVICE_OK;
+}
+
+int XYStage::SendXYStageSequence()
+{
+   // default feed rate ($4, mm/min) for the moves between sync pulses
+   double feed = 0.0;
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (hub != 0 && hub->GetParameter(4, feed) != DEVICE_OK)
+      feed = 0.0;
+
+   sequenceProgram_.clear();
+   sequenceProgram_.push_back("G90");
+   unsigned long pulses = 0;
+   size_t first = 0;
+   while (first < sequence_.size())
+   {
+      size_t last = first;
+      if (first + 1 < sequence_.size())
+      {
+         double dx = sequence_[first + 1].first - sequence_[first].first;
+         double dy = sequence_[first + 1].second - sequence_[first].second;
+         // runs are along one axis only, M108 counts travel on one axis
+         if ((fabs(dx) < sequenceToleranceUm) != (fabs(dy) < sequenceToleranceUm))
+         {
+            last = first + 1;
+            while (last + 1 < sequence_.size() &&
+                  fabs(sequence_[last + 1].first - sequence_[last].first - dx) < sequenceToleranceUm &&
+                  fabs(sequence_[last + 1].second - sequence_[last].second - dy) < sequenceToleranceUm)
+               last++;
+         }
+      }
+      unsigned long runPulses = AddSequenceRun(first, last, feed);
+      if (runPulses == 0)
+      {
+         // the spacing cannot be reproduced by M108: stop at every point
+         last = first;
+         runPulses = AddSequenceRun(first, last, feed);
+      }
+      pulses += runPulses;
+      first = last + 1;
+   }
+   // no pulse from the sync step of the SyncStep property; it is armed
+   // again before the next move (see RestoreSync())
+   sequenceProgram_.push_back(CEVA_NDE_GrblHub::FormatSyncOff());
+
+   if (pulses != sequence_.size())
+   {
+      ostringstream err;
+      err << "Sequence of " << sequence_.size() << " positions would give "
+         << pulses << " sync pulses";
+      LogMessage(err.str().c_str());
+      sequenceProgram_.clear();
+      return ERR_SEQUENCE_SYNC;
+   }
+
+   ostringstream os;
+   os << "Sequence of " << sequence_.size() << " positions compiled into "
+      << sequenceProgram_.size() << " lines";
+   LogMessage(os.str().c_str(), true);
+   return DEVICE_OK;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Action handlers
 ///////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Step sizes, read-only: they follow the controller's steps/mm settings
+ */
+int XYStage::OnStepSizeX(MM::PropertyBase* pProp, MM::ActionType eAct) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      pProp->Set(GetStepSizeXUm());
+   } 
+
+   return DEVICE_OK;
+}
+
+int XYStage::OnStepSizeY(MM::PropertyBase* pProp, MM::ActionType eAct) 
+{
+   if (eAct == MM::BeforeGet) 
+   {
+      pProp->Set(GetStepSizeYUm());
+   } 
+
+   return DEVICE_OK;
+}
 
 /**
  * Gets and sets the maximum speed with which the stage travels
@@ -474,6 +870,7 @@ int XYStage::OnSyncStep(MM::PropertyBase* pProp, MM::ActionType eAct)
 	   int ret = hub->SetSync(0,syncStep_);
 	   if(ret != DEVICE_OK)
 		   return ret;
+	   syncRestorePending_ = false;
    }
 
    return DEVICE_OK;
@@ -484,6 +881,68 @@ int XYStage::OnSyncStep(MM::PropertyBase* pProp, MM::ActionType eAct)
 ///////////////////////////////////////////////////////////////////////////////
 
 
+// Appends the G-code for the points first..last, which are equally spaced
+// along a single axis (or a single point if first == last), and returns the
+// number of sync pulses it gives: one per point. The sync is disarmed for
+// the rapid move to the first point and armed once the stage is there.
+// Returns 0, and appends nothing, if the spacing rounded to the resolution
+// of M108 would not put exactly one pulse on every point.
+unsigned long XYStage::AddSequenceRun(size_t first, size_t last, double feed)
+{
+   std::string sync;
+   if (first == last)
+   {
+      // P0: a single pulse at the current position
+      sync = CEVA_NDE_GrblHub::FormatSync(0, 0.0);
+   }
+   else
+   {
+      double dx = sequence_[first + 1].first - sequence_[first].first;
+      double dy = sequence_[first + 1].second - sequence_[first].second;
+      bool alongX = fabs(dx) >= sequenceToleranceUm;
+      double spacingUm = alongX ? fabs(dx) : fabs(dy);
+      double stepMm = CEVA_NDE_GrblHub::RoundSyncStep(spacingUm/1000.0);
+      double travelMm = alongX ?
+         fabs(sequence_[last].first - sequence_[first].first)/1000.0 :
+         fabs(sequence_[last].second - sequence_[first].second)/1000.0;
+      if (stepMm <= 0.0 || (size_t)floor(travelMm/stepMm + 1.0e-6) != last - first)
+         return 0;
+      sync = CEVA_NDE_GrblHub::FormatSync(alongX ? 0 : 1, spacingUm/1000.0);
+   }
+
+   char buff[100];
+   sequenceProgram_.push_back(CEVA_NDE_GrblHub::FormatSyncOff());
+   sprintf(buff, "G00X%.4fY%.4f", sequence_[first].first/1000.0, sequence_[first].second/1000.0);
+   sequenceProgram_.push_back(buff);
+   sequenceProgram_.push_back("G4P0"); // pulses start once the stage is at the first point
+   sequenceProgram_.push_back(sync);
+   if (first == last)
+      return 1;
+
+   if (feed > 0.0)
+      sprintf(buff, "G01X%.4fY%.4fF%.3f", sequence_[last].first/1000.0, sequence_[last].second/1000.0, feed);
+   else
+      sprintf(buff, "G01X%.4fY%.4f", sequence_[last].first/1000.0, sequence_[last].second/1000.0);
+   sequenceProgram_.push_back(buff);
+   return (unsigned long)(last - first + 1);
+}
+
+// Arms the sync step of the SyncStep property again after a sequence left
+// it disarmed. M108 gives a pulse at once, so this is done only before the
+// next move rather than when the sequence ends.
+int XYStage::RestoreSync()
+{
+   if (!syncRestorePending_)
+      return DEVICE_OK;
+   CEVA_NDE_GrblHub* hub = static_cast<CEVA_NDE_GrblHub*>(GetParentHub());
+   if (!hub || !hub->IsPortAvailable())
+      return ERR_NO_PORT_SET;
+   int ret = hub->SetSync(0, syncStep_);
+   if (ret == DEVICE_OK)
+      syncRestorePending_ = false;
+   return ret;
+}
+
 /**
  * Sends move command to both axes and waits for responses, blocking the calling thread.
  * If expected answers do not come within timeout interval, returns with error.
@@ -495,10 +954,8 @@ int XYStage::MoveBlocking(long x, long y, bool relative)
    //if (!home_)
    //   return ERR_HOME_REQUIRED; 
 
-   //// send command to X axis
-   //ret = xstage_->MoveBlocking(x, relative);
+   ret = relative ? SetRelativePositionSteps(x, y) : SetPositionSteps(x, y);
    if (ret != DEVICE_OK)
       return ret;
-   // send command to Y axis
-   return ret;//ystage_->MoveBlocking(y, relative);
+   return WaitForMotionDone(moveTimeoutMs_);
 }
\ No newline at end of file
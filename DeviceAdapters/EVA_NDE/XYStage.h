@@ -26,6 +26,8 @@
 
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
+#include <string>
+#include <vector>
 
 
 
@@ -56,12 +58,20 @@ public:
 	int GetPositionSteps(long& x, long& y);
 	int Home();
 	int Stop();
+	int Move(double vx, double vy);
 	int SetOrigin();
 	int GetLimitsUm(double& xMin, double& xMax, double& yMin, double& yMax);
 	int GetStepLimits(long& xMin, long& xMax, long& yMin, long& yMax);
 	double GetStepSizeXUm();
 	double GetStepSizeYUm();
-	int IsXYStageSequenceable(bool& isSequenceable) const {isSequenceable = false; return DEVICE_OK;}
+	int IsXYStageSequenceable(bool& isSequenceable) const {isSequenceable = true; return DEVICE_OK;}
+	int GetXYStageSequenceMaxLength(long& nrEvents) const;
+	int StartXYStageSequence();
+	int StopXYStageSequence();
+	int ClearXYStageSequence();
+	int AddToXYStageSequence(double positionX, double positionY);
+	int SendXYStageSequence();
+	int WaitForMotionDone(double timeoutMs);
 
 	// action interface
 	// ----------------
@@ -81,8 +91,14 @@ private:
 	int MoveBlocking(long x, long y, bool relative = false);
 	int SetCommand(const unsigned char* command, unsigned cmdLength);
 	int GetCommand(unsigned char* answer, unsigned answerLength, double TimeoutMs);
+	double GetStepSizeUm(int axisSetting);
+	void TrackMove(double xUm, double yUm, bool relative, double feed);
+	double MoveDurationSec(double distanceMm, double feed);
+	unsigned long AddSequenceRun(size_t first, size_t last, double feed);
+	int RestoreSync();
 
 	double syncStep_;
+	bool syncRestorePending_;     // a sequence left the sync disarmed
 	class CommandThread;
 
 	bool initialized_;            // true if the device is intitalized
@@ -91,11 +107,13 @@ private:
 	double moveTimeoutMs_;        // max wait for stage to finish moving
 	double acceleration_; 
 	double maxVelocity_;
+	double targetUm_[2];          // end of the last move queued
 
-	enum MOVE_MODE {MOVE, MOVEREL, HOME};
+	enum MOVE_MODE {MOVE, MOVEREL, HOME, UNKNOWN};  // UNKNOWN: G90/G91 not known, e.g. after a stop
 	MOVE_MODE lastMode_;
 
-	std::vector<double> *  parameters_;
+	std::vector<std::pair<double, double> > sequence_;  // positions in um
+	std::vector<std::string> sequenceProgram_;          // G-code sent by SendXYStageSequence
 	CommandThread* cmdThread_;    // thread used to execute move commands
 };
 
@@ -145,6 +145,7 @@ CEVA_NDE_PicoCamera::CEVA_NDE_PicoCamera() :
    roiX_(0),
    roiY_(0),
    sequenceStartTime_(0),
+   latencyTrace_(false),
    isSequenceable_(false),
    sequenceMaxLength_(100),
    sequenceRunning_(false),
@@ -156,6 +157,7 @@ CEVA_NDE_PicoCamera::CEVA_NDE_PicoCamera() :
    nComponents_(1),
    pEVA_NDE_PicoResourceLock_(0),
    triggerDevice_(""),
+   positionSource_(""),
    stopOnOverflow_(false),
    sampleOffset_(0),
    timeout_(5000)
@@ -163,6 +165,8 @@ CEVA_NDE_PicoCamera::CEVA_NDE_PicoCamera() :
 
    // call the base class method to set-up default error codes/messages
    InitializeDefaultErrorMessages();
+   for (int i = 0; i < 4; i++)
+      frameTraceUs_[i] = -1;
    pEVA_NDE_PicoResourceLock_ = new MMThreadLock();
    thd_ = new MySequenceThread(this);
    // parent ID display
@@ -296,6 +300,11 @@ int CEVA_NDE_PicoCamera::Initialize()
    nRet = CreateProperty("TimeIntervalNs", "0", MM::Integer, true, pAct);
    assert(nRet == DEVICE_OK);
 
+   // stage position per row, from the PositionSamples of e.g. the Grbl hub
+   pAct = new CPropertyAction (this, &CEVA_NDE_PicoCamera::OnPositionSource);
+   nRet = CreateProperty("PositionSource", "", MM::String, false, pAct);
+   assert(nRet == DEVICE_OK);
+
    // camera gain
    nRet = CreateProperty(MM::g_Keyword_Gain, "0", MM::Integer, false);
    assert(nRet == DEVICE_OK);
@@ -312,6 +321,12 @@ int CEVA_NDE_PicoCamera::Initialize()
    AddAllowedValue(propName.c_str(), "Yes");
    AddAllowedValue(propName.c_str(), "No");
 
+   // Whether to report the acquisition stage times for latency tracing
+   pAct = new CPropertyAction (this, &CEVA_NDE_PicoCamera::OnLatencyTrace);
+   CreateProperty("LatencyTrace", "No", MM::String, false, pAct);
+   AddAllowedValue("LatencyTrace", "Yes");
+   AddAllowedValue("LatencyTrace", "No");
+
    // Camera Status
   // pAct = new CPropertyAction (this, &CEVA_NDE_PicoCamera::OnStatus);
    std::string statusPropName = "Status";
@@ -746,22 +761,43 @@ int CEVA_NDE_PicoCamera::InsertImage()
 {
 
    MM::MMTime timeStamp = this->GetCurrentMMTime();
+   long long insertEnteredUs = (long long)timeStamp.sec_ * 1000000 + timeStamp.uSec_;
    char label[MM::MaxStrLength];
    this->GetLabel(label);
  
    // Important:  metadata about the image are generated here:
-   Metadata md;
-   md.put("Camera", label);
-   md.put(MM::g_Keyword_Metadata_StartTime, CDeviceUtils::ConvertToString(sequenceStartTime_.getMsec()));
-   md.put(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString((timeStamp - sequenceStartTime_).getMsec()));
-   md.put(MM::g_Keyword_Metadata_ROI_X, CDeviceUtils::ConvertToString( (long) roiX_)); 
-   md.put(MM::g_Keyword_Metadata_ROI_Y, CDeviceUtils::ConvertToString( (long) roiY_)); 
+   // binary encoding, the text form is only produced if the core asks for it
+   BinaryMetadata& md = frameMetadata_;
+   md.Clear();
+   md.PutString("Camera", label);
+   md.PutDouble(MM::g_Keyword_Metadata_StartTime, sequenceStartTime_.getMsec());
+   md.PutDouble(MM::g_Keyword_Elapsed_Time_ms, (timeStamp - sequenceStartTime_).getMsec());
+   md.PutInt64(MM::g_Keyword_Metadata_ROI_X, roiX_);
+   md.PutInt64(MM::g_Keyword_Metadata_ROI_Y, roiY_);
+
+   // latency trace checkpoints
+   if (latencyTrace_)
+   {
+      const char* const traceKeys[4] = {
+         MM::g_Keyword_Metadata_Trace_RunBlockIssued,
+         MM::g_Keyword_Metadata_Trace_CallbackFired,
+         MM::g_Keyword_Metadata_Trace_BulkTransferDone,
+         MM::g_Keyword_Metadata_Trace_ConversionDone
+      };
+      for (int i = 0; i < 4; i++)
+      {
+         if (frameTraceUs_[i] >= 0)
+            md.PutInt64(traceKeys[i], frameTraceUs_[i]);
+      }
+      md.PutInt64(MM::g_Keyword_Metadata_Trace_InsertImageEntered, insertEnteredUs);
+   }
+   PutRowPositions(md);
 
    imageCounter_++;
 
    char buf[MM::MaxStrLength];
    GetProperty(MM::g_Keyword_Binning, buf);
-   md.put(MM::g_Keyword_Binning, buf);
+   md.PutString(MM::g_Keyword_Binning, buf);
 
    MMThreadGuard g(imgPixelsLock_);
    const unsigned char* pI;
@@ -774,14 +810,14 @@ int CEVA_NDE_PicoCamera::InsertImage()
    // This method inserts a new image into the circular buffer (residing in MMCore)
    //int ret = GetCoreCallback()->InsertMultiChannel(this, pI, 1, w, h, b, &md ); // Inserting the md causes crash in debug builds
 
-   int ret = GetCoreCallback()->InsertImage(this, pI, w, h, b, md.Serialize().c_str());
+   int ret = GetCoreCallback()->InsertImage(this, pI, w, h, b, md.GetData(), md.GetSize());
 
    if (!stopOnOverflow_ && ret == DEVICE_BUFFER_OVERFLOW)
    {
       // do not stop on overflow - just reset the buffer
       GetCoreCallback()->ClearImageBuffer(this);
       // don't process this same image again...
-      return GetCoreCallback()->InsertImage(this, pI, w, h, b, md.Serialize().c_str(), false);
+      return GetCoreCallback()->InsertImage(this, pI, w, h, b, md.GetData(), md.GetSize(), false);
    } else
       return ret;
 }
@@ -811,6 +847,23 @@ int CEVA_NDE_PicoCamera::ThreadRun (MM::MMTime startTime)
    {
       return ret;
    }
+
+   // convert the rapid block timestamps to the core time base, relative to
+   // a pair of readings of both clocks taken now
+   MM::MMTime now = GetCurrentMMTime();
+   int64_t nowTicks = picoTicks();
+   long long nowUs = (long long)now.sec_ * 1000000 + now.uSec_;
+   double usPerTick = 1e6 / picoTicksPerSecond();
+   const int64_t ticks[4] = {
+      g_rapidBlockTimings.runBlockIssued,
+      g_rapidBlockTimings.callbackFired,
+      g_rapidBlockTimings.bulkTransferDone,
+      g_rapidBlockTimings.conversionDone
+   };
+   for (int i = 0; i < 4; i++)
+      frameTraceUs_[i] = ticks[i] != 0 ? nowUs - (long long)((nowTicks - ticks[i]) * usPerTick) : -1;
+   GetRowTimes();
+
    ret = InsertImage();
 
    if (ret != DEVICE_OK)
@@ -1135,6 +1188,140 @@ int CEVA_NDE_PicoCamera::OnTriggerDevice(MM::PropertyBase* pProp, MM::ActionType
 }
 
 
+int CEVA_NDE_PicoCamera::OnPositionSource(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(positionSource_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(positionSource_);
+   }
+   return DEVICE_OK;
+}
+
+/*
+ * Computes the trigger time of every row of the last rapid block run from
+ * the scope's trigger time stamps. They count sample intervals from the
+ * first trigger; the last capture ended when the block callback fired,
+ * one record length after its trigger.
+ */
+void CEVA_NDE_PicoCamera::GetRowTimes()
+{
+   rowTimesUs_.clear();
+   if (positionSource_.empty() || frameTraceUs_[1] < 0)
+      return;
+
+   unsigned rows = img_.Height();
+   triggerCounters_.resize(rows);
+   if (rows == 0 || picoGetTriggerCounters(&unit, (unsigned short)rows, &triggerCounters_[0]) != PICO_OK)
+      return;
+
+   double usPerSample = timeInterval / 1000.0;
+   long long lastTriggerUs = frameTraceUs_[1] - (long long)(img_.Width() * usPerSample);
+   rowTimesUs_.resize(rows);
+   for (unsigned i = 0; i < rows; i++)
+      rowTimesUs_[i] = lastTriggerUs -
+            (long long)((double)(triggerCounters_[rows - 1] - triggerCounters_[i]) * usPerSample);
+}
+
+/*
+ * Reads the newest stage positions from the PositionSamples property of the
+ * position source: "<t0>;<dt>,<x>,<y>;..." newest first, times in us of the
+ * core time base (dt relative to t0), positions in um. Stores them oldest
+ * first. Returns false if there are none.
+ */
+bool CEVA_NDE_PicoCamera::GetPositionSamples()
+{
+   sampleTimesUs_.clear();
+   sampleXUm_.clear();
+   sampleYUm_.clear();
+
+   char value[MM::MaxStrLength];
+   if (GetCoreCallback()->GetDeviceProperty(positionSource_.c_str(), "PositionSamples", value) != DEVICE_OK)
+   {
+      LogMessage("PositionSource has no PositionSamples property", true);
+      return false;
+   }
+
+   long long newestUs, dtUs;
+   double xUm, yUm;
+   int used = 0;
+   if (sscanf(value, "%lld%n", &newestUs, &used) != 1)
+      return false;
+   const char* p = value + used;
+   while (sscanf(p, ";%lld,%lf,%lf%n", &dtUs, &xUm, &yUm, &used) == 3)
+   {
+      sampleTimesUs_.push_back(newestUs + dtUs);
+      sampleXUm_.push_back(xUm);
+      sampleYUm_.push_back(yUm);
+      p += used;
+   }
+   std::reverse(sampleTimesUs_.begin(), sampleTimesUs_.end());
+   std::reverse(sampleXUm_.begin(), sampleXUm_.end());
+   std::reverse(sampleYUm_.begin(), sampleYUm_.end());
+   return !sampleTimesUs_.empty();
+}
+
+/*
+ * Position at timeUs, interpolated between the samples around it. Outside
+ * the sampled period it is extrapolated from the two nearest samples (held
+ * if there is only one) and false is returned.
+ */
+bool CEVA_NDE_PicoCamera::GetPositionAtUs(long long timeUs, double& xUm, double& yUm)
+{
+   size_t count = sampleTimesUs_.size();
+   size_t after = std::lower_bound(sampleTimesUs_.begin(), sampleTimesUs_.end(), timeUs) -
+         sampleTimesUs_.begin();
+   bool inside = after < count && (sampleTimesUs_[after] == timeUs || after > 0);
+   if (count == 1)
+   {
+      xUm = sampleXUm_[0];
+      yUm = sampleYUm_[0];
+      return inside;
+   }
+
+   if (after == 0)
+      after = 1;
+   else if (after == count)
+      after = count - 1;
+   size_t before = after - 1;
+   double f = (double)(timeUs - sampleTimesUs_[before]) /
+         (double)(sampleTimesUs_[after] - sampleTimesUs_[before]);
+   xUm = sampleXUm_[before] + f * (sampleXUm_[after] - sampleXUm_[before]);
+   yUm = sampleYUm_[before] + f * (sampleYUm_[after] - sampleYUm_[before]);
+   return inside;
+}
+
+/*
+ * Adds the stage position at the trigger time of every row, as one array
+ * per axis. Never waits for the position source: rows triggered after its
+ * newest report (or before its oldest) are extrapolated and flagged.
+ */
+void CEVA_NDE_PicoCamera::PutRowPositions(BinaryMetadata& md)
+{
+   if (rowTimesUs_.empty() || !GetPositionSamples())
+      return;
+
+   unsigned long rows = (unsigned long)rowTimesUs_.size();
+   rowXUm_.resize(rows);
+   rowYUm_.resize(rows);
+   rowExtrapolated_.resize(rows);
+   bool extrapolated = false;
+   for (unsigned long i = 0; i < rows; i++)
+   {
+      rowExtrapolated_[i] = GetPositionAtUs(rowTimesUs_[i], rowXUm_[i], rowYUm_[i]) ? 0 : 1;
+      if (rowExtrapolated_[i])
+         extrapolated = true;
+   }
+   md.PutDoubleArray(MM::g_Keyword_Metadata_RowPositionX, &rowXUm_[0], rows);
+   md.PutDoubleArray(MM::g_Keyword_Metadata_RowPositionY, &rowYUm_[0], rows);
+   if (extrapolated)
+      md.PutInt64Array(MM::g_Keyword_Metadata_RowPositionExtrapolated, &rowExtrapolated_[0], rows);
+}
+
 int CEVA_NDE_PicoCamera::OnIsSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
    std::string val = "Yes";
@@ -1159,6 +1346,22 @@ int CEVA_NDE_PicoCamera::OnIsSequenceable(MM::PropertyBase* pProp, MM::ActionTyp
    return DEVICE_OK;
 }
 
+int CEVA_NDE_PicoCamera::OnLatencyTrace(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(latencyTrace_ ? "Yes" : "No");
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string val;
+      pProp->Get(val);
+      latencyTrace_ = (val == "Yes");
+   }
+
+   return DEVICE_OK;
+}
+
 int CEVA_NDE_PicoCamera:: IsExposureSequenceable(bool& isSequenceable) const 
    {
       isSequenceable = isSequenceable_;
@@ -35,6 +35,7 @@
 
 #include "../../MMDevice/DeviceBase.h"
 #include "../../MMDevice/ImgBuffer.h"
+#include "../../MMDevice/BinaryMetadata.h"
 #include "../../MMDevice/DeviceThreads.h"
 #include "../../MMDevice/ModuleInterface.h"
 #include "../../MMCore/Error.h"
@@ -171,7 +172,9 @@ public:
 	//int OnSwitch(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnTriggerDevice(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPositionSource(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnIsSequenceable(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnLatencyTrace(MM::PropertyBase* pProp, MM::ActionType eAct);
    //-----oe-------
    int OnSampleOffset(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnSampleLength(MM::PropertyBase* pProp, MM::ActionType eAct);
@@ -202,6 +205,21 @@ private:
    unsigned roiX_;
    unsigned roiY_;
    MM::MMTime sequenceStartTime_;
+   BinaryMetadata frameMetadata_; // reused for every inserted frame
+   long long frameTraceUs_[4];    // rapid block stages of the current frame, core time base
+   bool latencyTrace_;            // attach the stage times to images as Trace-* tags
+   std::vector<uint64_t> triggerCounters_; // per capture, sample intervals since the first trigger
+   std::vector<long long> rowTimesUs_;     // trigger time of each row, core time base; empty if unknown
+   std::vector<double> rowXUm_;
+   std::vector<double> rowYUm_;
+   std::vector<long long> rowExtrapolated_;
+   std::vector<long long> sampleTimesUs_;  // PositionSamples of the position source, oldest first
+   std::vector<double> sampleXUm_;
+   std::vector<double> sampleYUm_;
+   void GetRowTimes();
+   bool GetPositionSamples();
+   bool GetPositionAtUs(long long timeUs, double& xUm, double& yUm);
+   void PutRowPositions(BinaryMetadata& md);
    bool isSequenceable_;
    long sequenceMaxLength_;
    bool sequenceRunning_;
@@ -214,6 +232,7 @@ private:
 	long image_height;
    double ccdT_;
 	std::string triggerDevice_;
+	std::string positionSource_;   // label of the device with a PositionSamples property, e.g. the Grbl hub
 
    bool stopOnOverflow_;
 
@@ -13,6 +13,7 @@
 #else
 #include <sys/types.h>
 #include <string.h>
+#include <time.h>
 
 #include <libps3000a-1.0/ps3000aApi.h>
 #include "linux_utils.h"
@@ -101,6 +102,18 @@ int16_t		g_autoStopped;
 int16_t		g_trig = 0;
 uint32_t	g_trigAt = 0;
 
+/* Timestamps (picoTicks()) of the stages of the last picoRunRapidBlock() call,
+ * used for acquisition latency tracing. 0 if a stage was not reached. */
+typedef struct tRapidBlockTimings
+{
+	int64_t runBlockIssued;
+	int64_t callbackFired;
+	int64_t bulkTransferDone;
+	int64_t conversionDone;
+}RAPID_BLOCK_TIMINGS;
+
+RAPID_BLOCK_TIMINGS g_rapidBlockTimings = {0, 0, 0, 0};
+
 char BlockFile[20]		= "block.txt";
 char DigiBlockFile[20]	= "digiBlock.txt";
 char StreamFile[20]		= "stream.txt";
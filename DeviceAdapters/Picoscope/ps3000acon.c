@@ -169,6 +169,35 @@ void PREF4 callBackStreaming(	int16_t handle,
 	}
 }
 
+/****************************************************************************
+* picoTicks
+* high resolution monotonic clock used to timestamp acquisition stages,
+* picoTicksPerSecond() ticks per second
+****************************************************************************/
+int64_t picoTicks(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+int64_t picoTicksPerSecond(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	return freq.QuadPart;
+#else
+	return 1000000000;
+#endif
+}
+
 /****************************************************************************
 * Block Callback
 * used by PS3000A data block collection calls, on receipt of data.
@@ -178,6 +207,7 @@ void PREF4 callBackBlock( int16_t handle, PICO_STATUS status, void * pParameter)
 {
 	if (status != PICO_CANCELLED)
 	{
+		g_rapidBlockTimings.callbackFired = picoTicks();
 		g_ready = TRUE;
 	}
 }
@@ -1629,9 +1659,11 @@ PICO_STATUS picoRunRapidBlock(UNIT * unit,unsigned short nCaptures,unsigned long
 	//Run
 
 	g_ready = 0;
+	memset(&g_rapidBlockTimings, 0, sizeof(g_rapidBlockTimings));
 	do
 	{
 		retry = 0;
+		g_rapidBlockTimings.runBlockIssued = picoTicks();
 		status = ps3000aRunBlock(unit->handle, 0, nSamples, timebase, 1, &timeIndisposed, 0, callBackBlock, NULL) ;
 		if(status!= PICO_OK)
 		{
@@ -1716,6 +1748,7 @@ PICO_STATUS picoRunRapidBlock(UNIT * unit,unsigned short nCaptures,unsigned long
 
 	//Get data
 	status = ps3000aGetValuesBulk(unit->handle, CompletedNSample, 0, nCaptures - 1, 1, PS3000A_RATIO_MODE_NONE, overflow);
+	g_rapidBlockTimings.bulkTransferDone = picoTicks();
 	if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED)
 	{
 		printf("\nPower Source Changed. Data collection aborted.\n");
@@ -1736,6 +1769,7 @@ PICO_STATUS picoRunRapidBlock(UNIT * unit,unsigned short nCaptures,unsigned long
 
 		}
 
+		g_rapidBlockTimings.conversionDone = picoTicks();
 	}
 
 	//Stop
@@ -1747,6 +1781,32 @@ PICO_STATUS picoRunRapidBlock(UNIT * unit,unsigned short nCaptures,unsigned long
 
 
 
+/****************************************************************************
+* picoGetTriggerCounters
+* Gets the trigger time of every capture of the last rapid block run, in
+* sample intervals since the trigger of the first capture. Call before
+* the next run.
+****************************************************************************/
+PICO_STATUS picoGetTriggerCounters(UNIT * unit,unsigned short nCaptures,uint64_t * counters)
+{
+	PS3000A_TRIGGER_INFO * info;
+	PICO_STATUS status;
+	unsigned short capture;
+
+	if (nCaptures == 0)
+		return PICO_OK;
+	info = (PS3000A_TRIGGER_INFO *) calloc(nCaptures, sizeof(PS3000A_TRIGGER_INFO));
+	status = ps3000aGetTriggerInfoBulk(unit->handle, info, 0, nCaptures - 1);
+	for (capture = 0; status == PICO_OK && capture < nCaptures; capture++)
+	{
+		if (info[capture].status != PICO_OK)
+			status = info[capture].status;
+		counters[capture] = info[capture].timeStampCounter;
+	}
+	free(info);
+	return status;
+}
+
 /****************************************************************************
 * Select input voltage ranges for channels
 ****************************************************************************/
@@ -0,0 +1,220 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AsyncCommands.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Per-device queues that run core commands in the background
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "AsyncCommands.h"
+#include "ErrorCodes.h"
+
+#include <memory>
+
+AsyncCommandQueue::AsyncCommandQueue() :
+   nextTicket_(1),
+   stopping_(false)
+{
+}
+
+/**
+ * Lets every worker finish its queued commands, then stops the workers.
+ */
+AsyncCommandQueue::~AsyncCommandQueue()
+{
+   std::map<std::string, Worker*> workers;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+      workers.swap(workers_);
+   }
+   changed_.notify_all();
+
+   for (std::map<std::string, Worker*>::iterator it = workers.begin(); it != workers.end(); ++it)
+   {
+      it->second->wait();
+      delete it->second;
+   }
+   for (std::map<long, Result>::iterator it = results_.begin(); it != results_.end(); ++it)
+      delete it->second.error;
+}
+
+/**
+ * Queues a command and returns its ticket. Takes ownership of the command.
+ */
+long AsyncCommandQueue::Submit(const std::string& queue, AsyncCommand* command)
+{
+   Worker* newWorker = 0;
+   long ticket;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      ticket = nextTicket_++;
+      results_[ticket] = Result();
+
+      Entry entry;
+      entry.ticket = ticket;
+      entry.command = command;
+      pending_[queue].push_back(entry);
+
+      if (workers_.find(queue) == workers_.end())
+      {
+         newWorker = new Worker(this, queue);
+         workers_[queue] = newWorker;
+      }
+   }
+   if (newWorker)
+      newWorker->activate();
+   changed_.notify_all();
+   return ticket;
+}
+
+bool AsyncCommandQueue::IsDone(long ticket) const throw (CMMError)
+{
+   boost::mutex::scoped_lock lock(mutex_);
+   std::map<long, Result>::const_iterator it = results_.find(ticket);
+   if (it == results_.end())
+      throw CMMError("Unknown asynchronous command ticket", MMERR_UnknownAsyncCommand);
+   return it->second.done;
+}
+
+/**
+ * Blocks until the command has finished and rethrows its error, if any.
+ * The ticket is no longer valid afterwards.
+ */
+void AsyncCommandQueue::Wait(long ticket) throw (CMMError)
+{
+   std::auto_ptr<CMMError> error;
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      std::map<long, Result>::iterator it = results_.find(ticket);
+      if (it == results_.end())
+         throw CMMError("Unknown asynchronous command ticket", MMERR_UnknownAsyncCommand);
+      while (!it->second.done)
+         changed_.wait(lock);
+      error.reset(it->second.error);
+      results_.erase(it);
+   }
+   if (error.get())
+      throw CMMError(*error);
+}
+
+/**
+ * Discards the result of a command without waiting for it. The command still
+ * runs if it has not finished, but its error, if any, is dropped. The ticket
+ * is no longer valid afterwards.
+ */
+void AsyncCommandQueue::Release(long ticket) throw (CMMError)
+{
+   boost::mutex::scoped_lock lock(mutex_);
+   std::map<long, Result>::iterator it = results_.find(ticket);
+   if (it == results_.end())
+      throw CMMError("Unknown asynchronous command ticket", MMERR_UnknownAsyncCommand);
+   delete it->second.error;
+   results_.erase(it);
+}
+
+/**
+ * Blocks until all commands submitted to the queue so far have finished.
+ */
+void AsyncCommandQueue::WaitForQueue(const std::string& queue)
+{
+   boost::mutex::scoped_lock lock(mutex_);
+   std::map<std::string, std::deque<Entry> >::const_iterator it = pending_.find(queue);
+   if (it == pending_.end())
+      return;
+   while (!it->second.empty())
+      changed_.wait(lock);
+}
+
+/**
+ * Blocks until all commands submitted so far have finished, then discards
+ * their results; their tickets are no longer valid. Returns the number of
+ * discarded results that were errors.
+ */
+unsigned long AsyncCommandQueue::WaitForAll()
+{
+   boost::mutex::scoped_lock lock(mutex_);
+   for (;;)
+   {
+      bool idle = true;
+      for (std::map<std::string, std::deque<Entry> >::const_iterator it = pending_.begin();
+            it != pending_.end(); ++it)
+      {
+         if (!it->second.empty())
+         {
+            idle = false;
+            break;
+         }
+      }
+      if (idle)
+         break;
+      changed_.wait(lock);
+   }
+
+   unsigned long failed = 0;
+   for (std::map<long, Result>::iterator it = results_.begin(); it != results_.end(); ++it)
+   {
+      if (it->second.error)
+         failed++;
+      delete it->second.error;
+   }
+   results_.clear();
+   return failed;
+}
+
+// Worker thread body. The running command stays at the front of its queue
+// until it has finished, so that WaitForQueue() covers it.
+void AsyncCommandQueue::Serve(const std::string& queue)
+{
+   boost::mutex::scoped_lock lock(mutex_);
+   std::deque<Entry>& entries = pending_[queue]; // map nodes are never erased
+   for (;;)
+   {
+      while (entries.empty() && !stopping_)
+         changed_.wait(lock);
+      if (entries.empty())
+         return;
+
+      Entry entry = entries.front();
+      lock.unlock();
+
+      CMMError* error = 0;
+      try
+      {
+         entry.command->Execute();
+      }
+      catch (const CMMError& err)
+      {
+         error = new CMMError(err);
+      }
+      catch (...)
+      {
+         error = new CMMError("Unexpected exception in asynchronous command",
+               MMERR_UnhandledException);
+      }
+      delete entry.command;
+
+      lock.lock();
+      entries.pop_front();
+      std::map<long, Result>::iterator it = results_.find(entry.ticket);
+      if (it != results_.end())
+      {
+         it->second.done = true;
+         it->second.error = error;
+      }
+      else
+         delete error;
+      changed_.notify_all();
+   }
+}
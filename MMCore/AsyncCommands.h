@@ -0,0 +1,113 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          AsyncCommands.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Per-device queues that run core commands in the background
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_ASYNC_COMMANDS_)
+#define _ASYNC_COMMANDS_
+
+#include "../MMDevice/DeviceThreads.h"
+#include "Error.h"
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <deque>
+#include <map>
+#include <string>
+
+/**
+ * A command for AsyncCommandQueue. Execute() reports failure by throwing
+ * CMMError, which is handed to whoever waits for the command.
+ */
+class AsyncCommand
+{
+public:
+   virtual ~AsyncCommand() {}
+   virtual void Execute() = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// AsyncCommandQueue class
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// Runs commands on one worker thread per named queue (normally a device
+// label), so that commands on the same queue run in submission order and
+// commands on different queues overlap. Workers are started on first use
+// and run until the object is destroyed.
+//
+// Each command is identified by a ticket. The result of a command is kept
+// until Wait() or Release() is called for its ticket, or WaitForAll()
+// returns.
+//
+// All methods are thread safe.
+//
+
+class AsyncCommandQueue
+{
+public:
+   AsyncCommandQueue();
+   ~AsyncCommandQueue();
+
+   long Submit(const std::string& queue, AsyncCommand* command);
+   bool IsDone(long ticket) const throw (CMMError);
+   void Wait(long ticket) throw (CMMError);
+   void Release(long ticket) throw (CMMError);
+   void WaitForQueue(const std::string& queue);
+   unsigned long WaitForAll();
+
+private:
+   class Worker : public MMDeviceThreadBase
+   {
+   public:
+      Worker(AsyncCommandQueue* owner, const std::string& queue) :
+         owner_(owner), queue_(queue) {}
+      int svc() { owner_->Serve(queue_); return 0; }
+   private:
+      AsyncCommandQueue* owner_;
+      std::string queue_;
+   };
+
+   struct Entry
+   {
+      long ticket;
+      AsyncCommand* command;
+   };
+
+   struct Result
+   {
+      Result() : done(false), error(0) {}
+      bool done;
+      CMMError* error; // owned; null on success
+   };
+
+   void Serve(const std::string& queue);
+
+   // make object non-copyable
+   AsyncCommandQueue(const AsyncCommandQueue&);
+   AsyncCommandQueue& operator=(const AsyncCommandQueue&);
+
+   mutable boost::mutex mutex_;
+   boost::condition_variable changed_; // new command, or command finished
+   long nextTicket_;                                 // synchronized by mutex_
+   bool stopping_;                                   // synchronized by mutex_
+   std::map<std::string, std::deque<Entry> > pending_; // synchronized by mutex_; front is running
+   std::map<std::string, Worker*> workers_;          // synchronized by mutex_
+   std::map<long, Result> results_;                  // synchronized by mutex_
+};
+
+#endif // !defined(_ASYNC_COMMANDS_)
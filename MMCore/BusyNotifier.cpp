@@ -0,0 +1,87 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          BusyNotifier.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Busy state reported by devices through OnBusyChanged()
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "BusyNotifier.h"
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/thread_time.hpp>
+
+void BusyNotifier::Report(const std::string& label, bool busy)
+{
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      busy_[label] = busy;
+   }
+   if (!busy)
+      changed_.notify_all();
+}
+
+/**
+ * Returns whether the device has ever reported its busy state.
+ */
+bool BusyNotifier::IsReporting(const std::string& label) const
+{
+   boost::mutex::scoped_lock lock(mutex_);
+   return busy_.find(label) != busy_.end();
+}
+
+/**
+ * Blocks until the device has reported that it is idle, or has been
+ * forgotten. Returns false if it was still busy after timeoutMs.
+ */
+bool BusyNotifier::WaitUntilIdle(const std::string& label, long timeoutMs)
+{
+   boost::system_time deadline = boost::get_system_time() +
+      boost::posix_time::milliseconds(timeoutMs);
+
+   boost::mutex::scoped_lock lock(mutex_);
+   for (;;)
+   {
+      std::map<std::string, bool>::const_iterator it = busy_.find(label);
+      if (it == busy_.end() || !it->second)
+         return true;
+      if (!changed_.timed_wait(lock, deadline))
+      {
+         it = busy_.find(label);
+         return it == busy_.end() || !it->second;
+      }
+   }
+}
+
+/**
+ * Drops the state of a device, e.g. when it is unloaded. Threads waiting
+ * for it are released.
+ */
+void BusyNotifier::Forget(const std::string& label)
+{
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      busy_.erase(label);
+   }
+   changed_.notify_all();
+}
+
+void BusyNotifier::Clear()
+{
+   {
+      boost::mutex::scoped_lock lock(mutex_);
+      busy_.clear();
+   }
+   changed_.notify_all();
+}
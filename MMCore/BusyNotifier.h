@@ -0,0 +1,58 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          BusyNotifier.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Busy state reported by devices through OnBusyChanged()
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_BUSY_NOTIFIER_)
+#define _BUSY_NOTIFIER_
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// BusyNotifier class
+// ~~~~~~~~~~~~~~~~~~
+// Keeps the last busy state reported by each device and lets threads block
+// until a device reports that it is idle, instead of polling Busy().
+//
+// A device takes part once it has called OnBusyChanged() at least once.
+// Devices that never do are unknown here; the core keeps polling them.
+//
+// All methods are thread safe.
+//
+
+class BusyNotifier
+{
+public:
+   void Report(const std::string& label, bool busy);
+   bool IsReporting(const std::string& label) const;
+   bool WaitUntilIdle(const std::string& label, long timeoutMs);
+
+   void Forget(const std::string& label);
+   void Clear();
+
+private:
+   mutable boost::mutex mutex_;
+   boost::condition_variable changed_;
+   std::map<std::string, bool> busy_; // synchronized by mutex_
+};
+
+#endif // !defined(_BUSY_NOTIFIER_)
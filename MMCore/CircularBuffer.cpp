@@ -0,0 +1,677 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CircularBuffer.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Generic implementation of the circular buffer. The buffer
+//                allows only one thread to enter at a time by using a mutex.
+//
+// COPYRIGHT:     University of California, San Francisco, 2007,
+//                100X Imaging Inc, 2008
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+// AUTHOR:        Nenad Amodaj, nenad@amodaj.com, 01/05/2007
+//
+
+#include "CircularBuffer.h"
+#include "CoreUtils.h"
+#include "../MMDevice/DeviceUtils.h"
+
+#include <limits.h>
+
+const long long bytesInMB = 1 << 20;
+const long adjustThreshold = LONG_MAX / 2;
+
+// Maximum number of images allowed in the buffer. This arbitrary limit keeps
+// the buffer indices well away from overflowing long integers.
+const unsigned long maxCBSize = 10000000;
+
+namespace {
+
+/*
+ * The metadata of an image being inserted, kept either as a Metadata object
+ * or as a binary metadata stream (see BinaryMetadata.h), depending on what
+ * the camera passed.
+ */
+class ImageTags
+{
+public:
+   ImageTags(Metadata* md, BinaryMetadata* binary) : md_(md), binary_(binary) {}
+
+   bool HasTag(const char* key) const
+   {
+      return binary_ ? binary_->HasTag(key) : md_->HasTag(key);
+   }
+
+   // Returns an empty string if there is no such tag
+   std::string GetString(const char* key) const
+   {
+      std::string value;
+      if (binary_)
+         BinaryMetadata::GetString(binary_->GetData(), binary_->GetSize(), key, value);
+      else if (md_->HasTag(key))
+         value = md_->GetSingleTag(key).GetValue();
+      return value;
+   }
+
+   void PutInt64(const char* key, long long value)
+   {
+      if (binary_)
+         binary_->PutInt64(key, value);
+      else
+         md_->PutImageTag(key, value);
+   }
+
+   void PutString(const char* key, const char* value)
+   {
+      if (binary_)
+         binary_->PutString(key, value);
+      else
+         md_->PutImageTag(key, value);
+   }
+
+   void PutStatistics(const FrameStatistics& stats)
+   {
+      if (binary_)
+         stats.AddToMetadata(*binary_);
+      else
+         stats.AddToMetadata(*md_);
+   }
+
+private:
+   Metadata* md_;
+   BinaryMetadata* binary_;
+};
+
+} // namespace
+
+CircularBuffer::CircularBuffer(unsigned int memorySizeMB) :
+   width_(0),
+   height_(0),
+   pixDepth_(0),
+   imageCounter_(0),
+   insertIndex_(0),
+   saveIndex_(0),
+   memorySizeMB_(memorySizeMB),
+   numChannels_(0),
+   numSlices_(0),
+   overflow_(false),
+   writingSlot_(-1),
+   detachedEnd_(0),
+   slotImageBytes_(0),
+   hasLastStats_(false)
+{
+}
+
+CircularBuffer::~CircularBuffer()
+{
+}
+
+/**
+ * Sets up the buffer for images of the given geometry. Nothing is reallocated
+ * if the geometry is unchanged, or if the new images fit in the memory of the
+ * existing slots (e.g. after a smaller RowCount or SampleLength); the number
+ * of slots then stays the same.
+ * Returns false if the memory footprint is too small for a single image, if
+ * allocation fails, or if the buffer would have to be reallocated while
+ * frame handles pin some of its slots (nothing is freed in that case).
+ */
+bool CircularBuffer::Initialize(unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth)
+{
+   MMThreadGuard guard(bufferLock_);
+   imageNumbers_.clear();
+
+   bool ret = true;
+   try
+   {
+      if (w == 0 || h==0 || pixDepth == 0 || channels == 0 || slices == 0)
+         return false; // does not make sense
+
+      if (w == width_ && height_ == h && pixDepth_ == pixDepth && channels == numChannels_ && slices == numSlices_)
+         if (frameArray_.size() > 0)
+            return true; // nothing to change
+
+      for (unsigned long i=0; i<frameArray_.size(); i++)
+      {
+         if (frameArray_[i].IsPinned())
+            return false; // a frame handle is still reading this slot
+      }
+
+      bool reshape = !frameArray_.empty() && channels == numChannels_ && slices == numSlices_ &&
+            (unsigned long)w * h * pixDepth <= slotImageBytes_;
+
+      width_ = w;
+      height_ = h;
+      pixDepth_ = pixDepth;
+      numChannels_ = channels;
+      numSlices_ = slices;
+
+      insertIndex_ = 0;
+      saveIndex_ = 0;
+      detachedEnd_ = 0;
+      overflow_ = false;
+      hasLastStats_ = false;
+
+      if (reshape)
+      {
+         for (unsigned long i=0; i<frameArray_.size(); i++)
+            frameArray_[i].Reshape(w, h, pixDepth);
+         return true;
+      }
+
+      // calculate the size of the entire buffer array once all images get allocated
+      // the actual size at the time of the creation is going to be less, because
+      // images are not allocated until pixels become available
+      unsigned long frameSizeBytes = width_ * height_ * pixDepth_ * numChannels_ * numSlices_;
+      unsigned long cbSize = (unsigned long) ((memorySizeMB_ * bytesInMB) / frameSizeBytes);
+
+      if (cbSize == 0)
+      {
+         frameArray_.resize(0);
+         return false; // memory footprint too small
+      }
+
+      // set a reasonable limit to circular buffer capacity
+      if (cbSize > maxCBSize)
+         cbSize = maxCBSize;
+
+      for (unsigned long i=0; i<frameArray_.size(); i++)
+         frameArray_[i].Clear();
+
+      // allocate buffers  - could conceivably throw an out-of-memory exception
+      slotImageBytes_ = (unsigned long)w * h * pixDepth;
+      frameArray_.resize(cbSize);
+      for (unsigned long i=0; i<frameArray_.size(); i++)
+      {
+         frameArray_[i].Resize(w, h, pixDepth);
+         frameArray_[i].Preallocate(numChannels_, numSlices_);
+      }
+   }
+
+   catch( ... /* std::bad_alloc& ex */)
+   {
+      frameArray_.resize(0);
+      slotImageBytes_ = 0;
+      ret = false;
+   }
+   return ret;
+}
+
+unsigned long CircularBuffer::GetSize() const
+{
+   MMThreadGuard guard(bufferLock_);
+   return (unsigned long)frameArray_.size();
+}
+
+unsigned long CircularBuffer::GetFreeSize() const
+{
+   MMThreadGuard guard(bufferLock_);
+   long freeSize = (long)frameArray_.size() - (insertIndex_ - saveIndex_);
+   if (freeSize < 0)
+      return 0;
+   else
+      return (unsigned long)freeSize;
+}
+
+unsigned long CircularBuffer::GetRemainingImageCount() const
+{
+   MMThreadGuard guard(bufferLock_);
+   return (unsigned long)(insertIndex_ - saveIndex_);
+}
+
+/**
+ * Returns the image size and the number of channels per frame in one locked
+ * call, for callers that allocate buffers to swap in.
+ */
+void CircularBuffer::GetImageGeometry(unsigned& width, unsigned& height, unsigned& depth, unsigned& channels) const
+{
+   MMThreadGuard guard(bufferLock_);
+   width = width_;
+   height = height_;
+   depth = pixDepth_;
+   channels = numChannels_;
+}
+
+/**
+ * Inserts a single image in the buffer.
+ */
+bool CircularBuffer::InsertImage(const unsigned char* pixArray, unsigned int width, unsigned int height, unsigned int byteDepth, const Metadata* pMd) throw (CMMError)
+{
+   return InsertMultiChannel(pixArray, 1, width, height, byteDepth, pMd);
+}
+
+/**
+ * Inserts a single image with metadata in the binary format (see
+ * BinaryMetadata.h).
+ */
+bool CircularBuffer::InsertImage(const unsigned char* pixArray, unsigned int width, unsigned int height, unsigned int byteDepth, const unsigned char* binaryMetadata, unsigned long metadataBytes) throw (CMMError)
+{
+   return InsertMultiChannel(pixArray, 1, width, height, byteDepth, binaryMetadata, metadataBytes);
+}
+
+/**
+ * Makes images whose "Camera" metadata tag equals cameraLabel go to the given
+ * buffer instead of this one. Passing 0 removes the route. Routes must only
+ * change while the camera is not capturing.
+ */
+void CircularBuffer::SetCameraRoute(const std::string& cameraLabel, CircularBuffer* target)
+{
+   MMThreadGuard guard(routeLock_);
+   if (target)
+      routes_[cameraLabel] = target;
+   else
+      routes_.erase(cameraLabel);
+}
+
+/**
+ * Inserts a multi-channel frame in the buffer, or in the buffer routed to the
+ * camera that produced it (see SetCameraRoute()).
+ * Returns false if the buffer is full. A frame whose slot is pinned by a
+ * frame handle is dropped and counted (see GetPinnedOverrunCount()); this
+ * still returns true, so that the camera does not treat it as an overflow.
+ */
+bool CircularBuffer::InsertMultiChannel(const unsigned char* pixArray, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, const Metadata* pMd) throw (CMMError)
+{
+   return InsertFrame(pixArray, numChannels, width, height, byteDepth, pMd, 0, 0);
+}
+
+/**
+ * Inserts a multi-channel frame with metadata in the binary format (see
+ * BinaryMetadata.h). The metadata is stored as is, with the tags added by the
+ * buffer appended, and only decoded when it is read.
+ */
+bool CircularBuffer::InsertMultiChannel(const unsigned char* pixArray, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, const unsigned char* binaryMetadata, unsigned long metadataBytes) throw (CMMError)
+{
+   if (binaryMetadata && metadataBytes > 0 && !BinaryMetadata::IsValid(binaryMetadata, metadataBytes))
+      throw CMMError("Malformed binary image metadata", MMERR_InvalidImageMetadata);
+
+   static const unsigned char empty[] = {'M', 'M', 'B', '1'};
+   if (!binaryMetadata || metadataBytes == 0)
+   {
+      binaryMetadata = empty;
+      metadataBytes = sizeof(empty);
+   }
+   return InsertFrame(pixArray, numChannels, width, height, byteDepth, 0, binaryMetadata, metadataBytes);
+}
+
+// Inserts a frame with either Metadata (pMd, which may be 0) or a valid
+// binary metadata stream.
+bool CircularBuffer::InsertFrame(const unsigned char* pixArray, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, const Metadata* pMd, const unsigned char* binaryMetadata, unsigned long metadataBytes)
+{
+   if (pMd || binaryMetadata)
+   {
+      CircularBuffer* target = 0;
+      {
+         MMThreadGuard guard(routeLock_);
+         if (!routes_.empty())
+         {
+            std::string cameraLabel;
+            bool found;
+            if (binaryMetadata)
+               found = BinaryMetadata::GetString(binaryMetadata, metadataBytes, MM::g_Keyword_CoreCamera, cameraLabel);
+            else
+            {
+               try
+               {
+                  cameraLabel = pMd->GetSingleTag(MM::g_Keyword_CoreCamera).GetValue();
+                  found = true;
+               }
+               catch (MetadataKeyError&)
+               {
+                  found = false;
+               }
+            }
+            // without a camera label the image stays in this buffer
+            std::map<std::string, CircularBuffer*>::const_iterator it = routes_.find(cameraLabel);
+            if (found && it != routes_.end())
+               target = it->second;
+         }
+      }
+      if (target && target != this)
+         return target->InsertFrame(pixArray, numChannels, width, height, byteDepth, pMd, binaryMetadata, metadataBytes);
+   }
+
+   MMThreadGuard insertGuard(insertLock_);
+
+   unsigned long singleChannelSize = (unsigned long)width * height * byteDepth;
+
+   {
+      MMThreadGuard guard(bufferLock_);
+
+      // check image dimensions
+      if (width != width_ || height_ != height || byteDepth != pixDepth_)
+         throw CMMError("Incompatible image dimensions in the circular buffer", MMERR_CircularBufferIncompatibleImage);
+
+      if (frameArray_.empty() || insertIndex_ - saveIndex_ >= (long)frameArray_.size())
+      {
+         // buffer overflow
+         overflow_ = true;
+         return false;
+      }
+   }
+
+   if (!ReserveInsertSlot())
+      return true;
+
+   bool computeStats;
+   unsigned bitDepth;
+   {
+      MMThreadGuard guard(bufferLock_);
+      computeStats = statsOptions_.enabled;
+      bitDepth = statsOptions_.bitDepth;
+   }
+   FrameStatistics stats;
+   bool haveStats = false;
+
+   for (unsigned i=0; i<numChannels; i++)
+   {
+      ImgBuffer* pImg;
+      Metadata md;
+      ImageTags tags(&md, binaryMetadata ? &binaryTags_ : 0);
+      {
+         MMThreadGuard guard(bufferLock_);
+         // we assume that all buffers are pre-allocated
+         pImg = frameArray_[insertIndex_ % frameArray_.size()].FindImage(i, 0);
+         if (!pImg)
+         {
+            writingSlot_ = -1;
+            return false;
+         }
+
+         // the same metadata is inserted for each channel
+         if (binaryMetadata)
+            binaryTags_.Assign(binaryMetadata, metadataBytes);
+         else if (pMd)
+            md = *pMd;
+
+         std::string cameraName = tags.GetString("Camera");
+         if (imageNumbers_.end() == imageNumbers_.find(cameraName))
+            imageNumbers_[cameraName] = 0;
+
+         // insert image number.
+         tags.PutInt64(MM::g_Keyword_Metadata_ImageNumber, imageNumbers_[cameraName]);
+         ++imageNumbers_[cameraName];
+      }
+
+      if (!tags.HasTag(MM::g_Keyword_Elapsed_Time_ms))
+      {
+         // if time tag was not supplied by the camera insert current timestamp
+         MM::MMTime timestamp = GetMMTimeNow();
+         tags.PutString(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString(timestamp.getMsec()));
+      }
+
+      tags.PutInt64("Width",width);
+      tags.PutInt64("Height",height);
+      if (byteDepth == 1)
+         tags.PutString("PixelType","GRAY8");
+      else if (byteDepth == 2)
+         tags.PutString("PixelType","GRAY16");
+      else if (byteDepth == 4)
+         tags.PutString("PixelType","RGB32");
+      else if (byteDepth == 8)
+         tags.PutString("PixelType","RGB64");
+      else
+         tags.PutString("PixelType","Unknown");
+
+      pImg->SetPixels(pixArray + i*singleChannelSize);
+
+      if (computeStats)
+      {
+         // the pixels are read from the source array, which is still in cache
+         FrameStatistics channelStats;
+         FrameStatistics& target = (i == 0) ? stats : channelStats;
+         if (target.Compute(pixArray + i*singleChannelSize, width, height, byteDepth, bitDepth))
+         {
+            tags.PutStatistics(target);
+            haveStats = haveStats || i == 0;
+         }
+      }
+
+      if (tags.HasTag(MM::g_Keyword_Metadata_Trace_InsertImageEntered))
+      {
+         // the camera traces latency (see LatencyTracer); the image is in
+         // the buffer now
+         MM::MMTime now = GetMMTimeNow();
+         tags.PutInt64(MM::g_Keyword_Metadata_Trace_Inserted, (long long)now.sec_ * 1000000 + now.uSec_);
+      }
+      if (binaryMetadata)
+         pImg->SetBinaryMetadata(binaryTags_.GetData(), binaryTags_.GetSize());
+      else
+         pImg->SetMetadata(md);
+   }
+
+   MMThreadGuard guard(bufferLock_);
+
+   if (haveStats)
+   {
+      lastStats_ = stats;
+      hasLastStats_ = true;
+   }
+   writingSlot_ = -1;
+   imageCounter_++;
+   insertIndex_++;
+   if ((insertIndex_ - (long)frameArray_.size()) > adjustThreshold && (saveIndex_- (long)frameArray_.size()) > adjustThreshold)
+   {
+      // adjust buffer indices to avoid overflowing integer size
+      insertIndex_ -= adjustThreshold;
+      saveIndex_ -= adjustThreshold;
+      detachedEnd_ -= adjustThreshold;
+   }
+
+   return true;
+}
+
+const unsigned char* CircularBuffer::GetTopImage() const
+{
+   const ImgBuffer* img = GetTopImageBuffer(0, 0);
+   if (!img)
+      return 0;
+   return img->GetPixels();
+}
+
+const ImgBuffer* CircularBuffer::GetTopImageBuffer(unsigned channel, unsigned slice) const
+{
+   MMThreadGuard guard(bufferLock_);
+
+   if (insertIndex_ == 0 || frameArray_.empty())
+      return 0;
+
+   // the most recent frame is the one just below insertIndex_
+   long targetIndex = (insertIndex_ - 1) % (long)frameArray_.size();
+   return frameArray_[targetIndex].FindImage(channel, slice);
+}
+
+/**
+ * Returns the image inserted n images before the most recent one.
+ * Returns 0 if there is no such image, or if it was handed out by
+ * DetachNextImageBuffers() and its slot now holds a spare buffer.
+ */
+const ImgBuffer* CircularBuffer::GetNthFromTopImageBuffer(unsigned long n) const
+{
+   MMThreadGuard guard(bufferLock_);
+
+   if (frameArray_.empty() || n >= frameArray_.size() || (long)n >= insertIndex_)
+      return 0;
+
+   long target = insertIndex_ - (long)n - 1;
+   if (target < detachedEnd_)
+      return 0;
+
+   return frameArray_[target % (long)frameArray_.size()].FindImage(0, 0);
+}
+
+const unsigned char* CircularBuffer::GetNextImage()
+{
+   const ImgBuffer* img = GetNextImageBuffer(0, 0);
+   if (!img)
+      return 0;
+   return img->GetPixels();
+}
+
+const ImgBuffer* CircularBuffer::GetNextImageBuffer(unsigned channel, unsigned slice)
+{
+   MMThreadGuard guard(bufferLock_);
+
+   long availableImages = insertIndex_ - saveIndex_;
+   if (availableImages < 1)
+      return 0;
+
+   long targetIndex = saveIndex_ % (long)frameArray_.size();
+   ++saveIndex_;
+   return frameArray_[targetIndex].FindImage(channel, slice);
+}
+
+/**
+ * Removes pending frames from the buffer in one locked pass, filling the
+ * supplied spare buffers with their images: one spare per channel, in
+ * channel order. Each image is swapped with its spare, so the caller
+ * receives ownership of the filled image and the buffer keeps an equally
+ * sized empty one. No pixel data is copied. Only whole frames are removed;
+ * the first frame whose channels do not all fit in the remaining spares is
+ * left in the buffer.
+ *
+ * The most recent frame is copied instead, so that GetTopImageBuffer() keeps
+ * returning it; so are pinned frames. Older swapped-out slots are no longer
+ * returned by GetNthFromTopImageBuffer() until they are written again.
+ * Returns the number of spares that now hold images (taken from the front).
+ */
+unsigned long CircularBuffer::DetachNextImageBuffers(std::vector<ImgBuffer*>& spares)
+{
+   MMThreadGuard guard(bufferLock_);
+
+   unsigned long count = 0;
+   while (insertIndex_ > saveIndex_ && !frameArray_.empty())
+   {
+      FrameBuffer& frame = frameArray_[saveIndex_ % frameArray_.size()];
+      unsigned channels = 0;
+      while (channels < numChannels_ && frame.FindImage(channels, 0) != 0)
+         channels++;
+      if (channels == 0 || count + channels > spares.size())
+         break;
+
+      // a frame handle is reading this slot in place, or it holds the
+      // image getLastImage() returns; leave it alone
+      bool copy = frame.IsPinned() || saveIndex_ == insertIndex_ - 1;
+      for (unsigned i = 0; i < channels; i++)
+      {
+         ImgBuffer* slot = frame.FindImage(i, 0);
+         ImgBuffer* spare = spares[count++];
+         if (!spare->Compatible(*slot))
+            spare->Resize(slot->Width(), slot->Height(), slot->Depth());
+         if (copy)
+         {
+            spare->Copy(*slot);
+            spare->SetMetadata(slot->GetMetadata());
+         }
+         else
+            slot->Swap(*spare);
+      }
+      if (!copy)
+         detachedEnd_ = saveIndex_ + 1;
+
+      saveIndex_++;
+   }
+   return count;
+}
+
+/**
+ * Pins the most recently inserted image so that it can be read in place.
+ * The slot index to pass to UnpinImageBuffer() is returned in 'slot'.
+ * Returns 0 if the buffer is empty, or if the newest image is being
+ * overwritten by an insert (possible only in a single-slot buffer).
+ */
+const ImgBuffer* CircularBuffer::PinTopImageBuffer(unsigned long& slot)
+{
+   MMThreadGuard guard(bufferLock_);
+   if (insertIndex_ == 0 || frameArray_.empty())
+      return 0;
+
+   slot = (unsigned long)((insertIndex_ - 1) % frameArray_.size());
+   if ((long)slot == writingSlot_)
+      return 0;
+
+   FrameBuffer& frame = frameArray_[slot];
+   const ImgBuffer* img = frame.FindImage(0, 0);
+   if (img != 0)
+      frame.Pin();
+   return img;
+}
+
+void CircularBuffer::UnpinImageBuffer(unsigned long slot)
+{
+   MMThreadGuard guard(bufferLock_);
+   if (slot < frameArray_.size())
+      frameArray_[slot].Unpin();
+}
+
+/**
+ * Returns the number of slots currently pinned by outstanding frame handles.
+ */
+unsigned long CircularBuffer::GetPinnedCount() const
+{
+   MMThreadGuard guard(bufferLock_);
+   unsigned long count = 0;
+   for (std::vector<FrameBuffer>::const_iterator it = frameArray_.begin();
+         it != frameArray_.end(); ++it)
+   {
+      if (it->IsPinned())
+         count++;
+   }
+   return count;
+}
+
+/**
+ * Checks whether the slot the next insert writes to may be overwritten, and
+ * if so, claims it so that it cannot be pinned until the insert is done.
+ * Called by InsertMultiChannel(), with insertLock_ held, before pixels are
+ * copied. If the slot is pinned by a reader the frame is dropped and counted
+ * as a pinned overrun instead of overwriting data that is still being read;
+ * the producer never waits.
+ */
+bool CircularBuffer::ReserveInsertSlot()
+{
+   MMThreadGuard guard(bufferLock_);
+   if (frameArray_.empty())
+      return true;
+
+   long slot = insertIndex_ % (long)frameArray_.size();
+   if (frameArray_[slot].IsPinned())
+   {
+      pinStats_.overruns++;
+      return false;
+   }
+   writingSlot_ = slot;
+   return true;
+}
+
+/**
+ * Returns the histogram (see FrameStatistics) of channel 0 of the most recent
+ * image, and the number of pixel values per bin. Returns false if frame
+ * statistics were off when that image was inserted.
+ */
+bool CircularBuffer::GetLastHistogram(std::vector<unsigned long>& histogram, unsigned& binWidth) const
+{
+   MMThreadGuard guard(bufferLock_);
+   if (!hasLastStats_)
+      return false;
+
+   const unsigned long* bins = lastStats_.GetHistogram();
+   histogram.assign(bins, bins + FrameStatistics::HistogramBins);
+   binWidth = lastStats_.GetBinWidth();
+   return true;
+}
+
+unsigned long CircularBuffer::GetClockTicksMs() const
+{
+   return (unsigned long)GetMMTimeNow().getMsec();
+}
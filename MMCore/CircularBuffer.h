@@ -25,11 +25,15 @@
 #if !defined(_CIRCULAR_BUFFER_)
 #define _CIRCULAR_BUFFER_
 
+#include <map>
+#include <string>
 #include <vector>
 #include "../MMDevice/ImgBuffer.h"
 #include "../MMDevice/MMDevice.h"
+#include "../MMDevice/BinaryMetadata.h"
 #include "ErrorCodes.h"
 #include "Error.h"
+#include "FrameStatistics.h"
 
 #ifdef WIN32
 #pragma warning( disable : 4290 ) // exception declaration warning
@@ -40,9 +44,6 @@
 // CircularBuffer class
 // ~~~~~~~~~~~~~~~~~~~~
 
-static MMThreadLock g_bufferLock;
-static MMThreadLock g_insertLock;
-
 class CircularBuffer
 {
 public:
@@ -56,22 +57,43 @@ public:
    unsigned long GetFreeSize() const;
    unsigned long GetRemainingImageCount() const;
 
-   unsigned int Width() const {MMThreadGuard guard(g_bufferLock); return width_;}
-   unsigned int Height() const {MMThreadGuard guard(g_bufferLock); return height_;}
-   unsigned int Depth() const {MMThreadGuard guard(g_bufferLock); return pixDepth_;}
+   unsigned int Width() const {MMThreadGuard guard(bufferLock_); return width_;}
+   unsigned int Height() const {MMThreadGuard guard(bufferLock_); return height_;}
+   unsigned int Depth() const {MMThreadGuard guard(bufferLock_); return pixDepth_;}
+   void GetImageGeometry(unsigned& width, unsigned& height, unsigned& depth, unsigned& channels) const;
+
+   void SetCameraRoute(const std::string& cameraLabel, CircularBuffer* target);
 
    bool InsertImage(const unsigned char* pixArray, unsigned int width, unsigned int height, unsigned int byteDepth, const Metadata* pMd) throw (CMMError);
    bool InsertMultiChannel(const unsigned char* pixArray, unsigned int numChannels, unsigned int width, unsigned int height, unsigned int byteDepth, const Metadata* pMd) throw (CMMError);
+   bool InsertImage(const unsigned char* pixArray, unsigned int width, unsigned int height, unsigned int byteDepth, const unsigned char* binaryMetadata, unsigned long metadataBytes) throw (CMMError);
+   bool InsertMultiChannel(const unsigned char* pixArray, unsigned int numChannels, unsigned int width, unsigned int height, unsigned int byteDepth, const unsigned char* binaryMetadata, unsigned long metadataBytes) throw (CMMError);
    const unsigned char* GetTopImage() const;
    const unsigned char* GetNextImage();
    const ImgBuffer* GetTopImageBuffer(unsigned channel, unsigned slice) const;
    const ImgBuffer* GetNthFromTopImageBuffer(unsigned long n) const;
    const ImgBuffer* GetNextImageBuffer(unsigned channel, unsigned slice);
-   void Clear() {MMThreadGuard guard(g_bufferLock); insertIndex_=0; saveIndex_=0; overflow_ = false;}
+   unsigned long DetachNextImageBuffers(std::vector<ImgBuffer*>& spares);
+
+   const ImgBuffer* PinTopImageBuffer(unsigned long& slot);
+   void UnpinImageBuffer(unsigned long slot);
+   unsigned long GetPinnedCount() const;
+   unsigned long GetPinnedOverrunCount() const {MMThreadGuard guard(bufferLock_); return pinStats_.overruns;}
+   void Clear() {MMThreadGuard guard(bufferLock_); insertIndex_=0; saveIndex_=0; detachedEnd_=0; overflow_ = false; hasLastStats_ = false;}
 
-   bool Overflow() {MMThreadGuard guard(g_bufferLock); return overflow_;}
+   bool Overflow() {MMThreadGuard guard(bufferLock_); return overflow_;}
+
+   void EnableFrameStatistics(bool enable) {MMThreadGuard guard(bufferLock_); statsOptions_.enabled = enable;}
+   bool IsFrameStatisticsEnabled() const {MMThreadGuard guard(bufferLock_); return statsOptions_.enabled;}
+   void SetBitDepth(unsigned bitDepth) {MMThreadGuard guard(bufferLock_); statsOptions_.bitDepth = bitDepth;}
+   bool GetLastHistogram(std::vector<unsigned long>& histogram, unsigned& binWidth) const;
 
 private:
+   mutable MMThreadLock bufferLock_;
+   MMThreadLock insertLock_;
+   MMThreadLock routeLock_;
+   std::map<std::string, CircularBuffer*> routes_; // Synchronized by routeLock_
+
    unsigned int width_;
    unsigned int height_;
    unsigned int pixDepth_;
@@ -83,11 +105,31 @@ private:
    unsigned int numChannels_;
    unsigned int numSlices_;
    bool overflow_;
+   long writingSlot_; // slot an insert is copying into, -1 if none
+   long detachedEnd_; // images below this index may have been swapped out
+   unsigned long slotImageBytes_; // pixel bytes allocated per slot image
    std::vector<FrameBuffer> frameArray_;
 
+   struct PinStats
+   {
+      PinStats() : overruns(0) {}
+      unsigned long overruns; // frames dropped because their slot was pinned
+   } pinStats_;
+
+   struct StatsOptions
+   {
+      StatsOptions() : enabled(false), bitDepth(0) {}
+      bool enabled; // compute FrameStatistics for inserted images
+      unsigned bitDepth; // of the camera, for binning 16 bit images
+   } statsOptions_;
+   FrameStatistics lastStats_; // of the most recent image, channel 0
+   bool hasLastStats_;
+   BinaryMetadata binaryTags_; // Synchronized by insertLock_
+
+   bool InsertFrame(const unsigned char* pixArray, unsigned int numChannels, unsigned int width, unsigned int height, unsigned int byteDepth, const Metadata* pMd, const unsigned char* binaryMetadata, unsigned long metadataBytes);
+   bool ReserveInsertSlot();
    unsigned long GetClockTicksMs() const;
 
 };
 
-
 #endif // !defined(_CIRCULAR_BUFFER_)
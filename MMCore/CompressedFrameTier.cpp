@@ -0,0 +1,274 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CompressedFrameTier.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Compressed overflow storage behind the circular buffer
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "CompressedFrameTier.h"
+#include "CircularBuffer.h"
+#include "ErrorCodes.h"
+#include "../MMDevice/DeviceUtils.h"
+
+#include <algorithm>
+#include <new>
+
+// How long the compressor sleeps when there is nothing to do
+const long g_compressorIdleMs = 5;
+
+CompressedFrameTier::CompressedFrameTier(CircularBuffer* cbuf, unsigned keepNewest,
+      unsigned long budgetBytes) :
+   cbuf_(cbuf),
+   keepNewest_(keepNewest),
+   budgetBytes_(budgetBytes),
+   usedBytes_(0),
+   stop_(false),
+   thread_(this)
+{
+   thread_.activate();
+}
+
+CompressedFrameTier::~CompressedFrameTier()
+{
+   {
+      MMThreadGuard guard(lock_);
+      stop_ = true;
+   }
+   thread_.wait();
+
+   for (std::vector<ImgBuffer*>::iterator it = spares_.begin(); it != spares_.end(); ++it)
+      delete *it;
+}
+
+/**
+ * Removes the oldest unread image, from the tier if it holds any, otherwise
+ * from the circular buffer. The returned buffer is valid until the next call.
+ * Returns 0 if there are no images. Throws if the oldest image could not be
+ * decompressed; it is dropped.
+ */
+const ImgBuffer* CompressedFrameTier::PopNextImageBuffer() throw (CMMError)
+{
+   MMThreadGuard guard(lock_);
+
+   lastPopped_.reset();
+   if (entries_.empty())
+      return cbuf_->GetNextImageBuffer(0, 0);
+
+   EntryPtr entry = entries_.front();
+   if (entry->raw)
+   {
+      entries_.pop_front();
+      usedBytes_ -= EntryBytes(*entry);
+      entry->taken = true;
+      lastPopped_ = entry;
+      return entry->raw;
+   }
+
+   if (!Unpack(*entry, popBuffer_))
+      DropCorruptFront();
+   entries_.pop_front();
+   usedBytes_ -= EntryBytes(*entry);
+   entry->taken = true;
+   return &popBuffer_;
+}
+
+/**
+ * Same contract as CircularBuffer::DetachNextImageBuffers(): fills the
+ * front of 'spares' with the oldest unread images, tier first. Images that
+ * follow one that cannot be decompressed are left for the next call, which
+ * drops the corrupt image and throws.
+ */
+unsigned long CompressedFrameTier::DetachNextImageBuffers(std::vector<ImgBuffer*>& spares) throw (CMMError)
+{
+   MMThreadGuard guard(lock_);
+
+   unsigned long count = 0;
+   while (count < spares.size() && !entries_.empty())
+   {
+      EntryPtr entry = entries_.front();
+      ImgBuffer* img = spares[count];
+      if (entry->raw)
+      {
+         img->Copy(*entry->raw);
+         img->SetMetadata(entry->raw->GetMetadata());
+      }
+      else if (!Unpack(*entry, *img))
+      {
+         if (count > 0)
+            return count;
+         DropCorruptFront();
+      }
+      entries_.pop_front();
+      usedBytes_ -= EntryBytes(*entry);
+      entry->taken = true;
+      count++;
+   }
+
+   if (count < spares.size())
+   {
+      std::vector<ImgBuffer*> rest(spares.begin() + count, spares.end());
+      unsigned long detached = cbuf_->DetachNextImageBuffers(rest);
+      std::copy(rest.begin(), rest.end(), spares.begin() + count);
+      count += detached;
+   }
+   return count;
+}
+
+unsigned long CompressedFrameTier::GetRemainingImageCount() const
+{
+   MMThreadGuard guard(lock_);
+   return (unsigned long)entries_.size() + cbuf_->GetRemainingImageCount();
+}
+
+unsigned long CompressedFrameTier::GetFrameCount() const
+{
+   MMThreadGuard guard(lock_);
+   return (unsigned long)entries_.size();
+}
+
+unsigned long CompressedFrameTier::GetUsedBytes() const
+{
+   MMThreadGuard guard(lock_);
+   return usedBytes_;
+}
+
+/**
+ * Discards all images held by the tier. Does not clear the circular buffer.
+ */
+void CompressedFrameTier::Clear()
+{
+   MMThreadGuard guard(lock_);
+   for (std::deque<EntryPtr>::iterator it = entries_.begin(); it != entries_.end(); ++it)
+      (*it)->taken = true;
+   entries_.clear();
+   usedBytes_ = 0;
+   lastPopped_.reset();
+}
+
+int CompressedFrameTier::RunCompressor()
+{
+   for (;;)
+   {
+      {
+         MMThreadGuard guard(lock_);
+         if (stop_)
+            break;
+      }
+      if (!CompressOne())
+         CDeviceUtils::SleepMs(g_compressorIdleMs);
+   }
+   return 0;
+}
+
+// Moves the oldest image out of the circular buffer, if there are more than
+// keepNewest_ waiting, and compresses it. Returns false if there was nothing
+// to do.
+bool CompressedFrameTier::CompressOne()
+{
+   EntryPtr entry;
+   {
+      MMThreadGuard guard(lock_);
+      if (usedBytes_ >= budgetBytes_ ||
+            cbuf_->GetRemainingImageCount() <= keepNewest_)
+         return false;
+
+      ImgBuffer* spare;
+      if (!spares_.empty())
+      {
+         spare = spares_.back();
+         spares_.pop_back();
+      }
+      else
+      {
+         try
+         {
+            unsigned width, height, depth, channels;
+            cbuf_->GetImageGeometry(width, height, depth, channels);
+            spare = new ImgBuffer(width, height, depth);
+         }
+         catch (std::bad_alloc&)
+         {
+            return false;
+         }
+      }
+
+      std::vector<ImgBuffer*> one(1, spare);
+      if (cbuf_->DetachNextImageBuffers(one) == 0)
+      {
+         spares_.push_back(spare);
+         return false;
+      }
+
+      entry.reset(new Entry);
+      entry->raw = spare;
+      entry->width = spare->Width();
+      entry->height = spare->Height();
+      entry->depth = spare->Depth();
+      entries_.push_back(entry);
+      usedBytes_ += EntryBytes(*entry);
+   }
+
+   // Compress outside the lock. Readers may pop the entry meanwhile; they
+   // only read the raw image, and mark the entry as taken.
+   std::vector<unsigned char> packed;
+   unsigned long rawBytes = EntryBytes(*entry);
+   FrameCodec::Compress(entry->raw->GetPixels(), rawBytes, entry->depth, packed, packWorkspace_);
+   Metadata md(entry->raw->GetMetadata());
+
+   MMThreadGuard guard(lock_);
+   if (entry->taken || packed.size() >= rawBytes)
+      return true; // popped already, or not worth it: keep the raw image
+
+   usedBytes_ -= rawBytes;
+   entry->packed.swap(packed);
+   entry->md = md;
+   spares_.push_back(entry->raw);
+   entry->raw = 0;
+   usedBytes_ += EntryBytes(*entry);
+   return true;
+}
+
+bool CompressedFrameTier::Unpack(const Entry& entry, ImgBuffer& img)
+{
+   if (img.Width() != entry.width || img.Height() != entry.height || img.Depth() != entry.depth)
+      img.Resize(entry.width, entry.height, entry.depth);
+
+   unsigned long bytes = (unsigned long)entry.width * entry.height * entry.depth;
+   if (!FrameCodec::Decompress(&entry.packed[0], (unsigned long)entry.packed.size(),
+            img.GetPixelsRW(), bytes, unpackWorkspace_))
+      return false;
+
+   img.SetMetadata(entry.md);
+   return true;
+}
+
+// Discards the oldest entry, which failed to decompress, and reports it.
+// Called with lock_ held.
+void CompressedFrameTier::DropCorruptFront()
+{
+   EntryPtr entry = entries_.front();
+   entries_.pop_front();
+   usedBytes_ -= EntryBytes(*entry);
+   entry->taken = true;
+   throw CMMError("A compressed image could not be decompressed and was dropped",
+         MMERR_CompressedImageCorrupt);
+}
+
+unsigned long CompressedFrameTier::EntryBytes(const Entry& entry)
+{
+   if (entry.raw)
+      return (unsigned long)entry.width * entry.height * entry.depth;
+   return (unsigned long)entry.packed.size();
+}
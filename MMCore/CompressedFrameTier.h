@@ -0,0 +1,123 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CompressedFrameTier.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Compressed overflow storage behind the circular buffer
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_COMPRESSED_FRAME_TIER_)
+#define _COMPRESSED_FRAME_TIER_
+
+#include "../MMDevice/DeviceThreads.h"
+#include "../MMDevice/ImgBuffer.h"
+#include "Error.h"
+#include "FrameCodec.h"
+
+#include <boost/shared_ptr.hpp>
+
+#include <deque>
+#include <vector>
+
+class CircularBuffer;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// CompressedFrameTier class
+// ~~~~~~~~~~~~~~~~~~~~~~~~~
+// A background thread moves all but the newest 'keepNewest' unread images out
+// of the circular buffer and stores them compressed (see FrameCodec), within
+// a fixed memory budget. This frees ring slots for the camera, so a stalled
+// consumer loses frames much later. Images are decompressed when popped.
+// keepNewest must be at least 1, so that the newest image, which
+// CircularBuffer::GetTopImageBuffer() returns, is never moved.
+//
+// Once the tier is in place, all pops must go through it so that images are
+// returned in acquisition order. Frames with more than one channel are left
+// in the circular buffer, so the tier is meant for single-channel cameras.
+// An image that fails to
+// decompress is dropped when it is reached, and the pop throws
+// MMERR_CompressedImageCorrupt.
+//
+
+class CompressedFrameTier
+{
+public:
+   CompressedFrameTier(CircularBuffer* cbuf, unsigned keepNewest, unsigned long budgetBytes);
+   ~CompressedFrameTier();
+
+   const ImgBuffer* PopNextImageBuffer() throw (CMMError);
+   unsigned long DetachNextImageBuffers(std::vector<ImgBuffer*>& spares) throw (CMMError);
+   unsigned long GetRemainingImageCount() const;
+   unsigned long GetFrameCount() const;
+   unsigned long GetUsedBytes() const;
+   unsigned GetKeepNewest() const { return keepNewest_; }
+   unsigned long GetBudgetBytes() const { return budgetBytes_; }
+   void Clear();
+
+private:
+   struct Entry
+   {
+      Entry() : raw(0), taken(false) {}
+      ~Entry() { delete raw; }
+
+      ImgBuffer* raw;   // set until compression is finished
+      bool taken;       // popped while still being compressed
+      std::vector<unsigned char> packed;
+      unsigned width;
+      unsigned height;
+      unsigned depth;
+      Metadata md;
+   };
+   typedef boost::shared_ptr<Entry> EntryPtr;
+
+   class CompressorThread : public MMDeviceThreadBase
+   {
+   public:
+      CompressorThread(CompressedFrameTier* tier) : tier_(tier) {}
+      int svc() { return tier_->RunCompressor(); }
+   private:
+      CompressedFrameTier* tier_;
+   };
+
+   int RunCompressor();
+   bool CompressOne();
+   bool Unpack(const Entry& entry, ImgBuffer& img);
+   void DropCorruptFront();
+   static unsigned long EntryBytes(const Entry& entry);
+
+   // make object non-copyable
+   CompressedFrameTier(const CompressedFrameTier&);
+   CompressedFrameTier& operator=(const CompressedFrameTier&);
+
+   CircularBuffer* cbuf_;
+   unsigned keepNewest_;
+   unsigned long budgetBytes_;
+
+   // Held while moving images between the circular buffer and the tier, and
+   // by readers, so that images are always returned in order.
+   mutable MMThreadLock lock_;
+   std::deque<EntryPtr> entries_;    // oldest first; synchronized by lock_
+   unsigned long usedBytes_;         // synchronized by lock_
+   std::vector<ImgBuffer*> spares_;  // synchronized by lock_
+   EntryPtr lastPopped_;             // keeps a popped raw image alive
+   ImgBuffer popBuffer_;             // holds the last decompressed image
+   FrameCodec::Workspace unpackWorkspace_; // synchronized by lock_
+   FrameCodec::Workspace packWorkspace_;   // used by the compressor thread only
+
+   bool stop_;                       // synchronized by lock_
+   CompressorThread thread_;
+};
+
+#endif // !defined(_COMPRESSED_FRAME_TIER_)
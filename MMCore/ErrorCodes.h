@@ -77,4 +77,10 @@
 #define MMERR_NullPointerException     49
 #define MMERR_CreatePeripheralFailed   50
 #define MMERR_PropertyNotInCache       51
+#define MMERR_CircularBufferPinned     52
+#define MMERR_CameraBufferPoolExhausted 53
+#define MMERR_NoCameraBuffer           54
+#define MMERR_UnknownAsyncCommand      55
+#define MMERR_InvalidImageMetadata     56
+#define MMERR_CompressedImageCorrupt   57
 #endif //_ERRORCODES_H_
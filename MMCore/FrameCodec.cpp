@@ -0,0 +1,277 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameCodec.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lossless in-memory compression of image frames
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "FrameCodec.h"
+
+#include <string.h>
+
+// Compressed stream layout:
+//    4 bytes  decompressed size, little endian
+//    1 byte   bytes per pixel used for the plane shuffle
+//    ...      LZ sequences
+//
+// Each LZ sequence is a token byte (high nibble: literal count, low nibble:
+// match length - g_minMatch; 15 means more length bytes follow, each adding
+// up to 255), the literals, then a 2-byte little endian match offset and any
+// match length bytes. The last sequence has literals only.
+
+const unsigned long g_headerBytes = 5;
+const unsigned long g_minMatch = 4;
+const unsigned long g_maxOffset = 65535;
+const unsigned g_hashBits = 12;
+
+namespace {
+
+inline unsigned int Read32(const unsigned char* p)
+{
+   unsigned int v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+inline unsigned Hash(unsigned int v)
+{
+   return (v * 2654435761U) >> (32 - g_hashBits);
+}
+
+inline void PutLength(unsigned long len, std::vector<unsigned char>& out)
+{
+   while (len >= 255)
+   {
+      out.push_back(255);
+      len -= 255;
+   }
+   out.push_back((unsigned char)len);
+}
+
+inline bool GetLength(const unsigned char*& ip, const unsigned char* end, unsigned long& len)
+{
+   unsigned char b;
+   do
+   {
+      if (ip >= end)
+         return false;
+      b = *ip++;
+      len += b;
+   } while (b == 255);
+   return true;
+}
+
+void PutSequence(const unsigned char* literals, unsigned long literalCount,
+      unsigned long offset, unsigned long matchLength, std::vector<unsigned char>& out)
+{
+   unsigned long matchCode = matchLength >= g_minMatch ? matchLength - g_minMatch : 0;
+   unsigned char token = (unsigned char)(((literalCount < 15 ? literalCount : 15) << 4) |
+         (matchCode < 15 ? matchCode : 15));
+   out.push_back(token);
+   if (literalCount >= 15)
+      PutLength(literalCount - 15, out);
+   out.insert(out.end(), literals, literals + literalCount);
+
+   if (matchLength == 0)
+      return; // last sequence
+
+   out.push_back((unsigned char)(offset & 0xff));
+   out.push_back((unsigned char)(offset >> 8));
+   if (matchCode >= 15)
+      PutLength(matchCode - 15, out);
+}
+
+} // anonymous namespace
+
+/**
+ * Compresses a frame. 'out' is overwritten with the compressed stream.
+ */
+void FrameCodec::Compress(const unsigned char* src, unsigned long sizeBytes,
+      unsigned bytesPerPixel, std::vector<unsigned char>& out, Workspace& ws)
+{
+   if (bytesPerPixel == 0 || bytesPerPixel > 255)
+      bytesPerPixel = 1;
+
+   // byte planes, then delta; samples that hover around a baseline turn
+   // into long runs of small values
+   std::vector<unsigned char>& planes = ws.planes;
+   planes.resize(sizeBytes);
+   if (sizeBytes > 0)
+   {
+      Shuffle(src, sizeBytes, bytesPerPixel, &planes[0]);
+      for (unsigned long i = sizeBytes - 1; i > 0; i--)
+         planes[i] = (unsigned char)(planes[i] - planes[i - 1]);
+   }
+
+   out.clear();
+   out.reserve(g_headerBytes + sizeBytes / 2);
+   out.push_back((unsigned char)(sizeBytes & 0xff));
+   out.push_back((unsigned char)((sizeBytes >> 8) & 0xff));
+   out.push_back((unsigned char)((sizeBytes >> 16) & 0xff));
+   out.push_back((unsigned char)((sizeBytes >> 24) & 0xff));
+   out.push_back((unsigned char)bytesPerPixel);
+
+   CompressLZ(sizeBytes > 0 ? &planes[0] : 0, sizeBytes, out, ws.table);
+}
+
+/**
+ * Returns the size a compressed stream expands to, or 0 if the stream is
+ * too short to be valid.
+ */
+unsigned long FrameCodec::GetDecompressedSize(const unsigned char* src,
+      unsigned long compressedBytes)
+{
+   if (compressedBytes < g_headerBytes)
+      return 0;
+   return (unsigned long)src[0] | ((unsigned long)src[1] << 8) |
+      ((unsigned long)src[2] << 16) | ((unsigned long)src[3] << 24);
+}
+
+/**
+ * Restores a frame compressed by Compress(). 'destBytes' must match the
+ * original frame size. Returns false if the stream is corrupt.
+ */
+bool FrameCodec::Decompress(const unsigned char* src, unsigned long compressedBytes,
+      unsigned char* dest, unsigned long destBytes, Workspace& ws)
+{
+   if (compressedBytes < g_headerBytes ||
+         GetDecompressedSize(src, compressedBytes) != destBytes)
+      return false;
+
+   unsigned bytesPerPixel = src[4];
+   if (bytesPerPixel == 0)
+      return false;
+
+   if (destBytes == 0)
+      return true;
+
+   std::vector<unsigned char>& planes = ws.planes;
+   planes.resize(destBytes);
+   if (!DecompressLZ(src + g_headerBytes, compressedBytes - g_headerBytes,
+            &planes[0], destBytes))
+      return false;
+
+   for (unsigned long i = 1; i < destBytes; i++)
+      planes[i] = (unsigned char)(planes[i] + planes[i - 1]);
+   Unshuffle(&planes[0], destBytes, bytesPerPixel, dest);
+   return true;
+}
+
+void FrameCodec::Shuffle(const unsigned char* src, unsigned long sizeBytes,
+      unsigned bytesPerPixel, unsigned char* dest)
+{
+   unsigned long pixels = sizeBytes / bytesPerPixel;
+   for (unsigned b = 0; b < bytesPerPixel; b++)
+   {
+      const unsigned char* s = src + b;
+      unsigned char* d = dest + b * pixels;
+      for (unsigned long i = 0; i < pixels; i++, s += bytesPerPixel)
+         d[i] = *s;
+   }
+   // trailing bytes that do not form a whole pixel are stored as they are
+   unsigned long done = pixels * bytesPerPixel;
+   memcpy(dest + done, src + done, sizeBytes - done);
+}
+
+void FrameCodec::Unshuffle(const unsigned char* src, unsigned long sizeBytes,
+      unsigned bytesPerPixel, unsigned char* dest)
+{
+   unsigned long pixels = sizeBytes / bytesPerPixel;
+   for (unsigned b = 0; b < bytesPerPixel; b++)
+   {
+      const unsigned char* s = src + b * pixels;
+      unsigned char* d = dest + b;
+      for (unsigned long i = 0; i < pixels; i++, d += bytesPerPixel)
+         *d = s[i];
+   }
+   unsigned long done = pixels * bytesPerPixel;
+   memcpy(dest + done, src + done, sizeBytes - done);
+}
+
+void FrameCodec::CompressLZ(const unsigned char* src, unsigned long sizeBytes,
+      std::vector<unsigned char>& out, std::vector<long>& table)
+{
+   table.assign(1 << g_hashBits, -1);
+
+   unsigned long ip = 0;
+   unsigned long anchor = 0;
+   while (ip + g_minMatch <= sizeBytes)
+   {
+      unsigned int seq = Read32(src + ip);
+      unsigned h = Hash(seq);
+      long ref = table[h];
+      table[h] = (long)ip;
+
+      if (ref >= 0 && ip - ref <= g_maxOffset && Read32(src + ref) == seq)
+      {
+         unsigned long len = g_minMatch;
+         while (ip + len < sizeBytes && src[ref + len] == src[ip + len])
+            len++;
+
+         PutSequence(src + anchor, ip - anchor, ip - ref, len, out);
+         ip += len;
+         anchor = ip;
+      }
+      else
+         ip++;
+   }
+
+   PutSequence(src + anchor, sizeBytes - anchor, 0, 0, out);
+}
+
+bool FrameCodec::DecompressLZ(const unsigned char* src, unsigned long sizeBytes,
+      unsigned char* dest, unsigned long destBytes)
+{
+   const unsigned char* ip = src;
+   const unsigned char* end = src + sizeBytes;
+   unsigned long op = 0;
+
+   while (ip < end)
+   {
+      unsigned char token = *ip++;
+
+      unsigned long literalCount = token >> 4;
+      if (literalCount == 15 && !GetLength(ip, end, literalCount))
+         return false;
+      if (literalCount > (unsigned long)(end - ip) || literalCount > destBytes - op)
+         return false;
+      memcpy(dest + op, ip, literalCount);
+      ip += literalCount;
+      op += literalCount;
+
+      if (ip == end)
+         break; // last sequence
+
+      if (end - ip < 2)
+         return false;
+      unsigned long offset = (unsigned long)ip[0] | ((unsigned long)ip[1] << 8);
+      ip += 2;
+
+      unsigned long matchLength = token & 0x0f;
+      if (matchLength == 15 && !GetLength(ip, end, matchLength))
+         return false;
+      matchLength += g_minMatch;
+
+      if (offset == 0 || offset > op || matchLength > destBytes - op)
+         return false;
+      // byte by byte: the match may overlap the bytes it produces
+      const unsigned char* ref = dest + op - offset;
+      for (unsigned long i = 0; i < matchLength; i++)
+         dest[op + i] = ref[i];
+      op += matchLength;
+   }
+
+   return op == destBytes;
+}
@@ -0,0 +1,65 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameCodec.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lossless in-memory compression of image frames
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_FRAME_CODEC_)
+#define _FRAME_CODEC_
+
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FrameCodec class
+// ~~~~~~~~~~~~~~~~
+// Fast lossless codec tuned for images whose samples vary slowly, such as
+// ultrasonic A-scans sitting around a baseline. Pixels are split into byte
+// planes (all low bytes, then all high bytes, ...), delta coded, and the
+// result is compressed with a byte-oriented LZ77 coder (LZ4-like sequences of
+// literals and back references). Speed matters more than ratio here.
+//
+
+class FrameCodec
+{
+public:
+   // Scratch memory of the codec. Reusing one per thread keeps steady-state
+   // compression and decompression from allocating.
+   struct Workspace
+   {
+      std::vector<unsigned char> planes;
+      std::vector<long> table;
+   };
+
+   static void Compress(const unsigned char* src, unsigned long sizeBytes,
+         unsigned bytesPerPixel, std::vector<unsigned char>& out, Workspace& ws);
+   static bool Decompress(const unsigned char* src, unsigned long compressedBytes,
+         unsigned char* dest, unsigned long destBytes, Workspace& ws);
+   static unsigned long GetDecompressedSize(const unsigned char* src,
+         unsigned long compressedBytes);
+
+private:
+   static void Shuffle(const unsigned char* src, unsigned long sizeBytes,
+         unsigned bytesPerPixel, unsigned char* dest);
+   static void Unshuffle(const unsigned char* src, unsigned long sizeBytes,
+         unsigned bytesPerPixel, unsigned char* dest);
+   static void CompressLZ(const unsigned char* src, unsigned long sizeBytes,
+         std::vector<unsigned char>& out, std::vector<long>& table);
+   static bool DecompressLZ(const unsigned char* src, unsigned long sizeBytes,
+         unsigned char* dest, unsigned long destBytes);
+};
+
+#endif // !defined(_FRAME_CODEC_)
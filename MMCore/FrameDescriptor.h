@@ -0,0 +1,65 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameDescriptor.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lightweight handle to an image removed from the circular
+//                buffer by CMMCore::popNextImages().
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _FRAME_DESCRIPTOR_H_
+#define _FRAME_DESCRIPTOR_H_
+
+#include "../MMDevice/ImageMetadata.h"
+
+/**
+ * Describes one image handed out by CMMCore::popNextImages().
+ *
+ * The descriptor does not own the pixels; they remain valid until the
+ * descriptor is passed back to CMMCore::releaseImages() (or the core is
+ * destroyed). Copying a descriptor is cheap and does not copy image data.
+ */
+class FrameDescriptor
+{
+public:
+   FrameDescriptor() :
+      pixels_(0), width_(0), height_(0), depth_(0), md_(0)
+   {}
+
+   FrameDescriptor(const unsigned char* pixels, unsigned width,
+         unsigned height, unsigned depth, const Metadata* md) :
+      pixels_(pixels), width_(width), height_(height), depth_(depth), md_(md)
+   {}
+
+   const void* getPixels() const { return pixels_; }
+   unsigned long getSizeBytes() const
+   { return (unsigned long)width_ * height_ * depth_; }
+   unsigned getWidth() const { return width_; }
+   unsigned getHeight() const { return height_; }
+   unsigned getBytesPerPixel() const { return depth_; }
+   const Metadata& getMetadata() const
+   {
+      static const Metadata empty;
+      return md_ ? *md_ : empty;
+   }
+
+private:
+   const unsigned char* pixels_;
+   unsigned width_;
+   unsigned height_;
+   unsigned depth_;
+   const Metadata* md_;
+};
+
+#endif //_FRAME_DESCRIPTOR_H_
@@ -0,0 +1,68 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameHandle.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Reference-counted handle that pins one circular buffer slot
+//                so that the image can be read in place.
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _FRAME_HANDLE_H_
+#define _FRAME_HANDLE_H_
+
+#include "../MMDevice/ImgBuffer.h"
+
+#include <boost/shared_ptr.hpp>
+
+/**
+ * Handle to an image that stays in the circular buffer.
+ *
+ * While at least one copy of a handle exists, the slot holding the image is
+ * pinned: the camera will not overwrite it (frames that would land in a
+ * pinned slot are dropped and counted instead). The slot is unpinned when
+ * the last copy is destroyed or reset() is called.
+ *
+ * Handles must be released before the circular buffer is resized or
+ * re-initialized for a different image geometry; until then both fail with
+ * MMERR_CircularBufferPinned. A handle shares ownership of the buffer, so it
+ * remains valid if it outlives the core.
+ */
+class FrameHandle
+{
+public:
+   FrameHandle() : img_(0) {}
+
+   FrameHandle(const ImgBuffer* img, boost::shared_ptr<void> pin) :
+      img_(img), pin_(pin)
+   {}
+
+   bool isValid() const { return img_ != 0; }
+   void reset() { img_ = 0; pin_.reset(); }
+
+   const void* getPixels() const { return img_ ? img_->GetPixels() : 0; }
+   unsigned getWidth() const { return img_ ? img_->Width() : 0; }
+   unsigned getHeight() const { return img_ ? img_->Height() : 0; }
+   unsigned getBytesPerPixel() const { return img_ ? img_->Depth() : 0; }
+   const Metadata& getMetadata() const
+   {
+      static const Metadata empty;
+      return img_ ? img_->GetMetadata() : empty;
+   }
+
+private:
+   const ImgBuffer* img_;
+   boost::shared_ptr<void> pin_;
+};
+
+#endif //_FRAME_HANDLE_H_
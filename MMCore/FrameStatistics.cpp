@@ -0,0 +1,165 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameStatistics.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pixel statistics computed when images are inserted
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "FrameStatistics.h"
+#include "../MMDevice/ImageMetadata.h"
+#include "../MMDevice/BinaryMetadata.h"
+#include "../MMDevice/MMDeviceConstants.h"
+
+#include <math.h>
+#include <string.h>
+
+// Pixels are processed in groups of g_lanes, each lane with its own
+// accumulators and histogram. Independent lanes keep consecutive pixels
+// that fall into the same bin from waiting on each other, and let the
+// compiler keep min/max/sum in vector registers.
+const unsigned g_lanes = 4;
+
+FrameStatistics::FrameStatistics() :
+   min_(0),
+   max_(0),
+   mean_(0.0),
+   stdDev_(0.0),
+   binWidth_(1)
+{
+   memset(histogram_, 0, sizeof(histogram_));
+}
+
+/**
+ * Computes the statistics of an image. Only 1 (8 bit) and 2 (16 bit) bytes
+ * per pixel are supported; returns false for other depths or empty images.
+ * 16 bit images are binned over the range of the camera's bit depth, e.g.
+ * 0-4095 (16 values per bin) for a 12 bit camera; values above that range
+ * are counted in the last bin. A bit depth of 0 means the full 16 bits.
+ */
+bool FrameStatistics::Compute(const unsigned char* pixels, unsigned width,
+      unsigned height, unsigned byteDepth, unsigned bitDepth)
+{
+   unsigned long count = (unsigned long)width * height;
+   if (pixels == 0 || count == 0)
+      return false;
+
+   if (byteDepth == 1)
+   {
+      binWidth_ = 1;
+      ComputeImpl(pixels, count, 0);
+   }
+   else if (byteDepth == 2)
+   {
+      if (bitDepth == 0 || bitDepth > 16)
+         bitDepth = 16;
+      unsigned shift = bitDepth > 8 ? bitDepth - 8 : 0;
+      binWidth_ = 1 << shift;
+      ComputeImpl(reinterpret_cast<const unsigned short*>(pixels), count, shift);
+   }
+   else
+      return false;
+   return true;
+}
+
+template <typename PixelType>
+void FrameStatistics::ComputeImpl(const PixelType* pixels, unsigned long count,
+      unsigned shift)
+{
+   unsigned long hist[g_lanes][HistogramBins];
+   memset(hist, 0, sizeof(hist));
+
+   unsigned lo[g_lanes], hi[g_lanes];
+   unsigned long long sum[g_lanes], sumSq[g_lanes];
+   for (unsigned l = 0; l < g_lanes; l++)
+   {
+      lo[l] = pixels[0];
+      hi[l] = pixels[0];
+      sum[l] = 0;
+      sumSq[l] = 0;
+   }
+
+   const unsigned lastBin = HistogramBins - 1;
+   unsigned long i = 0;
+   unsigned long groups = count / g_lanes;
+   for (unsigned long g = 0; g < groups; g++, i += g_lanes)
+   {
+      for (unsigned l = 0; l < g_lanes; l++)
+      {
+         unsigned v = pixels[i + l];
+         lo[l] = v < lo[l] ? v : lo[l];
+         hi[l] = v > hi[l] ? v : hi[l];
+         sum[l] += v;
+         sumSq[l] += (unsigned long long)v * v;
+         unsigned bin = v >> shift;
+         hist[l][bin < lastBin ? bin : lastBin]++;
+      }
+   }
+   for (; i < count; i++)
+   {
+      unsigned v = pixels[i];
+      lo[0] = v < lo[0] ? v : lo[0];
+      hi[0] = v > hi[0] ? v : hi[0];
+      sum[0] += v;
+      sumSq[0] += (unsigned long long)v * v;
+      unsigned bin = v >> shift;
+      hist[0][bin < lastBin ? bin : lastBin]++;
+   }
+
+   min_ = lo[0];
+   max_ = hi[0];
+   unsigned long long total = sum[0];
+   unsigned long long totalSq = sumSq[0];
+   for (unsigned l = 1; l < g_lanes; l++)
+   {
+      min_ = lo[l] < min_ ? lo[l] : min_;
+      max_ = hi[l] > max_ ? hi[l] : max_;
+      total += sum[l];
+      totalSq += sumSq[l];
+   }
+   for (unsigned b = 0; b < HistogramBins; b++)
+   {
+      histogram_[b] = hist[0][b];
+      for (unsigned l = 1; l < g_lanes; l++)
+         histogram_[b] += hist[l][b];
+   }
+
+   mean_ = (double)total / count;
+   double variance = (double)totalSq / count - mean_ * mean_;
+   stdDev_ = variance > 0.0 ? sqrt(variance) : 0.0;
+}
+
+/**
+ * Adds the minimum, maximum, mean, standard deviation and histogram bin
+ * width to the image metadata as numeric image tags; they are only
+ * formatted as text if a client reads them as such. The histogram itself is
+ * not added; see GetHistogram().
+ */
+void FrameStatistics::AddToMetadata(Metadata& md) const
+{
+   md.PutInt64Tag(MM::g_Keyword_Metadata_Stats_Min, "_", min_);
+   md.PutInt64Tag(MM::g_Keyword_Metadata_Stats_Max, "_", max_);
+   md.PutDoubleTag(MM::g_Keyword_Metadata_Stats_Mean, "_", mean_);
+   md.PutDoubleTag(MM::g_Keyword_Metadata_Stats_StdDev, "_", stdDev_);
+   md.PutInt64Tag(MM::g_Keyword_Metadata_Stats_HistogramBinWidth, "_", binWidth_);
+}
+
+void FrameStatistics::AddToMetadata(BinaryMetadata& md) const
+{
+   md.PutInt64(MM::g_Keyword_Metadata_Stats_Min, min_);
+   md.PutInt64(MM::g_Keyword_Metadata_Stats_Max, max_);
+   md.PutDouble(MM::g_Keyword_Metadata_Stats_Mean, mean_);
+   md.PutDouble(MM::g_Keyword_Metadata_Stats_StdDev, stdDev_);
+   md.PutInt64(MM::g_Keyword_Metadata_Stats_HistogramBinWidth, binWidth_);
+}
@@ -0,0 +1,69 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameStatistics.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Pixel statistics computed when images are inserted
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_FRAME_STATISTICS_)
+#define _FRAME_STATISTICS_
+
+class Metadata;
+class BinaryMetadata;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FrameStatistics class
+// ~~~~~~~~~~~~~~~~~~~~~
+// Minimum, maximum, mean, standard deviation and a 256-bin histogram of an
+// 8 or 16 bit grayscale image, computed in a single pass over the pixels.
+// The scalar values are attached to images as numeric metadata tags
+// (MM::g_Keyword_Metadata_Stats_*) so that display clients can autoscale
+// without reading the pixels themselves; the histogram is only available
+// through CircularBuffer::GetLastHistogram().
+//
+
+class FrameStatistics
+{
+public:
+   static const unsigned HistogramBins = 256;
+
+   FrameStatistics();
+
+   bool Compute(const unsigned char* pixels, unsigned width, unsigned height,
+         unsigned byteDepth, unsigned bitDepth);
+   void AddToMetadata(Metadata& md) const;
+   void AddToMetadata(BinaryMetadata& md) const;
+
+   unsigned GetMin() const { return min_; }
+   unsigned GetMax() const { return max_; }
+   double GetMean() const { return mean_; }
+   double GetStdDev() const { return stdDev_; }
+   unsigned GetBinWidth() const { return binWidth_; }
+   const unsigned long* GetHistogram() const { return histogram_; }
+
+private:
+   template <typename PixelType>
+   void ComputeImpl(const PixelType* pixels, unsigned long count, unsigned shift);
+
+   unsigned min_;
+   unsigned max_;
+   double mean_;
+   double stdDev_;
+   unsigned binWidth_;
+   unsigned long histogram_[HistogramBins];
+};
+
+#endif // !defined(_FRAME_STATISTICS_)
@@ -0,0 +1,278 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          LatencyTracer.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Per-frame acquisition pipeline latency tracing
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "LatencyTracer.h"
+#include "../MMDevice/ImageMetadata.h"
+#include "../MMDevice/MMDeviceConstants.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+// metadata keys of the checkpoints, in LatencyTracer::Checkpoint order;
+// Popped is stamped by the core itself
+const char* const g_checkpointKeys[LatencyTracer::CheckpointCount] =
+{
+   MM::g_Keyword_Metadata_Trace_RunBlockIssued,
+   MM::g_Keyword_Metadata_Trace_CallbackFired,
+   MM::g_Keyword_Metadata_Trace_BulkTransferDone,
+   MM::g_Keyword_Metadata_Trace_ConversionDone,
+   MM::g_Keyword_Metadata_Trace_InsertImageEntered,
+   MM::g_Keyword_Metadata_Trace_Inserted,
+   0
+};
+
+const char* const g_checkpointNames[LatencyTracer::CheckpointCount] =
+{
+   "RunBlockIssued",
+   "CallbackFired",
+   "BulkTransferDone",
+   "ConversionDone",
+   "InsertImageEntered",
+   "Inserted",
+   "Popped"
+};
+
+// log2 histogram buckets: [0, 1) us, [1, 2) us, [2, 4) us, ...
+const int g_histogramBuckets = 32;
+
+int HistogramBucket(long long us)
+{
+   int bucket = 0;
+   while (us > 0 && bucket < g_histogramBuckets - 1)
+   {
+      us >>= 1;
+      bucket++;
+   }
+   return bucket;
+}
+
+long long Percentile(const std::vector<long long>& sorted, int percent)
+{
+   size_t idx = (sorted.size() * percent + 99) / 100;
+   if (idx > 0)
+      idx--;
+   return sorted[idx];
+}
+
+void ReportLine(std::ostringstream& os, const std::string& name, std::vector<long long>& samples)
+{
+   os << std::left << std::setw(42) << name << std::right;
+   if (samples.empty())
+   {
+      os << std::setw(8) << 0 << "\n";
+      return;
+   }
+
+   std::sort(samples.begin(), samples.end());
+   os << std::setw(8) << samples.size()
+      << std::setw(12) << Percentile(samples, 50)
+      << std::setw(12) << Percentile(samples, 90)
+      << std::setw(12) << Percentile(samples, 99)
+      << std::setw(12) << samples.back() << "\n";
+}
+
+} // anonymous namespace
+
+LatencyTracer::LatencyTracer(unsigned long capacity) :
+   ring_(capacity > 0 ? capacity : 1),
+   next_(0),
+   count_(0),
+   frameCounter_(0),
+   enabled_(false)
+{
+}
+
+void LatencyTracer::Enable(bool enable)
+{
+   MMThreadGuard guard(lock_);
+   enabled_ = enable;
+}
+
+bool LatencyTracer::IsEnabled() const
+{
+   MMThreadGuard guard(lock_);
+   return enabled_;
+}
+
+/**
+ * Discards all recorded frames.
+ */
+void LatencyTracer::Clear()
+{
+   MMThreadGuard guard(lock_);
+   next_ = 0;
+   count_ = 0;
+   frameCounter_ = 0;
+}
+
+const char* LatencyTracer::GetCheckpointName(int checkpoint)
+{
+   if (checkpoint < 0 || checkpoint >= CheckpointCount)
+      return "";
+   return g_checkpointNames[checkpoint];
+}
+
+/**
+ * Records the checkpoints found in the image metadata together with the time
+ * the image was popped. The oldest frame is overwritten when the ring is full.
+ * The tags are read in place, so nothing is allocated here.
+ */
+void LatencyTracer::RecordFrame(const Metadata& md, long long poppedUs)
+{
+   FrameTrace trace;
+   trace.imageNumber = -1;
+   for (int i = 0; i < CheckpointCount; i++)
+   {
+      trace.timesUs[i] = -1;
+      // a checkpoint may not be reported by the camera
+      if (g_checkpointKeys[i] != 0)
+         md.GetInt64Tag(g_checkpointKeys[i], trace.timesUs[i]);
+   }
+   trace.timesUs[Popped] = poppedUs;
+
+   long long imageNumber;
+   if (md.GetInt64Tag(MM::g_Keyword_Metadata_ImageNumber, imageNumber))
+      trace.imageNumber = (long)imageNumber;
+
+   MMThreadGuard guard(lock_);
+   if (!enabled_)
+      return;
+   if (trace.imageNumber < 0)
+      trace.imageNumber = frameCounter_;
+   frameCounter_++;
+   ring_[next_] = trace;
+   next_ = (next_ + 1) % ring_.size();
+   if (count_ < ring_.size())
+      count_++;
+}
+
+/**
+ * Returns a text table with the latency of each pipeline stage (between two
+ * consecutive checkpoints reported by the camera) and of the whole pipeline,
+ * as sample count, 50th, 90th, 99th percentile and maximum in microseconds,
+ * followed by a log2 histogram of the end-to-end latency.
+ */
+std::string LatencyTracer::GetStatsReport() const
+{
+   std::vector<FrameTrace> traces;
+   GetTraces(traces);
+
+   std::vector<long long> stages[CheckpointCount];
+   std::vector<long long> total;
+   long histogram[g_histogramBuckets] = {0};
+   total.reserve(traces.size());
+
+   for (std::vector<FrameTrace>::const_iterator it = traces.begin(); it != traces.end(); ++it)
+   {
+      int prev = -1;
+      for (int i = 0; i < CheckpointCount; i++)
+      {
+         if (it->timesUs[i] < 0)
+            continue;
+         if (prev >= 0)
+            stages[i].push_back(it->timesUs[i] - it->timesUs[prev]);
+         else if (i != Popped)
+         {
+            long long us = it->timesUs[Popped] - it->timesUs[i];
+            total.push_back(us);
+            histogram[HistogramBucket(us)]++;
+         }
+         prev = i;
+      }
+   }
+
+   std::ostringstream os;
+   os << "Frames traced: " << traces.size() << "\n";
+   os << std::left << std::setw(42) << "Stage (us)" << std::right
+      << std::setw(8) << "n"
+      << std::setw(12) << "p50"
+      << std::setw(12) << "p90"
+      << std::setw(12) << "p99"
+      << std::setw(12) << "max" << "\n";
+   for (int i = 1; i < CheckpointCount; i++)
+   {
+      if (stages[i].empty())
+         continue;
+      ReportLine(os, std::string("-> ") + g_checkpointNames[i], stages[i]);
+   }
+   ReportLine(os, "Total (first checkpoint -> Popped)", total);
+
+   os << "End-to-end histogram (us):\n";
+   for (int b = 0; b < g_histogramBuckets; b++)
+   {
+      if (histogram[b] == 0)
+         continue;
+      long long lo = b == 0 ? 0 : (1LL << (b - 1));
+      os << "  [" << lo << ", " << (1LL << b) << ") " << histogram[b] << "\n";
+   }
+   return os.str();
+}
+
+/**
+ * Returns the recorded frames in the Chrome trace event format
+ * (chrome://tracing, Perfetto). Every stage of a frame is a complete ("X")
+ * event; frames are spread over a few rows so that overlapping frames
+ * remain readable.
+ */
+std::string LatencyTracer::GetChromeTraceJSON() const
+{
+   std::vector<FrameTrace> traces;
+   GetTraces(traces);
+
+   std::ostringstream os;
+   os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+   bool first = true;
+   for (std::vector<FrameTrace>::const_iterator it = traces.begin(); it != traces.end(); ++it)
+   {
+      int prev = -1;
+      for (int i = 0; i < CheckpointCount; i++)
+      {
+         if (it->timesUs[i] < 0)
+            continue;
+         if (prev >= 0)
+         {
+            os << (first ? "" : ",") << "\n"
+               << "{\"name\":\"" << g_checkpointNames[prev] << " -> " << g_checkpointNames[i]
+               << "\",\"cat\":\"acquisition\",\"ph\":\"X\""
+               << ",\"ts\":" << it->timesUs[prev]
+               << ",\"dur\":" << (it->timesUs[i] - it->timesUs[prev])
+               << ",\"pid\":1,\"tid\":" << (it->imageNumber % 4 + 1)
+               << ",\"args\":{\"frame\":" << it->imageNumber << "}}";
+            first = false;
+         }
+         prev = i;
+      }
+   }
+   os << "\n]}\n";
+   return os.str();
+}
+
+// Copies the recorded frames, oldest first.
+void LatencyTracer::GetTraces(std::vector<FrameTrace>& traces) const
+{
+   MMThreadGuard guard(lock_);
+   traces.clear();
+   traces.reserve(count_);
+   unsigned long start = (next_ + ring_.size() - count_) % ring_.size();
+   for (unsigned long i = 0; i < count_; i++)
+      traces.push_back(ring_[(start + i) % ring_.size()]);
+}
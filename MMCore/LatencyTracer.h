@@ -0,0 +1,88 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          LatencyTracer.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Per-frame acquisition pipeline latency tracing
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_LATENCY_TRACER_)
+#define _LATENCY_TRACER_
+
+#include "../MMDevice/DeviceThreads.h"
+
+#include <string>
+#include <vector>
+
+class Metadata;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// LatencyTracer class
+// ~~~~~~~~~~~~~~~~~~~
+// Collects timestamps of the stages every frame passes through, from the
+// hardware acquisition to the consumer. Camera adapters attach the
+// timestamps they know about as image metadata (MM::g_Keyword_Trace_*) when
+// tracing is turned on in the camera, so that untraced frames carry no extra
+// tags; the core adds the time the frame is popped and records the whole
+// trace in a preallocated ring. Timestamps are microseconds in the core time
+// base (MM::Core::GetCurrentMMTime()).
+//
+
+class LatencyTracer
+{
+public:
+   enum Checkpoint
+   {
+      RunBlockIssued,
+      CallbackFired,
+      BulkTransferDone,
+      ConversionDone,
+      InsertImageEntered,
+      Inserted,
+      Popped,
+      CheckpointCount
+   };
+
+   LatencyTracer(unsigned long capacity);
+
+   void Enable(bool enable);
+   bool IsEnabled() const;
+   void Clear();
+
+   void RecordFrame(const Metadata& md, long long poppedUs);
+
+   std::string GetStatsReport() const;
+   std::string GetChromeTraceJSON() const;
+
+   static const char* GetCheckpointName(int checkpoint);
+
+private:
+   struct FrameTrace
+   {
+      long imageNumber;
+      long long timesUs[CheckpointCount]; // -1 if not recorded
+   };
+
+   void GetTraces(std::vector<FrameTrace>& traces) const;
+
+   mutable MMThreadLock lock_;
+   std::vector<FrameTrace> ring_;
+   unsigned long next_;
+   unsigned long count_;
+   long frameCounter_;
+   bool enabled_;
+};
+
+#endif // !defined(_LATENCY_TRACER_)
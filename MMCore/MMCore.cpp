@@ -43,6 +43,7 @@
 #include "../MMDevice/ImageMetadata.h"
 #include "../MMDevice/ModuleInterface.h"
 #include "CircularBuffer.h"
+#include "CompressedFrameTier.h"
 #include "ConfigGroup.h"
 #include "Configuration.h"
 #include "CoreCallback.h"
@@ -52,6 +53,7 @@
 #include "Host.h"
 #include "MMCore.h"
 #include "MMEventCallback.h"
+#include "ParallelTasks.h"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 
@@ -101,9 +103,12 @@ using namespace std;
  * of the public API of the Core), not just CMMCore.
  */
 const int MMCore_versionMajor = 6;
-const int MMCore_versionMinor = 0;
+const int MMCore_versionMinor = 5;
 const int MMCore_versionPatch = 0;
 
+// Number of images whose latency trace is kept
+const unsigned long g_latencyTraceCapacity = 4096;
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // CMMcore class
@@ -126,8 +131,11 @@ CMMCore::CMMCore() :
    properties_(0),
    externalCallback_(0),
    pixelSizeGroup_(0),
-   cbuf_(0),
-   pPostedErrorsLock_(NULL)
+   compressedTier_(0),
+   frameStatisticsEnabled_(false),
+   cameraBufferPoolMB_(0),
+   pPostedErrorsLock_(NULL),
+   latencyTracer_(g_latencyTraceCapacity)
 {
    configGroups_ = new ConfigGroupCollection();
    pixelSizeGroup_ = new PixelSizeConfigGroup();
@@ -190,9 +198,19 @@ CMMCore::CMMCore() :
    errorText_[MMERR_InvalidImageSequence] = "Issue snapImage before getImage.";
    errorText_[MMERR_NullPointerException] = "Null Pointer Exception.";
    errorText_[MMERR_CreatePeripheralFailed] = "Hub failed to create specified peripheral device.";
+   errorText_[MMERR_CircularBufferPinned] =
+      "Circular buffer images are still held by frame handles.";
+   errorText_[MMERR_CameraBufferPoolExhausted] =
+      "Not enough memory left in the camera buffer pool.";
+   errorText_[MMERR_NoCameraBuffer] = "No buffer has been created for this camera.";
+   errorText_[MMERR_UnknownAsyncCommand] =
+      "Unknown asynchronous command ticket, or it was already waited for.";
+   errorText_[MMERR_InvalidImageMetadata] = "Malformed binary image metadata.";
+   errorText_[MMERR_CompressedImageCorrupt] =
+      "A compressed image in the circular buffer could not be decompressed.";
 
    callback_ = new CoreCallback(this);
-   cbuf_ = new CircularBuffer(10); // allocate 10MB initially
+   cbuf_.reset(new CircularBuffer(10)); // allocate 10MB initially
 
    // set-up core properties
    properties_ = new CorePropertyCollection(this);
@@ -272,10 +290,21 @@ CMMCore::~CMMCore()
    delete callback_;
    delete configGroups_;
    delete properties_;
-   delete cbuf_;
+   delete compressedTier_;
+   cbuf_.reset(); // frame handles may keep it alive a while longer
+   for (std::map<std::string, CircularBuffer*>::iterator it = cameraBuffers_.begin();
+         it != cameraBuffers_.end(); ++it)
+      delete it->second;
    delete pixelSizeGroup_;
    delete pPostedErrorsLock_;
 
+   for (std::vector<ImgBuffer*>::iterator it = imageBatchPool_.begin();
+         it != imageBatchPool_.end(); ++it)
+      delete *it;
+   for (std::map<const void*, ImgBuffer*>::iterator it = imageBatchesOut_.begin();
+         it != imageBatchesOut_.end(); ++it)
+      delete it->second;
+
    LOG_INFO(coreLogger_) << "Core session ended";
 }
 
@@ -505,45 +534,225 @@ string CMMCore::getAPIVersionInfo() const
    return txt.str();
 }
 
+namespace {
+
+// Upper limit on the number of devices the core accesses at the same time
+const unsigned g_maxDeviceThreads = 8;
+
+size_t FindGroup(std::vector<size_t>& groupOf, size_t i)
+{
+   while (groupOf[i] != i)
+   {
+      groupOf[i] = groupOf[groupOf[i]];
+      i = groupOf[i];
+   }
+   return i;
+}
+
+void JoinGroups(std::vector<size_t>& groupOf, size_t a, size_t b)
+{
+   a = FindGroup(groupOf, a);
+   b = FindGroup(groupOf, b);
+   // the group is represented by its earliest loaded device
+   if (a < b)
+      groupOf[b] = a;
+   else if (b < a)
+      groupOf[a] = b;
+}
+
+// Splits devices into groups that have to be accessed one after the other:
+// devices sharing a serial port, and a port and the devices using it;
+// optionally also a hub and its peripherals, and devices of the same adapter
+// module. Each group lists device indices in load order; groups are ordered
+// by their first device.
+std::vector< std::vector<size_t> > GroupDependentDevices(
+      const std::vector< boost::shared_ptr<DeviceInstance> >& devices,
+      bool byParent, bool byModule)
+{
+   std::map<std::string, size_t> indexOf;
+   for (size_t i=0; i<devices.size(); i++)
+      indexOf[devices[i]->GetLabel()] = i;
+
+   std::vector<size_t> groupOf(devices.size());
+   std::map<std::string, size_t> portUsers;
+   std::map<std::string, size_t> moduleUsers;
+   for (size_t i=0; i<devices.size(); i++)
+   {
+      groupOf[i] = i;
+
+      std::string parent;
+      std::string port;
+      std::string module;
+      {
+         mm::DeviceModuleLockGuard guard(devices[i]);
+         parent = devices[i]->GetParentID();
+         module = devices[i]->GetAdapterModule()->GetName();
+         if (devices[i]->HasProperty(MM::g_Keyword_Port))
+         {
+            try
+            {
+               port = devices[i]->GetProperty(MM::g_Keyword_Port);
+            }
+            catch (const CMMError&)
+            {
+               // treat as not using a port
+            }
+         }
+      }
+
+      std::map<std::string, size_t>::iterator it = indexOf.find(parent);
+      if (byParent && !parent.empty() && it != indexOf.end())
+         JoinGroups(groupOf, i, it->second);
+
+      if (byModule)
+      {
+         it = moduleUsers.find(module);
+         if (it != moduleUsers.end())
+            JoinGroups(groupOf, i, it->second);
+         else
+            moduleUsers[module] = i;
+      }
+
+      if (!port.empty())
+      {
+         it = indexOf.find(port);
+         if (it != indexOf.end())
+            JoinGroups(groupOf, i, it->second);
+         it = portUsers.find(port);
+         if (it != portUsers.end())
+            JoinGroups(groupOf, i, it->second);
+         else
+            portUsers[port] = i;
+      }
+   }
+
+   std::vector< std::vector<size_t> > groups;
+   std::map<size_t, size_t> groupIndex;
+   for (size_t i=0; i<devices.size(); i++)
+   {
+      size_t root = FindGroup(groupOf, i);
+      std::map<size_t, size_t>::iterator it = groupIndex.find(root);
+      if (it == groupIndex.end())
+      {
+         it = groupIndex.insert(std::make_pair(root, groups.size())).first;
+         groups.push_back(std::vector<size_t>());
+      }
+      groups[it->second].push_back(i);
+   }
+   return groups;
+}
+
+// Reads all properties of a group of devices for a system state snapshot.
+// Static properties are served from, and stored in, the cache.
+class DeviceStateTask : public ParallelTask
+{
+public:
+   DeviceStateTask(const std::vector< boost::shared_ptr<DeviceInstance> >* devices,
+         const std::vector<size_t>* group, PropertyValueCache* cache,
+         std::vector< std::vector<PropertySetting> >* settings) :
+      devices_(devices), group_(group), cache_(cache), settings_(settings)
+   {}
+
+   void Run()
+   {
+      for (size_t j=0; j<group_->size(); j++)
+      {
+         boost::shared_ptr<DeviceInstance> pDev = (*devices_)[(*group_)[j]];
+         std::vector<PropertySetting>& out = (*settings_)[(*group_)[j]];
+         std::string label = pDev->GetLabel();
+
+         mm::DeviceModuleLockGuard guard(pDev);
+         std::vector<std::string> propertyNames = pDev->GetPropertyNames();
+         for (std::vector<std::string>::const_iterator it = propertyNames.begin(), end = propertyNames.end();
+               it != end; ++it)
+         {
+            std::string val;
+            bool readOnly = false;
+            bool isStatic = false;
+            try
+            {
+               isStatic = cache_->IsStatic(label, *it, pDev->GetPropertyInitStatus(it->c_str()));
+            }
+            catch (const CMMError&)
+            {
+            }
+            if (isStatic && cache_->Get(label, *it, val, readOnly))
+            {
+               out.push_back(PropertySetting(label.c_str(), it->c_str(), val.c_str(), readOnly));
+               continue;
+            }
+
+            bool valid = true;
+            try
+            {
+               val = pDev->GetProperty(*it);
+            }
+            catch (const CMMError&)
+            {
+               // XXX BUG This should not be ignored, but the interface does not
+               // allow throwing from this function. Keeping old behavior for now.
+               valid = false;
+            }
+
+            try
+            {
+               readOnly = pDev->GetPropertyReadOnly(it->c_str());
+            }
+            catch (const CMMError&)
+            {
+               // XXX BUG This should not be ignored, but the interface does not
+               // allow throwing from this function. Keeping old behavior for now.
+            }
+            if (isStatic && valid)
+               cache_->Put(label, *it, val, readOnly);
+            out.push_back(PropertySetting(label.c_str(), it->c_str(), val.c_str(), readOnly));
+         }
+      }
+   }
+
+private:
+   const std::vector< boost::shared_ptr<DeviceInstance> >* devices_;
+   const std::vector<size_t>* group_;
+   PropertyValueCache* cache_;
+   std::vector< std::vector<PropertySetting> >* settings_;
+};
+
+} // anonymous namespace
+
 /**
  * Returns the entire system state, i.e. the collection of all property values from all devices.
+ *
+ * Devices that do not share an adapter module or a port are queried in
+ * parallel. Values of static properties (see setPropertyStatic()) are
+ * taken from the cache once they have been read.
  * @return Configuration object containing a collection of device-property-value triplets
  */
 Configuration CMMCore::getSystemState()
 {
    Configuration config;
    vector<string> devices = deviceManager_.GetDeviceList();
+   std::vector< boost::shared_ptr<DeviceInstance> > pDevices;
    for (vector<string>::const_iterator i = devices.begin(), end = devices.end(); i != end; ++i)
+      pDevices.push_back(deviceManager_.GetDevice(*i));
+
+   std::vector< std::vector<size_t> > groups = GroupDependentDevices(pDevices, false, true);
+   std::vector< std::vector<PropertySetting> > settings(pDevices.size());
+   std::vector<DeviceStateTask> tasks;
+   tasks.reserve(groups.size());
+   std::vector<ParallelTask*> runList;
+   for (size_t g=0; g<groups.size(); g++)
    {
-      boost::shared_ptr<DeviceInstance> pDev = deviceManager_.GetDevice(*i);
-      mm::DeviceModuleLockGuard guard(pDev);
-      std::vector<std::string> propertyNames = pDev->GetPropertyNames();
-      for (std::vector<std::string>::const_iterator it = propertyNames.begin(), end = propertyNames.end();
-            it != end; ++it)
-      {
-         std::string val;
-         try
-         {
-            val = pDev->GetProperty(*it);
-         }
-         catch (const CMMError&)
-         {
-            // XXX BUG This should not be ignored, but the interface does not
-            // allow throwing from this function. Keeping old behavior for now.
-         }
+      tasks.push_back(DeviceStateTask(&pDevices, &groups[g], &propertyValueCache_, &settings));
+      runList.push_back(&tasks.back());
+   }
+   ParallelTaskRunner runner(g_maxDeviceThreads);
+   runner.Run(runList);
 
-         bool readOnly = false;
-         try
-         {
-            readOnly = pDev->GetPropertyReadOnly(it->c_str());
-         }
-         catch (const CMMError&)
-         {
-            // XXX BUG This should not be ignored, but the interface does not
-            // allow throwing from this function. Keeping old behavior for now.
-         }
-         config.addSetting(PropertySetting(i->c_str(), it->c_str(), val.c_str(), readOnly));
-      }
+   // keep the device order independent of the order the queries finished
+   for (size_t i=0; i<settings.size(); i++)
+   {
+      for (size_t j=0; j<settings[i].size(); j++)
+         config.addSetting(settings[i][j]);
    }
 
    // add core properties
@@ -565,8 +774,7 @@ Configuration CMMCore::getSystemState()
  */
 Configuration CMMCore::getSystemStateCache() const
 {
-   MMThreadGuard scg(stateCacheLock_);
-   return stateCache_;
+   return stateCache_.GetConfiguration();
 }
 
 /**
@@ -866,10 +1074,13 @@ void CMMCore::unloadDevice(const char* label///< the name of the device to unloa
                            ) throw (CMMError)
 {
    boost::shared_ptr<DeviceInstance> pDevice = deviceManager_.GetDevice(label);
+   asyncCommands_.WaitForQueue(label);
 
    try {
       mm::DeviceModuleLockGuard guard(pDevice);
       LOG_DEBUG(coreLogger_) << "Will unload device " << label;
+      propertyValueCache_.InvalidateDevice(label);
+      busyNotifier_.Forget(label);
       deviceManager_.UnloadDevice(pDevice);
       LOG_DEBUG(coreLogger_) << "Did unload device " << label;
    }
@@ -885,6 +1096,8 @@ void CMMCore::unloadDevice(const char* label///< the name of the device to unloa
  */
 void CMMCore::unloadAllDevices() throw (CMMError)
 {
+   asyncCommands_.WaitForAll();
+
    try {
       configGroups_->Clear();
 
@@ -903,6 +1116,8 @@ void CMMCore::unloadAllDevices() throw (CMMError)
       }
 
       LOG_DEBUG(coreLogger_) << "Will unload all devices";
+      propertyValueCache_.Clear();
+      busyNotifier_.Clear();
       deviceManager_.UnloadAllDevices();
       LOG_INFO(coreLogger_) << "Did unload all devices";
    
@@ -957,35 +1172,136 @@ void CMMCore::reset() throw (CMMError)
 }
 
 
+namespace {
+
+// Initializes a group of dependent devices one after the other, in load
+// order. Stops at the first failure: later devices in the group depend on
+// the ones before them.
+class DeviceInitTask : public ParallelTask
+{
+public:
+   DeviceInitTask(boost::shared_ptr<mm::logging::Logger> logger) :
+      logger_(logger), initialized_(0), failed_(false), errorCode_(0)
+   {}
+
+   void AddDevice(boost::shared_ptr<DeviceInstance> pDevice) { devices_.push_back(pDevice); }
+   size_t GetInitializedCount() const { return initialized_; }
+
+   bool Failed() const { return failed_; }
+   const std::string& GetFailedLabel() const { return failedLabel_; }
+   const std::string& GetErrorMessage() const { return errorMsg_; }
+   int GetErrorCode() const { return errorCode_; }
+
+   void Run()
+   {
+      for (initialized_ = 0; initialized_ < devices_.size(); initialized_++)
+      {
+         boost::shared_ptr<DeviceInstance> pDevice = devices_[initialized_];
+         std::string label = pDevice->GetLabel();
+         try
+         {
+            mm::DeviceModuleLockGuard guard(pDevice);
+            LOG_INFO(logger_) << "Will initialize device " << label;
+            MM::MMTime start = GetMMTimeNow();
+            pDevice->Initialize();
+            LOG_INFO(logger_) << "Did initialize device " << label << " (" <<
+               (GetMMTimeNow() - start).getMsec() << " ms)";
+         }
+         catch (CMMError& err)
+         {
+            failed_ = true;
+            failedLabel_ = label;
+            errorMsg_ = err.getMsg();
+            errorCode_ = err.getCode();
+            return;
+         }
+      }
+   }
+
+private:
+   boost::shared_ptr<mm::logging::Logger> logger_;
+   std::vector< boost::shared_ptr<DeviceInstance> > devices_;
+   size_t initialized_;
+   bool failed_;
+   std::string failedLabel_;
+   std::string errorMsg_;
+   int errorCode_;
+};
+
+} // anonymous namespace
+
 /**
  * Calls Initialize() method for each loaded device.
  * This method also initialized allowed values for core properties, based
  * on the collection of loaded devices.
+ *
+ * Devices that depend on each other - a hub and its peripherals, a serial
+ * port and the devices using it - are initialized one after the other, in
+ * load order. Independent groups of devices are initialized in parallel, so
+ * slow handshakes with unrelated hardware overlap. If devices fail, the
+ * error of the first one in load order is thrown once all groups are done.
  */
 void CMMCore::initializeAllDevices() throw (CMMError)
 {
    vector<string> devices = deviceManager_.GetDeviceList();
    LOG_INFO(coreLogger_) << "Will initialize " << devices.size() << " devices";
+   MM::MMTime start = GetMMTimeNow();
 
+   std::vector< boost::shared_ptr<DeviceInstance> > pDevices;
    for (size_t i=0; i<devices.size(); i++)
    {
-      boost::shared_ptr<DeviceInstance> pDevice;
       try {
-         pDevice = deviceManager_.GetDevice(devices[i]);
+         pDevices.push_back(deviceManager_.GetDevice(devices[i]));
       }
       catch (CMMError& err) {
          logError(devices[i].c_str(), err.getMsg().c_str());
          throw;
       }
-      mm::DeviceModuleLockGuard guard(pDevice);
-      LOG_INFO(coreLogger_) << "Will initialize device " << devices[i];
-      pDevice->Initialize();
-      LOG_INFO(coreLogger_) << "Did initialize device " << devices[i];
+      propertyValueCache_.InvalidateDevice(devices[i]);
+   }
+
+   std::vector< std::vector<size_t> > groups = GroupDependentDevices(pDevices, true, false);
+   std::vector<DeviceInitTask> tasks(groups.size(), DeviceInitTask(coreLogger_));
+   std::vector<ParallelTask*> runList;
+   for (size_t g=0; g<groups.size(); g++)
+   {
+      for (size_t j=0; j<groups[g].size(); j++)
+         tasks[g].AddDevice(pDevices[groups[g][j]]);
+      runList.push_back(&tasks[g]);
+   }
+
+   LOG_DEBUG(coreLogger_) << "Initializing " << groups.size() << " independent device groups";
+   ParallelTaskRunner runner(g_maxDeviceThreads);
+   runner.Run(runList);
+
+   // roles are assigned in load order, as when initializing serially
+   std::vector<bool> initialized(pDevices.size(), false);
+   const DeviceInitTask* failed = 0;
+   size_t failedIndex = pDevices.size();
+   for (size_t g=0; g<groups.size(); g++)
+   {
+      for (size_t j=0; j<tasks[g].GetInitializedCount(); j++)
+         initialized[groups[g][j]] = true;
+      if (tasks[g].Failed() && groups[g][tasks[g].GetInitializedCount()] < failedIndex)
+      {
+         failed = &tasks[g];
+         failedIndex = groups[g][tasks[g].GetInitializedCount()];
+      }
+   }
+   for (size_t i=0; i<pDevices.size(); i++)
+   {
+      if (initialized[i])
+         assignDefaultRole(pDevices[i]);
+   }
 
-      assignDefaultRole(pDevice);
+   if (failed)
+   {
+      logError(failed->GetFailedLabel().c_str(), failed->GetErrorMessage().c_str());
+      throw CMMError(failed->GetErrorMessage(), failed->GetErrorCode());
    }
 
-   LOG_INFO(coreLogger_) << "Finished initializing " << devices.size() << " devices";
+   LOG_INFO(coreLogger_) << "Finished initializing " << devices.size() << " devices (" <<
+      (GetMMTimeNow() - start).getMsec() << " ms)";
 
    updateCoreProperties();
 }
@@ -1028,6 +1344,7 @@ void CMMCore::initializeDevice(const char* label ///< the device to initialize
    mm::DeviceModuleLockGuard guard(pDevice);
 
    LOG_INFO(coreLogger_) << "Will initialize device " << label;
+   propertyValueCache_.InvalidateDevice(label);
    pDevice->Initialize();
    LOG_INFO(coreLogger_) << "Did initialize device " << label;
    
@@ -1043,6 +1360,14 @@ void CMMCore::updateSystemStateCache()
 {
    LOG_DEBUG(coreLogger_) << "Will update system state cache";
    Configuration wk = getSystemState();
+   for (size_t i = 0; i < wk.size(); i++)
+   {
+      PropertySetting setting = wk.getSetting(i);
+      if (setting.getPropertyValue().size() >= MM::MaxStrLength)
+         LOG_WARNING(coreLogger_) << "Property " << setting.getPropertyName() <<
+            " of device " << setting.getDeviceLabel() <<
+            " is too long for the system state cache and is not cached";
+   }
    {
       MMThreadGuard scg(stateCacheLock_);
       stateCache_ = wk;
@@ -1050,6 +1375,58 @@ void CMMCore::updateSystemStateCache()
    LOG_INFO(coreLogger_) << "Did update system state cache";
 }
 
+/**
+ * Re-reads the properties marked volatile with setPropertyStatic(label,
+ * propName, false) and stores their values in the system state cache.
+ *
+ * Devices report other property changes to the cache as they happen, so
+ * this is much cheaper than updateSystemStateCache() for keeping the cache
+ * current. Properties of devices that are no longer loaded, and properties
+ * that cannot be read, are skipped.
+ */
+void CMMCore::updateVolatileStateCache()
+{
+   std::vector<std::pair<std::string, std::string> > props =
+      propertyValueCache_.GetHinted(PropertyValueCache::Volatile);
+   LOG_DEBUG(coreLogger_) << "Will update " << props.size() <<
+      " volatile properties in system state cache";
+
+   for (size_t i = 0; i < props.size(); i++)
+   {
+      const char* label = props[i].first.c_str();
+      const char* propName = props[i].second.c_str();
+      try
+      {
+         std::string value = getProperty(label, propName);
+         bool readOnly = isPropertyReadOnly(label, propName);
+         MMThreadGuard scg(stateCacheLock_);
+         if (!stateCache_.addSetting(PropertySetting(label, propName, value.c_str(), readOnly)))
+            LOG_WARNING(coreLogger_) << "Property " << propName << " of device " <<
+               label << " is too long for the system state cache and is not cached";
+      }
+      catch (CMMError& err)
+      {
+         LOG_WARNING(coreLogger_) << "Cannot refresh property " << propName <<
+            " of device " << label << " in system state cache: " << err.getMsg();
+      }
+   }
+   LOG_DEBUG(coreLogger_) << "Did update volatile properties in system state cache";
+}
+
+/**
+ * Stores a property value reported by a device in the system state cache.
+ * Called from CoreCallback::OnPropertyChanged(); the device has changed the
+ * property by itself, so any cached static value is dropped as well.
+ */
+void CMMCore::updateCachedProperty(const char* label, const char* propName, const char* value)
+{
+   propertyValueCache_.Invalidate(label, propName);
+   MMThreadGuard scg(stateCacheLock_);
+   if (!stateCache_.addSetting(PropertySetting(label, propName, value)))
+      LOG_WARNING(coreLogger_) << "Property " << propName << " of device " <<
+         label << " is too long for the system state cache and is not cached";
+}
+
 /**
  * Returns device type.
  */
@@ -1267,20 +1644,29 @@ void CMMCore::waitForDevice(const char* label) throw (CMMError)
 
 /**
  * Waits (blocks the calling thread) until the specified device becomes
+ * non-busy.
+ *
+ * Devices that report their busy state through OnBusyChanged() wake the
+ * caller as soon as they report idle, after which Busy() is checked once to
+ * confirm. Other devices are polled every pollingIntervalMs_.
+ *
  * @param device   the device label
  */
 void CMMCore::waitForDevice(boost::shared_ptr<DeviceInstance> pDev) throw (CMMError)
 {
-   LOG_DEBUG(coreLogger_) << "Waiting for device " << pDev->GetLabel() << "...";
+   std::string label = pDev->GetLabel();
+   LOG_DEBUG(coreLogger_) << "Waiting for device " << label << "...";
 
    MM::TimeoutMs timeout(GetMMTimeNow(),timeoutMs_);
+   if (busyNotifier_.IsReporting(label))
+      busyNotifier_.WaitUntilIdle(label, timeoutMs_); // on timeout, Busy() below fails fast
+
    mm::DeviceModuleLockGuard guard(pDev);
    
    while (pDev->Busy())
    {
       if (timeout.expired(GetMMTimeNow()))
       {
-         string label = pDev->GetLabel();
          std::ostringstream mez;
          mez << "wait timed out after " << timeoutMs_ << " ms. ";
          logError(label.c_str(), mez.str().c_str());
@@ -1291,8 +1677,18 @@ void CMMCore::waitForDevice(boost::shared_ptr<DeviceInstance> pDev) throw (CMMEr
 
      sleep(pollingIntervalMs_);
    }
-   LOG_DEBUG(coreLogger_) << "Finished waiting for device " << pDev->GetLabel();
+   LOG_DEBUG(coreLogger_) << "Finished waiting for device " << label;
+}
+
+/**
+ * Records a busy state change reported by a device and wakes up threads
+ * waiting for it. Called from CoreCallback::OnBusyChanged().
+ */
+void CMMCore::updateDeviceBusy(const char* label, bool busy)
+{
+   busyNotifier_.Report(label, busy);
 }
+
 /**
  * Checks the busy status of the entire system. The system will report busy if any
  * of the devices is busy.
@@ -2111,6 +2507,187 @@ void CMMCore::snapImage() throw (CMMError)
 }
 
 
+// Commands behind the asynchronous API. Each one calls the synchronous core
+// method, so device module locking is the same as for a direct call.
+namespace
+{
+   class SetXYPositionCommand : public AsyncCommand
+   {
+   public:
+      SetXYPositionCommand(CMMCore* core, const std::string& label, double x, double y) :
+         core_(core), label_(label), x_(x), y_(y) {}
+      void Execute()
+      {
+         core_->setXYPosition(label_.c_str(), x_, y_);
+         core_->waitForDevice(label_.c_str());
+      }
+   private:
+      CMMCore* core_;
+      std::string label_;
+      double x_;
+      double y_;
+   };
+
+   class SetPositionCommand : public AsyncCommand
+   {
+   public:
+      SetPositionCommand(CMMCore* core, const std::string& label, double position) :
+         core_(core), label_(label), position_(position) {}
+      void Execute()
+      {
+         core_->setPosition(label_.c_str(), position_);
+         core_->waitForDevice(label_.c_str());
+      }
+   private:
+      CMMCore* core_;
+      std::string label_;
+      double position_;
+   };
+
+   class SnapImageCommand : public AsyncCommand
+   {
+   public:
+      explicit SnapImageCommand(CMMCore* core) : core_(core) {}
+      void Execute() { core_->snapImage(); }
+   private:
+      CMMCore* core_;
+   };
+
+   class SetConfigCommand : public AsyncCommand
+   {
+   public:
+      SetConfigCommand(CMMCore* core, const std::string& group, const std::string& config) :
+         core_(core), group_(group), config_(config) {}
+      void Execute()
+      {
+         core_->setConfig(group_.c_str(), config_.c_str());
+         core_->waitForConfig(group_.c_str(), config_.c_str());
+      }
+   private:
+      CMMCore* core_;
+      std::string group_;
+      std::string config_;
+   };
+} // anonymous namespace
+
+/**
+ * Starts moving the XY stage in the background and returns at once.
+ * The command is complete when the stage has stopped.
+ *
+ * Commands for the same device run in the order they were issued; commands
+ * for different devices run concurrently.
+ *
+ * @return the ticket to pass to waitForAsyncCommand()
+ * @param label  the XY stage device label
+ * @param x      the X axis position in microns
+ * @param y      the Y axis position in microns
+ */
+long CMMCore::setXYPositionAsync(const char* label, double x, double y) throw (CMMError)
+{
+   deviceManager_.GetDeviceOfType<XYStageInstance>(label);
+   return asyncCommands_.Submit(label, new SetXYPositionCommand(this, label, x, y));
+}
+
+/**
+ * Starts moving the stage in the background and returns at once.
+ * The command is complete when the stage has stopped.
+ *
+ * @return the ticket to pass to waitForAsyncCommand()
+ * @param label     the stage device label
+ * @param position  the desired stage position, in microns
+ */
+long CMMCore::setPositionAsync(const char* label, double position) throw (CMMError)
+{
+   deviceManager_.GetDeviceOfType<StageInstance>(label);
+   return asyncCommands_.Submit(label, new SetPositionCommand(this, label, position));
+}
+
+/**
+ * Acquires a single image in the background with the current camera, as
+ * snapImage() does. Call getImage() after the command has completed.
+ *
+ * @return the ticket to pass to waitForAsyncCommand()
+ */
+long CMMCore::snapImageAsync() throw (CMMError)
+{
+   boost::shared_ptr<CameraInstance> camera = currentCameraDevice_.lock();
+   if (!camera)
+      throw CMMError(getCoreErrorText(MMERR_CameraNotAvailable).c_str(), MMERR_CameraNotAvailable);
+   return asyncCommands_.Submit(camera->GetLabel(), new SnapImageCommand(this));
+}
+
+/**
+ * Applies a configuration in the background and returns at once. The
+ * command is complete when all devices in the configuration are idle.
+ *
+ * Configurations of the same group are applied in the order they were
+ * issued. They are not ordered with respect to commands for single devices.
+ *
+ * @return the ticket to pass to waitForAsyncCommand()
+ * @param groupName   the configuration group name
+ * @param configName  the configuration preset name
+ */
+long CMMCore::setConfigAsync(const char* groupName, const char* configName) throw (CMMError)
+{
+   CheckConfigGroupName(groupName);
+   CheckConfigPresetName(configName);
+   if (!isConfigDefined(groupName, configName))
+      throw CMMError("Preset " + ToQuotedString(configName) + " of group " +
+            ToQuotedString(groupName) + " does not exist",
+            MMERR_NoConfiguration);
+
+   // '/' keeps group queues apart from device queues
+   return asyncCommands_.Submit(std::string("/") + groupName,
+         new SetConfigCommand(this, groupName, configName));
+}
+
+/**
+ * Tells whether an asynchronous command has completed, successfully or not.
+ *
+ * @param ticket   the ticket returned when the command was issued
+ */
+bool CMMCore::isAsyncCommandDone(long ticket) throw (CMMError)
+{
+   return asyncCommands_.IsDone(ticket);
+}
+
+/**
+ * Blocks until an asynchronous command has completed. If the command
+ * failed, its error is thrown here. Every ticket should be waited for once;
+ * it is no longer valid afterwards.
+ *
+ * @param ticket   the ticket returned when the command was issued
+ */
+void CMMCore::waitForAsyncCommand(long ticket) throw (CMMError)
+{
+   asyncCommands_.Wait(ticket);
+}
+
+/**
+ * Discards the result of an asynchronous command that is not going to be
+ * waited for. The command still runs to completion; a failure is not
+ * reported. The ticket is no longer valid afterwards.
+ *
+ * @param ticket   the ticket returned when the command was issued
+ */
+void CMMCore::releaseAsyncCommand(long ticket) throw (CMMError)
+{
+   asyncCommands_.Release(ticket);
+}
+
+/**
+ * Blocks until all asynchronous commands issued so far have completed, and
+ * discards their results: outstanding tickets are no longer valid.
+ * Errors are only logged here; use waitForAsyncCommand() to receive them.
+ */
+void CMMCore::waitForAllAsyncCommands()
+{
+   unsigned long failed = asyncCommands_.WaitForAll();
+   if (failed > 0)
+      LOG_WARNING(coreLogger_) << failed <<
+         " asynchronous command(s) failed without being waited for";
+}
+
 // Predicate used by assignImageSynchro() and removeImageSynchro()
 namespace
 {
@@ -2424,12 +3001,10 @@ void CMMCore::startSequenceAcquisition(long numImages, double intervalMs, bool s
 
 		try
 		{
-			if (!cbuf_->Initialize(camera->GetNumberOfChannels(), 1, camera->GetImageWidth(), camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
-			{
-				logError(getDeviceName(camera).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
-				throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
-			}
+			initializeBufferForCamera(cbuf_.get(), camera);
 			cbuf_->Clear();
+			if (compressedTier_)
+				compressedTier_->Clear();
          mm::DeviceModuleLockGuard guard(camera);
 
          LOG_DEBUG(coreLogger_) << "Will start sequence acquisition from default camera";
@@ -2457,12 +3032,25 @@ void CMMCore::startSequenceAcquisition(long numImages, double intervalMs, bool s
  * This command does not block the calling thread for the uration of the acquisition.
  * The difference between this method and the one with the same name but operating on the "default"
  * camera is that it does not automatically intitialize the circular buffer.
+ * If the camera has its own buffer (see createCameraBuffer()), that buffer
+ * is initialized from the camera's current geometry.
  */
 void CMMCore::startSequenceAcquisition(const char* label, long numImages, double intervalMs, bool stopOnOverflow) throw (CMMError)
 {
    boost::shared_ptr<CameraInstance> pCam =
       deviceManager_.GetDeviceOfType<CameraInstance>(label);
 
+   if (hasCameraBuffer(label))
+   {
+      {
+         mm::DeviceModuleLockGuard guard(pCam);
+         if(pCam->IsCapturing())
+            throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(), 
+                           MMERR_NotAllowedDuringSequenceAcquisition);
+      }
+      initializeCameraBuffer(label);
+   }
+
    mm::DeviceModuleLockGuard guard(pCam);
    if(pCam->IsCapturing())
       throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(), 
@@ -2512,12 +3100,10 @@ void CMMCore::initializeCircularBuffer() throw (CMMError)
    if (camera)
    {
       mm::DeviceModuleLockGuard guard(camera);
-      if (!cbuf_->Initialize(camera->GetNumberOfChannels(), 1, camera->GetImageWidth(), camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
-      {
-         logError(getDeviceName(camera).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
-         throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
-      }
+      initializeBufferForCamera(cbuf_.get(), camera);
       cbuf_->Clear();
+      if (compressedTier_)
+         compressedTier_->Clear();
    }
    else
    {
@@ -2565,12 +3151,10 @@ void CMMCore::startContinuousSequenceAcquisition(double intervalMs) throw (CMMEr
             ,MMERR_NotAllowedDuringSequenceAcquisition);
       }
 
-      if (!cbuf_->Initialize(camera->GetNumberOfChannels(), 1, camera->GetImageWidth(), camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
-      {
-         logError(getDeviceName(camera).c_str(), getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str());
-         throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
-      }
+      initializeBufferForCamera(cbuf_.get(), camera);
       cbuf_->Clear();
+      if (compressedTier_)
+         compressedTier_->Clear();
       LOG_DEBUG(coreLogger_) << "Will start continuous sequence acquisition from current camera";
       int nRet = camera->StartSequenceAcquisition(intervalMs);
       if (nRet != DEVICE_OK)
@@ -2642,112 +3226,796 @@ bool CMMCore::isSequenceRunning(const char* label) throw (CMMError)
 };
 
 /**
- * Gets the last image from the circular buffer.
- * Returns 0 if the buffer is empty.
- */
-void* CMMCore::getLastImage() throw (CMMError)
-{
+ * Gets the last image from the circular buffer.
+ * Returns 0 if the buffer is empty.
+ */
+void* CMMCore::getLastImage() throw (CMMError)
+{
+
+   // scope for the thread guard
+   {
+      MMThreadGuard g(*pPostedErrorsLock_);
+
+      if(0 < postedErrors_.size())
+      {
+         std::pair< int, std::string>  toThrow(postedErrors_[0]);
+         // todo, process the collection of posted errors.
+         postedErrors_.clear();
+         throw CMMError( toThrow.second.c_str(), toThrow.first);
+      
+      }
+   }
+
+   unsigned char* pBuf = const_cast<unsigned char*>(cbuf_->GetTopImage());
+   if (pBuf != 0)
+      return pBuf;
+   else
+   {
+      logError("CMMCore::getLastImage", getCoreErrorText(MMERR_CircularBufferEmpty).c_str());
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+   }
+}
+
+void* CMMCore::getLastImageMD(unsigned channel, unsigned slice, Metadata& md) const throw (CMMError)
+{
+   const ImgBuffer* pBuf = cbuf_->GetTopImageBuffer(channel, slice);
+   if (pBuf != 0)
+   {
+      md = pBuf->GetMetadata();
+      return const_cast<unsigned char*>(pBuf->GetPixels());
+   }
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Returns a pointer to the pixels of the image that was last inserted into the circular buffer
+ * Also provides all metadata associated with that image
+ */
+void* CMMCore::getLastImageMD(Metadata& md) const throw (CMMError)
+{
+   return getLastImageMD(0, 0, md);
+}
+
+/**
+ * Returns a pointer to the pixels of the image that was inserted n images ago 
+ * Also provides all metadata associated with that image
+ * Images already removed with popNextImages() are no longer available here,
+ * except the most recent one.
+ */
+void* CMMCore::getNBeforeLastImageMD(unsigned long n, Metadata& md) const throw (CMMError)
+{
+   const ImgBuffer* pBuf = cbuf_->GetNthFromTopImageBuffer(n);
+   if (pBuf != 0)
+   {
+      md = pBuf->GetMetadata();
+      return const_cast<unsigned char*>(pBuf->GetPixels());
+   }
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Gets and removes the next image from the circular buffer.
+ * Returns 0 if the buffer is empty.
+ * The pixels may be overwritten once the camera wraps around the buffer; with
+ * circular buffer compression enabled they are only valid until the next pop.
+ */
+void* CMMCore::popNextImage() throw (CMMError)
+{
+   unsigned char* pBuf;
+   if (compressedTier_)
+   {
+      const ImgBuffer* img;
+      try
+      {
+         img = compressedTier_->PopNextImageBuffer();
+      }
+      catch (CMMError& err)
+      {
+         logError("MMCore::popNextImage", err.getMsg().c_str());
+         throw;
+      }
+      traceFramePopped(img);
+      pBuf = img ? const_cast<unsigned char*>(img->GetPixels()) : 0;
+   }
+   else if (latencyTracer_.IsEnabled())
+   {
+      // the metadata is needed for the trace
+      const ImgBuffer* img = cbuf_->GetNextImageBuffer(0, 0);
+      traceFramePopped(img);
+      pBuf = img ? const_cast<unsigned char*>(img->GetPixels()) : 0;
+   }
+   else
+      pBuf = const_cast<unsigned char*>(cbuf_->GetNextImage());
+   if (pBuf != 0)
+      return pBuf;
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+void* CMMCore::popNextImageMD(unsigned channel, unsigned slice, Metadata& md) throw (CMMError)
+{
+   const ImgBuffer* pBuf;
+   if (compressedTier_ && channel == 0 && slice == 0)
+   {
+      try
+      {
+         pBuf = compressedTier_->PopNextImageBuffer();
+      }
+      catch (CMMError& err)
+      {
+         logError("MMCore::popNextImageMD", err.getMsg().c_str());
+         throw;
+      }
+   }
+   else
+      pBuf = cbuf_->GetNextImageBuffer(channel, slice);
+   traceFramePopped(pBuf);
+   if (pBuf != 0)
+   {
+      md = pBuf->GetMetadata();
+      return const_cast<unsigned char*>(pBuf->GetPixels());
+   }
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+void* CMMCore::popNextImageMD(Metadata& md) throw (CMMError)
+{
+   return popNextImageMD(0, 0, md);
+}
+
+/**
+ * Gets and removes up to maxCount frames from the circular buffer in a single
+ * call, oldest first. A frame from a multi-channel camera yields one
+ * descriptor per channel, in channel order.
+ *
+ * Unlike popNextImage(), the returned pixels are not overwritten by the
+ * camera when the buffer wraps around: each image is moved out of the buffer
+ * and stays valid until it is handed back with releaseImages(). Frames must
+ * be released, otherwise their memory is held until the core is destroyed.
+ * The most recent frame is copied rather than moved, so getLastImage()
+ * still returns it; older images are no longer available from
+ * getNBeforeLastImageMD().
+ *
+ * Returns an empty vector if no images are pending.
+ * @param maxCount  maximum number of frames to remove
+ */
+std::vector<FrameDescriptor> CMMCore::popNextImages(unsigned maxCount) throw (CMMError)
+{
+   // scope for the thread guard
+   {
+      MMThreadGuard g(*pPostedErrorsLock_);
+
+      if(0 < postedErrors_.size())
+      {
+         std::pair< int, std::string>  toThrow(postedErrors_[0]);
+         postedErrors_.clear();
+         throw CMMError( toThrow.second.c_str(), toThrow.first);
+      }
+   }
+
+   std::vector<FrameDescriptor> frames;
+   unsigned width, height, depth, channels;
+   cbuf_->GetImageGeometry(width, height, depth, channels);
+   unsigned long pending = compressedTier_ ?
+      compressedTier_->GetRemainingImageCount() : cbuf_->GetRemainingImageCount();
+   unsigned long count = std::min((unsigned long)maxCount, pending) * channels;
+   if (count == 0)
+      return frames;
+
+   // Gather empty buffers to swap into the circular buffer. Allocation
+   // happens here, outside of the circular buffer lock.
+   std::vector<ImgBuffer*> spares;
+   spares.reserve(count);
+   {
+      MMThreadGuard g(imageBatchLock_);
+      while (spares.size() < count && !imageBatchPool_.empty())
+      {
+         spares.push_back(imageBatchPool_.back());
+         imageBatchPool_.pop_back();
+      }
+   }
+   try
+   {
+      while (spares.size() < count)
+         spares.push_back(new ImgBuffer(width, height, depth));
+   }
+   catch (std::bad_alloc&)
+   {
+      MMThreadGuard g(imageBatchLock_);
+      imageBatchPool_.insert(imageBatchPool_.end(), spares.begin(), spares.end());
+      throw CMMError(getCoreErrorText(MMERR_OutOfMemory).c_str(), MMERR_OutOfMemory);
+   }
+
+   unsigned long detached;
+   try
+   {
+      detached = compressedTier_ ?
+         compressedTier_->DetachNextImageBuffers(spares) : cbuf_->DetachNextImageBuffers(spares);
+   }
+   catch (CMMError& err)
+   {
+      logError("MMCore::popNextImages", err.getMsg().c_str());
+      MMThreadGuard g(imageBatchLock_);
+      imageBatchPool_.insert(imageBatchPool_.end(), spares.begin(), spares.end());
+      throw;
+   }
+
+   frames.reserve(detached);
+   MMThreadGuard g(imageBatchLock_);
+   for (unsigned long i = 0; i < detached; i++)
+   {
+      ImgBuffer* img = spares[i];
+      traceFramePopped(img);
+      frames.push_back(FrameDescriptor(img->GetPixels(), img->Width(),
+               img->Height(), img->Depth(), &img->GetMetadata()));
+      imageBatchesOut_[img->GetPixels()] = img;
+   }
+   imageBatchPool_.insert(imageBatchPool_.end(), spares.begin() + detached, spares.end());
+
+   return frames;
+}
+
+/**
+ * Returns images obtained from popNextImages() to the core for reuse.
+ * The pixel and metadata pointers of the released descriptors must not be
+ * used afterwards. Descriptors that are not outstanding are ignored.
+ */
+void CMMCore::releaseImages(const std::vector<FrameDescriptor>& frames)
+{
+   MMThreadGuard g(imageBatchLock_);
+   for (std::vector<FrameDescriptor>::const_iterator it = frames.begin();
+         it != frames.end(); ++it)
+   {
+      std::map<const void*, ImgBuffer*>::iterator found =
+         imageBatchesOut_.find(it->getPixels());
+      if (found == imageBatchesOut_.end())
+         continue;
+      imageBatchPool_.push_back(found->second);
+      imageBatchesOut_.erase(found);
+   }
+}
+
+namespace {
+
+// Deleter for the shared pin of a FrameHandle: unpins the slot when the last
+// handle referring to it goes away. Holds a reference to the buffer, so that
+// handles stay valid after the core has released or replaced it.
+class SlotUnpinner
+{
+public:
+   SlotUnpinner(boost::shared_ptr<CircularBuffer> cbuf, unsigned long slot) :
+      cbuf_(cbuf), slot_(slot)
+   {}
+   void operator()(void*) { cbuf_->UnpinImageBuffer(slot_); }
+
+private:
+   boost::shared_ptr<CircularBuffer> cbuf_;
+   unsigned long slot_;
+};
+
+} // anonymous namespace
+
+/**
+ * Returns a handle to the image that was last inserted into the circular
+ * buffer, without copying it.
+ *
+ * The image stays in the buffer and can be read in place for as long as the
+ * handle (or any copy of it) exists; the camera will not overwrite it in the
+ * meantime. Release handles promptly: while a slot is pinned, frames that
+ * would be stored in it are dropped (see getPinnedFrameOverrunCount()).
+ */
+FrameHandle CMMCore::getLastImageHandle() throw (CMMError)
+{
+   // scope for the thread guard
+   {
+      MMThreadGuard g(*pPostedErrorsLock_);
+
+      if(0 < postedErrors_.size())
+      {
+         std::pair< int, std::string>  toThrow(postedErrors_[0]);
+         postedErrors_.clear();
+         throw CMMError( toThrow.second.c_str(), toThrow.first);
+      }
+   }
+
+   unsigned long slot;
+   const ImgBuffer* pBuf = cbuf_->PinTopImageBuffer(slot);
+   if (pBuf == 0)
+   {
+      logError("CMMCore::getLastImageHandle", getCoreErrorText(MMERR_CircularBufferEmpty).c_str());
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+   }
+
+   try
+   {
+      boost::shared_ptr<void> pin(cbuf_.get(), SlotUnpinner(cbuf_, slot));
+      return FrameHandle(pBuf, pin);
+   }
+   catch (std::bad_alloc&)
+   {
+      // shared_ptr invokes the deleter itself if it fails to allocate
+      throw CMMError(getCoreErrorText(MMERR_OutOfMemory).c_str(), MMERR_OutOfMemory);
+   }
+}
+
+/**
+ * Returns the number of frames that were dropped since the circular buffer
+ * was allocated because the slot they would have been stored in was pinned
+ * by a FrameHandle.
+ */
+long CMMCore::getPinnedFrameOverrunCount()
+{
+   if (cbuf_)
+   {
+      return cbuf_->GetPinnedOverrunCount();
+   }
+   return 0;
+}
+
+/**
+ * Gets the last image from the buffer of the specified camera.
+ * Cameras without their own buffer share the default circular buffer.
+ * @param cameraLabel   the camera label
+ */
+void* CMMCore::getLastImage(const char* cameraLabel) throw (CMMError)
+{
+   CircularBuffer* cbuf = getCameraBuffer(cameraLabel);
+   unsigned char* pBuf = const_cast<unsigned char*>(cbuf->GetTopImage());
+   if (pBuf != 0)
+      return pBuf;
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Gets and removes the next image from the buffer of the specified camera.
+ * @param cameraLabel   the camera label
+ */
+void* CMMCore::popNextImage(const char* cameraLabel) throw (CMMError)
+{
+   CircularBuffer* cbuf = getCameraBuffer(cameraLabel);
+   unsigned char* pBuf;
+   if (latencyTracer_.IsEnabled())
+   {
+      const ImgBuffer* img = cbuf->GetNextImageBuffer(0, 0);
+      traceFramePopped(img);
+      pBuf = img ? const_cast<unsigned char*>(img->GetPixels()) : 0;
+   }
+   else
+      pBuf = const_cast<unsigned char*>(cbuf->GetNextImage());
+   if (pBuf != 0)
+      return pBuf;
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Gets and removes the next image, with its metadata, from the buffer of the
+ * specified camera.
+ * @param cameraLabel   the camera label
+ */
+void* CMMCore::popNextImageMD(const char* cameraLabel, Metadata& md) throw (CMMError)
+{
+   CircularBuffer* cbuf = getCameraBuffer(cameraLabel);
+   const ImgBuffer* pBuf = cbuf->GetNextImageBuffer(0, 0);
+   traceFramePopped(pBuf);
+   if (pBuf != 0)
+   {
+      md = pBuf->GetMetadata();
+      return const_cast<unsigned char*>(pBuf->GetPixels());
+   }
+   else
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+}
+
+/**
+ * Returns the number of images waiting in the buffer of the specified camera.
+ * @param cameraLabel   the camera label
+ */
+long CMMCore::getRemainingImageCount(const char* cameraLabel) throw (CMMError)
+{
+   return getCameraBuffer(cameraLabel)->GetRemainingImageCount();
+}
+
+/**
+ * Sets the total amount of memory that per-camera buffers may use.
+ * The pool can not be made smaller than the memory already assigned to
+ * existing camera buffers.
+ * @param sizeMB   pool size in megabytes
+ */
+void CMMCore::setCameraBufferPoolMemoryFootprint(unsigned sizeMB) throw (CMMError)
+{
+   MMThreadGuard g(cameraBuffersLock_);
+
+   unsigned used = 0;
+   for (std::map<std::string, CircularBuffer*>::const_iterator it = cameraBuffers_.begin();
+         it != cameraBuffers_.end(); ++it)
+      used += it->second->GetMemorySizeMB();
+
+   if (sizeMB < used)
+      throw CMMError(getCoreErrorText(MMERR_CameraBufferPoolExhausted).c_str(), MMERR_CameraBufferPoolExhausted);
+
+   cameraBufferPoolMB_ = sizeMB;
+   LOG_DEBUG(coreLogger_) << "Camera buffer pool set to " << sizeMB << " MB (" <<
+      used << " MB in use)";
+}
+
+unsigned CMMCore::getCameraBufferPoolMemoryFootprint()
+{
+   MMThreadGuard g(cameraBuffersLock_);
+   return cameraBufferPoolMB_;
+}
+
+/**
+ * Returns the amount of pool memory not yet assigned to a camera buffer.
+ */
+unsigned CMMCore::getCameraBufferPoolFreeMemory()
+{
+   MMThreadGuard g(cameraBuffersLock_);
+
+   unsigned used = 0;
+   for (std::map<std::string, CircularBuffer*>::const_iterator it = cameraBuffers_.begin();
+         it != cameraBuffers_.end(); ++it)
+      used += it->second->GetMemorySizeMB();
+   return used < cameraBufferPoolMB_ ? cameraBufferPoolMB_ - used : 0;
+}
+
+/**
+ * Gives a camera its own buffer, so that it can stream at the same time as
+ * other cameras with independent image geometry. The memory is taken from
+ * the camera buffer pool (see setCameraBufferPoolMemoryFootprint()).
+ * An existing buffer for the camera is replaced.
+ *
+ * Images from the camera are then retrieved with the label-taking variants
+ * of getLastImage(), popNextImage() and popNextImageMD().
+ * @param cameraLabel   the camera label
+ * @param sizeMB        buffer size in megabytes
+ */
+void CMMCore::createCameraBuffer(const char* cameraLabel, unsigned sizeMB) throw (CMMError)
+{
+   boost::shared_ptr<CameraInstance> pCam =
+      deviceManager_.GetDeviceOfType<CameraInstance>(cameraLabel);
+   {
+      mm::DeviceModuleLockGuard guard(pCam);
+      if (pCam->IsCapturing())
+         throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                        MMERR_NotAllowedDuringSequenceAcquisition);
+   }
+
+   MMThreadGuard g(cameraBuffersLock_);
+
+   unsigned used = 0;
+   CircularBuffer* old = 0;
+   for (std::map<std::string, CircularBuffer*>::const_iterator it = cameraBuffers_.begin();
+         it != cameraBuffers_.end(); ++it)
+   {
+      if (it->first == cameraLabel)
+         old = it->second;
+      else
+         used += it->second->GetMemorySizeMB();
+   }
+
+   if (used + sizeMB > cameraBufferPoolMB_)
+      throw CMMError(getCoreErrorText(MMERR_CameraBufferPoolExhausted).c_str(), MMERR_CameraBufferPoolExhausted);
+   if (old && old->GetPinnedCount() > 0)
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferPinned).c_str(), MMERR_CircularBufferPinned);
+
+   CircularBuffer* cbuf;
+   try
+   {
+      cbuf = new CircularBuffer(sizeMB);
+   }
+   catch (bad_alloc& ex)
+   {
+      ostringstream messs;
+      messs << getCoreErrorText(MMERR_OutOfMemory).c_str() << " " << ex.what() << endl;
+      throw CMMError(messs.str().c_str() , MMERR_OutOfMemory);
+   }
+   cbuf->EnableFrameStatistics(frameStatisticsEnabled_);
+   cameraBuffers_[cameraLabel] = cbuf;
+   cbuf_->SetCameraRoute(cameraLabel, cbuf);
+   delete old;
+
+   LOG_DEBUG(coreLogger_) << "Created " << sizeMB << " MB buffer for camera " <<
+      cameraLabel;
+}
+
+/**
+ * Releases the buffer of a camera; the camera goes back to using the default
+ * circular buffer.
+ * @param cameraLabel   the camera label
+ */
+void CMMCore::removeCameraBuffer(const char* cameraLabel) throw (CMMError)
+{
+   boost::shared_ptr<CameraInstance> pCam =
+      deviceManager_.GetDeviceOfType<CameraInstance>(cameraLabel);
+   {
+      mm::DeviceModuleLockGuard guard(pCam);
+      if (pCam->IsCapturing())
+         throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                        MMERR_NotAllowedDuringSequenceAcquisition);
+   }
+
+   MMThreadGuard g(cameraBuffersLock_);
+   std::map<std::string, CircularBuffer*>::iterator it = cameraBuffers_.find(cameraLabel);
+   if (it == cameraBuffers_.end())
+      return;
+   if (it->second->GetPinnedCount() > 0)
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferPinned).c_str(), MMERR_CircularBufferPinned);
+
+   cbuf_->SetCameraRoute(cameraLabel, 0);
+   delete it->second;
+   cameraBuffers_.erase(it);
+   LOG_DEBUG(coreLogger_) << "Removed buffer for camera " << cameraLabel;
+}
+
+bool CMMCore::hasCameraBuffer(const char* cameraLabel)
+{
+   MMThreadGuard g(cameraBuffersLock_);
+   return cameraBuffers_.find(cameraLabel) != cameraBuffers_.end();
+}
+
+/**
+ * Initializes the buffer of a camera from the camera's current settings.
+ * @param cameraLabel   the camera label
+ */
+void CMMCore::initializeCameraBuffer(const char* cameraLabel) throw (CMMError)
+{
+   boost::shared_ptr<CameraInstance> pCam =
+      deviceManager_.GetDeviceOfType<CameraInstance>(cameraLabel);
+   CircularBuffer* cbuf = getCameraBuffer(cameraLabel);
+   if (cbuf == cbuf_.get())
+      throw CMMError(getCoreErrorText(MMERR_NoCameraBuffer).c_str(), MMERR_NoCameraBuffer);
+
+   try
+   {
+      mm::DeviceModuleLockGuard guard(pCam);
+      initializeBufferForCamera(cbuf, pCam);
+      cbuf->Clear();
+   }
+   catch (bad_alloc& ex)
+   {
+      ostringstream messs;
+      messs << getCoreErrorText(MMERR_OutOfMemory).c_str() << " " << ex.what() << endl;
+      throw CMMError(messs.str().c_str() , MMERR_OutOfMemory);
+   }
+   LOG_DEBUG(coreLogger_) << "Buffer for camera " << cameraLabel << " initialized";
+}
+
+/**
+ * Returns the buffer images from the given camera are inserted into: the
+ * camera's own buffer if it has one, otherwise the default circular buffer.
+ * The insert path matches the same table: cbuf_ forwards images to the buffer
+ * routed to their "Camera" metadata tag (see CircularBuffer::SetCameraRoute()).
+ */
+CircularBuffer* CMMCore::getCircularBufferForCamera(const std::string& label)
+{
+   MMThreadGuard g(cameraBuffersLock_);
+   std::map<std::string, CircularBuffer*>::const_iterator it = cameraBuffers_.find(label);
+   if (it != cameraBuffers_.end())
+      return it->second;
+   return cbuf_.get();
+}
+
+CircularBuffer* CMMCore::getCameraBuffer(const char* cameraLabel) throw (CMMError)
+{
+   CheckDeviceLabel(cameraLabel);
+   // validates that the device exists and is a camera
+   deviceManager_.GetDeviceOfType<CameraInstance>(cameraLabel);
+   return getCircularBufferForCamera(cameraLabel);
+}
+
+// Sets up a buffer for the camera's current image geometry. The buffer
+// refuses to reallocate its slots while frame handles pin any of them.
+void CMMCore::initializeBufferForCamera(CircularBuffer* cbuf,
+      boost::shared_ptr<CameraInstance> camera) throw (CMMError)
+{
+   cbuf->SetBitDepth(camera->GetBitDepth());
+   if (!cbuf->Initialize(camera->GetNumberOfChannels(), 1, camera->GetImageWidth(), camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
+   {
+      int code = cbuf->GetPinnedCount() > 0 ?
+         MMERR_CircularBufferPinned : MMERR_CircularBufferFailedToInitialize;
+      logError(getDeviceName(camera).c_str(), getCoreErrorText(code).c_str());
+      throw CMMError(getCoreErrorText(code).c_str(), code);
+   }
+}
+
+/**
+ * Removes all images from the circular buffer
+ * It will rarely be needed to call this directly since starting a sequence
+ * acquisition will call this function.  However, clearig the circular buffer
+ * before requesting images from it can help avoid showing stale images
+ */
+void CMMCore::clearCircularBuffer() throw (CMMError)
+{
+   cbuf_->Clear();
+   if (compressedTier_)
+      compressedTier_->Clear();
+}
+
+/**
+ * Adds a compressed tier behind the circular buffer.
+ * A background thread compresses all but the newest keepNewest unread images
+ * and moves them out of the circular buffer, so that the buffer holds
+ * several times more images for the same memory. Images are decompressed
+ * when popped; getLastImage() is unaffected.
+ * Intended for single-channel cameras.
+ *
+ * While compression is enabled, the pointer returned by popNextImage() and
+ * popNextImageMD() may point to a buffer owned by the tier, and is only valid
+ * until the next pop; copy the pixels before popping again, or use
+ * popNextImages(), whose images stay valid until released.
+ * @param keepNewest  number of newest images left uncompressed; at least 1,
+ *                    so that the image getLastImage() returns stays in place
+ * @param sizeMB      memory available for compressed images
+ */
+void CMMCore::enableCircularBufferCompression(unsigned keepNewest, unsigned sizeMB) throw (CMMError)
+{
+   if (isSequenceRunning())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+   if (keepNewest < 1)
+      throw CMMError("Circular buffer compression must keep at least the newest image uncompressed",
+                     MMERR_InvalidCoreValue);
 
-   // scope for the thread guard
+   delete compressedTier_;
+   compressedTier_ = 0;
+   try
    {
-      MMThreadGuard g(*pPostedErrorsLock_);
-
-      if(0 < postedErrors_.size())
-      {
-         std::pair< int, std::string>  toThrow(postedErrors_[0]);
-         // todo, process the collection of posted errors.
-         postedErrors_.clear();
-         throw CMMError( toThrow.second.c_str(), toThrow.first);
-      
-      }
+      compressedTier_ = new CompressedFrameTier(cbuf_.get(), keepNewest,
+            (unsigned long)sizeMB * 1024 * 1024);
    }
-
-   unsigned char* pBuf = const_cast<unsigned char*>(cbuf_->GetTopImage());
-   if (pBuf != 0)
-      return pBuf;
-   else
+   catch (bad_alloc& ex)
    {
-      logError("CMMCore::getLastImage", getCoreErrorText(MMERR_CircularBufferEmpty).c_str());
-      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+      ostringstream messs;
+      messs << getCoreErrorText(MMERR_OutOfMemory).c_str() << " " << ex.what() << endl;
+      throw CMMError(messs.str().c_str() , MMERR_OutOfMemory);
    }
+   LOG_DEBUG(coreLogger_) << "Enabled circular buffer compression (" << sizeMB <<
+      " MB, newest " << keepNewest << " images uncompressed)";
 }
 
-void* CMMCore::getLastImageMD(unsigned channel, unsigned slice, Metadata& md) const throw (CMMError)
+/**
+ * Removes the compressed tier. Images held compressed are discarded.
+ */
+void CMMCore::disableCircularBufferCompression() throw (CMMError)
 {
-   const ImgBuffer* pBuf = cbuf_->GetTopImageBuffer(channel, slice);
-   if (pBuf != 0)
+   if (isSequenceRunning())
+      throw CMMError(getCoreErrorText(MMERR_NotAllowedDuringSequenceAcquisition).c_str(),
+                     MMERR_NotAllowedDuringSequenceAcquisition);
+
+   if (compressedTier_ && compressedTier_->GetFrameCount() > 0)
+      LOG_WARNING(coreLogger_) << "Discarding " << compressedTier_->GetFrameCount() <<
+         " compressed images";
+   delete compressedTier_;
+   compressedTier_ = 0;
+}
+
+bool CMMCore::isCircularBufferCompressionEnabled()
+{
+   return compressedTier_ != 0;
+}
+
+/**
+ * Returns the number of unread images currently held in compressed form.
+ */
+long CMMCore::getCompressedImageCount()
+{
+   if (compressedTier_)
    {
-      md = pBuf->GetMetadata();
-      return const_cast<unsigned char*>(pBuf->GetPixels());
+      return compressedTier_->GetFrameCount();
    }
-   else
-      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+   return 0;
 }
 
 /**
- * Returns a pointer to the pixels of the image that was last inserted into the circular buffer
- * Also provides all metadata associated with that image
+ * Turns on or off the computation of pixel statistics for every inserted
+ * image. When on, the minimum, maximum, mean and standard deviation of 8 and
+ * 16 bit images are added to the image metadata
+ * (MM::g_Keyword_Metadata_Stats_*), so that display clients can scale
+ * images without reading the pixels. The histogram of the most recent image
+ * is available from getLastImageHistogram().
  */
-void* CMMCore::getLastImageMD(Metadata& md) const throw (CMMError)
+void CMMCore::enableFrameStatistics(bool enable)
 {
-   return getLastImageMD(0, 0, md);
+   frameStatisticsEnabled_ = enable;
+   cbuf_->EnableFrameStatistics(enable);
+
+   MMThreadGuard g(cameraBuffersLock_);
+   for (std::map<std::string, CircularBuffer*>::iterator it = cameraBuffers_.begin();
+         it != cameraBuffers_.end(); ++it)
+      it->second->EnableFrameStatistics(enable);
+
+   LOG_DEBUG(coreLogger_) << "Frame statistics " << (enable ? "enabled" : "disabled");
+}
+
+bool CMMCore::isFrameStatisticsEnabled()
+{
+   return frameStatisticsEnabled_;
 }
 
 /**
- * Returns a pointer to the pixels of the image that was inserted n images ago 
- * Also provides all metadata associated with that image
+ * Returns the 256-bin histogram of the most recent image in the circular
+ * buffer. 16 bit images are binned over the camera's bit depth; the number
+ * of values per bin is in the MM::g_Keyword_Metadata_Stats_HistogramBinWidth
+ * metadata tag of the image.
+ * Requires frame statistics to be enabled (see enableFrameStatistics()).
  */
-void* CMMCore::getNBeforeLastImageMD(unsigned long n, Metadata& md) const throw (CMMError)
+std::vector<long> CMMCore::getLastImageHistogram() throw (CMMError)
 {
-   const ImgBuffer* pBuf = cbuf_->GetNthFromTopImageBuffer(n);
-   if (pBuf != 0)
-   {
-      md = pBuf->GetMetadata();
-      return const_cast<unsigned char*>(pBuf->GetPixels());
-   }
-   else
+   std::vector<unsigned long> bins;
+   unsigned binWidth;
+   if (!cbuf_->GetLastHistogram(bins, binWidth))
       throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+   return std::vector<long>(bins.begin(), bins.end());
 }
 
 /**
- * Gets and removes the next image from the circular buffer.
- * Returns 0 if the buffer is empty.
+ * Starts or stops recording the acquisition latency of every popped image.
+ * Cameras report the stages an image went through as trace metadata
+ * (MM::g_Keyword_Metadata_Trace_*); the core adds the time it was popped.
+ * The most recent images are kept, older ones are overwritten.
  */
-void* CMMCore::popNextImage() throw (CMMError)
+void CMMCore::enableAcquisitionLatencyTracing(bool enable)
 {
-   unsigned char* pBuf = const_cast<unsigned char*>(cbuf_->GetNextImage());
-   if (pBuf != 0)
-      return pBuf;
-   else
-      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+   latencyTracer_.Enable(enable);
+   LOG_DEBUG(coreLogger_) << "Acquisition latency tracing " << (enable ? "enabled" : "disabled");
 }
 
-void* CMMCore::popNextImageMD(unsigned channel, unsigned slice, Metadata& md) throw (CMMError)
+bool CMMCore::isAcquisitionLatencyTracingEnabled()
 {
-   const ImgBuffer* pBuf = cbuf_->GetNextImageBuffer(channel, slice);
-   if (pBuf != 0)
-   {
-      md = pBuf->GetMetadata();
-      return const_cast<unsigned char*>(pBuf->GetPixels());
-   }
-   else
-      throw CMMError(getCoreErrorText(MMERR_CircularBufferEmpty).c_str(), MMERR_CircularBufferEmpty);
+   return latencyTracer_.IsEnabled();
 }
 
-void* CMMCore::popNextImageMD(Metadata& md) throw (CMMError)
+/**
+ * Discards all recorded latency traces.
+ */
+void CMMCore::clearAcquisitionLatencyTrace()
 {
-   return popNextImageMD(0, 0, md);
+   latencyTracer_.Clear();
 }
 
 /**
- * Removes all images from the circular buffer
- * It will rarely be needed to call this directly since starting a sequence
- * acquisition will call this function.  However, clearig the circular buffer
- * before requesting images from it can help avoid showing stale images
+ * Returns the latency of each acquisition stage over the recorded images
+ * as a text table of percentiles, in microseconds, with a histogram of the
+ * end-to-end latency.
  */
-void CMMCore::clearCircularBuffer() throw (CMMError)
+std::string CMMCore::getAcquisitionLatencyStats()
 {
-   cbuf_->Clear();
+   return latencyTracer_.GetStatsReport();
+}
+
+/**
+ * Saves the recorded latency traces in the Chrome trace event format, which
+ * can be opened in chrome://tracing or Perfetto.
+ * @param fileName   the output file
+ */
+void CMMCore::saveAcquisitionLatencyTrace(const char* fileName) throw (CMMError)
+{
+   if (!fileName)
+      throw CMMError("Null filename");
+
+   ofstream os;
+   os.open(fileName, ios_base::out | ios_base::trunc);
+   if (!os.is_open())
+   {
+      logError(fileName, getCoreErrorText(MMERR_FileOpenFailed).c_str());
+      throw CMMError(ToQuotedString(fileName) + ": " + getCoreErrorText(MMERR_FileOpenFailed),
+            MMERR_FileOpenFailed);
+   }
+   os << latencyTracer_.GetChromeTraceJSON();
+}
+
+// Records the latency trace of an image that is being popped.
+void CMMCore::traceFramePopped(const ImgBuffer* img)
+{
+   if (img == 0 || !latencyTracer_.IsEnabled())
+      return;
+   MM::MMTime now = GetMMTimeNow();
+   latencyTracer_.RecordFrame(img->GetMetadata(), (long long)now.sec_ * 1000000 + now.uSec_);
 }
 
 /**
@@ -2756,12 +4024,26 @@ void CMMCore::clearCircularBuffer() throw (CMMError)
 void CMMCore::setCircularBufferMemoryFootprint(unsigned sizeMB ///< n megabytes
                                                ) throw (CMMError)
 {
-   delete cbuf_; // discard old buffer
+   if (cbuf_ && cbuf_->GetPinnedCount() > 0)
+      throw CMMError(getCoreErrorText(MMERR_CircularBufferPinned).c_str(), MMERR_CircularBufferPinned);
+
+   // the compression tier refers to the buffer; rebuild it afterwards
+   unsigned keepNewest = 0;
+   unsigned long compressedBytes = 0;
+   if (compressedTier_)
+   {
+      keepNewest = compressedTier_->GetKeepNewest();
+      compressedBytes = compressedTier_->GetBudgetBytes();
+      delete compressedTier_;
+      compressedTier_ = 0;
+   }
+
+   cbuf_.reset(); // discard old buffer
    LOG_DEBUG(coreLogger_) << "Will set circular buffer size to " <<
       sizeMB << " MB";
 	try
 	{
-		cbuf_ = new CircularBuffer(sizeMB);
+		cbuf_.reset(new CircularBuffer(sizeMB));
 	}
 	catch(bad_alloc& ex)
 	{
@@ -2770,7 +4052,14 @@ void CMMCore::setCircularBufferMemoryFootprint(unsigned sizeMB ///< n megabytes
 		messs << getCoreErrorText(MMERR_OutOfMemory).c_str() << " " << ex.what() << endl;
 		throw CMMError(messs.str().c_str() , MMERR_OutOfMemory);
 	}
-	if (NULL == cbuf_) throw CMMError(getCoreErrorText(MMERR_OutOfMemory).c_str(), MMERR_OutOfMemory);
+	if (!cbuf_) throw CMMError(getCoreErrorText(MMERR_OutOfMemory).c_str(), MMERR_OutOfMemory);
+   cbuf_->EnableFrameStatistics(frameStatisticsEnabled_);
+   {
+      MMThreadGuard g(cameraBuffersLock_);
+      for (std::map<std::string, CircularBuffer*>::const_iterator it = cameraBuffers_.begin();
+            it != cameraBuffers_.end(); ++it)
+         cbuf_->SetCameraRoute(it->first, it->second);
+   }
 
 
 	try
@@ -2781,10 +4070,12 @@ void CMMCore::setCircularBufferMemoryFootprint(unsigned sizeMB ///< n megabytes
       if (camera)
 		{
          mm::DeviceModuleLockGuard guard(camera);
-         if (!cbuf_->Initialize(camera->GetNumberOfChannels(), 1, camera->GetImageWidth(), camera->GetImageHeight(), camera->GetImageBytesPerPixel()))
-				throw CMMError(getCoreErrorText(MMERR_CircularBufferFailedToInitialize).c_str(), MMERR_CircularBufferFailedToInitialize);
+         initializeBufferForCamera(cbuf_.get(), camera);
 		}
 
+      if (compressedBytes > 0)
+         compressedTier_ = new CompressedFrameTier(cbuf_.get(), keepNewest, compressedBytes);
+
       LOG_DEBUG(coreLogger_) << "Did set circular buffer size to " <<
          sizeMB << " MB";
 	}
@@ -2794,7 +4085,7 @@ void CMMCore::setCircularBufferMemoryFootprint(unsigned sizeMB ///< n megabytes
 		messs << getCoreErrorText(MMERR_OutOfMemory).c_str() << " " << ex.what() << endl;
 		throw CMMError(messs.str().c_str() , MMERR_OutOfMemory);
 	}
-	if (NULL == cbuf_)
+	if (!cbuf_)
       throw CMMError(getCoreErrorText(MMERR_OutOfMemory).c_str(), MMERR_OutOfMemory);
 }
 
@@ -2809,6 +4100,10 @@ unsigned CMMCore::getCircularBufferMemoryFootprint()
 
 long CMMCore::getRemainingImageCount()
 {
+   if (compressedTier_)
+   {
+      return compressedTier_->GetRemainingImageCount();
+   }
    if (cbuf_)
    {
       return cbuf_->GetRemainingImageCount();
@@ -3320,15 +4615,31 @@ string CMMCore::getPropertyFromCache(const char* label, const char* propName) co
    CheckDeviceLabel(label);
    CheckPropertyName(propName);
 
-   {
-      MMThreadGuard scg(stateCacheLock_);
-      if (!stateCache_.isPropertyIncluded(label, propName))
-         throw CMMError("Property " + ToQuotedString(propName) + " of device " +
-               ToQuotedString(label) + " not found in cache",
-               MMERR_PropertyNotInCache);
-      PropertySetting s = stateCache_.getSetting(label, propName);
-      return s.getPropertyValue();
-   }
+   std::string value;
+   if (!stateCache_.GetValue(label, propName, value))
+      throw CMMError("Property " + ToQuotedString(propName) + " of device " +
+            ToQuotedString(label) + " not found in cache",
+            MMERR_PropertyNotInCache);
+   return value;
+}
+
+/**
+ * Returns how many times the cached value of the property has been updated,
+ * either by the core or by the device itself. Comparing the result of two
+ * calls tells whether the value changed in between without reading it.
+ *
+ * @return the update count, 0 if the property is not in the cache
+ * @param label       the device label
+ * @param propName    the property name
+ */
+unsigned long CMMCore::getPropertyCacheGeneration(const char* label, const char* propName) const throw (CMMError)
+{
+   if (IsCoreDeviceLabel(label))
+      return 0;
+   CheckDeviceLabel(label);
+   CheckPropertyName(propName);
+
+   return stateCache_.GetGeneration(label, propName);
 }
 
 /**
@@ -3366,6 +4677,7 @@ void CMMCore::setProperty(const char* label, const char* propName,
       mm::DeviceModuleLockGuard guard(pDevice);
 
       pDevice->SetProperty(propName, propValue);
+      propertyValueCache_.Invalidate(label, propName);
 
       {
          MMThreadGuard scg(stateCacheLock_);
@@ -3478,6 +4790,56 @@ bool CMMCore::isPropertyPreInit(const char* label, const char* propName) throw (
    return pDevice->GetPropertyInitStatus(propName);
 }
 
+/**
+ * Marks a property as static or volatile for system state snapshots.
+ * The value of a static property is read from the device once and then
+ * served from a cache until it is set through the core, or the device is
+ * initialized or unloaded. Use this for properties that never change by
+ * themselves; by default only pre-init properties are static. Properties
+ * explicitly marked volatile are the ones refreshed by
+ * updateVolatileStateCache().
+ *
+ * @param label      the device label
+ * @param propName   the property name
+ * @param isStatic   true for static, false for volatile
+ */
+void CMMCore::setPropertyStatic(const char* label, const char* propName, bool isStatic) throw (CMMError)
+{
+   if (IsCoreDeviceLabel(label))
+      return;
+   boost::shared_ptr<DeviceInstance> pDevice = deviceManager_.GetDevice(label);
+   CheckPropertyName(propName);
+
+   propertyValueCache_.SetHint(label, propName,
+         isStatic ? PropertyValueCache::Static : PropertyValueCache::Volatile);
+}
+
+/**
+ * Tells whether getSystemState() may serve the property from the cache.
+ *
+ * @param label      the device label
+ * @param propName   the property name
+ */
+bool CMMCore::isPropertyStatic(const char* label, const char* propName) throw (CMMError)
+{
+   if (IsCoreDeviceLabel(label))
+      return false;
+   boost::shared_ptr<DeviceInstance> pDevice = deviceManager_.GetDevice(label);
+   CheckPropertyName(propName);
+
+   mm::DeviceModuleLockGuard guard(pDevice);
+   return propertyValueCache_.IsStatic(label, propName, pDevice->GetPropertyInitStatus(propName));
+}
+
+/**
+ * Drops all cached static property values, so that the next system state
+ * snapshot reads every property from the devices.
+ */
+void CMMCore::clearPropertyValueCache()
+{
+   propertyValueCache_.InvalidateAll();
+}
+
 /**
  * Returns the property lower limit value, if the property has limits - 0 otherwise.
  */
@@ -4639,7 +6001,6 @@ string CMMCore::getCurrentPixelSizeConfig(bool cached) throw (CMMError)
 				}
 				else
 				{
-               MMThreadGuard scg(stateCacheLock_);
                value = stateCache_.getSetting(cs.getDeviceLabel().c_str(), cs.getPropertyName().c_str()).getPropertyValue();
 				}
                PropertySetting ss(cs.getDeviceLabel().c_str(), cs.getPropertyName().c_str(), value.c_str()); // state setting
@@ -6277,17 +7638,124 @@ bool CMMCore::IsCoreDeviceLabel(const char* label) const throw (CMMError)
    return (strcmp(label, MM::g_Keyword_CoreDevice) == 0);
 }
 
+namespace {
+
+// Settings of one device within a configuration
+struct DeviceSettingsBatch
+{
+   boost::shared_ptr<DeviceInstance> device;
+   std::vector<PropertySetting> settings;
+   std::vector<PropertySetting> applied;
+   std::vector<PropertySetting> failed;
+};
+
+// Applies the settings of a group of dependent devices, one device at a
+// time with a single module lock acquisition per device. Settings are put
+// in the known order first. A setting that fails is tried once more at
+// once, in case the failure was transient; if it fails again it is retried
+// after each later setting that succeeds, and when a retry succeeds it is
+// ordered after the one property that was set just before.
+class DeviceConfigTask : public ParallelTask
+{
+public:
+   DeviceConfigTask(PropertyOrder* order, boost::shared_ptr<mm::logging::Logger> logger) :
+      order_(order), logger_(logger)
+   {}
+
+   void AddBatch(DeviceSettingsBatch* batch) { batches_.push_back(batch); }
+
+   void Run()
+   {
+      for (size_t b=0; b<batches_.size(); b++)
+         Apply(*batches_[b]);
+   }
+
+private:
+   void Apply(DeviceSettingsBatch& batch)
+   {
+      std::string label = batch.device->GetLabel();
+      std::vector<PropertySetting> pending = batch.settings;
+      order_->Sort(label, pending);
+
+      mm::DeviceModuleLockGuard guard(batch.device);
+      std::vector<PropertySetting> blocked;
+      for (size_t i=0; i<pending.size(); i++)
+      {
+         if (!TrySet(batch, pending[i]) && !TrySet(batch, pending[i]))
+            blocked.push_back(pending[i]);
+         else
+            RetryBlocked(batch, label, pending[i].getPropertyName(), blocked);
+      }
+      batch.failed = blocked;
+   }
+
+   // Retries the blocked settings now that 'enabler' has been set. Each one
+   // that succeeds is ordered after 'enabler', and may unblock others.
+   void RetryBlocked(DeviceSettingsBatch& batch, const std::string& label,
+         const std::string& enabler, std::vector<PropertySetting>& blocked)
+   {
+      std::vector<std::string> enablers(1, enabler);
+      while (!enablers.empty() && !blocked.empty())
+      {
+         std::string first = enablers.back();
+         enablers.pop_back();
+         for (size_t k=0; k<blocked.size(); )
+         {
+            if (!TrySet(batch, blocked[k]))
+            {
+               k++;
+               continue;
+            }
+            std::string then = blocked[k].getPropertyName();
+            if (order_->Add(label, first, then, true))
+               LOG_DEBUG(logger_) << "Learned that " << label << "-" <<
+                  then << " is set after " << first;
+            blocked.erase(blocked.begin() + k);
+            enablers.push_back(then);
+         }
+      }
+   }
+
+   static bool TrySet(DeviceSettingsBatch& batch, const PropertySetting& setting)
+   {
+      try
+      {
+         batch.device->SetProperty(setting.getPropertyName(), setting.getPropertyValue());
+      }
+      catch (const CMMError&)
+      {
+         return false;
+      }
+      batch.applied.push_back(setting);
+      return true;
+   }
+
+   PropertyOrder* order_;
+   boost::shared_ptr<mm::logging::Logger> logger_;
+   std::vector<DeviceSettingsBatch*> batches_;
+};
+
+} // anonymous namespace
+
 /**
  * Set all properties in a configuration
- * Upon error, don't stop, but try to set all failed properties again
- * until all succees or no more change takes place
+ *
+ * Core properties are set first. Device settings are then grouped per
+ * device and sorted by the known property order (see
+ * definePropertyOrder()); each device is set up under one module lock, and
+ * devices that share neither an adapter module, a hub nor a port are set up
+ * in parallel. Settings a device rejects are retried on that device after
+ * each of its other settings that succeeds, and the order that worked is
+ * remembered for next time (see clearLearnedPropertyOrder()).
+ * Settings that still fail are retried across all devices, for dependencies
+ * between devices, until all succeed or no more change takes place.
  * If errors remain, throw an error 
  */
 void CMMCore::applyConfiguration(const Configuration& config) throw (CMMError)
 {
-   std::ostringstream sall;
-   bool error = false;
-   vector<PropertySetting> failedProps;
+   std::vector< boost::shared_ptr<DeviceInstance> > pDevices;
+   std::vector<DeviceSettingsBatch> batches;
+   std::map<std::string, size_t> batchOf;
    for (size_t i=0; i<config.size(); i++)
    {
       PropertySetting setting = config.getSetting(i);
@@ -6300,31 +7768,51 @@ void CMMCore::applyConfiguration(const Configuration& config) throw (CMMError)
             MMThreadGuard scg(stateCacheLock_);
             stateCache_.addSetting(PropertySetting(MM::g_Keyword_CoreDevice, setting.getPropertyName().c_str(), setting.getPropertyValue().c_str()));
          }
+         continue;
       }
-      else
+
+      // devices in order of first appearance in the configuration
+      std::map<std::string, size_t>::iterator it = batchOf.find(setting.getDeviceLabel());
+      if (it == batchOf.end())
       {
-         // normal processing
          boost::shared_ptr<DeviceInstance> pDevice =
             deviceManager_.GetDevice(setting.getDeviceLabel());
-         mm::DeviceModuleLockGuard guard(pDevice);
-         try
-         {
-            pDevice->SetProperty(setting.getPropertyName(),
-                  setting.getPropertyValue());
+         it = batchOf.insert(std::make_pair(setting.getDeviceLabel(), batches.size())).first;
+         pDevices.push_back(pDevice);
+         batches.push_back(DeviceSettingsBatch());
+         batches.back().device = pDevice;
+      }
+      batches[it->second].settings.push_back(setting);
+   }
+   if (batches.empty())
+      return;
 
-            {
-               MMThreadGuard scg(stateCacheLock_);
-               stateCache_.addSetting(setting);
-            }
-         }
-         catch (const CMMError&)
-         {
-            failedProps.push_back(setting);
-            error = true;
-         }
+   std::vector< std::vector<size_t> > groups = GroupDependentDevices(pDevices, true, true);
+   std::vector<DeviceConfigTask> tasks(groups.size(), DeviceConfigTask(&propertyOrder_, coreLogger_));
+   std::vector<ParallelTask*> runList;
+   for (size_t g=0; g<groups.size(); g++)
+   {
+      for (size_t j=0; j<groups[g].size(); j++)
+         tasks[g].AddBatch(&batches[groups[g][j]]);
+      runList.push_back(&tasks[g]);
+   }
+   ParallelTaskRunner runner(g_maxDeviceThreads);
+   runner.Run(runList);
+
+   vector<PropertySetting> failedProps;
+   for (size_t b=0; b<batches.size(); b++)
+   {
+      for (size_t i=0; i<batches[b].applied.size(); i++)
+      {
+         propertyValueCache_.Invalidate(batches[b].applied[i].getDeviceLabel(),
+               batches[b].applied[i].getPropertyName());
+         MMThreadGuard scg(stateCacheLock_);
+         stateCache_.addSetting(batches[b].applied[i]);
       }
+      failedProps.insert(failedProps.end(), batches[b].failed.begin(), batches[b].failed.end());
    }
-   if (error) 
+
+   if (!failedProps.empty()) 
    {
       string errorString;
       while (failedProps.size() > (unsigned) applyProperties(failedProps, errorString) )
@@ -6337,6 +7825,58 @@ void CMMCore::applyConfiguration(const Configuration& config) throw (CMMError)
    }
 }
 
+/**
+ * Requires a property of a device to be set after another one whenever
+ * both are in a configuration being applied, e.g. an input range that the
+ * device only accepts once its channel is enabled.
+ *
+ * applyConfiguration() also learns such constraints by itself when a
+ * setting only succeeds on a retry; declaring them up front avoids the
+ * failed first attempt.
+ *
+ * @param label      the device label
+ * @param firstProp  the property to set first
+ * @param thenProp   the property to set after it
+ */
+void CMMCore::definePropertyOrder(const char* label, const char* firstProp,
+      const char* thenProp) throw (CMMError)
+{
+   CheckDeviceLabel(label);
+   CheckPropertyName(firstProp);
+   CheckPropertyName(thenProp);
+
+   if (!propertyOrder_.Add(label, firstProp, thenProp))
+      throw CMMError("Property " + ToQuotedString(thenProp) + " of device " +
+            ToQuotedString(label) + " cannot be ordered after " +
+            ToQuotedString(firstProp) + ": the opposite order is already defined",
+            MMERR_GENERIC);
+}
+
+/**
+ * Forgets all declared and learned property order constraints of a device.
+ *
+ * @param label      the device label
+ */
+void CMMCore::clearPropertyOrder(const char* label) throw (CMMError)
+{
+   CheckDeviceLabel(label);
+   propertyOrder_.Remove(label);
+}
+
+/**
+ * Forgets the property order constraints of a device that
+ * applyConfiguration() has learned, keeping those declared with
+ * definePropertyOrder(). Use this if a constraint was learned from a failure
+ * that had another cause.
+ *
+ * @param label      the device label
+ */
+void CMMCore::clearLearnedPropertyOrder(const char* label) throw (CMMError)
+{
+   CheckDeviceLabel(label);
+   propertyOrder_.RemoveLearned(label);
+}
+
 /*
  * Helper function for applyConfiguration
  * It is possible that setting certain properties failed because they are dependend
@@ -6359,6 +7899,7 @@ int CMMCore::applyProperties(vector<PropertySetting>& props, string& lastError)
          pDevice->SetProperty(props[i].getPropertyName(),
                props[i].getPropertyValue());
 
+         propertyValueCache_.Invalidate(props[i].getDeviceLabel(), props[i].getPropertyName());
          {
             MMThreadGuard scg(stateCacheLock_);
             stateCache_.addSetting(props[i]);
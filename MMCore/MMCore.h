@@ -56,12 +56,20 @@
 #include "../MMDevice/DeviceThreads.h"
 #include "../MMDevice/MMDevice.h"
 #include "../MMDevice/MMDeviceConstants.h"
+#include "AsyncCommands.h"
+#include "BusyNotifier.h"
 #include "Configuration.h"
 #include "CoreUtils.h"
 #include "DeviceManager.h"
 #include "Devices/DeviceInstances.h"
 #include "Error.h"
 #include "ErrorCodes.h"
+#include "FrameDescriptor.h"
+#include "FrameHandle.h"
+#include "LatencyTracer.h"
+#include "PropertyOrder.h"
+#include "PropertyValueCache.h"
+#include "StateCache.h"
 #include "LogManager.h"
 #include "PluginManager.h"
 
@@ -86,6 +94,8 @@
 
 
 class CircularBuffer;
+class CompressedFrameTier;
+class ImgBuffer;
 class Configuration;
 class PropertyBlock;
 class ConfigGroupCollection;
@@ -209,6 +219,13 @@ public:
    std::vector<std::string> getAllowedPropertyValues(const char* label, const char* propName) throw (CMMError);
    bool isPropertyReadOnly(const char* label, const char* propName) throw (CMMError);
    bool isPropertyPreInit(const char* label, const char* propName) throw (CMMError);
+   void setPropertyStatic(const char* label, const char* propName, bool isStatic) throw (CMMError);
+   bool isPropertyStatic(const char* label, const char* propName) throw (CMMError);
+   void clearPropertyValueCache();
+   void definePropertyOrder(const char* label, const char* firstProp,
+         const char* thenProp) throw (CMMError);
+   void clearPropertyOrder(const char* label) throw (CMMError);
+   void clearLearnedPropertyOrder(const char* label) throw (CMMError);
    bool isPropertySequenceable(const char* label, const char* propName) throw (CMMError);
    bool hasPropertyLimits(const char* label, const char* propName) throw (CMMError);
    double getPropertyLowerLimit(const char* label, const char* propName) throw (CMMError);
@@ -264,13 +281,17 @@ public:
    /** \name System state cache.
     *
     * The system state cache retains the last-set or last-read value of each
-    * device property.
+    * device property. Devices push their own changes into it, so only
+    * properties marked volatile need to be refreshed by polling.
     */
    ///@{
    Configuration getSystemStateCache() const;
    void updateSystemStateCache();
+   void updateVolatileStateCache();
    std::string getPropertyFromCache(const char* deviceLabel,
          const char* propName) const throw (CMMError);
+   unsigned long getPropertyCacheGeneration(const char* deviceLabel,
+         const char* propName) const throw (CMMError);
    std::string getCurrentConfigFromCache(const char* groupName) throw (CMMError);
    Configuration getConfigGroupStateFromCache(const char* group) throw (CMMError);
    ///@}
@@ -385,6 +406,26 @@ public:
    void* getNBeforeLastImageMD(unsigned long n, Metadata& md)
       const throw (CMMError);
    void* popNextImageMD(Metadata& md) throw (CMMError);
+   std::vector<FrameDescriptor> popNextImages(unsigned maxCount)
+      throw (CMMError);
+   void releaseImages(const std::vector<FrameDescriptor>& frames);
+   FrameHandle getLastImageHandle() throw (CMMError);
+   long getPinnedFrameOverrunCount();
+
+   void* getLastImage(const char* cameraLabel) throw (CMMError);
+   void* popNextImage(const char* cameraLabel) throw (CMMError);
+   void* popNextImageMD(const char* cameraLabel, Metadata& md)
+      throw (CMMError);
+   long getRemainingImageCount(const char* cameraLabel) throw (CMMError);
+
+   void setCameraBufferPoolMemoryFootprint(unsigned sizeMB) throw (CMMError);
+   unsigned getCameraBufferPoolMemoryFootprint();
+   unsigned getCameraBufferPoolFreeMemory();
+   void createCameraBuffer(const char* cameraLabel, unsigned sizeMB)
+      throw (CMMError);
+   void removeCameraBuffer(const char* cameraLabel) throw (CMMError);
+   bool hasCameraBuffer(const char* cameraLabel);
+   void initializeCameraBuffer(const char* cameraLabel) throw (CMMError);
 
    long getRemainingImageCount();
    long getBufferTotalCapacity();
@@ -394,6 +435,21 @@ public:
    unsigned getCircularBufferMemoryFootprint();
    void initializeCircularBuffer() throw (CMMError);
    void clearCircularBuffer() throw (CMMError);
+   void enableCircularBufferCompression(unsigned keepNewest, unsigned sizeMB)
+      throw (CMMError);
+   void disableCircularBufferCompression() throw (CMMError);
+   bool isCircularBufferCompressionEnabled();
+   long getCompressedImageCount();
+
+   void enableFrameStatistics(bool enable);
+   bool isFrameStatisticsEnabled();
+   std::vector<long> getLastImageHistogram() throw (CMMError);
+
+   void enableAcquisitionLatencyTracing(bool enable);
+   bool isAcquisitionLatencyTracingEnabled();
+   void clearAcquisitionLatencyTrace();
+   std::string getAcquisitionLatencyStats();
+   void saveAcquisitionLatencyTrace(const char* fileName) throw (CMMError);
 
    bool isExposureSequenceable(const char* cameraLabel) throw (CMMError);
    void startExposureSequence(const char* cameraLabel) throw (CMMError);
@@ -477,6 +533,24 @@ public:
          std::vector<double> ySequence) throw (CMMError);
    ///@}
 
+   /** \name Asynchronous commands.
+    *
+    * These return a ticket at once and run the command on a background
+    * thread for the device. Pass every ticket to waitForAsyncCommand() or
+    * releaseAsyncCommand(), or call waitForAllAsyncCommands().
+    */
+   ///@{
+   long setXYPositionAsync(const char* xyStageLabel,
+         double x, double y) throw (CMMError);
+   long setPositionAsync(const char* stageLabel, double position) throw (CMMError);
+   long snapImageAsync() throw (CMMError);
+   long setConfigAsync(const char* groupName, const char* configName) throw (CMMError);
+   bool isAsyncCommandDone(long ticket) throw (CMMError);
+   void waitForAsyncCommand(long ticket) throw (CMMError);
+   void releaseAsyncCommand(long ticket) throw (CMMError);
+   void waitForAllAsyncCommands();
+   ///@}
+
    /** \name Serial port control. */
    ///@{
    void setSerialProperties(const char* portName,
@@ -613,7 +687,15 @@ private:
    CorePropertyCollection* properties_;
    MMEventCallback* externalCallback_;  // notification hook to the higher layer (e.g. GUI)
    PixelSizeConfigGroup* pixelSizeGroup_;
-   CircularBuffer* cbuf_;
+   boost::shared_ptr<CircularBuffer> cbuf_; // shared with outstanding frame handles
+   CompressedFrameTier* compressedTier_; // optional; reads go through it when set
+   bool frameStatisticsEnabled_; // applied to every buffer images are inserted into
+
+   // Optional per-camera buffers, carved out of a shared memory pool.
+   // Cameras without their own buffer use cbuf_.
+   MMThreadLock cameraBuffersLock_;
+   std::map<std::string, CircularBuffer*> cameraBuffers_; // Synchronized by cameraBuffersLock_
+   unsigned cameraBufferPoolMB_; // Synchronized by cameraBuffersLock_
 
    std::vector< boost::weak_ptr<DeviceInstance> > imageSynchroDevices_;
    CPluginManager pluginManager_;
@@ -624,11 +706,23 @@ private:
    // Must be unlocked when calling MMEventCallback or calling device methods
    // or acquiring a module lock
    mutable MMThreadLock stateCacheLock_;
-   mutable Configuration stateCache_; // Synchronized by stateCacheLock_
+   mutable StateCache stateCache_; // Writes synchronized by stateCacheLock_; reads take no lock
+   PropertyValueCache propertyValueCache_; // static property values for getSystemState()
+   PropertyOrder propertyOrder_; // property order constraints for applyConfiguration()
+   BusyNotifier busyNotifier_; // busy state pushed by devices, for waitForDevice()
+   AsyncCommandQueue asyncCommands_; // worker queues behind the *Async() methods
 
    MMThreadLock* pPostedErrorsLock_;
    mutable std::deque<std::pair< int, std::string> > postedErrors_;
 
+   // Buffers detached from the circular buffer by popNextImages(). Keyed by
+   // pixel address so that releaseImages() can find them from descriptors.
+   MMThreadLock imageBatchLock_;
+   std::vector<ImgBuffer*> imageBatchPool_; // Synchronized by imageBatchLock_
+   std::map<const void*, ImgBuffer*> imageBatchesOut_; // Synchronized by imageBatchLock_
+
+   LatencyTracer latencyTracer_; // per-frame timestamps, recorded when images are popped
+
 private:
    // Parameter/value validation
    static void CheckDeviceLabel(const char* label) throw (CMMError);
@@ -643,6 +737,13 @@ private:
    void applyConfiguration(const Configuration& config) throw (CMMError);
    int applyProperties(std::vector<PropertySetting>& props, std::string& lastError);
    void waitForDevice(boost::shared_ptr<DeviceInstance> pDev) throw (CMMError);
+   CircularBuffer* getCircularBufferForCamera(const std::string& label);
+   CircularBuffer* getCameraBuffer(const char* cameraLabel) throw (CMMError);
+   void initializeBufferForCamera(CircularBuffer* cbuf,
+         boost::shared_ptr<CameraInstance> camera) throw (CMMError);
+   void traceFramePopped(const ImgBuffer* img);
+   void updateCachedProperty(const char* label, const char* propName, const char* value);
+   void updateDeviceBusy(const char* label, bool busy);
    Configuration getConfigGroupState(const char* group, bool fromCache) throw (CMMError);
    std::string getDeviceErrorText(int deviceCode, boost::shared_ptr<DeviceInstance> pDevice);
    std::string getDeviceName(boost::shared_ptr<DeviceInstance> pDev);
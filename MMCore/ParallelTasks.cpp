@@ -0,0 +1,86 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ParallelTasks.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Runs independent core tasks on a set of worker threads
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "ParallelTasks.h"
+
+ParallelTaskRunner::ParallelTaskRunner(unsigned maxThreads) :
+   maxThreads_(maxThreads),
+   tasks_(0),
+   next_(0)
+{
+}
+
+/**
+ * Runs all tasks and waits for them to finish.
+ */
+void ParallelTaskRunner::Run(const std::vector<ParallelTask*>& tasks)
+{
+   if (tasks.size() <= 1 || maxThreads_ <= 1)
+   {
+      for (size_t i = 0; i < tasks.size(); i++)
+         tasks[i]->Run();
+      return;
+   }
+
+   {
+      MMThreadGuard guard(lock_);
+      tasks_ = &tasks;
+      next_ = 0;
+   }
+
+   size_t threadCount = tasks.size() < maxThreads_ ? tasks.size() : maxThreads_;
+   std::vector<Worker*> workers;
+   workers.reserve(threadCount);
+   for (size_t i = 0; i < threadCount; i++)
+   {
+      workers.push_back(new Worker(this));
+      workers.back()->activate();
+   }
+   for (size_t i = 0; i < workers.size(); i++)
+   {
+      workers[i]->wait();
+      delete workers[i];
+   }
+
+   MMThreadGuard guard(lock_);
+   tasks_ = 0;
+}
+
+void ParallelTaskRunner::RunTasks()
+{
+   for (ParallelTask* task = NextTask(); task != 0; task = NextTask())
+   {
+      try
+      {
+         task->Run();
+      }
+      catch (...)
+      {
+         // tasks report their own errors; never let one end the worker
+      }
+   }
+}
+
+ParallelTask* ParallelTaskRunner::NextTask()
+{
+   MMThreadGuard guard(lock_);
+   if (tasks_ == 0 || next_ >= tasks_->size())
+      return 0;
+   return (*tasks_)[next_++];
+}
@@ -0,0 +1,81 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ParallelTasks.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Runs independent core tasks on a set of worker threads
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_PARALLEL_TASKS_)
+#define _PARALLEL_TASKS_
+
+#include "../MMDevice/DeviceThreads.h"
+
+#include <vector>
+
+/**
+ * A unit of work for ParallelTaskRunner. Run() must not throw; tasks record
+ * their own errors for the caller to inspect afterwards.
+ */
+class ParallelTask
+{
+public:
+   virtual ~ParallelTask() {}
+   virtual void Run() = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// ParallelTaskRunner class
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+// Runs a list of independent tasks on up to maxThreads worker threads and
+// returns when all of them have finished. Workers take the tasks in list
+// order. With one task, or maxThreads <= 1, the tasks are run on the calling
+// thread.
+//
+// Tasks that touch devices still take the device module locks, so devices
+// of the same adapter module never run concurrently.
+//
+
+class ParallelTaskRunner
+{
+public:
+   explicit ParallelTaskRunner(unsigned maxThreads);
+
+   void Run(const std::vector<ParallelTask*>& tasks);
+
+private:
+   class Worker : public MMDeviceThreadBase
+   {
+   public:
+      Worker(ParallelTaskRunner* runner) : runner_(runner) {}
+      int svc() { runner_->RunTasks(); return 0; }
+   private:
+      ParallelTaskRunner* runner_;
+   };
+
+   void RunTasks();
+   ParallelTask* NextTask();
+
+   // make object non-copyable
+   ParallelTaskRunner(const ParallelTaskRunner&);
+   ParallelTaskRunner& operator=(const ParallelTaskRunner&);
+
+   unsigned maxThreads_;
+   MMThreadLock lock_;
+   const std::vector<ParallelTask*>* tasks_; // synchronized by lock_
+   size_t next_;                             // synchronized by lock_
+};
+
+#endif // !defined(_PARALLEL_TASKS_)
@@ -0,0 +1,159 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PropertyOrder.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Order in which properties of a device have to be set
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "PropertyOrder.h"
+
+/**
+ * Requires thenProp to be set after firstProp. Returns false, and changes
+ * nothing, if the opposite order is already required. A learned constraint
+ * is dropped again by RemoveLearned(), unless it is also declared.
+ */
+bool PropertyOrder::Add(const std::string& label, const std::string& firstProp,
+      const std::string& thenProp, bool learned)
+{
+   if (firstProp == thenProp)
+      return false;
+
+   MMThreadGuard guard(lock_);
+   Predecessors& preds = constraints_[label];
+   std::set<std::string> beforeFirst;
+   CollectPredecessors(preds, firstProp, beforeFirst);
+   if (beforeFirst.find(thenProp) != beforeFirst.end())
+      return false;
+
+   bool added = preds[thenProp].insert(firstProp).second;
+   if (learned && added)
+      learned_[label][thenProp].insert(firstProp);
+   else if (!learned)
+   {
+      std::map<std::string, Predecessors>::iterator dev = learned_.find(label);
+      if (dev != learned_.end())
+         dev->second[thenProp].erase(firstProp);
+   }
+   return true;
+}
+
+void PropertyOrder::Remove(const std::string& label)
+{
+   MMThreadGuard guard(lock_);
+   constraints_.erase(label);
+   learned_.erase(label);
+}
+
+/**
+ * Forgets the constraints of a device that were learned rather than
+ * declared.
+ */
+void PropertyOrder::RemoveLearned(const std::string& label)
+{
+   MMThreadGuard guard(lock_);
+   std::map<std::string, Predecessors>::iterator dev = learned_.find(label);
+   if (dev == learned_.end())
+      return;
+
+   Predecessors& preds = constraints_[label];
+   for (Predecessors::const_iterator it = dev->second.begin(); it != dev->second.end(); ++it)
+   {
+      Predecessors::iterator then = preds.find(it->first);
+      if (then == preds.end())
+         continue;
+      for (std::set<std::string>::const_iterator p = it->second.begin(); p != it->second.end(); ++p)
+         then->second.erase(*p);
+      if (then->second.empty())
+         preds.erase(then);
+   }
+   if (preds.empty())
+      constraints_.erase(label);
+   learned_.erase(dev);
+}
+
+void PropertyOrder::Clear()
+{
+   MMThreadGuard guard(lock_);
+   constraints_.clear();
+   learned_.clear();
+}
+
+/**
+ * Reorders the settings of one device to satisfy the constraints. Settings
+ * that are not constrained relative to each other keep their order.
+ * Constraints also hold through properties missing from the list.
+ */
+void PropertyOrder::Sort(const std::string& label, std::vector<PropertySetting>& settings) const
+{
+   MMThreadGuard guard(lock_);
+   std::map<std::string, Predecessors>::const_iterator dev = constraints_.find(label);
+   if (dev == constraints_.end() || settings.size() < 2)
+      return;
+
+   const size_t n = settings.size();
+   std::map<std::string, size_t> indexOf;
+   for (size_t i = 0; i < n; i++)
+      indexOf[settings[i].getPropertyName()] = i;
+
+   std::vector< std::vector<size_t> > before(n);
+   for (size_t i = 0; i < n; i++)
+   {
+      std::set<std::string> preds;
+      CollectPredecessors(dev->second, settings[i].getPropertyName(), preds);
+      for (std::set<std::string>::const_iterator it = preds.begin(); it != preds.end(); ++it)
+      {
+         std::map<std::string, size_t>::const_iterator idx = indexOf.find(*it);
+         if (idx != indexOf.end() && idx->second != i)
+            before[i].push_back(idx->second);
+      }
+   }
+
+   // take the earliest setting whose predecessors are all placed
+   std::vector<bool> placed(n, false);
+   std::vector<PropertySetting> sorted;
+   sorted.reserve(n);
+   while (sorted.size() < n)
+   {
+      size_t pick = n;
+      for (size_t i = 0; i < n && pick == n; i++)
+      {
+         if (placed[i])
+            continue;
+         bool ready = true;
+         for (size_t j = 0; j < before[i].size() && ready; j++)
+            ready = placed[before[i][j]];
+         if (ready)
+            pick = i;
+      }
+      placed[pick] = true;
+      sorted.push_back(settings[pick]);
+   }
+   settings.swap(sorted);
+}
+
+// Adds every property that has to be set before 'prop', directly or
+// transitively, to 'found'
+void PropertyOrder::CollectPredecessors(const Predecessors& preds, const std::string& prop,
+      std::set<std::string>& found)
+{
+   Predecessors::const_iterator it = preds.find(prop);
+   if (it == preds.end())
+      return;
+   for (std::set<std::string>::const_iterator p = it->second.begin(); p != it->second.end(); ++p)
+   {
+      if (found.insert(*p).second)
+         CollectPredecessors(preds, *p, found);
+   }
+}
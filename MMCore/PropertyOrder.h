@@ -0,0 +1,70 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PropertyOrder.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Order in which properties of a device have to be set
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_PROPERTY_ORDER_)
+#define _PROPERTY_ORDER_
+
+#include "../MMDevice/DeviceThreads.h"
+#include "Configuration.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// PropertyOrder class
+// ~~~~~~~~~~~~~~~~~~~
+// Constraints of the form "set property B of a device only after property
+// A", e.g. an input range that is only accepted once its channel has been
+// enabled. Constraints are either declared by the user or learned when
+// applying a configuration: a setting that failed, and succeeded when it was
+// retried right after another property was set, is ordered after that
+// property. Learned constraints can be forgotten separately, in case one
+// was learned from a failure that had another cause.
+//
+// Constraints that would make the order cyclic are rejected.
+//
+// All methods are thread safe.
+//
+
+class PropertyOrder
+{
+public:
+   bool Add(const std::string& label, const std::string& firstProp,
+         const std::string& thenProp, bool learned = false);
+   void Remove(const std::string& label);
+   void RemoveLearned(const std::string& label);
+   void Clear();
+
+   void Sort(const std::string& label, std::vector<PropertySetting>& settings) const;
+
+private:
+   typedef std::map< std::string, std::set<std::string> > Predecessors;
+
+   static void CollectPredecessors(const Predecessors& preds, const std::string& prop,
+         std::set<std::string>& found);
+
+   mutable MMThreadLock lock_;
+   std::map<std::string, Predecessors> constraints_; // by device label; synchronized by lock_
+   std::map<std::string, Predecessors> learned_; // subset of constraints_ not declared; synchronized by lock_
+};
+
+#endif // !defined(_PROPERTY_ORDER_)
@@ -0,0 +1,124 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PropertyValueCache.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Cache of device property values that do not change by
+//                themselves
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "PropertyValueCache.h"
+
+void PropertyValueCache::SetHint(const std::string& label, const std::string& prop, Hint hint)
+{
+   MMThreadGuard guard(lock_);
+   Key key(label, prop);
+   if (hint == Default)
+      hints_.erase(key);
+   else
+      hints_[key] = hint;
+   values_.erase(key);
+}
+
+PropertyValueCache::Hint PropertyValueCache::GetHint(const std::string& label,
+      const std::string& prop) const
+{
+   MMThreadGuard guard(lock_);
+   std::map<Key, Hint>::const_iterator it = hints_.find(Key(label, prop));
+   return it == hints_.end() ? Default : it->second;
+}
+
+/**
+ * Returns whether the value of a property may be served from the cache.
+ */
+bool PropertyValueCache::IsStatic(const std::string& label, const std::string& prop,
+      bool isPreInit) const
+{
+   Hint hint = GetHint(label, prop);
+   if (hint == Default)
+      return isPreInit;
+   return hint == Static;
+}
+
+/**
+ * Returns the (device label, property name) pairs that carry the given hint.
+ */
+std::vector<std::pair<std::string, std::string> > PropertyValueCache::GetHinted(Hint hint) const
+{
+   MMThreadGuard guard(lock_);
+   std::vector<Key> keys;
+   for (std::map<Key, Hint>::const_iterator it = hints_.begin(); it != hints_.end(); ++it)
+   {
+      if (it->second == hint)
+         keys.push_back(it->first);
+   }
+   return keys;
+}
+
+bool PropertyValueCache::Get(const std::string& label, const std::string& prop,
+      std::string& value, bool& readOnly) const
+{
+   MMThreadGuard guard(lock_);
+   std::map<Key, Entry>::const_iterator it = values_.find(Key(label, prop));
+   if (it == values_.end())
+      return false;
+   value = it->second.value;
+   readOnly = it->second.readOnly;
+   return true;
+}
+
+void PropertyValueCache::Put(const std::string& label, const std::string& prop,
+      const std::string& value, bool readOnly)
+{
+   MMThreadGuard guard(lock_);
+   Entry& entry = values_[Key(label, prop)];
+   entry.value = value;
+   entry.readOnly = readOnly;
+}
+
+void PropertyValueCache::Invalidate(const std::string& label, const std::string& prop)
+{
+   MMThreadGuard guard(lock_);
+   values_.erase(Key(label, prop));
+}
+
+/**
+ * Drops the cached values of a device. Hints are kept.
+ */
+void PropertyValueCache::InvalidateDevice(const std::string& label)
+{
+   MMThreadGuard guard(lock_);
+   std::map<Key, Entry>::iterator it = values_.lower_bound(Key(label, std::string()));
+   while (it != values_.end() && it->first.first == label)
+      values_.erase(it++);
+}
+
+/**
+ * Drops all cached values. Hints are kept.
+ */
+void PropertyValueCache::InvalidateAll()
+{
+   MMThreadGuard guard(lock_);
+   values_.clear();
+}
+
+/**
+ * Drops all cached values and hints.
+ */
+void PropertyValueCache::Clear()
+{
+   MMThreadGuard guard(lock_);
+   values_.clear();
+   hints_.clear();
+}
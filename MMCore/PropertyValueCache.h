@@ -0,0 +1,83 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PropertyValueCache.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Cache of device property values that do not change by
+//                themselves
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_PROPERTY_VALUE_CACHE_)
+#define _PROPERTY_VALUE_CACHE_
+
+#include "../MMDevice/DeviceThreads.h"
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// PropertyValueCache class
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+// Holds the values of "static" device properties, which only change when
+// set through the core, so that system state snapshots can skip querying
+// the device for them. By default pre-initialization properties are static
+// and all others are volatile (read from the device every time); hints
+// override the default per property.
+//
+// All methods are thread safe.
+//
+
+class PropertyValueCache
+{
+public:
+   enum Hint
+   {
+      Default,
+      Static,
+      Volatile
+   };
+
+   void SetHint(const std::string& label, const std::string& prop, Hint hint);
+   Hint GetHint(const std::string& label, const std::string& prop) const;
+   bool IsStatic(const std::string& label, const std::string& prop, bool isPreInit) const;
+   std::vector<std::pair<std::string, std::string> > GetHinted(Hint hint) const;
+
+   bool Get(const std::string& label, const std::string& prop,
+         std::string& value, bool& readOnly) const;
+   void Put(const std::string& label, const std::string& prop,
+         const std::string& value, bool readOnly);
+
+   void Invalidate(const std::string& label, const std::string& prop);
+   void InvalidateDevice(const std::string& label);
+   void InvalidateAll();
+   void Clear();
+
+private:
+   typedef std::pair<std::string, std::string> Key; // device label, property name
+
+   struct Entry
+   {
+      std::string value;
+      bool readOnly;
+   };
+
+   mutable MMThreadLock lock_;
+   std::map<Key, Hint> hints_;    // synchronized by lock_
+   std::map<Key, Entry> values_;  // synchronized by lock_
+};
+
+#endif // !defined(_PROPERTY_VALUE_CACHE_)
@@ -0,0 +1,306 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          StateCache.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Versioned cache of the system state with lock-free reads
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "StateCache.h"
+#include "CoreUtils.h"
+#include "ErrorCodes.h"
+
+#include <string.h>
+#include <set>
+
+const unsigned long g_initialBuckets = 256;
+
+namespace {
+
+// Full memory barrier; publishes writes made before it to other threads
+inline void FullBarrier()
+{
+#ifdef _WIN32
+   MemoryBarrier();
+#else
+   __sync_synchronize();
+#endif
+}
+
+template <typename T>
+inline T LoadAcquire(const volatile T& location)
+{
+   T value = location;
+   FullBarrier();
+   return value;
+}
+
+template <typename T>
+inline void StoreRelease(volatile T& location, T value)
+{
+   FullBarrier();
+   location = value;
+}
+
+} // anonymous namespace
+
+StateCache::Table::Table(unsigned long capacity) :
+   mask(capacity - 1),
+   buckets(new Slot* volatile[capacity])
+{
+   for (unsigned long i = 0; i < capacity; i++)
+      buckets[i] = 0;
+}
+
+StateCache::Table::~Table()
+{
+   delete[] buckets;
+}
+
+StateCache::StateCache() :
+   table_(new Table(g_initialBuckets))
+{
+}
+
+StateCache::~StateCache()
+{
+   delete table_;
+   for (std::vector<Table*>::iterator it = retiredTables_.begin(); it != retiredTables_.end(); ++it)
+      delete *it;
+   for (std::vector<Slot*>::iterator it = slots_.begin(); it != slots_.end(); ++it)
+      delete *it;
+}
+
+/**
+ * Replaces the cached state with the given configuration (a full refresh).
+ * Entries missing from the configuration are removed; entries are updated
+ * in place, so concurrent readers never see a half-replaced cache.
+ */
+StateCache& StateCache::operator=(const Configuration& config)
+{
+   MMThreadGuard guard(writeLock_);
+
+   std::set<const Slot*> written;
+   for (size_t i = 0; i < config.size(); i++)
+   {
+      PropertySetting setting = config.getSetting(i);
+      Write(setting);
+      written.insert(Find(setting.getDeviceLabel().c_str(), setting.getPropertyName().c_str()));
+   }
+   for (std::vector<Slot*>::iterator it = slots_.begin(); it != slots_.end(); ++it)
+   {
+      if ((*it)->present && written.find(*it) == written.end())
+         WriteSlot(**it, false, false, std::string());
+   }
+   return *this;
+}
+
+/**
+ * Sets the cached value of one property.
+ * Returns false if the value is too long to be cached; the property is then
+ * removed from the cache.
+ */
+bool StateCache::addSetting(const PropertySetting& setting)
+{
+   MMThreadGuard guard(writeLock_);
+   return Write(setting);
+}
+
+bool StateCache::isPropertyIncluded(const char* label, const char* propName) const
+{
+   const Slot* slot = Find(label, propName);
+   if (slot == 0)
+      return false;
+   Snapshot snapshot;
+   Read(*slot, snapshot);
+   return snapshot.present;
+}
+
+PropertySetting StateCache::getSetting(const char* label, const char* propName) const throw (CMMError)
+{
+   const Slot* slot = Find(label, propName);
+   Snapshot snapshot;
+   if (slot != 0)
+      Read(*slot, snapshot);
+   if (slot == 0 || !snapshot.present)
+      throw CMMError("Property " + ToQuotedString(propName) + " of device " +
+            ToQuotedString(label) + " not found in cache",
+            MMERR_PropertyNotInCache);
+   return PropertySetting(label, propName, snapshot.value.c_str(), snapshot.readOnly);
+}
+
+/**
+ * Returns the cached value of a property, without taking a lock.
+ * If 'generation' is given, it receives the number of times the value has
+ * been written. Returns false if the property is not in the cache.
+ */
+bool StateCache::GetValue(const char* label, const char* propName, std::string& value,
+      unsigned long* generation) const
+{
+   const Slot* slot = Find(label, propName);
+   if (slot == 0)
+      return false;
+   Snapshot snapshot;
+   Read(*slot, snapshot);
+   if (!snapshot.present)
+      return false;
+   value.swap(snapshot.value);
+   if (generation)
+      *generation = snapshot.generation;
+   return true;
+}
+
+/**
+ * Returns the number of times the cached value of a property has been
+ * written, 0 if it never was.
+ */
+unsigned long StateCache::GetGeneration(const char* label, const char* propName) const
+{
+   const Slot* slot = Find(label, propName);
+   if (slot == 0)
+      return 0;
+   return (unsigned long)(LoadAcquire(slot->sequence) / 2);
+}
+
+/**
+ * Returns the whole cached state.
+ */
+Configuration StateCache::GetConfiguration() const
+{
+   MMThreadGuard guard(writeLock_);
+   Configuration config;
+   for (std::vector<Slot*>::const_iterator it = slots_.begin(); it != slots_.end(); ++it)
+   {
+      const Slot& slot = **it;
+      if (slot.present)
+         config.addSetting(PropertySetting(slot.label.c_str(), slot.propName.c_str(),
+                  std::string(slot.value, slot.length).c_str(), slot.readOnly));
+   }
+   return config;
+}
+
+// FNV-1a over the label, a separator and the property name
+unsigned long StateCache::Hash(const char* label, const char* propName)
+{
+   unsigned long h = 2166136261UL;
+   for (const char* p = label; *p; p++)
+      h = ((h ^ (unsigned char)*p) * 16777619UL) & 0xffffffffUL;
+   h = ((h ^ 0xffUL) * 16777619UL) & 0xffffffffUL;
+   for (const char* p = propName; *p; p++)
+      h = ((h ^ (unsigned char)*p) * 16777619UL) & 0xffffffffUL;
+   return h;
+}
+
+const StateCache::Slot* StateCache::Find(const char* label, const char* propName) const
+{
+   unsigned long h = Hash(label, propName);
+   const Table* table = LoadAcquire(table_);
+   for (unsigned long i = h & table->mask; ; i = (i + 1) & table->mask)
+   {
+      const Slot* slot = LoadAcquire(table->buckets[i]);
+      if (slot == 0)
+         return 0;
+      if (slot->hash == h && slot->label == label && slot->propName == propName)
+         return slot;
+   }
+}
+
+void StateCache::Read(const Slot& slot, Snapshot& snapshot)
+{
+   char buf[MM::MaxStrLength];
+   for (;;)
+   {
+      long before = LoadAcquire(slot.sequence);
+      if (before & 1)
+         continue; // write in progress
+
+      snapshot.present = slot.present;
+      snapshot.readOnly = slot.readOnly;
+      unsigned length = slot.length;
+      if (length >= MM::MaxStrLength)
+         length = MM::MaxStrLength - 1;
+      memcpy(buf, slot.value, length);
+
+      FullBarrier();
+      if (slot.sequence == before)
+      {
+         snapshot.generation = (unsigned long)(before / 2);
+         snapshot.value.assign(buf, length);
+         return;
+      }
+   }
+}
+
+// Must be called with writeLock_ held. Returns false if the value is too long.
+bool StateCache::Write(const PropertySetting& setting)
+{
+   std::string label = setting.getDeviceLabel();
+   std::string propName = setting.getPropertyName();
+
+   Slot* slot = const_cast<Slot*>(Find(label.c_str(), propName.c_str()));
+   if (slot == 0)
+   {
+      slot = new Slot(label, propName, Hash(label.c_str(), propName.c_str()));
+      bool stored = WriteSlot(*slot, true, setting.getReadOnly(), setting.getPropertyValue());
+      slots_.push_back(slot);
+      Insert(slot);
+      return stored;
+   }
+   return WriteSlot(*slot, true, setting.getReadOnly(), setting.getPropertyValue());
+}
+
+// Marks the slot as not present, rather than truncating, if the value does
+// not fit; returns false in that case.
+bool StateCache::WriteSlot(Slot& slot, bool present, bool readOnly, const std::string& value)
+{
+   bool fits = value.size() < MM::MaxStrLength;
+   size_t length = fits ? value.size() : 0;
+
+   StoreRelease(slot.sequence, slot.sequence + 1);
+   FullBarrier();
+   slot.present = present && fits;
+   slot.readOnly = readOnly;
+   memcpy(slot.value, value.data(), length);
+   slot.value[length] = 0;
+   slot.length = (unsigned)length;
+   StoreRelease(slot.sequence, slot.sequence + 1);
+   return fits;
+}
+
+// Publishes a new slot. Must be called with writeLock_ held, after the slot
+// has been added to slots_. Keeps the table at most half full; a grown table
+// replaces the old one, which stays allocated for readers still using it.
+void StateCache::Insert(Slot* slot)
+{
+   Table* table = table_;
+   if (slots_.size() * 2 > table->mask + 1)
+   {
+      Table* grown = new Table((table->mask + 1) * 2);
+      for (std::vector<Slot*>::iterator it = slots_.begin(); it != slots_.end(); ++it)
+      {
+         unsigned long i = (*it)->hash & grown->mask;
+         while (grown->buckets[i] != 0)
+            i = (i + 1) & grown->mask;
+         grown->buckets[i] = *it;
+      }
+      retiredTables_.push_back(table);
+      StoreRelease(table_, grown);
+      return;
+   }
+
+   unsigned long i = slot->hash & table->mask;
+   while (table->buckets[i] != 0)
+      i = (i + 1) & table->mask;
+   StoreRelease(table->buckets[i], slot);
+}
@@ -0,0 +1,122 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          StateCache.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMCore
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Versioned cache of the system state with lock-free reads
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#if !defined(_STATE_CACHE_)
+#define _STATE_CACHE_
+
+#include "../MMDevice/DeviceThreads.h"
+#include "../MMDevice/MMDeviceConstants.h"
+#include "Configuration.h"
+#include "Error.h"
+
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// StateCache class
+// ~~~~~~~~~~~~~~~~
+// Last known value of every device property. Devices publish changes through
+// OnPropertyChanged(), the core writes values it sets, and a full refresh
+// replaces everything.
+//
+// Each entry carries a generation counter that is incremented on every
+// write, so readers can tell whether a value changed since they last looked.
+// Lookups go through an open-addressing hash table and take no lock: entries
+// and tables are never freed while the cache exists, and values are read
+// with a sequence lock (retry if a write happened meanwhile). Writers are
+// serialized internally.
+//
+// Values are limited to MM::MaxStrLength - 1 characters, the same limit that
+// applies to device property values. Longer values are not stored truncated:
+// the property is left out of the cache instead, as if it had no value.
+//
+// The addSetting(), isPropertyIncluded() and getSetting() methods mirror
+// Configuration, which this class replaces as the core state cache.
+//
+
+class StateCache
+{
+public:
+   StateCache();
+   ~StateCache();
+
+   StateCache& operator=(const Configuration& config);
+
+   bool addSetting(const PropertySetting& setting);
+   bool isPropertyIncluded(const char* label, const char* propName) const;
+   PropertySetting getSetting(const char* label, const char* propName) const throw (CMMError);
+
+   bool GetValue(const char* label, const char* propName, std::string& value,
+         unsigned long* generation = 0) const;
+   unsigned long GetGeneration(const char* label, const char* propName) const;
+   Configuration GetConfiguration() const;
+
+private:
+   struct Slot
+   {
+      Slot(const std::string& l, const std::string& p, unsigned long h) :
+         label(l), propName(p), hash(h), sequence(0), present(false),
+         readOnly(false), length(0)
+      { value[0] = 0; }
+
+      const std::string label;     // immutable once published
+      const std::string propName;  // immutable once published
+      const unsigned long hash;
+      volatile long sequence;      // odd while a write is in progress
+      bool present;                // false after a refresh without it
+      bool readOnly;
+      unsigned length;
+      char value[MM::MaxStrLength];
+   };
+
+   struct Table
+   {
+      explicit Table(unsigned long capacity);
+      ~Table();
+      unsigned long mask;
+      Slot* volatile* buckets;
+   };
+
+   struct Snapshot
+   {
+      bool present;
+      bool readOnly;
+      unsigned long generation;
+      std::string value;
+   };
+
+   static unsigned long Hash(const char* label, const char* propName);
+   const Slot* Find(const char* label, const char* propName) const;
+   static void Read(const Slot& slot, Snapshot& snapshot);
+   bool Write(const PropertySetting& setting);
+   static bool WriteSlot(Slot& slot, bool present, bool readOnly, const std::string& value);
+   void Insert(Slot* slot);
+
+   // make object non-copyable
+   StateCache(const StateCache&);
+   StateCache& operator=(const StateCache&);
+
+   Table* volatile table_;
+   mutable MMThreadLock writeLock_;
+   std::vector<Slot*> slots_;          // synchronized by writeLock_, in insertion order
+   std::vector<Table*> retiredTables_; // synchronized by writeLock_
+};
+
+#endif // !defined(_STATE_CACHE_)
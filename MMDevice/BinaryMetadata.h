@@ -0,0 +1,429 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          BinaryMetadata.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     MMDevice - Device adapter kit
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Compact binary encoding of per-image metadata
+//
+// LICENSE:       This file is distributed under the "Lesser GPL" (LGPL) license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _BINARY_METADATA_H_
+#define _BINARY_METADATA_H_
+
+#include "ImageMetadata.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Wire format
+// -----------
+// A stream starts with the 4 magic bytes "MMB1", followed by entries until the
+// end of the buffer. All integers are little endian.
+//
+//    uint8    value type (BinaryMetadata::ValueType)
+//    uint8    flags (bit 0: read-only, bit 1: device label present)
+//    uint16   key length, then the key bytes
+//    [uint16  device label length, then the label bytes]
+//    value:
+//       Int64        8 bytes, two's complement
+//       Double       8 bytes, IEEE 754
+//       String       uint32 length, then the bytes
+//       Int64Array   uint32 count, then count x 8 bytes
+//       DoubleArray  uint32 count, then count x 8 bytes
+//
+// Tags without a device label are image tags (device "_"), the same as tags
+// added with Metadata::PutImageTag().
+//
+
+/**
+ * Builds a binary metadata stream for
+ * MM::Core::InsertImage(..., const unsigned char* binaryMetadata, ...).
+ *
+ * Values keep their type, and nothing is formatted as text or allocated
+ * per tag. Reuse one instance per camera: Clear() keeps the
+ * allocated memory, so steady-state encoding does not allocate at all.
+ */
+class BinaryMetadata
+{
+public:
+   enum ValueType
+   {
+      Int64 = 1,
+      Double = 2,
+      String = 3,
+      Int64Array = 4,
+      DoubleArray = 5
+   };
+
+   BinaryMetadata() { Clear(); }
+
+   void Clear()
+   {
+      data_.clear();
+      data_.push_back('M');
+      data_.push_back('M');
+      data_.push_back('B');
+      data_.push_back('1');
+   }
+
+   const unsigned char* GetData() const { return &data_[0]; }
+   unsigned long GetSize() const { return (unsigned long)data_.size(); }
+
+   void PutInt64(const char* key, long long value, const char* device = 0)
+   {
+      PutHeader(Int64, key, device);
+      PutU64((unsigned long long)value);
+   }
+
+   void PutDouble(const char* key, double value, const char* device = 0)
+   {
+      PutHeader(Double, key, device);
+      PutU64(DoubleBits(value));
+   }
+
+   void PutString(const char* key, const char* value, const char* device = 0)
+   {
+      PutHeader(String, key, device);
+      unsigned long len = (unsigned long)strlen(value);
+      PutU32(len);
+      data_.insert(data_.end(), value, value + len);
+   }
+
+   void PutInt64Array(const char* key, const long long* values, unsigned long count,
+         const char* device = 0)
+   {
+      PutHeader(Int64Array, key, device);
+      PutU32(count);
+      for (unsigned long i = 0; i < count; i++)
+         PutU64((unsigned long long)values[i]);
+   }
+
+   void PutDoubleArray(const char* key, const double* values, unsigned long count,
+         const char* device = 0)
+   {
+      PutHeader(DoubleArray, key, device);
+      PutU32(count);
+      for (unsigned long i = 0; i < count; i++)
+         PutU64(DoubleBits(values[i]));
+   }
+
+   /**
+    * Replaces the stream with a copy of an existing one, so that more tags
+    * can be appended to it. Returns false, leaving an empty stream, if the
+    * data is not a well-formed binary metadata stream.
+    */
+   bool Assign(const unsigned char* data, unsigned long size)
+   {
+      if (!IsValid(data, size))
+      {
+         Clear();
+         return false;
+      }
+      data_.assign(data, data + size);
+      return true;
+   }
+
+   bool HasTag(const char* key) const { return HasTag(GetData(), GetSize(), key); }
+
+   /**
+    * Returns whether a stream is well formed.
+    */
+   static bool IsValid(const unsigned char* data, unsigned long size)
+   {
+      if (size < 4 || memcmp(data, "MMB1", 4) != 0)
+         return false;
+      Entry entry;
+      for (const unsigned char* p = data + 4; p < data + size; )
+      {
+         if (!Next(p, data + size, entry))
+            return false;
+      }
+      return true;
+   }
+
+   /**
+    * Returns whether a stream has a tag with the given qualified name
+    * ("device-name", or just the name for image tags).
+    */
+   static bool HasTag(const unsigned char* data, unsigned long size, const char* key)
+   {
+      const unsigned char* value;
+      unsigned long length;
+      unsigned char type;
+      return Find(data, size, key, type, value, length);
+   }
+
+   /**
+    * Gets the value of a string tag, without decoding the rest of the
+    * stream. Returns false if there is no string tag with that name.
+    */
+   static bool GetString(const unsigned char* data, unsigned long size, const char* key,
+         std::string& value)
+   {
+      const unsigned char* bytes;
+      unsigned long length;
+      unsigned char type;
+      if (!Find(data, size, key, type, bytes, length) || type != String)
+         return false;
+      value.assign((const char*)bytes, length);
+      return true;
+   }
+
+   /**
+    * Converts a binary stream to the legacy Metadata representation.
+    * Numbers keep their type; array values are formatted as text.
+    * Returns false if the stream is malformed; tags decoded up to that point
+    * are kept.
+    */
+   static bool ToMetadata(const unsigned char* data, unsigned long size, Metadata& md)
+   {
+      if (size < 4 || memcmp(data, "MMB1", 4) != 0)
+         return false;
+
+      Entry entry;
+      for (const unsigned char* p = data + 4; p < data + size; )
+      {
+         if (!Next(p, data + size, entry))
+            return false;
+
+         std::string key(entry.key, entry.keyLength);
+         std::string device(entry.device, entry.deviceLength);
+         bool readOnly = (entry.flags & 1) != 0;
+
+         switch (entry.type)
+         {
+            case Int64:
+               md.PutInt64Tag(key.c_str(), device.c_str(), (long long)ReadU64(entry.value), readOnly);
+               break;
+            case Double:
+               md.PutDoubleTag(key.c_str(), device.c_str(), BitsToDouble(ReadU64(entry.value)), readOnly);
+               break;
+            case String:
+            {
+               MetadataSingleTag tag(key.c_str(), device.c_str(), readOnly);
+               tag.SetValue(std::string((const char*)entry.value, entry.count).c_str());
+               md.SetTag(tag);
+               break;
+            }
+            default:
+            {
+               MetadataArrayTag tag;
+               tag.SetName(key.c_str());
+               tag.SetDevice(device.c_str());
+               tag.SetReadOnly(readOnly);
+               unsigned char scalar = entry.type == Int64Array ? (unsigned char)Int64 : (unsigned char)Double;
+               for (unsigned long i = 0; i < entry.count; i++)
+                  tag.AddValue(FormatValue(scalar, ReadU64(entry.value + 8 * i)).c_str());
+               md.SetTag(tag);
+               break;
+            }
+         }
+      }
+      return true;
+   }
+
+private:
+   void PutHeader(ValueType type, const char* key, const char* device)
+   {
+      bool hasDevice = device != 0 && strcmp(device, "_") != 0;
+      data_.push_back((unsigned char)type);
+      // read-only, like tags added with Metadata::PutTag()
+      data_.push_back((unsigned char)(hasDevice ? 3 : 1));
+      PutString16(key);
+      if (hasDevice)
+         PutString16(device);
+   }
+
+   void PutString16(const char* s)
+   {
+      size_t len = strlen(s);
+      if (len > 0xffff)
+         len = 0xffff;
+      data_.push_back((unsigned char)(len & 0xff));
+      data_.push_back((unsigned char)(len >> 8));
+      data_.insert(data_.end(), s, s + len);
+   }
+
+   void PutU32(unsigned long v)
+   {
+      for (int i = 0; i < 4; i++)
+         data_.push_back((unsigned char)((v >> (8 * i)) & 0xff));
+   }
+
+   void PutU64(unsigned long long v)
+   {
+      for (int i = 0; i < 8; i++)
+         data_.push_back((unsigned char)((v >> (8 * i)) & 0xff));
+   }
+
+   static unsigned long long DoubleBits(double d)
+   {
+      unsigned long long bits;
+      memcpy(&bits, &d, sizeof(bits));
+      return bits;
+   }
+
+   // One tag of a stream, pointing into the stream
+   struct Entry
+   {
+      unsigned char type;
+      unsigned char flags;
+      const char* key;
+      unsigned long keyLength;
+      const char* device;         // "_" if the tag has no device label
+      unsigned long deviceLength;
+      const unsigned char* value; // 8-byte numbers, or the string bytes
+      unsigned long count;        // string length, or number of array values
+   };
+
+   // Parses the tag at p and advances p past it
+   static bool Next(const unsigned char*& p, const unsigned char* end, Entry& entry)
+   {
+      if (end - p < 4)
+         return false;
+      entry.type = p[0];
+      entry.flags = p[1];
+      p += 2;
+
+      if (!GetString16(p, end, entry.key, entry.keyLength))
+         return false;
+      entry.device = "_";
+      entry.deviceLength = 1;
+      if ((entry.flags & 2) && !GetString16(p, end, entry.device, entry.deviceLength))
+         return false;
+
+      unsigned long bytes;
+      switch (entry.type)
+      {
+         case Int64:
+         case Double:
+            entry.count = 1;
+            bytes = 8;
+            break;
+         case String:
+            if (!GetU32(p, end, entry.count))
+               return false;
+            bytes = entry.count;
+            break;
+         case Int64Array:
+         case DoubleArray:
+            if (!GetU32(p, end, entry.count) || (unsigned long)(end - p) / 8 < entry.count)
+               return false;
+            bytes = 8 * entry.count;
+            break;
+         default:
+            return false;
+      }
+      if ((unsigned long)(end - p) < bytes)
+         return false;
+      entry.value = p;
+      p += bytes;
+      return true;
+   }
+
+   // Compares the qualified name of a tag, built as Metadata does
+   static bool HasKey(const Entry& entry, const char* key)
+   {
+      size_t length = strlen(key);
+      if (entry.deviceLength == 1 && entry.device[0] == '_')
+         return length == entry.keyLength && memcmp(key, entry.key, length) == 0;
+      return length == entry.deviceLength + 1 + entry.keyLength &&
+            memcmp(key, entry.device, entry.deviceLength) == 0 &&
+            key[entry.deviceLength] == '-' &&
+            memcmp(key + entry.deviceLength + 1, entry.key, entry.keyLength) == 0;
+   }
+
+   // Finds the last tag with a name, which is the one ToMetadata() keeps
+   static bool Find(const unsigned char* data, unsigned long size, const char* key,
+         unsigned char& type, const unsigned char*& value, unsigned long& count)
+   {
+      if (size < 4 || memcmp(data, "MMB1", 4) != 0)
+         return false;
+      bool found = false;
+      Entry entry;
+      for (const unsigned char* p = data + 4; p < data + size; )
+      {
+         if (!Next(p, data + size, entry))
+            break;
+         if (HasKey(entry, key))
+         {
+            found = true;
+            type = entry.type;
+            value = entry.value;
+            count = entry.count;
+         }
+      }
+      return found;
+   }
+
+   static bool GetString16(const unsigned char*& p, const unsigned char* end,
+         const char*& s, unsigned long& length)
+   {
+      if (end - p < 2)
+         return false;
+      length = p[0] | (p[1] << 8);
+      p += 2;
+      if ((unsigned long)(end - p) < length)
+         return false;
+      s = (const char*)p;
+      p += length;
+      return true;
+   }
+
+   static bool GetU32(const unsigned char*& p, const unsigned char* end, unsigned long& v)
+   {
+      if (end - p < 4)
+         return false;
+      v = 0;
+      for (int i = 3; i >= 0; i--)
+         v = (v << 8) | p[i];
+      p += 4;
+      return true;
+   }
+
+   static unsigned long long ReadU64(const unsigned char* p)
+   {
+      unsigned long long v = 0;
+      for (int i = 7; i >= 0; i--)
+         v = (v << 8) | p[i];
+      return v;
+   }
+
+   static double BitsToDouble(unsigned long long bits)
+   {
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      return d;
+   }
+
+   static std::string FormatValue(unsigned char type, unsigned long long bits)
+   {
+      char buf[64];
+      if (type == Int64)
+      {
+         sprintf(buf, "%lld", (long long)bits);
+      }
+      else
+      {
+         sprintf(buf, "%.15g", BitsToDouble(bits));
+      }
+      return buf;
+   }
+
+   std::vector<unsigned char> data_;
+};
+
+#endif //_BINARY_METADATA_H_
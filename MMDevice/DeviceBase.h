@@ -1090,6 +1090,16 @@ protected:
       return DEVICE_NO_CALLBACK_REGISTERED;
    }
 
+   /**
+    * Signals to the core that the device became busy or idle.
+    */
+   int OnBusyChanged(bool busy)
+   {
+      if (callback_)
+         return callback_->OnBusyChanged(this, busy);
+      return DEVICE_NO_CALLBACK_REGISTERED;
+   }
+
    /*
     */
    int OnExposureChanged(double exposure)
@@ -35,8 +35,13 @@
 #include <vector>
 #include <map>
 #include <sstream>
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // MetadataError
@@ -262,91 +267,147 @@ private:
 
 /**
  * Container for all metadata associated with a single image.
+ *
+ * All tags live in one block of memory: a header, a fixed-size entry per tag,
+ * and a pool holding the names and text values of the tags. Integer and
+ * floating point values are kept in the entry itself and are formatted as
+ * text only when the tag is read, so adding a tag to a block with room for
+ * it does not allocate, and copying the tags of an image is one allocation
+ * and a memcpy.
+ *
+ * Tags are looked up by key id, a hash of the qualified name that every
+ * module computes the same way, so that ids agree between the core and the
+ * device adapters without a shared table. Entries are sorted by key id and
+ * found by binary search.
+ *
+ * A block is kept and modified only by the module that allocated it. Copying
+ * or modifying metadata that comes from another module copies the block;
+ * copies within a module share it until one of them is modified.
  */
 class Metadata
 {
 public:
 
-   Metadata() {} // empty constructor
+   Metadata() : tags_(0) {} // empty constructor
 
    ~Metadata() // destructor
    {
       Clear();
    }
 
-   Metadata(const Metadata& original) // copy constructor
+   Metadata(const Metadata& original) : // copy constructor
+      tags_(0)
    {
-      for (TagIterator it = original.tags_.begin(); it != original.tags_.end(); it++)
-      {
-         SetTag(*it->second);
-      }
+      Assign(original.tags_);
    }
 
    void Clear() {
-      for (TagIterator it=tags_.begin(); it != tags_.end(); it++)
-         delete it->second;
-      tags_.clear();
+      if (tags_)
+         Release(tags_);
+      tags_ = 0;
    }
 
    std::vector<std::string> GetKeys() const
    {
       std::vector<std::string> keyList;
-      for (TagIterator it = tags_.begin(), end = tags_.end(); it != end; ++it)
-         keyList.push_back(it->first);
+      if (!tags_)
+         return keyList;
+      keyList.reserve(tags_->count);
+      for (unsigned long i = 0; i < tags_->count; i++)
+         keyList.push_back(Key(tags_, Entries(tags_)[i]));
+      std::sort(keyList.begin(), keyList.end());
       return keyList;
    }
 
    bool HasTag(const char* key)
    {
-      TagIterator it = tags_.find(key);
-      if (it != tags_.end())
-         return true;
-      else
-         return false;
+      return Find(key) != 0;
    }
-   
+
    MetadataSingleTag GetSingleTag(const char* key) const throw (MetadataKeyError)
    {
-      MetadataTag* tag = FindTag(key);
-      const MetadataSingleTag* stag = tag->ToSingleTag();
-      return *stag;
+      const TagEntry* entry = Find(key);
+      if (entry == 0 || entry->type == ArrayValue)
+         throw MetadataKeyError();
+      MetadataSingleTag tag(Name(tags_, *entry), Device(tags_, *entry), entry->readOnly != 0);
+      char buf[64];
+      tag.SetValue(ValueText(tags_, *entry, buf));
+      return tag;
    }
 
    MetadataArrayTag GetArrayTag(const char* key) const throw (MetadataKeyError)
    {
-      MetadataTag* tag = FindTag(key);
-      const MetadataArrayTag* atag = tag->ToArrayTag();
-      return *atag;
+      const TagEntry* entry = Find(key);
+      if (entry == 0 || entry->type != ArrayValue)
+         throw MetadataKeyError();
+      MetadataArrayTag tag;
+      tag.SetName(Name(tags_, *entry));
+      tag.SetDevice(Device(tags_, *entry));
+      tag.SetReadOnly(entry->readOnly != 0);
+      const char* value = Values(tags_, *entry);
+      for (unsigned long i = 0; i < entry->count; i++)
+      {
+         tag.AddValue(value);
+         value += strlen(value) + 1;
+      }
+      return tag;
+   }
+
+   /*
+    * Gets the value of a single tag as an integer, reading it in place.
+    * Text values are parsed and doubles are truncated. Returns false if
+    * there is no such tag or its value is not a number.
+    */
+   bool GetInt64Tag(const char* key, long long& value) const
+   {
+      const TagEntry* entry = Find(key);
+      if (entry == 0 || entry->type == ArrayValue)
+         return false;
+      if (entry->type == IntValue)
+         value = entry->number.i;
+      else if (entry->type == DoubleValue)
+         value = (long long)entry->number.d;
+      else
+      {
+         const char* text = Values(tags_, *entry);
+         char* end;
+#ifdef _MSC_VER
+         long long parsed = _strtoi64(text, &end, 10);
+#else
+         long long parsed = strtoll(text, &end, 10);
+#endif
+         if (end == text)
+            return false;
+         value = parsed;
+      }
+      return true;
    }
 
    void SetTag(MetadataTag& tag)
    {
-      MetadataTag* newTag = tag.Clone();
-      RemoveTag(tag.GetQualifiedName().c_str());
-      tags_.insert(std::make_pair(tag.GetQualifiedName(), newTag));
+      SetTag(tag, true);
    }
 
    void RemoveTag(const char* key)
    {
-      TagIterator it = tags_.find(key);
-      if (it != tags_.end())
-      {
-         delete it->second;
-         tags_.erase(key);
-      }
+      unsigned long idx;
+      if (!tags_ || !Locate(tags_, KeyId(key), key, idx))
+         return;
+      TagBlock* block = Writable(0, 0); // keeps the order of the entries
+      TagEntry* entries = Entries(block);
+      block->garbage += entries[idx].textSize;
+      memmove(entries + idx, entries + idx + 1, (block->count - idx - 1) * sizeof(TagEntry));
+      block->count--;
    }
 
    /*
-    * Convenience method to add a MetadataSingleTag
+    * Convenience method to add a MetadataSingleTag. Numbers are stored as
+    * such and formatted like std::ostream would when the tag is read.
     */
    template <class anytype>
    void PutTag(std::string key, std::string deviceLabel, anytype value)
    {
-      std::stringstream os;
-      os << value;
-      MetadataSingleTag tag = MetadataSingleTag(key.c_str(), deviceLabel.c_str(), true);
-      tag.SetValue(os.str().c_str());
-      SetTag(tag);
+      PutValue(key.c_str(), deviceLabel.c_str(), value);
    }
 
    /*
@@ -367,56 +428,98 @@ public:
       PutImageTag(key, value);
    }
 
+   /*
+    * Add tags with numeric values, kept as numbers until the tag is read.
+    * Doubles are formatted with 15 significant digits.
+    */
+   void PutInt64Tag(const char* key, const char* deviceLabel, long long value, bool readOnly = true)
+   {
+      TagEntry entry = NewEntry(IntValue, readOnly);
+      entry.number.i = value;
+      Put(key, deviceLabel, entry, 0, true);
+   }
+
+   void PutDoubleTag(const char* key, const char* deviceLabel, double value, bool readOnly = true)
+   {
+      TagEntry entry = NewEntry(DoubleValue, readOnly);
+      entry.number.d = value;
+      entry.digits = 15;
+      Put(key, deviceLabel, entry, 0, true);
+   }
+
 #ifndef SWIG
    Metadata& operator=(const Metadata& rhs)
    {
+      if (this == &rhs || tags_ == rhs.tags_)
+         return *this;
+
       Clear();
-      
-      for (TagIterator it=rhs.tags_.begin(); it != rhs.tags_.end(); it++)
-      {
-         SetTag(*it->second);
-      }
+      Assign(rhs.tags_);
 
       return *this;
    }
 #endif
 
    void Merge(const Metadata& newTags)
-   {     
-      for (TagIterator it=newTags.tags_.begin(); it != newTags.tags_.end(); it++)
+   {
+      if (!newTags.tags_)
+         return;
+      if (!tags_)
+      {
+         *this = newTags;
+         return;
+      }
+      Metadata source(newTags); // keeps the tags intact if this is newTags
+      const TagBlock* block = source.tags_;
+      for (unsigned long i = 0; i < block->count; i++)
       {
-         SetTag(*it->second);
+         const TagEntry& entry = Entries(block)[i];
+         unsigned long valueSize = entry.textSize - entry.valueOffset;
+         char* values = Put(Name(block, entry), Device(block, entry), entry, valueSize, true);
+         memcpy(values, Values(block, entry), valueSize);
       }
    }
 
+   /*
+    * Exchanges the tags of two containers without copying them.
+    */
+   void Swap(Metadata& other)
+   {
+      TagBlock* tmp = tags_;
+      tags_ = other.tags_;
+      other.tags_ = tmp;
+   }
+
    std::string Serialize() const
    {
       std::ostringstream os;
 
-      os << tags_.size();
-      for (TagIterator it = tags_.begin(); it != tags_.end(); it++)
+      os << (tags_ ? tags_->count : 0);
+      if (!tags_)
+         return os.str();
+      for (unsigned long i = 0; i < tags_->count; i++)
       {
-         std::string id("s");
-         if (it->second->ToArrayTag())
-            id = "a";
+         const TagEntry& entry = Entries(tags_)[i];
+         bool isArray = entry.type == ArrayValue;
 
-         os << id << std::endl;
-         os << it->second->GetName() << std::endl << it->second->GetDevice() << std::endl;
-         os << (it->second->IsReadOnly() ? 1 : 0) << std::endl;
+         os << (isArray ? "a" : "s") << std::endl;
+         os << Name(tags_, entry) << std::endl << Device(tags_, entry) << std::endl;
+         os << (entry.readOnly ? 1 : 0) << std::endl;
 
-         if (id.compare("s") == 0)
+         if (!isArray)
          {
-            const MetadataSingleTag* st = it->second->ToSingleTag();
-				std::string  s1 = st->GetValue();
-            os << s1 << std::endl;
+            char buf[64];
+            os << ValueText(tags_, entry, buf) << std::endl;
          }
          else
          {
-            const MetadataArrayTag* at = it->second->ToArrayTag();
-
-            os << (long) at->GetSize() << std::endl;
-            for (size_t i=0; i<at->GetSize(); i++)
-               os << at->GetValue(i) << std::endl;
+            os << (long) entry.count << std::endl;
+            const char* value = Values(tags_, entry);
+            for (unsigned long j = 0; j < entry.count; j++)
+            {
+               os << value << std::endl;
+               value += strlen(value) + 1;
+            }
          }
       }
 
@@ -455,8 +558,7 @@ public:
             ms.SetReadOnly(atoi(readLine(is).c_str()) == 1 ? true : false);
             ms.SetValue(readLine(is).c_str());
 
-            MetadataTag* newTag = ms.Clone();
-            tags_.insert(std::make_pair(ms.GetQualifiedName(), newTag));
+            SetTag(ms, false); // the first of duplicate tags wins
          }
          else if (id.compare("a") == 0)
          {
@@ -472,8 +574,7 @@ public:
                as.AddValue(readLine(is).c_str());
             }
 
-            MetadataTag* newTag = as.Clone();
-            tags_.insert(std::make_pair(as.GetQualifiedName(), newTag));
+            SetTag(as, false);
          }
          else
          {
@@ -487,31 +588,440 @@ public:
    {
       std::ostringstream os;
 
-      os << tags_.size();
-      for (TagIterator it = tags_.begin(); it != tags_.end(); it++)
+      os << (tags_ ? tags_->count : 0);
+      if (!tags_)
+         return os.str();
+      for (unsigned long i = 0; i < tags_->count; i++)
       {
-         std::string id("s");
-         if (it->second->ToArrayTag())
-            id = "a";
-         std::string ser = it->second->Serialize();
-         os << id << " : " << ser << std::endl;
+         const TagEntry& entry = Entries(tags_)[i];
+         std::string key = Key(tags_, entry);
+         if (entry.type == ArrayValue)
+            os << "a : " << GetArrayTag(key.c_str()).Serialize() << std::endl;
+         else
+            os << "s : " << GetSingleTag(key.c_str()).Serialize() << std::endl;
       }
 
       return os.str();
    }
 
 private:
-   MetadataTag* FindTag(const char* key) const
+   enum ValueType
    {
-      TagIterator it = tags_.find(key);
-      if (it != tags_.end())
-         return it->second;
+      StringValue,
+      IntValue,
+      DoubleValue,
+      ArrayValue
+   };
+
+   /*
+    * One tag. The text of a tag is stored in the pool, at offset text: the
+    * qualified name, the device label and, for strings and arrays, the
+    * values, each terminated by a NUL. The name is the tail of the qualified
+    * name. Entries hold no pointers and are copied with memcpy.
+    */
+   struct TagEntry
+   {
+      unsigned long keyId;       // KeyId() of the qualified name
+      unsigned long text;        // pool offset of the text of the tag
+      unsigned long textSize;    // bytes of text, including the NULs
+      unsigned long nameOffset;  // offsets within the text
+      unsigned long deviceOffset;
+      unsigned long valueOffset;
+      unsigned long count;       // number of values of an array
+      unsigned char type;        // ValueType
+      unsigned char readOnly;
+      unsigned char digits;      // significant digits of a double
+      union
+      {
+         long long i;
+         double d;
+      } number;
+   };
+
+   /*
+    * Header of a block. The entries follow the header, and the pool follows
+    * the entries. The reference count is atomic, so that copies may be
+    * released from different threads. destroy frees the block in the module
+    * that allocated it; since every module has its own DestroyBlock(), it
+    * also tells whether the block belongs to the current module.
+    */
+   struct TagBlock
+   {
+      volatile long refCount;
+      void (*destroy)(TagBlock*);
+      unsigned long count;     // entries in use
+      unsigned long capacity;  // entries allocated
+      unsigned long poolUsed;  // bytes
+      unsigned long poolSize;
+      unsigned long garbage;   // pool bytes of replaced or removed tags
+   };
+
+   static size_t HeaderSize() { return (sizeof(TagBlock) + 7) & ~(size_t)7; }
+
+   static TagEntry* Entries(TagBlock* block)
+   {
+      return (TagEntry*)((char*)block + HeaderSize());
+   }
+
+   static const TagEntry* Entries(const TagBlock* block)
+   {
+      return (const TagEntry*)((const char*)block + HeaderSize());
+   }
+
+   static char* Pool(TagBlock* block)
+   {
+      return (char*)(Entries(block) + block->capacity);
+   }
+
+   static const char* Pool(const TagBlock* block)
+   {
+      return (const char*)(Entries(block) + block->capacity);
+   }
+
+   static const char* Text(const TagBlock* block, const TagEntry& entry)
+   {
+      return Pool(block) + entry.text;
+   }
+
+   static const char* Key(const TagBlock* block, const TagEntry& entry)
+   {
+      return Text(block, entry);
+   }
+
+   static const char* Name(const TagBlock* block, const TagEntry& entry)
+   {
+      return Text(block, entry) + entry.nameOffset;
+   }
+
+   static const char* Device(const TagBlock* block, const TagEntry& entry)
+   {
+      return Text(block, entry) + entry.deviceOffset;
+   }
+
+   static const char* Values(const TagBlock* block, const TagEntry& entry)
+   {
+      return Text(block, entry) + entry.valueOffset;
+   }
+
+   // Returns the value of a single tag as text; buf holds formatted numbers
+   static const char* ValueText(const TagBlock* block, const TagEntry& entry, char* buf)
+   {
+      if (entry.type == IntValue)
+         sprintf(buf, "%lld", entry.number.i);
+      else if (entry.type == DoubleValue)
+         sprintf(buf, "%.*g", (int)entry.digits, entry.number.d);
       else
-         throw MetadataKeyError();
+         return Values(block, entry);
+      return buf;
+   }
+
+   static TagBlock* NewBlock(unsigned long capacity, unsigned long poolSize)
+   {
+      char* memory = new char[HeaderSize() + capacity * sizeof(TagEntry) + poolSize];
+      TagBlock* block = (TagBlock*)memory;
+      block->refCount = 1;
+      block->destroy = &DestroyBlock;
+      block->count = 0;
+      block->capacity = capacity;
+      block->poolUsed = 0;
+      block->poolSize = poolSize;
+      block->garbage = 0;
+      return block;
+   }
+
+   static void DestroyBlock(TagBlock* block)
+   {
+      delete[] (char*)block;
+   }
+
+   static void AddRef(TagBlock* block)
+   {
+#ifdef _MSC_VER
+      _InterlockedIncrement(&block->refCount);
+#else
+      __sync_add_and_fetch(&block->refCount, 1);
+#endif
+   }
+
+   static void Release(TagBlock* block)
+   {
+#ifdef _MSC_VER
+      long count = _InterlockedDecrement(&block->refCount);
+#else
+      long count = __sync_sub_and_fetch(&block->refCount, 1);
+#endif
+      if (count == 0)
+         block->destroy(block);
+   }
+
+   static unsigned long Grow(unsigned long needed, unsigned long current, unsigned long minimum)
+   {
+      if (needed <= current)
+         return current;
+      unsigned long size = 2 * current > minimum ? 2 * current : minimum;
+      return needed > size ? needed : size;
+   }
+
+   // Copies a block, with room for the given number of additional entries
+   // and pool bytes. The text of replaced or removed tags is dropped.
+   static TagBlock* CopyBlock(const TagBlock* source, unsigned long entries, unsigned long bytes)
+   {
+      if (!source)
+         return NewBlock(Grow(entries, 0, 8), Grow(bytes, 0, 256));
+
+      unsigned long live = source->poolUsed - source->garbage;
+      TagBlock* block = NewBlock(Grow(source->count + entries, source->capacity, 8),
+            Grow(live + bytes, source->poolSize, 256));
+      memcpy(Entries(block), Entries(source), source->count * sizeof(TagEntry));
+      block->count = source->count;
+      if (source->garbage == 0)
+         memcpy(Pool(block), Pool(source), live);
+      else
+      {
+         TagEntry* copied = Entries(block);
+         unsigned long offset = 0;
+         for (unsigned long i = 0; i < block->count; i++)
+         {
+            memcpy(Pool(block) + offset, Text(source, copied[i]), copied[i].textSize);
+            copied[i].text = offset;
+            offset += copied[i].textSize;
+         }
+      }
+      block->poolUsed = live;
+      return block;
+   }
+
+   void Assign(TagBlock* block)
+   {
+      if (!block)
+         tags_ = 0;
+      else if (block->destroy == &DestroyBlock)
+      {
+         AddRef(block);
+         tags_ = block;
+      }
+      else
+         tags_ = CopyBlock(block, 0, 0);
+   }
+
+   // Returns a block owned by this object alone, allocated by this module,
+   // with room for the given number of additional entries and pool bytes.
+   TagBlock* Writable(unsigned long entries, unsigned long bytes)
+   {
+      TagBlock* block = tags_;
+      if (block && block->destroy == &DestroyBlock && block->refCount == 1 &&
+            block->count + entries <= block->capacity &&
+            block->poolUsed + bytes <= block->poolSize)
+         return block;
+      block = CopyBlock(block, entries, bytes);
+      Clear();
+      tags_ = block;
+      return block;
+   }
+
+   /*
+    * Numeric id of a tag name (32-bit FNV-1a). Deterministic, so that ids
+    * agree between the core and device modules.
+    */
+   static unsigned long KeyId(const char* key)
+   {
+      unsigned long h = 2166136261UL;
+      for (const unsigned char* p = (const unsigned char*)key; *p; p++)
+         h = ((h ^ *p) * 16777619UL) & 0xffffffffUL;
+      return h;
+   }
+
+   // Finds the entry of a qualified name. If there is none, idx is where it
+   // would be inserted.
+   static bool Locate(const TagBlock* block, unsigned long keyId, const char* key, unsigned long& idx)
+   {
+      const TagEntry* entries = Entries(block);
+      unsigned long lo = 0, hi = block->count;
+      while (lo < hi)
+      {
+         unsigned long mid = lo + (hi - lo) / 2;
+         if (entries[mid].keyId < keyId)
+            lo = mid + 1;
+         else
+            hi = mid;
+      }
+      for (idx = lo; idx < block->count && entries[idx].keyId == keyId; idx++)
+      {
+         if (strcmp(Key(block, entries[idx]), key) == 0)
+            return true;
+      }
+      return false;
+   }
+
+   const TagEntry* Find(const char* key) const
+   {
+      unsigned long idx;
+      if (tags_ && Locate(tags_, KeyId(key), key, idx))
+         return Entries(tags_) + idx;
+      return 0;
+   }
+
+   static TagEntry NewEntry(ValueType type, bool readOnly)
+   {
+      TagEntry entry;
+      memset(&entry, 0, sizeof(entry));
+      entry.type = (unsigned char)type;
+      entry.readOnly = readOnly ? 1 : 0;
+      return entry;
+   }
+
+   /*
+    * Adds a tag, or replaces the tag of the same name if replace is set.
+    * The type, flags and number are taken from value. Returns where the
+    * valueSize bytes of string or array values are to be written; the
+    * pointer is valid until the next modification.
+    */
+   char* Put(const char* name, const char* device, const TagEntry& value,
+         unsigned long valueSize, bool replace)
+   {
+      unsigned long nameLen = (unsigned long)strlen(name);
+      unsigned long deviceLen = (unsigned long)strlen(device);
+      bool imageTag = strcmp(device, "_") == 0;
+      unsigned long keyLen = imageTag ? nameLen : deviceLen + 1 + nameLen;
+      unsigned long size = keyLen + 1 + deviceLen + 1 + valueSize;
+
+      TagBlock* block = Writable(1, size);
+      char* text = Pool(block) + block->poolUsed;
+      char* p = text;
+      if (!imageTag)
+      {
+         memcpy(p, device, deviceLen);
+         p += deviceLen;
+         *p++ = '-';
+      }
+      memcpy(p, name, nameLen + 1);
+      p += nameLen + 1;
+      memcpy(p, device, deviceLen + 1);
+      p += deviceLen + 1;
+
+      TagEntry entry = value;
+      entry.keyId = KeyId(text);
+      entry.text = block->poolUsed;
+      entry.textSize = size;
+      entry.nameOffset = imageTag ? 0 : deviceLen + 1;
+      entry.deviceOffset = keyLen + 1;
+      entry.valueOffset = keyLen + 1 + deviceLen + 1;
+
+      unsigned long idx;
+      TagEntry* entries = Entries(block);
+      if (Locate(block, entry.keyId, text, idx))
+      {
+         if (!replace)
+            return p; // the text is not kept
+         block->garbage += entries[idx].textSize;
+         entries[idx] = entry;
+      }
+      else
+      {
+         memmove(entries + idx + 1, entries + idx, (block->count - idx) * sizeof(TagEntry));
+         entries[idx] = entry;
+         block->count++;
+      }
+      block->poolUsed += size;
+      return p;
+   }
+
+   void PutText(const char* key, const char* deviceLabel, const char* value, bool readOnly, bool replace)
+   {
+      unsigned long size = (unsigned long)strlen(value) + 1;
+      memcpy(Put(key, deviceLabel, NewEntry(StringValue, readOnly), size, replace), value, size);
+   }
+
+   void SetTag(MetadataTag& tag, bool replace)
+   {
+      const char* name = tag.GetName().c_str();
+      const char* device = tag.GetDevice().c_str();
+      const MetadataSingleTag* single = tag.ToSingleTag();
+      const MetadataArrayTag* array = tag.ToArrayTag();
+      if (single)
+         PutText(name, device, single->GetValue().c_str(), tag.IsReadOnly(), replace);
+      else if (array)
+      {
+         TagEntry entry = NewEntry(ArrayValue, tag.IsReadOnly());
+         entry.count = (unsigned long)array->GetSize();
+         unsigned long size = 0;
+         for (unsigned long i = 0; i < entry.count; i++)
+            size += (unsigned long)array->GetValue(i).size() + 1;
+         char* p = Put(name, device, entry, size, replace);
+         for (unsigned long i = 0; i < entry.count; i++)
+         {
+            const std::string& value = array->GetValue(i);
+            memcpy(p, value.c_str(), value.size() + 1);
+            p += value.size() + 1;
+         }
+      }
+   }
+
+   // PutTag() helpers: numbers are kept as numbers, anything else as text
+   void PutValue(const char* key, const char* deviceLabel, long long value)
+   {
+      PutInt64Tag(key, deviceLabel, value);
+   }
+   void PutValue(const char* key, const char* deviceLabel, long value)
+   {
+      PutInt64Tag(key, deviceLabel, value);
+   }
+   void PutValue(const char* key, const char* deviceLabel, unsigned long value)
+   {
+      if ((long long)value < 0)
+         PutTextValue(key, deviceLabel, value);
+      else
+         PutInt64Tag(key, deviceLabel, (long long)value);
+   }
+   void PutValue(const char* key, const char* deviceLabel, int value)
+   {
+      PutInt64Tag(key, deviceLabel, value);
+   }
+   void PutValue(const char* key, const char* deviceLabel, unsigned int value)
+   {
+      PutInt64Tag(key, deviceLabel, value);
+   }
+   void PutValue(const char* key, const char* deviceLabel, short value)
+   {
+      PutInt64Tag(key, deviceLabel, value);
+   }
+   void PutValue(const char* key, const char* deviceLabel, unsigned short value)
+   {
+      PutInt64Tag(key, deviceLabel, value);
+   }
+   void PutValue(const char* key, const char* deviceLabel, double value)
+   {
+      TagEntry entry = NewEntry(DoubleValue, true);
+      entry.number.d = value;
+      entry.digits = 6; // the default precision of std::ostream
+      Put(key, deviceLabel, entry, 0, true);
+   }
+   void PutValue(const char* key, const char* deviceLabel, float value)
+   {
+      PutValue(key, deviceLabel, (double)value);
+   }
+   void PutValue(const char* key, const char* deviceLabel, const char* value)
+   {
+      PutText(key, deviceLabel, value, true, true);
+   }
+   void PutValue(const char* key, const char* deviceLabel, const std::string& value)
+   {
+      PutText(key, deviceLabel, value.c_str(), true, true);
+   }
+   template <class anytype>
+   void PutValue(const char* key, const char* deviceLabel, const anytype& value)
+   {
+      PutTextValue(key, deviceLabel, value);
+   }
+   template <class anytype>
+   void PutTextValue(const char* key, const char* deviceLabel, const anytype& value)
+   {
+      std::ostringstream os;
+      os << value;
+      PutText(key, deviceLabel, os.str().c_str(), true, true);
    }
 
-   std::map<std::string, MetadataTag*> tags_;
-   typedef std::map<std::string, MetadataTag*>::const_iterator TagIterator;
+   TagBlock* tags_; // 0 when empty; shared between copies until modified
 };
 
 #endif //_IMAGE_METADATA_H_
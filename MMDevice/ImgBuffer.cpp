@@ -19,15 +19,17 @@
 // NOTE:          Imported from ADVI for use in Micro-Manager
 ///////////////////////////////////////////////////////////////////////////////
 #include "ImgBuffer.h"
+#include "BinaryMetadata.h"
 #include <math.h>
 #include <assert.h>
+#include <algorithm>
 using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
 // ImgBuffer class
 //
 ImgBuffer::ImgBuffer(unsigned xSize, unsigned ySize, unsigned pixDepth) :
-   pixels_(0), width_(xSize), height_(ySize), pixDepth_(pixDepth)
+   pixels_(0), capacity_(xSize * ySize * pixDepth), width_(xSize), height_(ySize), pixDepth_(pixDepth)
 {
    pixels_ = new unsigned char[xSize * ySize * pixDepth];
    assert(pixels_);
@@ -36,6 +38,7 @@ ImgBuffer::ImgBuffer(unsigned xSize, unsigned ySize, unsigned pixDepth) :
 
 ImgBuffer::ImgBuffer() :
    pixels_(0),
+   capacity_(0),
    width_(0),
    height_(0),
    pixDepth_(0)
@@ -45,6 +48,7 @@ ImgBuffer::ImgBuffer() :
 ImgBuffer::ImgBuffer(const ImgBuffer& right)                
 {
    pixels_ = 0;
+   capacity_ = 0;
    *this = right;
 }
 
@@ -103,11 +107,12 @@ bool ImgBuffer::Compatible(const ImgBuffer& img) const
 void ImgBuffer::Resize(unsigned xSize, unsigned ySize, unsigned pixDepth)
 {
    // re-allocate internal buffer if it is not big enough
-   if (width_ * height_ * pixDepth_ < xSize * ySize * pixDepth)
+   if (capacity_ < xSize * ySize * pixDepth)
    {
       delete[] pixels_;
       pixels_ = new unsigned char [xSize * ySize * pixDepth];
       assert(pixels_);
+      capacity_ = xSize * ySize * pixDepth;
    }
 
    width_ = xSize;
@@ -118,10 +123,11 @@ void ImgBuffer::Resize(unsigned xSize, unsigned ySize, unsigned pixDepth)
 void ImgBuffer::Resize(unsigned xSize, unsigned ySize)
 {
    // re-allocate internal buffer if it is not big enough
-   if (width_ * height_ < xSize * ySize)
+   if (capacity_ < xSize * ySize * pixDepth_)
    {
       delete[] pixels_;
       pixels_ = new unsigned char[xSize * ySize * pixDepth_];
+      capacity_ = xSize * ySize * pixDepth_;
    }
 
    width_ = xSize;
@@ -138,6 +144,19 @@ void ImgBuffer::Copy(const ImgBuffer& right)
    SetPixels((void*)right.GetPixels());
 }
 
+// Exchange pixels, geometry and metadata with another buffer without copying.
+void ImgBuffer::Swap(ImgBuffer& rhs)
+{
+   std::swap(pixels_, rhs.pixels_);
+   std::swap(capacity_, rhs.capacity_);
+   std::swap(width_, rhs.width_);
+   std::swap(height_, rhs.height_);
+   std::swap(pixDepth_, rhs.pixDepth_);
+   name_.swap(rhs.name_);
+   metadata_.Swap(rhs.metadata_);
+   binaryMetadata_.swap(rhs.binaryMetadata_);
+}
+
 ImgBuffer& ImgBuffer::operator=(const ImgBuffer& img)
 {
    if(this == &img)
@@ -150,6 +169,7 @@ ImgBuffer& ImgBuffer::operator=(const ImgBuffer& img)
    height_ = img.Height();
    pixDepth_ = img.Depth();
    pixels_ = new unsigned char[width_ * height_ * pixDepth_];
+   capacity_ = width_ * height_ * pixDepth_;
 
    Copy(img);
 
@@ -158,11 +178,31 @@ ImgBuffer& ImgBuffer::operator=(const ImgBuffer& img)
 
 void ImgBuffer::SetMetadata(const Metadata& md)
 {
-   //metadata_ = md;
-   // Serialize/Restore instead of =operator used to avoid object new/delete
-   // issues accross the DLL boundary (on Windows)
-   // TODO: this is inefficient and should be revised
-    metadata_.Restore(md.Serialize().c_str());
+   // Metadata allocated by another module (across the DLL boundary) is
+   // copied on assignment, never shared or freed here
+   MMThreadGuard guard(metadataLock_);
+   metadata_ = md;
+   binaryMetadata_.clear();
+}
+
+// Stores metadata in the BinaryMetadata wire format without decoding it.
+void ImgBuffer::SetBinaryMetadata(const unsigned char* data, unsigned long size)
+{
+   MMThreadGuard guard(metadataLock_);
+   metadata_.Clear();
+   binaryMetadata_.assign(data, data + size);
+}
+
+const Metadata& ImgBuffer::GetMetadata() const
+{
+   MMThreadGuard guard(metadataLock_);
+   if (!binaryMetadata_.empty())
+   {
+      BinaryMetadata::ToMetadata(&binaryMetadata_[0],
+            (unsigned long)binaryMetadata_.size(), metadata_);
+      binaryMetadata_.clear();
+   }
+   return metadata_;
 }
 
 
@@ -176,6 +216,7 @@ FrameBuffer::FrameBuffer(unsigned xSize, unsigned ySize, unsigned byteDepth)
    height_ = ySize;
    depth_ = byteDepth;
    handlePending_ = false;
+   pinCount_ = 0;
    frameID_ = 0;
 }
 
@@ -185,6 +226,7 @@ FrameBuffer::FrameBuffer()
    height_ = 0;
    depth_ = 0;
    handlePending_ = false;
+   pinCount_ = 0;
    frameID_ = 0;
 }
 
@@ -221,6 +263,18 @@ void FrameBuffer::Resize(unsigned xSize, unsigned ySize, unsigned byteDepth)
    depth_ = byteDepth;
 }
 
+// Changes the geometry of the existing images, keeping their memory where it
+// is large enough for the new geometry.
+void FrameBuffer::Reshape(unsigned xSize, unsigned ySize, unsigned byteDepth)
+{
+   for (unsigned i=0; i<images_.size(); i++)
+      images_[i]->Resize(xSize, ySize, byteDepth);
+   width_ = xSize;
+   height_ = ySize;
+   depth_ = byteDepth;
+   handlePending_ = false;
+}
+
 bool FrameBuffer::SetImage(unsigned channel, unsigned slice, const ImgBuffer& imgBuf)
 {
    handlePending_ = false;
@@ -60,18 +60,26 @@ public:
    void SetName(const char* name) {name_ = name;}
    const std::string& GetName() {return name_;}
    void SetMetadata(const Metadata& md);
-   const Metadata& GetMetadata() const {return metadata_;}
+   void SetBinaryMetadata(const unsigned char* data, unsigned long size);
+   const Metadata& GetMetadata() const;
 
    void Copy(const ImgBuffer& rhs);
+   void Swap(ImgBuffer& rhs);
    ImgBuffer& operator=(const ImgBuffer& rhs);
 
 private:
    unsigned char* pixels_;
+   unsigned long capacity_; // bytes allocated for pixels_
    unsigned int width_;
    unsigned int height_;
    unsigned int pixDepth_;
    std::string name_;
-   Metadata metadata_;
+   // Binary metadata (see BinaryMetadata.h) is kept as is and only converted
+   // into metadata_ when GetMetadata() is called. The lock makes concurrent
+   // readers decode it only once; it is not copied with the image.
+   mutable MMThreadLock metadataLock_;
+   mutable Metadata metadata_;
+   mutable std::vector<unsigned char> binaryMetadata_;
 };
 
 class FrameBuffer
@@ -82,6 +90,7 @@ public:
    ~FrameBuffer();
 
    void Resize(unsigned xSize, unsigned ySize, unsigned pixDepth);
+   void Reshape(unsigned xSize, unsigned ySize, unsigned pixDepth);
    void Clear();
    void Preallocate(unsigned channels, unsigned slices);
 
@@ -99,6 +108,11 @@ public:
    bool IsHandlePending() const {return handlePending_;}
    void SetHandlePending() {handlePending_ = true;}
 
+   // Pinned frames are being read in place and must not be overwritten.
+   void Pin() {pinCount_++;}
+   void Unpin() {if (pinCount_ > 0) pinCount_--;}
+   bool IsPinned() const {return pinCount_ > 0;}
+
 private:
    static unsigned long GetIndex(unsigned channel, unsigned slice);
    ImgBuffer* InsertNewImage(unsigned channel, unsigned slice);
@@ -107,6 +121,7 @@ private:
    std::map<unsigned long, ImgBuffer*> indexMap_;
    long frameID_;
    bool handlePending_;
+   long pinCount_;
    unsigned int width_;
    unsigned int height_;
    unsigned int depth_;
@@ -27,7 +27,7 @@
 // Header version
 // If any of the class definitions changes, the interface version
 // must be incremented
-#define DEVICE_INTERFACE_VERSION 65
+#define DEVICE_INTERFACE_VERSION 67
 ///////////////////////////////////////////////////////////////////////////////
 
 
@@ -47,6 +47,7 @@
 #include "MMDeviceConstants.h"
 #include "DeviceUtils.h"
 #include "ImageMetadata.h"
+#include "BinaryMetadata.h"
 #include "DeviceThreads.h"
 #include <string>
 #include <cstring>
@@ -1273,6 +1274,14 @@ namespace MM {
        * Magnifiers can use this to signal changes in magnification
        */
       virtual int OnMagnifierChanged(const Device* caller) = 0;
+      /**
+       * Devices that know when they start and finish an action (e.g. a stage
+       * move) can call this on every change of their busy state, so that the
+       * core can wake up waiting threads instead of polling Busy(). A device
+       * that uses it should report busy before the call that starts the
+       * action returns, and must keep Busy() consistent with what it reports.
+       */
+      virtual int OnBusyChanged(const Device* caller, bool busy) = 0;
 
       virtual unsigned long GetClockTicksUs(const Device* caller) = 0;
       virtual MM::MMTime GetCurrentMMTime() = 0;
@@ -1284,6 +1293,23 @@ namespace MM {
       virtual int InsertImage(const Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const Metadata* md = 0, const bool doProcess = true) = 0;
       /// \deprecated Use the other forms instead.
       virtual int InsertImage(const Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const char* serializedMetadata, const bool doProcess = true) = 0;
+      /**
+       * Inserts an image with metadata in the binary format built by
+       * BinaryMetadata (see BinaryMetadata.h). The metadata is converted to
+       * the text representation only when someone reads it.
+       *
+       * The core stores the stream as is (see CircularBuffer). The default
+       * implementation decodes the metadata right away and inserts the image
+       * with the Metadata form.
+       */
+      virtual int InsertImage(const Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const unsigned char* binaryMetadata, unsigned long metadataBytes, const bool doProcess = true)
+      {
+         Metadata md;
+         if (binaryMetadata != 0 && metadataBytes > 0 &&
+               !BinaryMetadata::ToMetadata(binaryMetadata, metadataBytes, md))
+            return DEVICE_ERR;
+         return InsertImage(caller, buf, width, height, byteDepth, &md, doProcess);
+      }
       virtual void ClearImageBuffer(const Device* caller) = 0;
       virtual bool InitializeImageBuffer(unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth) = 0;
       virtual int InsertMultiChannel(const Device* caller, const unsigned char* buf, unsigned numChannels, unsigned width, unsigned height, unsigned byteDepth, Metadata* md = 0) = 0;
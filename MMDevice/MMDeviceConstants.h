@@ -149,6 +149,27 @@ namespace MM {
    const char* const g_Keyword_Metadata_StartTime   = "StartTime-ms";
    const char* const g_Keyword_Metadata_ROI_X       = "ROI-X-start";
    const char* const g_Keyword_Metadata_ROI_Y       = "ROI-Y-start";
+   // stage position at the trigger of each image row (line scans), arrays
+   const char* const g_Keyword_Metadata_RowPositionX = "RowPositionX-um";
+   const char* const g_Keyword_Metadata_RowPositionY = "RowPositionY-um";
+   // 1 for rows whose position was extrapolated past the recorded samples;
+   // absent if no row was
+   const char* const g_Keyword_Metadata_RowPositionExtrapolated = "RowPositionExtrapolated";
+
+   // acquisition latency trace checkpoints, microseconds in the core time base
+   const char* const g_Keyword_Metadata_Trace_RunBlockIssued     = "Trace-RunBlockIssued-us";
+   const char* const g_Keyword_Metadata_Trace_CallbackFired      = "Trace-CallbackFired-us";
+   const char* const g_Keyword_Metadata_Trace_BulkTransferDone   = "Trace-BulkTransferDone-us";
+   const char* const g_Keyword_Metadata_Trace_ConversionDone     = "Trace-ConversionDone-us";
+   const char* const g_Keyword_Metadata_Trace_InsertImageEntered = "Trace-InsertImageEntered-us";
+   const char* const g_Keyword_Metadata_Trace_Inserted           = "Trace-Inserted-us";
+
+   // pixel statistics computed by the core when images are inserted
+   const char* const g_Keyword_Metadata_Stats_Min               = "Stats-Min";
+   const char* const g_Keyword_Metadata_Stats_Max               = "Stats-Max";
+   const char* const g_Keyword_Metadata_Stats_Mean              = "Stats-Mean";
+   const char* const g_Keyword_Metadata_Stats_StdDev            = "Stats-StdDev";
+   const char* const g_Keyword_Metadata_Stats_HistogramBinWidth = "Stats-HistogramBinWidth";
 
    // configuration file format constants
    const char* const g_FieldDelimiters = ",";